@@ -0,0 +1,176 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#define _POSIX_C_SOURCE 200112L
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+struct atlas_async_s {
+	const image_t**		images;
+	uint32				image_count;
+	atlas_options_t		opts;
+	atlas_pool_t*		pool;			/* the caller's, NULL for a thread of its own */
+	pthread_t			thread;
+	atlas_async_fun_t	done;
+	void*				user;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		over;			/* 'finished' went up */
+	ATLAS_ASYNC_STATE	state;
+	bool				cancelled;
+	bool				finished;		/* the callback returned */
+	bool				taken;			/* the atlas went to atlas_async_wait */
+	atlas_t*			atlas;
+};
+
+bool
+atlas_async_cancelled(atlas_async_t* async) {
+	bool	cancelled;
+
+	if( NULL == async ) return false;
+
+	pthread_mutex_lock(&async->lock);
+	cancelled	= async->cancelled;
+	pthread_mutex_unlock(&async->lock);
+
+	return cancelled;
+}
+
+static void
+run(atlas_async_t* async) {
+	atlas_pool_t*		stages;
+	atlas_t*			atlas	= NULL;
+	ATLAS_ASYNC_STATE	state;
+
+	TRACE_BEGIN("atlas_make_async");
+
+	if( !atlas_async_cancelled(async) ) {
+		/* a pool task keeps its stages serial, waiting for its own pool would never return */
+		stages	= NULL == async->pool ? atlas_stage_pool(&async->opts) : NULL;
+		atlas	= atlas_build(async->images, async->image_count, &async->opts, stages, async);
+	}
+
+	pthread_mutex_lock(&async->lock);
+	async->atlas	= atlas;
+	async->state	= atlas ? ATLAS_ASYNC_DONE : (async->cancelled ? ATLAS_ASYNC_CANCELLED : ATLAS_ASYNC_FAILED);
+	state			= async->state;
+	pthread_mutex_unlock(&async->lock);
+
+	TRACE_END("atlas_make_async");
+
+	if( async->done ) async->done(async->user, async, state);
+
+	pthread_mutex_lock(&async->lock);
+	async->finished	= true;
+	pthread_cond_broadcast(&async->over);
+	pthread_mutex_unlock(&async->lock);
+}
+
+static void
+run_task(void* arg) {
+	run((atlas_async_t*)arg);
+}
+
+static void*
+run_thread(void* arg) {
+	run((atlas_async_t*)arg);
+	return NULL;
+}
+
+atlas_async_t*
+atlas_make_async(const image_t** images, uint32 image_count, const atlas_options_t* opts, atlas_pool_t* pool, atlas_async_fun_t done, void* user) {
+	atlas_async_t*	async	= (atlas_async_t*)malloc(sizeof(atlas_async_t));
+	assert( NULL != async );
+
+	memset(async, 0, sizeof(atlas_async_t));
+	async->images		= images;
+	async->image_count	= image_count;
+	async->pool			= pool;
+	async->done			= done;
+	async->user			= user;
+	async->state		= ATLAS_ASYNC_RUNNING;
+
+	if( opts ) {
+		async->opts	= *opts;
+	} else {
+		atlas_options_init(&async->opts);
+	}
+
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->over, NULL);
+
+	if( pool ) {
+		atlas_pool_submit(pool, run_task, async);
+	} else if( pthread_create(&async->thread, NULL, run_thread, async) != 0 ) {
+		fprintf(stderr, "ERROR: atlas_make_async: can't start a thread\n");
+		pthread_cond_destroy(&async->over);
+		pthread_mutex_destroy(&async->lock);
+		free(async);
+		return NULL;
+	}
+
+	return async;
+}
+
+ATLAS_ASYNC_STATE
+atlas_async_poll(atlas_async_t* async) {
+	ATLAS_ASYNC_STATE	state;
+
+	pthread_mutex_lock(&async->lock);
+	state	= async->state;
+	pthread_mutex_unlock(&async->lock);
+
+	return state;
+}
+
+atlas_t*
+atlas_async_wait(atlas_async_t* async) {
+	atlas_t*	atlas;
+
+	pthread_mutex_lock(&async->lock);
+	while( !async->finished ) {
+		pthread_cond_wait(&async->over, &async->lock);
+	}
+	atlas			= async->taken ? NULL : async->atlas;
+	async->taken	= true;
+	pthread_mutex_unlock(&async->lock);
+
+	return atlas;
+}
+
+void
+atlas_async_cancel(atlas_async_t* async) {
+	pthread_mutex_lock(&async->lock);
+	async->cancelled	= true;
+	pthread_mutex_unlock(&async->lock);
+}
+
+void
+atlas_async_release(atlas_async_t* async) {
+	atlas_t*	atlas	= atlas_async_wait(async);
+
+	if( atlas ) atlas_release(atlas);
+	if( NULL == async->pool ) pthread_join(async->thread, NULL);
+
+	pthread_cond_destroy(&async->over);
+	pthread_mutex_destroy(&async->lock);
+	free(async);
+}
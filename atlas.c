@@ -16,19 +16,32 @@
 ** <http://www.gnu.org/licenses/>.
 **
 */
-#include "atlas.h"
+#include "atlas_private.h"
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
 #include <assert.h>
+#include <stdint.h>
 
 #include "stb/stb_rect_pack.h"
 
-struct atlas_s {
-	image_t*		baked_image;
-	uint32			image_count;
-	rect_t*			coordinates;
-};
+#ifdef STBRP_LARGE_RECTS
+#define ATLAS_MAX_RECT_SIZE		0x7FFFFFFF
+#else
+#define ATLAS_MAX_RECT_SIZE		0xFFFF
+#endif
+
+/*
+ * skyline nodes (target width / mean rect width) from which the index beats
+ * walking the node list, rotation searches twice per rect and needs more
+ */
+#define ATLAS_INDEX_MIN_NODES			128
+#define ATLAS_INDEX_MIN_NODES_ROTATED	384
+
+static inline uint32
+align_up(uint32 v, uint32 alignment) {
+	return ((v + alignment - 1) / alignment) * alignment;
+}
 
 const image_t*
 atlas_baked_image(const atlas_t* atlas) {
@@ -42,151 +55,1490 @@ atlas_image_count(const atlas_t* atlas) {
 
 rect_t
 atlas_image_coordinates(const atlas_t* atlas, uint32 img) {
-	return atlas->coordinates[img];
+	const atlas_entry_t*	e	= &atlas->entries[img];
+	rect_t					r;
+	bool					rot	= (e->flags & ATLAS_ENTRY_ROTATED) != 0;
+	r.x			= e->x;
+	r.y			= e->y;
+	r.width		= rot ? e->height : e->width;
+	r.height	= rot ? e->width  : e->height;
+	return r;
+}
+
+bool
+atlas_image_rotated(const atlas_t* atlas, uint32 img) {
+	return (atlas->entries[img].flags & ATLAS_ENTRY_ROTATED) != 0;
+}
+
+atlas_trim_t
+atlas_image_trim(const atlas_t* atlas, uint32 img) {
+	const atlas_entry_t*	e	= &atlas->entries[img];
+	atlas_trim_t			t;
+	t.x				= e->trim_x;
+	t.y				= e->trim_y;
+	t.source_width	= e->source_width;
+	t.source_height	= e->source_height;
+	return t;
+}
+
+const char*
+atlas_image_key(const atlas_t* atlas, uint32 img) {
+	uint32	key	= atlas->entries[img].key;
+	return key == ATLAS_NO_KEY ? NULL : &atlas->keys[key];
+}
+
+uint32
+atlas_find(const atlas_t* atlas, const char* key) {
+	uint32	img;
+
+	if( atlas->key_count == 0 ) return ATLAS_NOT_FOUND;
+
+	/* removed images and the ones added since keep stale slots */
+	img	= atlas->slots[hash_slot(hash_key(key), atlas->buckets, atlas->key_count)];
+	if( atlas->entries[img].key == ATLAS_NO_KEY || strcmp(&atlas->keys[atlas->entries[img].key], key) != 0 ) return ATLAS_NOT_FOUND;
+
+	return img;
+}
+
+/* copy the keys next to the entries and build their perfect hash, false on duplicates */
+bool
+atlas_build_keys(atlas_t* atlas, const char** keys) {
+	uint64_t*	hashes	= NULL;
+	uint32*		values	= NULL;
+	uint32		size	= 0;
+	uint32		count	= 0;
+	uint32		r;
+	bool		ok;
+
+	for( r = 0; r < atlas->image_count; ++r ) {
+		atlas->entries[r].key	= ATLAS_NO_KEY;
+		if( keys[r] ) {
+			size	+= (uint32)strlen(keys[r]) + 1;
+			++count;
+		}
+	}
+
+	atlas->keys			= (char*)malloc(size ? size : 1);
+	atlas->keys_size	= size;
+	atlas->key_count	= count;
+	atlas->buckets		= (sint32*)malloc(sizeof(sint32) * (count ? count : 1));
+	atlas->slots		= (uint32*)malloc(sizeof(uint32) * (count ? count : 1));
+	hashes				= (uint64_t*)malloc(sizeof(uint64_t) * (count ? count : 1));
+	values				= (uint32*)malloc(sizeof(uint32) * (count ? count : 1));
+	assert( NULL != atlas->keys && NULL != atlas->buckets && NULL != atlas->slots && NULL != hashes && NULL != values );
+
+	size	= 0;
+	count	= 0;
+	for( r = 0; r < atlas->image_count; ++r ) {
+		uint32	len;
+		if( !keys[r] ) continue;
+
+		len	= (uint32)strlen(keys[r]) + 1;
+		memcpy(&atlas->keys[size], keys[r], len);
+		atlas->entries[r].key	= size;
+		hashes[count]	= hash_key(keys[r]);
+		values[count]	= r;
+		size	+= len;
+		++count;
+	}
+
+	ok	= hash_build(hashes, values, count, atlas->buckets, atlas->slots);
+	if( !ok ) {
+		fprintf(stderr, "ERROR: atlas_make: duplicate keys\n");
+	}
+
+	free(values);
+	free(hashes);
+	return ok;
+}
+
+void
+atlas_build_uv_table(atlas_t* atlas, ATLAS_UV_LAYOUT layout, bool half_texel) {
+	float	inv_w	= 1.0f / (float)image_width(atlas->baked_image);
+	float	inv_h	= 1.0f / (float)image_height(atlas->baked_image);
+	float	inset	= half_texel ? 0.5f : 0.0f;
+	uint32	stride	= align_up(atlas->image_count, 4);
+	float*	uvs;
+	uint32	r;
+
+	free(atlas->uv_block);
+	atlas->uv_block		= NULL;
+	atlas->uvs			= NULL;
+	atlas->uv_layout	= layout;
+	atlas->uv_stride	= stride;
+	atlas->uv_half_texel	= half_texel;
+
+	if( layout == ATLAS_UV_NONE ) return;
+
+	/* the same amount of floats for both layouts */
+	atlas->uv_block	= malloc(sizeof(float) * 4 * (stride ? stride : 1) + 15);
+	assert( NULL != atlas->uv_block );
+
+	uvs			= (float*)(((uintptr_t)atlas->uv_block + 15) & ~(uintptr_t)15);
+	atlas->uvs	= uvs;
+	memset(uvs, 0, sizeof(float) * 4 * stride);
+
+	for( r = 0; r < atlas->image_count; ++r ) {
+		const atlas_entry_t*	e	= &atlas->entries[r];
+		bool	rot	= (e->flags & ATLAS_ENTRY_ROTATED) != 0;
+		float	w	= (float)(rot ? e->height : e->width);
+		float	h	= (float)(rot ? e->width  : e->height);
+		float	u0	= ((float)e->x + inset) * inv_w;
+		float	v0	= ((float)e->y + inset) * inv_h;
+		float	u1	= ((float)e->x + w - inset) * inv_w;
+		float	v1	= ((float)e->y + h - inset) * inv_h;
+
+		if( layout == ATLAS_UV_AOS ) {
+			uvs[r * 4 + 0]	= u0;
+			uvs[r * 4 + 1]	= v0;
+			uvs[r * 4 + 2]	= u1;
+			uvs[r * 4 + 3]	= v1;
+		} else {
+			uvs[r]				= u0;
+			uvs[r + stride]		= v0;
+			uvs[r + stride * 2]	= u1;
+			uvs[r + stride * 3]	= v1;
+		}
+	}
+}
+
+const float*
+atlas_uv_table(const atlas_t* atlas) {
+	return atlas->uvs;
+}
+
+uint32
+atlas_uv_table_size(const atlas_t* atlas) {
+	switch(atlas->uv_layout) {
+	case ATLAS_UV_AOS:	return (uint32)sizeof(float) * 4 * atlas->image_count;
+	case ATLAS_UV_SOA:	return (uint32)sizeof(float) * 4 * atlas->uv_stride;
+	default:			return 0;
+	}
+}
+
+uint32
+atlas_uv_stride(const atlas_t* atlas) {
+	return atlas->uv_stride;
+}
+
+void
+atlas_options_init(atlas_options_t* opts) {
+	opts->alignment		= 1;
+	opts->output_format	= PF_AUTO;
+	opts->trim			= false;
+	opts->allow_rotation	= false;
+	opts->max_size		= 16384;
+	opts->skyline		= ATLAS_SKYLINE_AUTO;
+	opts->search		= ATLAS_SEARCH_FAST;
+	opts->search_budget_ms	= 0.0;
+	opts->sdf_spread	= 0;
+	opts->keys			= NULL;
+	opts->uv_layout		= ATLAS_UV_NONE;
+	opts->uv_half_texel	= false;
+	opts->stats			= NULL;
+	opts->pool			= NULL;
 }
 
 static stbrp_rect
-image_to_rect(uint32 id, const image_t* img) {
+entry_to_rect(uint32 id, const atlas_entry_t* e, uint32 alignment) {
 	stbrp_rect	rect;
-	rect.w	= (uint16) (image_width(img)  + 1);
-	rect.h	= (uint16) (image_height(img) + 1);
-	rect.id	= (uint16)id;
+	/* fully transparent trimmed images take no space */
+	bool		empty	= e->width == 0 || e->height == 0;
+	rect.w	= (stbrp_coord) (empty ? 0 : align_up(e->width  + 1, alignment));
+	rect.h	= (stbrp_coord) (empty ? 0 : align_up(e->height + 1, alignment));
+	rect.id	= (int)id;
 	rect.was_packed	= 0;
+	rect.was_rotated	= 0;
 	rect.x	= 0;
 	rect.y	= 0;
 	return rect;
 }
 
+/* memory accounting, see atlas_stats_t.peak_temp_bytes and peak_bytes */
+typedef struct {
+	size_t			live;			/* scratch */
+	size_t			peak;
+	size_t			held;			/* sources and baked images */
+	size_t			peak_total;
+} mem_track_t;
+
+static inline void
+mem_acquire(mem_track_t* mem, size_t bytes) {
+	mem->live	+= bytes;
+	if( mem->live > mem->peak ) mem->peak = mem->live;
+	if( mem->live + mem->held > mem->peak_total ) mem->peak_total = mem->live + mem->held;
+}
+
+static inline void
+mem_release(mem_track_t* mem, size_t bytes) {
+	mem->live	-= bytes;
+}
+
+static inline void
+mem_hold(mem_track_t* mem, size_t bytes) {
+	mem->held	+= bytes;
+	if( mem->live + mem->held > mem->peak_total ) mem->peak_total = mem->live + mem->held;
+}
+
+static inline void
+mem_drop(mem_track_t* mem, size_t bytes) {
+	mem->held	-= bytes;
+}
+
+/*
+ * where a build gets its images: a caller owned array, or a producer whose
+ * images the build owns and releases as soon as it is done with them
+ */
+typedef struct {
+	const image_t**		images;
+	atlas_produce_fun_t	produce;
+	void*				user;
+	uint32				spread;			/* produced PF_A8 images are replaced by their distance fields */
+	atlas_pool_t*		pool;
+} source_t;
+
+static const image_t*
+source_get(const source_t* src, uint32 i, mem_track_t* mem) {
+	image_t*	img;
+	image_t*	field;
+
+	if( NULL == src->produce ) return src->images[i];
+
+	img	= src->produce(src->user, i);
+	if( NULL == img ) {
+		fprintf(stderr, "ERROR: atlas_make_consume: no image %u\n", i);
+		return NULL;
+	}
+
+	if( src->spread && image_format(img) == PF_A8 ) {
+		field	= image_sdf(img, src->spread, src->pool);
+		image_release(img);
+		if( NULL == field ) return NULL;
+		img	= field;
+	}
+
+	mem_hold(mem, image_data_size(img));
+	return img;
+}
+
+static void
+source_put(const source_t* src, const image_t* img, mem_track_t* mem) {
+	if( NULL == src->produce ) return;
+
+	mem_drop(mem, image_data_size(img));
+	image_release((image_t*)img);
+}
+
+/* the palettes of a set of PF_I8 images, gathered while measuring them */
+typedef struct {
+	color4b_t*		colors;
+	uint32			count;
+	uint32			capacity;
+	uint32*			sizes;			/* entries per image */
+} palettes_t;
+
+static void
+palettes_add(palettes_t* pal, const image_t* img, uint32 i, uint32 image_count) {
+	uint32	size	= image_palette_size(img);
+
+	if( NULL == pal->sizes ) {
+		pal->sizes	= (uint32*)malloc(sizeof(uint32) * image_count);
+		assert( NULL != pal->sizes );
+	}
+
+	if( pal->count + size > pal->capacity ) {
+		pal->capacity	= (pal->count + size) * 2;
+		pal->colors		= (color4b_t*)realloc(pal->colors, sizeof(color4b_t) * pal->capacity);
+		assert( NULL != pal->colors );
+	}
+
+	if( size ) memcpy(pal->colors + pal->count, image_palette(img), sizeof(color4b_t) * size);
+	pal->count		+= size;
+	pal->sizes[i]	= size;
+}
+
+static void
+palettes_free(palettes_t* pal) {
+	free(pal->colors);
+	free(pal->sizes);
+	memset(pal, 0, sizeof(palettes_t));
+}
+
+/* packing buffers of a build, atlas_make_batch keeps them per worker across builds */
+typedef struct {
+	stbrp_rect*		rects;
+	sint32*			order;			/* twice 'capacity', the second half is the sort buffer */
+	uint32			capacity;
+	void*			nodes;			/* skyline nodes or index */
+	size_t			nodes_size;
+} scratch_t;
+
+static void
+scratch_reserve(scratch_t* scratch, uint32 count) {
+	if( scratch->capacity >= count ) return;
+
+	free(scratch->rects);
+	free(scratch->order);
+	scratch->capacity	= count;
+	scratch->rects		= (stbrp_rect*)malloc(sizeof(stbrp_rect) * count);
+	scratch->order		= (sint32*)malloc(sizeof(sint32) * count * 2);
+	assert( NULL != scratch->rects && NULL != scratch->order );
+}
+
+static void*
+scratch_nodes(scratch_t* scratch, size_t size) {
+	if( scratch->nodes_size < size ) {
+		free(scratch->nodes);
+		scratch->nodes_size	= size;
+		scratch->nodes		= malloc(size);
+		assert( NULL != scratch->nodes );
+	}
+	return scratch->nodes;
+}
+
+static void
+scratch_free(scratch_t* scratch) {
+	free(scratch->rects);
+	free(scratch->order);
+	free(scratch->nodes);
+	memset(scratch, 0, sizeof(scratch_t));
+}
+
+/*
+ * packing order: height then width, both descending. LSD radix sort on the
+ * bytes of the complemented sizes, digits that are the same for every rect
+ * (usually the high ones) are skipped
+ */
+static void
+sort_rects(const stbrp_rect* rects, uint32 count, sint32* order, sint32* tmp) {
+	uint32		hist[8][256];
+	sint32*		src	= order;
+	sint32*		dst	= tmp;
+	uint32		d, i;
+
+	memset(hist, 0, sizeof(hist));
+	for( i = 0; i < count; ++i ) {
+		uint32	w	= ~(uint32)rects[i].w;
+		uint32	h	= ~(uint32)rects[i].h;
+		for( d = 0; d < 4; ++d ) {
+			++hist[d][(w >> (d * 8)) & 0xFF];
+			++hist[d + 4][(h >> (d * 8)) & 0xFF];
+		}
+		order[i]	= (sint32)i;
+	}
+
+	/* width digits first, the stable passes on the height keep them as tie breaker */
+	for( d = 0; d < 8; ++d ) {
+		uint32	shift	= (d % 4) * 8;
+		uint32	sum		= 0;
+		sint32*	t;
+
+		if( count == 0 || hist[d][(~(uint32)(d < 4 ? rects[0].w : rects[0].h) >> shift) & 0xFF] == count ) continue;
+
+		for( i = 0; i < 256; ++i ) {
+			uint32	c	= hist[d][i];
+			hist[d][i]	= sum;
+			sum			+= c;
+		}
+
+		for( i = 0; i < count; ++i ) {
+			const stbrp_rect*	r	= &rects[src[i]];
+			uint32				k	= ~(uint32)(d < 4 ? r->w : r->h);
+			dst[hist[d][(k >> shift) & 0xFF]++]	= src[i];
+		}
+
+		t	= src;
+		src	= dst;
+		dst	= t;
+	}
+
+	if( src != order ) {
+		memcpy(order, src, sizeof(sint32) * count);
+	}
+}
+
+static const uint32	texture_size[ATLAS_SIZE_CANDIDATES]	= { 128, 256, 512, 1024, 2048, 4096, 8192, 16384 };
+
+/*
+ * smallest candidate size that holds every rect, rects are packed in the
+ * given order and keep the placement of the winning size. sizes whose
+ * image, at 'texel_size' bytes a texel, is too large to save are skipped
+ */
 static uint32
-find_best_size(uint32 img_count, const image_t** imgs) {
-	static uint32	texture_size[] = { 128,	256, 512, 1024, 2048 };
-	bool			success	= true;
+find_best_size(uint32 img_count, scratch_t* scratch, bool allow_rotation, uint32 max_size, uint32 texel_size, ATLAS_SKYLINE skyline, atlas_stats_t* stats, mem_track_t* mem, atlas_async_t* async) {
 	uint32			size	= 0;
+	uint32			max_side	= 0;
+	uint64_t		area	= 0;
+	uint64_t		widths	= 0;
+	uint32			packed	= 0;
+	stbrp_rect*		rects	= scratch->rects;
+	size_t			tracked	= 0;
+	stbrp_node		node;
 	uint32			r;
 	uint32			s;
 
-	stbrp_rect*		rects	= (stbrp_rect*)malloc(sizeof(stbrp_rect) * img_count);
+	TRACE_BEGIN("find_best_size");
+
 	for( r = 0; r < img_count; ++r ) {
-		rects[r]	= image_to_rect(r, imgs[r]);
+		area		+= (uint64_t)rects[r].w * rects[r].h;
+		if( (uint32)rects[r].w > max_side ) max_side = (uint32)rects[r].w;
+		if( (uint32)rects[r].h > max_side ) max_side = (uint32)rects[r].h;
+		if( rects[r].w != 0 && rects[r].h != 0 ) {
+			widths	+= rects[r].w;
+			++packed;
+		}
 	}
 
-	for( s = 0; s < sizeof(texture_size) / sizeof(uint32); ++s ) {
+	for( s = 0; s < ATLAS_SIZE_CANDIDATES && texture_size[s] <= max_size; ++s ) {
 		stbrp_context	ctx;
-		uint32			r;
 		uint32			width	= texture_size[s];
-		stbrp_node*		nodes	= (stbrp_node*)malloc(sizeof(stbrp_node) * width * 2);
-		memset(nodes, 0, sizeof(stbrp_node) * width * 2);
+		size_t			needed;
+		void*			nodes;
+		bool			indexed	= skyline == ATLAS_SKYLINE_INDEXED;
+		bool			success;
+		double			t;
 
-		stbrp_init_target(&ctx, (sint32)width, (sint32)width, nodes, (sint32)width * 2);
-		stbrp_pack_rects(&ctx, rects, (sint32)img_count);
+		/* sizes that cannot hold the largest image or the total area are not worth a pack */
+		if( width < max_side || (uint64_t)width * width < area ) continue;
+		if( (uint64_t)width * width * texel_size > ATLAS_PIXELS_SIZE_MAX ) break;
+		if( atlas_async_cancelled(async) ) break;
 
-		free(nodes);
+		if( skyline == ATLAS_SKYLINE_AUTO && packed != 0 ) {
+			indexed	= (uint64_t)width * packed >= widths * (allow_rotation ? ATLAS_INDEX_MIN_NODES_ROTATED : ATLAS_INDEX_MIN_NODES);
+		}
 
-		/* check if all rectangles were packed */
-		success	= true;
-		for( r = 0; r < img_count; ++r ) {
-			if( !rects[r].was_packed ) {
-				success	= false;
-				size	= 0;
-				break;
-			}
+		/* the skyline nodes or index, the buffer only grows and is reused by the following attempts */
+		needed	= indexed ? (size_t)stbrp_index_size((sint32)width) : sizeof(stbrp_node) * width * 2;
+		nodes	= scratch_nodes(scratch, needed);
+		if( tracked < needed ) {
+			mem_release(mem, tracked);
+			mem_acquire(mem, needed);
+			tracked	= needed;
+		}
+
+		if( indexed ) {
+			stbrp_init_target(&ctx, (sint32)width, (sint32)width, &node, 1);
+			stbrp_setup_index(&ctx, nodes);
+		} else {
+			stbrp_init_target(&ctx, (sint32)width, (sint32)width, (stbrp_node*)nodes, (sint32)width * 2);
+		}
+		stbrp_setup_allow_rotation(&ctx, allow_rotation);
+
+		t	= timer_now_ms();
+
+		TRACE_BEGIN("stbrp_pack_rects");
+		success	= stbrp_pack_rects_ordered(&ctx, rects, scratch->order, (sint32)img_count) != 0;
+		TRACE_END("stbrp_pack_rects");
+
+		if( stats->sizes_tried < ATLAS_SIZE_CANDIDATES ) {
+			stats->tried[stats->sizes_tried++]	= width;
 		}
 
 		if( success ) {
+			size					= width;
+			stats->pack_ms			= timer_now_ms() - t;
+			stats->nodes_peak		= (uint32)ctx.nodes_peak;
+			stats->node_capacity	= indexed ? width : width * 2;
+			break;
+		}
+	}
+
+	mem_release(mem, tracked);
+
+	TRACE_END("find_best_size");
+
+	return size;
+}
+
+/*
+ * ATLAS_SEARCH_QUALITY: the other skyline heuristic and packing orders,
+ * each configuration a task packing the same rects at the same size
+ */
+typedef enum {
+	ORDER_HEIGHT,			/* the order of find_best_size */
+	ORDER_WIDTH,
+	ORDER_AREA,
+	ORDER_PERIMETER,
+	ORDER_MAX_SIDE,
+	ORDER_COUNT
+} ORDER;
+
+#define SEARCH_CONFIGS			(ORDER_COUNT * 2 - 1)	/* both heuristics, but BL by height is already packed */
+
+typedef struct {
+	uint32			key;			/* both descending */
+	uint32			tie;
+	sint32			index;
+} sort_key_t;
+
+static int
+compare_sort_key(const void* a, const void* b) {
+	const sort_key_t*	ka	= (const sort_key_t*)a;
+	const sort_key_t*	kb	= (const sort_key_t*)b;
+	if( ka->key != kb->key ) return ka->key > kb->key ? -1 : 1;
+	if( ka->tie != kb->tie ) return ka->tie > kb->tie ? -1 : 1;
+	return ka->index < kb->index ? -1 : (ka->index > kb->index ? 1 : 0);
+}
+
+/* the packing order by 'order', ties broken by the other side then the index */
+static void
+sort_order(const stbrp_rect* rects, uint32 count, ORDER order, sint32* out, sort_key_t* keys) {
+	uint32	i;
+
+	for( i = 0; i < count; ++i ) {
+		uint32	w		= (uint32)rects[i].w;
+		uint32	h		= (uint32)rects[i].h;
+		uint32	long_side	= w > h ? w : h;
+		uint32	short_side	= w > h ? h : w;
+
+		keys[i].index	= (sint32)i;
+		switch( order ) {
+		case ORDER_WIDTH:		keys[i].key = w;			keys[i].tie = h;			break;
+		case ORDER_AREA:		keys[i].key = w * h;		keys[i].tie = long_side;	break;
+		case ORDER_PERIMETER:	keys[i].key = w + h;		keys[i].tie = long_side;	break;
+		case ORDER_MAX_SIDE:	keys[i].key = long_side;	keys[i].tie = short_side;	break;
+		default:				keys[i].key = h;			keys[i].tie = w;			break;
+		}
+	}
+
+	qsort(keys, count, sizeof(sort_key_t), compare_sort_key);
+	for( i = 0; i < count; ++i ) {
+		out[i]	= keys[i].index;
+	}
+}
+
+/* packed area over the bounding box of the packed rects, 0 when nothing takes space */
+static double
+occupancy(const stbrp_rect* rects, uint32 count) {
+	uint64_t	area	= 0;
+	uint32		right	= 0;
+	uint32		bottom	= 0;
+	uint32		i;
+
+	for( i = 0; i < count; ++i ) {
+		if( rects[i].w == 0 || rects[i].h == 0 ) continue;
+		area	+= (uint64_t)rects[i].w * rects[i].h;
+		if( (uint32)(rects[i].x + rects[i].w) > right ) right = rects[i].x + rects[i].w;
+		if( (uint32)(rects[i].y + rects[i].h) > bottom ) bottom = rects[i].y + rects[i].h;
+	}
+
+	return area ? (double)area / ((double)right * bottom) : 0.0;
+}
+
+typedef struct {
+	const stbrp_rect*	base;		/* the rects, their placement is overwritten */
+	const sint32*		order;		/* packing order */
+	uint32				count;
+	uint32				width;
+	int					heuristic;
+	bool				allow_rotation;
+	bool				indexed;
+	double				deadline;	/* timer_now_ms, 0 for none */
+
+	stbrp_rect*			rects;
+	bool				ran;		/* false when the budget ran out first */
+	bool				success;
+	double				occupancy;
+	double				pack_ms;
+	uint32				nodes_peak;
+} search_task_t;
+
+static void
+search_task(void* arg) {
+	search_task_t*	task	= (search_task_t*)arg;
+	stbrp_context	ctx;
+	stbrp_node		node;
+	void*			nodes;
+	double			t		= timer_now_ms();
+
+	task->ran		= false;
+	task->success	= false;
+	if( task->deadline != 0.0 && t >= task->deadline ) return;
+
+	nodes	= malloc(task->indexed ? (size_t)stbrp_index_size((sint32)task->width) : sizeof(stbrp_node) * task->width * 2);
+	assert( NULL != nodes );
+
+	if( task->indexed ) {
+		stbrp_init_target(&ctx, (sint32)task->width, (sint32)task->width, &node, 1);
+		stbrp_setup_index(&ctx, nodes);
+	} else {
+		stbrp_init_target(&ctx, (sint32)task->width, (sint32)task->width, (stbrp_node*)nodes, (sint32)task->width * 2);
+		stbrp_setup_heuristic(&ctx, task->heuristic);
+	}
+	stbrp_setup_allow_rotation(&ctx, task->allow_rotation);
+
+	memcpy(task->rects, task->base, sizeof(stbrp_rect) * task->count);
+	task->ran			= true;
+	task->success		= stbrp_pack_rects_ordered(&ctx, task->rects, task->order, (sint32)task->count) != 0;
+	task->occupancy		= task->success ? occupancy(task->rects, task->count) : 0.0;
+	task->nodes_peak	= (uint32)ctx.nodes_peak;
+	task->pack_ms		= timer_now_ms() - t;
+
+	free(nodes);
+}
+
+/*
+ * every other configuration at each size up to 'size', the one found by
+ * find_best_size, smallest first. the first size a configuration fits at
+ * wins, with the highest occupancy: at 'size' only when it beats the
+ * current placement, which is replaced. returns the size kept
+ */
+static uint32
+search_heuristics(uint32 img_count, scratch_t* scratch, const atlas_options_t* opts, uint32 size, atlas_pool_t* pool, atlas_stats_t* stats, mem_track_t* mem, atlas_async_t* async) {
+	search_task_t	tasks[SEARCH_CONFIGS];
+	stbrp_rect*		base		= (stbrp_rect*)malloc(sizeof(stbrp_rect) * (img_count ? img_count : 1));
+	stbrp_rect*		rects		= (stbrp_rect*)malloc(sizeof(stbrp_rect) * SEARCH_CONFIGS * (img_count ? img_count : 1));
+	sint32*			orders		= (sint32*)malloc(sizeof(sint32) * ORDER_COUNT * (img_count ? img_count : 1));
+	sort_key_t*		keys		= (sort_key_t*)malloc(sizeof(sort_key_t) * (img_count ? img_count : 1));
+	size_t			tracked		= (sizeof(stbrp_rect) * (SEARCH_CONFIGS + 1) + sizeof(sint32) * ORDER_COUNT) * img_count;
+	double			deadline	= opts->search_budget_ms > 0.0 ? timer_now_ms() + opts->search_budget_ms : 0.0;
+	double			best		= occupancy(scratch->rects, img_count);
+	uint32			max_side	= 0;
+	uint64_t		area		= 0;
+	atlas_task_group_t	group;
+	uint32			r, s, c, o;
+
+	assert( NULL != base && NULL != rects && NULL != orders && NULL != keys );
+
+	TRACE_BEGIN("search_heuristics");
+	atlas_task_group_init(&group);
+	mem_acquire(mem, tracked);
+
+	memcpy(base, scratch->rects, sizeof(stbrp_rect) * img_count);
+	for( r = 0; r < img_count; ++r ) {
+		/* back to the source orientation, for the size bounds */
+		if( base[r].was_rotated ) {
+			stbrp_coord	t	= base[r].w;
+			base[r].w			= base[r].h;
+			base[r].h			= t;
+			base[r].was_rotated	= 0;
+		}
+		area	+= (uint64_t)base[r].w * base[r].h;
+		if( (uint32)base[r].w > max_side ) max_side = base[r].w;
+		if( (uint32)base[r].h > max_side ) max_side = base[r].h;
+	}
+
+	memcpy(orders, scratch->order, sizeof(sint32) * img_count);
+	for( o = 1; o < ORDER_COUNT; ++o ) {
+		sort_order(base, img_count, (ORDER)o, &orders[o * img_count], keys);
+	}
+	free(keys);
+
+	for( c = 0; c < SEARCH_CONFIGS; ++c ) {
+		/* BF for every order, then BL for the ones find_best_size did not try */
+		bool	bf	= c < ORDER_COUNT;
+		tasks[c].base			= base;
+		tasks[c].order			= &orders[(bf ? c : c - ORDER_COUNT + 1) * img_count];
+		tasks[c].count			= img_count;
+		tasks[c].heuristic		= bf ? STBRP_HEURISTIC_Skyline_BF_sortHeight : STBRP_HEURISTIC_Skyline_BL_sortHeight;
+		tasks[c].allow_rotation	= opts->allow_rotation;
+		tasks[c].indexed		= !bf && opts->skyline != ATLAS_SKYLINE_LIST;
+		tasks[c].deadline		= deadline;
+		tasks[c].rects			= &rects[c * img_count];
+	}
+
+	for( s = 0; s < ATLAS_SIZE_CANDIDATES && texture_size[s] <= size; ++s ) {
+		uint32	width	= texture_size[s];
+		uint32	winner	= SEARCH_CONFIGS;
+
+		if( width < max_side || (uint64_t)width * width < area ) continue;
+		if( atlas_async_cancelled(async) || (deadline != 0.0 && timer_now_ms() >= deadline) ) break;
+
+		for( c = 0; c < SEARCH_CONFIGS; ++c ) {
+			tasks[c].width	= width;
+			if( pool ) {
+				atlas_pool_submit_group(pool, &group, search_task, &tasks[c]);
+			} else {
+				search_task(&tasks[c]);
+			}
+		}
+		if( pool ) atlas_pool_wait_group(pool, &group);
+
+		for( c = 0; c < SEARCH_CONFIGS; ++c ) {
+			if( tasks[c].ran ) ++stats->search_packs;
+			if( tasks[c].success && (tasks[c].occupancy > best || width < size) && (winner == SEARCH_CONFIGS || tasks[c].occupancy > tasks[winner].occupancy) ) {
+				winner	= c;
+			}
+		}
+
+		if( winner != SEARCH_CONFIGS ) {
+			memcpy(scratch->rects, tasks[winner].rects, sizeof(stbrp_rect) * img_count);
+			stats->pack_ms			= tasks[winner].pack_ms;
+			stats->nodes_peak		= tasks[winner].nodes_peak;
+			stats->node_capacity	= tasks[winner].indexed ? width : width * 2;
 			size	= width;
 			break;
 		}
 	}
 
+	mem_release(mem, tracked);
+	free(orders);
 	free(rects);
+	free(base);
 
-	if( !success ) return 0;
-	else return size;
-}
+	TRACE_END("search_heuristics");
 
+	return size;
+}
 
 atlas_t*
-atlas_make(uint32 image_count, const image_t** images) {
+atlas_make(const image_t** images, uint32 image_count) {
+	atlas_options_t	opts;
+	atlas_options_init(&opts);
+	return atlas_make_ex(images, image_count, &opts);
+}
+
+/*
+ * one palette for a set of PF_I8 images: their entries are quantized
+ * together, exactly when there are no more than IMAGE_PALETTE_MAX distinct
+ * colours. one entry is kept fully transparent for the texels no image
+ * covers, its index goes to 'clear'. 'luts' maps the indices of image i
+ * through luts[i * 256]
+ */
+static image_t*
+merge_palettes(const palettes_t* pal, uint32 image_count, uint8* luts, uint8* clear, atlas_pool_t* pool) {
+	static const color4b_t	transparent	= { 0, 0, 0, 0 };
+	color4b_t	colors[IMAGE_PALETTE_MAX];
+	uint32		i, c, n;
+	image_t*	entries;
+	image_t*	merged;
+
+	entries	= image_allocate(pal->count ? pal->count : 1, 1, PF_R8G8B8A8);
+	assert( NULL != entries );
+
+	for( n = 0; n < pal->count; ++n ) {
+		image_set_pixelb(entries, n, 0, pal->colors[n]);
+	}
+
+	merged	= image_quantize(entries, IMAGE_PALETTE_MAX, pool);
+
+	/* a full palette without a transparent entry gives one up for it */
+	if( merged && image_transparent_index(merged) == IMAGE_PALETTE_MAX && image_palette_size(merged) == IMAGE_PALETTE_MAX ) {
+		image_release(merged);
+		merged	= image_quantize(entries, IMAGE_PALETTE_MAX - 1, pool);
+	}
+	image_release(entries);
+	if( NULL == merged ) return NULL;
+
+	*clear	= (uint8)image_transparent_index(merged);
+	if( image_transparent_index(merged) == IMAGE_PALETTE_MAX ) {
+		n	= image_palette_size(merged);
+		memcpy(colors, image_palette(merged), sizeof(color4b_t) * n);
+		colors[n]	= transparent;
+		image_set_palette(merged, colors, n + 1);
+		*clear	= (uint8)n;
+	}
+
+	memset(luts, 0, (size_t)IMAGE_PALETTE_MAX * image_count);
+	for( i = 0, n = 0; i < image_count; ++i ) {
+		for( c = 0; c < pal->sizes[i]; ++c, ++n ) {
+			luts[(size_t)i * IMAGE_PALETTE_MAX + c]	= ((const uint8*)image_pixels(merged))[n];
+		}
+	}
+
+	return merged;
+}
+
+/* indices of a blitted PF_I8 region through 'lut' */
+static void
+remap_region(image_t* tex, uint32 x, uint32 y, uint32 width, uint32 height, const uint8* lut) {
+	uint8*	pixels	= (uint8*)image_pixels(tex);
+	uint32	i, j;
+
+	for( j = y; j < y + height; ++j ) {
+		uint8*	row	= pixels + (size_t)j * image_width(tex);
+		for( i = x; i < x + width; ++i ) {
+			row[i]	= lut[row[i]];
+		}
+	}
+}
+
+#define BLIT_ROWS				64		/* source rows copied between two cancellation checks */
+
+/* the packed region of an image into the baked one, 'lut' remaps PF_I8 indices. false once cancelled */
+static bool
+blit_entry(image_t* tex, const atlas_entry_t* e, const image_t* img, const uint8* lut, atlas_async_t* async) {
+	bool	rot	= (e->flags & ATLAS_ENTRY_ROTATED) != 0;
+	uint32	row, rows;
+
+	for( row = 0; row < e->height; row += rows ) {
+		if( atlas_async_cancelled(async) ) return false;
+
+		rows	= e->height - row < BLIT_ROWS ? e->height - row : BLIT_ROWS;
+		if( rot ) {
+			image_blit_transposed(tex, e->x + row, e->y, img, e->trim_x, e->trim_y + row, e->width, rows);
+			if( lut ) remap_region(tex, e->x + row, e->y, rows, e->width, lut);
+		} else {
+			image_blit(tex, e->x, e->y + row, img, e->trim_x, e->trim_y + row, e->width, rows);
+			if( lut ) remap_region(tex, e->x, e->y + row, e->width, rows, lut);
+		}
+	}
+
+	return true;
+}
+
+/* a format holding both: the widest float one if there is one, RGBA8 for other mixes */
+static PIXEL_FORMAT
+common_format(PIXEL_FORMAT a, PIXEL_FORMAT b) {
+	if( a == b ) return a;
+	if( a == PF_R32G32B32A32F || b == PF_R32G32B32A32F ) return PF_R32G32B32A32F;
+	if( a == PF_R16G16B16A16F || b == PF_R16G16B16A16F ) return PF_R16G16B16A16F;
+	return PF_R8G8B8A8;
+}
+
+/*
+ * the source regions of the images, trimmed to their alpha bounds if
+ * requested, their common format (see common_format) and the palettes
+ * of an all PF_I8 set. false if an image is missing or too large
+ */
+static bool
+measure_sources(const source_t* src, uint32 image_count, const atlas_options_t* opts, uint32 alignment, atlas_entry_t* entries, PIXEL_FORMAT* common, palettes_t* pal, atlas_stats_t* stats, mem_track_t* mem) {
+	uint32	r;
+
+	*common	= PF_R8G8B8A8;
+
+	for( r = 0; r < image_count; ++r ) {
+		atlas_entry_t*	e	= &entries[r];
+		const image_t*	img	= source_get(src, r, mem);
+
+		if( NULL == img ) return false;
+
+		*common	= r == 0 ? image_format(img) : common_format(*common, image_format(img));
+
+		if( *common == PF_I8 ) {
+			palettes_add(pal, img, r, image_count);
+		} else if( pal->sizes ) {
+			palettes_free(pal);
+		}
+
+		e->key				= ATLAS_NO_KEY;
+		e->source_width		= image_width(img);
+		e->source_height	= image_height(img);
+
+		if( opts->trim ) {
+			image_alpha_bounds(img, &e->trim_x, &e->trim_y, &e->width, &e->height);
+		} else {
+			e->width	= e->source_width;
+			e->height	= e->source_height;
+		}
+
+		source_put(src, img, mem);
+
+		/* the packer coordinates would silently wrap */
+		if( align_up(e->width + 1, alignment) > ATLAS_MAX_RECT_SIZE || align_up(e->height + 1, alignment) > ATLAS_MAX_RECT_SIZE ) {
+			fprintf(stderr, "ERROR: atlas_make: image %u is too large (%ux%u)\n", r, e->width, e->height);
+			return false;
+		}
+
+		stats->image_area	+= e->width * e->height;
+	}
+
+	return true;
+}
+
+/* 'async' is checked between the phases, NULL when the build can't be cancelled */
+static atlas_t*
+make_atlas(const source_t* src, uint32 image_count, const atlas_options_t* opts, scratch_t* scratch, atlas_pool_t* pool, atlas_async_t* async) {
 	stbrp_rect*	rects	= NULL;
-	stbrp_node*	nodes	= NULL;
-	stbrp_context	ctx;
 	uint32		r;
 	uint32		best_size;
 	image_t*	tex		= NULL;
 	atlas_t*	atlas	= NULL;
-	rect_t*		drects	= NULL;
+	atlas_entry_t*	entries	= NULL;
+	uint32		alignment	= opts->alignment ? opts->alignment : 1;
+	atlas_stats_t	stats;
+	mem_track_t	mem;
+	PIXEL_FORMAT	bake_format	= opts->output_format;
+	PIXEL_FORMAT	common;
+	bool		compress	= image_format_block_size(opts->output_format) != 0;
+	bool		quantize;
+	palettes_t	palettes;
+	image_t*	palette	= NULL;
+	uint8*		luts	= NULL;
+	uint8		clear	= 0;
+	double		start	= timer_now_ms();
+	double		t;
 
-	/* try to find the best texture size */
-	best_size	= find_best_size(image_count, images);
+	memset(&stats, 0, sizeof(stats));
+	memset(&mem, 0, sizeof(mem));
+	memset(&palettes, 0, sizeof(palettes));
+	stats.image_count	= image_count;
 
-	/* create the texture and fill in the pixels */
-	tex	= image_allocate(best_size, best_size, PF_R8G8B8A8);
-	assert( NULL != tex );
+	/* caller owned sources are live for the whole build */
+	if( NULL == src->produce ) {
+		for( r = 0; r < image_count; ++r ) {
+			mem_hold(&mem, image_data_size(src->images[r]));
+		}
+	}
 
-	/* image to rect */
-	rects	= (stbrp_rect*)malloc(sizeof(stbrp_rect) * image_count);
-	assert( NULL != rects );
+	entries	= (atlas_entry_t*)malloc(sizeof(atlas_entry_t) * (image_count ? image_count : 1));
+	assert( NULL != entries );
+
+	memset(entries, 0, sizeof(atlas_entry_t) * image_count);
+
+	if( !measure_sources(src, image_count, opts, alignment, entries, &common, &palettes, &stats, &mem) ) {
+		palettes_free(&palettes);
+		free(entries);
+		return NULL;
+	}
 
+	/* compressed and indexed atlases are baked in the images format first */
+	if( bake_format == PF_AUTO || bake_format == PF_I8 || compress ) {
+		bake_format	= common;
+	}
+
+	quantize	= opts->output_format == PF_I8 && bake_format != PF_I8;
+
+	if( image_format_pixel_size(bake_format) == 0 ) {
+		fprintf(stderr, "ERROR: atlas_make: unsupported output format 0x%X\n", opts->output_format);
+		palettes_free(&palettes);
+		free(entries);
+		return NULL;
+	}
+
+	t	= timer_now_ms();
+	stats.trim_ms	= t - start;
+
+	/* rects and their packing order, sorted once for every candidate size */
+	scratch_reserve(scratch, image_count);
+	rects	= scratch->rects;
+
+	mem_acquire(&mem, (sizeof(stbrp_rect) + sizeof(sint32) * 2) * image_count);
 	for( r = 0; r < image_count; ++r ) {
-		rects[r]	= image_to_rect(r, images[r]);
+		rects[r]	= entry_to_rect(r, &entries[r], alignment);
 	}
 
-	/* nodes */
-	nodes	= (stbrp_node*)malloc(sizeof(stbrp_node) * best_size * 2);
-	assert( NULL != nodes );
+	TRACE_BEGIN("sort_rects");
+	sort_rects(rects, image_count, scratch->order, scratch->order + image_count);
+	TRACE_END("sort_rects");
 
-	memset(nodes, 0, sizeof(stbrp_node) * best_size * 2);
+	/* try to find the best texture size, the winning attempt is the final packing */
+	best_size	= find_best_size(image_count, scratch, opts->allow_rotation, opts->max_size, image_format_pixel_size(bake_format), opts->skyline, &stats, &mem, async);
+	if( best_size != 0 && opts->search == ATLAS_SEARCH_QUALITY ) {
+		best_size	= search_heuristics(image_count, scratch, opts, best_size, pool, &stats, &mem, async);
+	}
 
-	/* desitnation rectangles */
-	drects	= (rect_t*)malloc(sizeof(rect_t) * image_count);
-	assert( NULL != drects );
+	mem_release(&mem, sizeof(sint32) * 2 * image_count);
 
-	memset(drects, 0, sizeof(rect_t) * image_count);
+	stats.search_ms	= timer_now_ms() - t - stats.pack_ms;
 
-	/* pack */
-	stbrp_init_target(&ctx, (int)best_size, (int)best_size, nodes, (int)best_size * 2);
-	stbrp_pack_rects(&ctx, rects, (int)image_count);
+	if( atlas_async_cancelled(async) ) {
+		palettes_free(&palettes);
+		free(entries);
+		return NULL;
+	}
 
-	free(nodes);
+	if( best_size == 0 ) {
+		fprintf(stderr, "ERROR: atlas_make: images do not fit in the largest texture size\n");
+		palettes_free(&palettes);
+		free(entries);
+		stats.total_ms	= timer_now_ms() - start;
+		if( opts->stats ) *opts->stats = stats;
+		return NULL;
+	}
+
+	/* indexed images share a palette, their indices are remapped as they are copied */
+	if( bake_format == PF_I8 ) {
+		luts	= (uint8*)malloc((size_t)IMAGE_PALETTE_MAX * image_count);
+		assert( NULL != luts );
+
+		palette	= merge_palettes(&palettes, image_count, luts, &clear, pool);
+		palettes_free(&palettes);
+		if( NULL == palette ) {
+			free(luts);
+			free(entries);
+			return NULL;
+		}
+	}
+
+	/* create the texture and fill in the pixels */
+	tex	= image_allocate(best_size, best_size, bake_format);
+	assert( NULL != tex );
+
+	if( palette ) {
+		memset(image_pixels(tex), clear, image_data_size(tex));
+	}
+
+	/* an uncompressed image that gets block compressed is scratch */
+	if( compress ) {
+		mem_acquire(&mem, image_data_size(tex));
+	} else {
+		mem_hold(&mem, image_data_size(tex));
+	}
+
+	t	= timer_now_ms();
 
 	/* copy the rectangle */
+	TRACE_BEGIN("blit");
 	for( r = 0; r < image_count; ++r ) {
-		uint32	y;
-		uint32	h	= image_height(images[r]);
-		uint32	w	= image_width(images[r]);
+		atlas_entry_t*	e	= &entries[r];
+		const image_t*	img;
+		bool			blitted;
 
 		assert( rects[r].was_packed );
 
-		drects[r].x	= rects[r].x;
-		drects[r].y	= rects[r].y;
-		drects[r].width	= rects[r].w;
-		drects[r].height= rects[r].h;
+		stats.packed_area	+= (uint32)rects[r].w * (uint32)rects[r].h;
 
-		for( y = 0; y < h ; ++y ) {
-			uint32	x;
-			for( x = 0; x < w; ++x ) {
-				color4b_t	src	= image_get_pixelb(images[r], x, y);
-				image_set_pixelb(tex, rects[r].x + x, rects[r].y + y, src);
-			}
+		e->x	= rects[r].x;
+		e->y	= rects[r].y;
+		if( rects[r].was_rotated ) e->flags |= ATLAS_ENTRY_ROTATED;
+
+		img	= source_get(src, r, &mem);
+		if( NULL == img ) break;
+
+		/* a producer must give the same image on both passes */
+		if( image_width(img) != e->source_width || image_height(img) != e->source_height || (bake_format == PF_I8 && image_format(img) != PF_I8) ) {
+			fprintf(stderr, "ERROR: atlas_make_consume: image %u changed between its passes\n", r);
+			source_put(src, img, &mem);
+			break;
 		}
+
+		blitted	= blit_entry(tex, e, img, luts ? &luts[(size_t)r * IMAGE_PALETTE_MAX] : NULL, async);
+		source_put(src, img, &mem);
+		if( !blitted ) break;
 	}
 
-	/* release resources */
-	free(rects);
+	TRACE_END("blit");
+
+	free(luts);
+
+	/* without a palette yet the indices were copied as is, 'luts' remapped them */
+	if( palette ) {
+		image_set_palette(tex, image_palette(palette), image_palette_size(palette));
+		image_release(palette);
+	}
+
+	if( r != image_count || atlas_async_cancelled(async) ) {
+		image_release(tex);
+		free(entries);
+		return NULL;
+	}
+
+	mem_release(&mem, sizeof(stbrp_rect) * image_count);
+
+	stats.blit_ms	= timer_now_ms() - t;
+	t	= timer_now_ms();
+
+	/* quantize the baked image, the direct colour one is scratch from here */
+	if( quantize ) {
+		image_t*	itex;
+
+		itex	= image_quantize(tex, IMAGE_PALETTE_MAX, pool);
+		if( NULL == itex ) {
+			image_release(tex);
+			free(entries);
+			return NULL;
+		}
+
+		mem_hold(&mem, image_data_size(itex));
+		mem_drop(&mem, image_data_size(tex));
+
+		image_release(tex);
+		tex	= itex;
+	}
+
+	if( compress && atlas_async_cancelled(async) ) {
+		image_release(tex);
+		free(entries);
+		return NULL;
+	}
+
+	/* block compress the baked image, the uncompressed one is scratch from here */
+	if( compress ) {
+		image_t*	ctex;
+
+		ctex	= image_compress(tex, opts->output_format, pool);
+
+		if( NULL == ctex ) {
+			image_release(tex);
+			free(entries);
+			return NULL;
+		}
+
+		mem_hold(&mem, image_data_size(ctex));
+		mem_release(&mem, image_data_size(tex));
+
+		image_release(tex);
+		tex	= ctex;
+	}
+
+	stats.encode_ms	= timer_now_ms() - t;
 
 	/* final result */
 	atlas	= (atlas_t*)malloc(sizeof(atlas_t));
 	assert( NULL != atlas );
 
+	memset(atlas, 0, sizeof(atlas_t));
 	atlas->baked_image	= tex;
-	atlas->coordinates	= drects;
+	atlas->entries		= entries;
 	atlas->image_count	= image_count;
+	atlas->entry_capacity	= image_count;
+	atlas->alignment	= alignment;
+
+	if( opts->keys && !atlas_build_keys(atlas, opts->keys) ) {
+		atlas_release(atlas);
+		return NULL;
+	}
+
+	if( opts->uv_layout != ATLAS_UV_NONE ) {
+		atlas_build_uv_table(atlas, opts->uv_layout, opts->uv_half_texel);
+	}
+
+	stats.size				= best_size;
+	stats.wasted_area		= best_size * best_size - stats.image_area;
+	stats.fill_ratio		= (float)stats.image_area / (float)(best_size * best_size);
+	stats.peak_temp_bytes	= mem.peak;
+	stats.peak_bytes		= mem.peak_total;
+	stats.total_ms			= timer_now_ms() - start;
+
+	if( opts->stats ) {
+		*opts->stats	= stats;
+	}
+
 	return atlas;
 }
 
+/* one distance field, see make_fields */
+typedef struct {
+	const image_t*	src;
+	image_t*		field;
+	uint32			spread;
+} sdf_task_t;
+
+static void
+sdf_task(void* arg) {
+	sdf_task_t*	task	= (sdf_task_t*)arg;
+	task->field	= image_sdf(task->src, task->spread, NULL);
+}
+
+static void
+release_fields(const image_t** fields, const image_t** images, uint32 image_count) {
+	uint32	i;
+	for( i = 0; i < image_count; ++i ) {
+		if( fields[i] && fields[i] != images[i] ) image_release((image_t*)fields[i]);
+	}
+	free(fields);
+}
+
+/*
+ * the images to pack with the PF_A8 ones replaced by their distance fields,
+ * one image per task on 'pool', or a single image split over it. NULL if
+ * a field could not be made
+ */
+static const image_t**
+make_fields(const image_t** images, uint32 image_count, uint32 spread, atlas_pool_t* pool) {
+	const image_t**	fields	= (const image_t**)malloc(sizeof(image_t*) * (image_count ? image_count : 1));
+	sdf_task_t*		tasks	= (sdf_task_t*)malloc(sizeof(sdf_task_t) * (image_count ? image_count : 1));
+	atlas_task_group_t	group;
+	bool			ok		= true;
+	uint32			i;
+
+	assert( NULL != fields && NULL != tasks );
+
+	TRACE_BEGIN("make_fields");
+	atlas_task_group_init(&group);
+
+	for( i = 0; i < image_count; ++i ) {
+		tasks[i].src	= images[i];
+		tasks[i].field	= NULL;
+		tasks[i].spread	= spread;
+		if( image_format(images[i]) != PF_A8 ) continue;
+
+		if( image_count == 1 ) {
+			tasks[i].field	= image_sdf(images[i], spread, pool);
+		} else if( pool ) {
+			atlas_pool_submit_group(pool, &group, sdf_task, &tasks[i]);
+		} else {
+			sdf_task(&tasks[i]);
+		}
+	}
+	if( pool ) atlas_pool_wait_group(pool, &group);
+
+	for( i = 0; i < image_count; ++i ) {
+		bool	a8	= image_format(images[i]) == PF_A8;
+		fields[i]	= a8 ? tasks[i].field : images[i];
+		if( a8 && NULL == tasks[i].field ) ok = false;
+	}
+
+	TRACE_END("make_fields");
+
+	free(tasks);
+
+	if( !ok ) {
+		release_fields(fields, images, image_count);
+		return NULL;
+	}
+
+	return fields;
+}
+
+/* the distance field stage around make_atlas, 'pool' may be NULL */
+static atlas_t*
+make_atlas_fields(const image_t** images, uint32 image_count, const atlas_options_t* opts, scratch_t* scratch, atlas_pool_t* pool, atlas_async_t* async) {
+	source_t		src;
+	atlas_t*		atlas;
+	double			t;
+
+	memset(&src, 0, sizeof(src));
+	src.images	= images;
+
+	if( opts->sdf_spread == 0 ) return make_atlas(&src, image_count, opts, scratch, pool, async);
+
+	t		= timer_now_ms();
+	src.images	= make_fields(images, image_count, opts->sdf_spread, pool);
+	if( NULL == src.images ) return NULL;
+	t		= timer_now_ms() - t;
+
+	atlas	= make_atlas(&src, image_count, opts, scratch, pool, async);
+	release_fields(src.images, images, image_count);
+
+	if( atlas && opts->stats ) {
+		opts->stats->sdf_ms		= t;
+		opts->stats->total_ms	+= t;
+	}
+
+	return atlas;
+}
+
+atlas_t*
+atlas_build(const image_t** images, uint32 image_count, const atlas_options_t* opts, atlas_pool_t* pool, atlas_async_t* async) {
+	scratch_t		scratch;
+	atlas_t*		atlas;
+
+	memset(&scratch, 0, sizeof(scratch));
+	atlas	= make_atlas_fields(images, image_count, opts, &scratch, pool, async);
+	scratch_free(&scratch);
+
+	return atlas;
+}
+
+atlas_pool_t*
+atlas_stage_pool(const atlas_options_t* opts) {
+	/* the distance fields, the quantizer, the block encoder and the quality search are the only stages worth threads */
+	if( !opts->sdf_spread && opts->output_format != PF_I8 && !image_format_block_size(opts->output_format) && opts->search != ATLAS_SEARCH_QUALITY ) return NULL;
+	if( opts->pool ) return opts->pool;
+	return atlas_cpu_count() > 1 ? atlas_pool_shared() : NULL;
+}
+
+atlas_t*
+atlas_make_ex(const image_t** images, uint32 image_count, const atlas_options_t* opts) {
+	return atlas_build(images, image_count, opts, atlas_stage_pool(opts), NULL);
+}
+
+atlas_t*
+atlas_make_consume(uint32 image_count, atlas_produce_fun_t produce, void* user, const atlas_options_t* opts) {
+	scratch_t		scratch;
+	source_t		src;
+	atlas_t*		atlas;
+
+	memset(&scratch, 0, sizeof(scratch));
+	memset(&src, 0, sizeof(src));
+	src.produce	= produce;
+	src.user	= user;
+	src.spread	= opts->sdf_spread;
+	src.pool	= atlas_stage_pool(opts);
+
+	/* the distance fields are made one image at a time as they are produced */
+	atlas	= make_atlas(&src, image_count, opts, &scratch, src.pool, NULL);
+
+	scratch_free(&scratch);
+
+	return atlas;
+}
+
+/* a batch in flight, jobs run on the pool with the scratch of their worker */
+typedef struct {
+	atlas_pool_t*	pool;
+	scratch_t*		scratch;		/* one per worker */
+	atlas_options_t	defaults;
+} batch_t;
+
+typedef struct {
+	batch_t*		batch;
+	atlas_job_t*	job;
+	uint64_t		cost;			/* source pixels, the scheduling estimate */
+} batch_task_t;
+
+static int
+compare_task_cost(const void* a, const void* b) {
+	const batch_task_t*	ta	= (const batch_task_t*)a;
+	const batch_task_t*	tb	= (const batch_task_t*)b;
+	if( ta->cost != tb->cost ) return ta->cost > tb->cost ? -1 : 1;
+	return ta->job < tb->job ? -1 : (ta->job > tb->job ? 1 : 0);
+}
+
+static void
+batch_task(void* arg) {
+	batch_task_t*	task	= (batch_task_t*)arg;
+	batch_t*		batch	= task->batch;
+	atlas_job_t*	job		= task->job;
+	uint32			w		= atlas_pool_worker(batch->pool);
+
+	assert( w < atlas_pool_thread_count(batch->pool) );
+
+	TRACE_BEGIN("batch_job");
+	/* the batch already keeps every worker busy, the fields and palette of a job are made serially */
+	job->atlas	= make_atlas_fields(job->images, job->image_count, job->opts ? job->opts : &batch->defaults, &batch->scratch[w], NULL, NULL);
+	TRACE_END("batch_job");
+}
+
+bool
+atlas_make_batch(atlas_job_t* jobs, uint32 job_count, atlas_pool_t* pool) {
+	batch_task_t*	tasks;
+	batch_t			batch;
+	atlas_task_group_t	group;
+	uint32			workers;
+	uint32			j, i;
+	bool			ok			= true;
+
+	if( job_count == 0 ) return true;
+
+	if( NULL == pool && NULL == (pool = atlas_pool_shared()) ) {
+		fprintf(stderr, "ERROR: atlas_make_batch: no thread pool\n");
+		return false;
+	}
+
+	workers	= atlas_pool_thread_count(pool);
+	batch.pool		= pool;
+	batch.scratch	= (scratch_t*)malloc(sizeof(scratch_t) * workers);
+	tasks			= (batch_task_t*)malloc(sizeof(batch_task_t) * job_count);
+	assert( NULL != batch.scratch && NULL != tasks );
+
+	memset(batch.scratch, 0, sizeof(scratch_t) * workers);
+	atlas_options_init(&batch.defaults);
+
+	for( j = 0; j < job_count; ++j ) {
+		tasks[j].batch	= &batch;
+		tasks[j].job	= &jobs[j];
+		tasks[j].cost	= 0;
+		jobs[j].atlas	= NULL;
+		for( i = 0; i < jobs[j].image_count; ++i ) {
+			tasks[j].cost	+= (uint64_t)image_width(jobs[j].images[i]) * image_height(jobs[j].images[i]);
+		}
+	}
+
+	/* longest processing time first: the small jobs fill the gaps at the end */
+	qsort(tasks, job_count, sizeof(batch_task_t), compare_task_cost);
+
+	atlas_task_group_init(&group);
+	for( j = 0; j < job_count; ++j ) {
+		atlas_pool_submit_group(pool, &group, batch_task, &tasks[j]);
+	}
+	atlas_pool_wait_group(pool, &group);
+
+	for( j = 0; j < job_count; ++j ) {
+		if( NULL == jobs[j].atlas ) ok = false;
+	}
+
+	for( i = 0; i < workers; ++i ) {
+		scratch_free(&batch.scratch[i]);
+	}
+	free(batch.scratch);
+	free(tasks);
+
+	return ok;
+}
+
+uint32
+atlas_make_split(const image_t** images, uint32 image_count, const atlas_options_t* opts, atlas_t** atlases, uint32* atlas_of, uint32* index_of) {
+	static const PIXEL_FORMAT	formats[ATLAS_SPLIT_MAX]	= { PF_A8, PF_R8G8B8, PF_R8G8B8A8, PF_I8, PF_R16G16B16A16F, PF_R32G32B32A32F };
+	atlas_job_t		jobs[ATLAS_SPLIT_MAX];
+	atlas_options_t	sub[ATLAS_SPLIT_MAX];
+	uint32			first[ATLAS_SPLIT_MAX];		/* of every format in 'grouped' */
+	uint32			next[ATLAS_SPLIT_MAX];
+	uint32			job_of[ATLAS_SPLIT_MAX];
+	const image_t**	grouped	= (const image_t**)malloc(sizeof(image_t*) * (image_count ? image_count : 1));
+	const char**	keys	= (const char**)malloc(sizeof(char*) * (image_count ? image_count : 1));
+	uint32			job_count	= 0;
+	uint32			total	= 0;
+	uint32			r, f;
+	bool			ok;
+
+	assert( NULL != grouped && NULL != keys );
+
+	/* images per format, counted in index_of first */
+	memset(first, 0, sizeof(first));
+	for( r = 0; r < image_count; ++r ) {
+		for( f = 0; f < ATLAS_SPLIT_MAX && formats[f] != image_format(images[r]); ++f ) {}
+		if( f == ATLAS_SPLIT_MAX ) {
+			fprintf(stderr, "ERROR: atlas_make_split: image %u has an unsupported format 0x%X\n", r, image_format(images[r]));
+			free(keys);
+			free(grouped);
+			return 0;
+		}
+		atlas_of[r]	= f;
+		++first[f];
+	}
+
+	/* a job per format present, its images in their original order */
+	for( f = 0; f < ATLAS_SPLIT_MAX; ++f ) {
+		uint32	count	= first[f];
+
+		first[f]	= total;
+		job_of[f]	= job_count;
+		if( count == 0 ) continue;
+
+		sub[job_count]			= *opts;
+		sub[job_count].stats	= NULL;
+		sub[job_count].keys		= opts->keys ? &keys[total] : NULL;
+		if( !image_format_block_size(opts->output_format) && opts->output_format != PF_I8 ) {
+			sub[job_count].output_format	= PF_AUTO;
+		}
+
+		jobs[job_count].images		= &grouped[total];
+		jobs[job_count].image_count	= count;
+		jobs[job_count].opts		= &sub[job_count];
+		++job_count;
+		total	+= count;
+	}
+
+	memcpy(next, first, sizeof(next));
+	for( r = 0; r < image_count; ++r ) {
+		uint32	at	= next[atlas_of[r]]++;
+		grouped[at]	= images[r];
+		keys[at]	= opts->keys ? opts->keys[r] : NULL;
+		index_of[r]	= at - first[atlas_of[r]];
+		atlas_of[r]	= job_of[atlas_of[r]];
+	}
+
+	ok	= atlas_make_batch(jobs, job_count, NULL);
+
+	for( f = 0; f < job_count; ++f ) {
+		atlases[f]	= jobs[f].atlas;
+		if( !ok && jobs[f].atlas ) {
+			atlas_release(jobs[f].atlas);
+			atlases[f]	= NULL;
+		}
+	}
+
+	free(keys);
+	free(grouped);
+
+	return ok ? job_count : 0;
+}
+
+void
+atlas_free_keys(atlas_t* atlas) {
+	free(atlas->keys);
+	free(atlas->buckets);
+	free(atlas->slots);
+	atlas->keys			= NULL;
+	atlas->buckets		= NULL;
+	atlas->slots		= NULL;
+	atlas->keys_size	= 0;
+	atlas->key_count	= 0;
+}
+
 void
 atlas_release(atlas_t* atlas) {
-	image_release(atlas->baked_image);
-	free(atlas->coordinates);
+	if( atlas->mapping ) atlas_detach(atlas);
+	if( atlas->baked_image ) image_release(atlas->baked_image);
+	free(atlas->entries);
+	atlas_free_keys(atlas);
+	free(atlas->uv_block);
+	free(atlas->free.areas);
+	free(atlas->removed);
+	free(atlas->dirty);
+	free(atlas->regions);
 	free(atlas);
 }
@@ -18,6 +18,7 @@
 */
 #ifndef __ATLAS_LIB__H__
 #define __ATLAS_LIB__H__
+#include <stddef.h>
 #include "c99-3d-math/3dmath.h"
 
 /*
@@ -26,7 +27,15 @@
 typedef enum {
 	PF_A8,
 	PF_R8G8B8,
-	PF_R8G8B8A8
+	PF_R8G8B8A8,
+	PF_BC1,			/* block compressed 4x4, RGB + 1 bit alpha, 8 bytes per block */
+	PF_BC3,			/* block compressed 4x4, RGBA, 16 bytes per block */
+	PF_BC7,			/* block compressed 4x4, RGBA, 16 bytes per block */
+	PF_I8,			/* 8 bit index in a palette of up to IMAGE_PALETTE_MAX RGBA colours */
+	PF_R16G16B16A16F,	/* half float RGBA, 8 bytes per pixel, not clamped to [0, 1] */
+	PF_R32G32B32A32F,	/* float RGBA, 16 bytes per pixel, not clamped to [0, 1] */
+
+	PF_AUTO	= 0x100	/* atlas_options_t.output_format only: the smallest format holding every image */
 } PIXEL_FORMAT;
 
 typedef struct image_s	image_t;
@@ -41,24 +50,443 @@ uint32					image_width(const image_t* img);
 uint32					image_height(const image_t* img);
 PIXEL_FORMAT			image_format(const image_t* img);
 
+image_t*				image_allocate(uint32 width, uint32 height, PIXEL_FORMAT fmt);
 image_t*				image_initb(uint32 width, uint32 height, PIXEL_FORMAT fmt, void* initial_state, image_initb_fun_t filler);
 image_t*				image_initf(uint32 width, uint32 height, PIXEL_FORMAT fmt, void* initial_state, image_initf_fun_t filler);
 
+/* an image over 'pixels', which stay the caller's: they must outlive the image and image_release leaves them */
+image_t*				image_wrap(uint32 width, uint32 height, PIXEL_FORMAT fmt, void* pixels);
+
 void					image_release(image_t* img);
 
+void*					image_pixels(const image_t* img);
+size_t					image_data_size(const image_t* img);
+
+#define IMAGE_PALETTE_MAX		256
+
+/* PF_I8 palette, NULL for the other formats. texels set from colours take the nearest entry */
+const color4b_t*		image_palette(const image_t* img);
+uint32					image_palette_size(const image_t* img);
+void					image_set_palette(image_t* img, const color4b_t* colors, uint32 count);
+
+/* tight box around the pixels with a non-zero alpha, false when the image is fully transparent */
+bool					image_alpha_bounds(const image_t* img, uint32* x, uint32* y, uint32* width, uint32* height);
+
+color4b_t				image_get_pixelb(const image_t* img, uint32 x, uint32 y);
+void					image_set_pixelb(image_t* img, uint32 x, uint32 y, color4b_t col);
+/* float colours are clamped to [0, 1] and rounded when stored in an 8 bit format */
+color4_t				image_get_pixelf(const image_t* img, uint32 x, uint32 y);
+void					image_set_pixelf(image_t* img, uint32 x, uint32 y, color4_t col);
+
+/*
+ * copy a width x height region of src at (sx, sy) to dst at (dx, dy), converting the format if needed.
+ * indices go to the closest entries of an indexed dst with another palette, as is into one without
+ */
+void					image_blit(image_t* dst, uint32 dx, uint32 dy, const image_t* src, uint32 sx, uint32 sy, uint32 width, uint32 height);
+/* same, but the region lands transposed (height x width): source (x, y) goes to (dx + y, dy + x) */
+void					image_blit_transposed(image_t* dst, uint32 dx, uint32 dy, const image_t* src, uint32 sx, uint32 sy, uint32 width, uint32 height);
+
 void*					image_foldb(const image_t* img, void* initial_state, image_foldb_fun_t f);
 void*					image_foldf(const image_t* img, void* initial_state, image_foldf_fun_t f);
 
+/*
+ * pool.c
+ */
+typedef struct atlas_pool_s atlas_pool_t;
+
+typedef void			(*atlas_task_fun_t)(void* arg);
+
+uint32					atlas_cpu_count(void);
+
+/* 0 threads means one per cpu */
+atlas_pool_t*			atlas_pool_make(uint32 thread_count);
+void					atlas_pool_release(atlas_pool_t* pool);
+
+uint32					atlas_pool_thread_count(const atlas_pool_t* pool);
+/* index of the calling worker, atlas_pool_thread_count() outside of the pool's threads */
+uint32					atlas_pool_worker(const atlas_pool_t* pool);
+void					atlas_pool_submit(atlas_pool_t* pool, atlas_task_fun_t fun, void* arg);
+/* block until every submitted task has run */
+void					atlas_pool_wait(atlas_pool_t* pool);
+
+/* tasks waited for together, so that callers sharing a pool don't wait for each other */
+typedef struct {
+	uint32			pending;		/* queued or running, under the pool lock */
+} atlas_task_group_t;
+
+void					atlas_task_group_init(atlas_task_group_t* group);
+void					atlas_pool_submit_group(atlas_pool_t* pool, atlas_task_group_t* group, atlas_task_fun_t fun, void* arg);
+/* block until every task of 'group' has run */
+void					atlas_pool_wait_group(atlas_pool_t* pool, atlas_task_group_t* group);
+
+/*
+ * bc.c
+ */
+/*
+ * encode an uncompressed image into PF_BC1, PF_BC3 or PF_BC7, NULL on
+ * failure. float images are clamped to [0, 1]. the block rows are split
+ * over 'pool' when not NULL
+ */
+image_t*				image_compress(const image_t* img, PIXEL_FORMAT fmt, atlas_pool_t* pool);
+
+/*
+ * sdf.c
+ */
+/*
+ * signed distance field of a PF_A8 image (alpha > 127 is inside), as a
+ * PF_A8 image 'spread' texels larger on every side: 128 on the edge, 255
+ * 'spread' texels inside and 0 as far outside. the passes are split over
+ * 'pool' when not NULL
+ */
+image_t*				image_sdf(const image_t* img, uint32 spread, atlas_pool_t* pool);
+
+/*
+ * palette.c
+ */
+/*
+ * PF_I8 copy of an image with at most max_colors (<= IMAGE_PALETTE_MAX)
+ * entries: exact when the image has that few colours, median cut quantized
+ * otherwise, split over 'pool' when not NULL
+ */
+image_t*				image_quantize(const image_t* img, uint32 max_colors, atlas_pool_t* pool);
+
 /*
  * atlas.c
  */
 typedef struct atlas_s atlas_t;
 
+#define ATLAS_NOT_FOUND			0xFFFFFFFF
+
+typedef enum {
+	ATLAS_UV_NONE,
+	ATLAS_UV_AOS,		/* u0 v0 u1 v1 per image */
+	ATLAS_UV_SOA		/* all u0, then all v0, all u1 and all v1, each array 'stride' floats */
+} ATLAS_UV_LAYOUT;
+
+/* how the packer searches the skyline, all give the same placements */
+typedef enum {
+	ATLAS_SKYLINE_AUTO,		/* the index when the skyline is expected to get long */
+	ATLAS_SKYLINE_INDEXED,	/* segment tree over the columns, scales to large rect counts */
+	ATLAS_SKYLINE_LIST,		/* stb_rect_pack walking its node list */
+} ATLAS_SKYLINE;
+
+/* how hard the packer looks for a smaller texture */
+typedef enum {
+	ATLAS_SEARCH_FAST,		/* bottom left skyline, rects by height */
+	ATLAS_SEARCH_QUALITY,	/* also best fit, and rects by width, area, perimeter and longest side, in parallel */
+} ATLAS_SEARCH;
+
+#define ATLAS_SIZE_CANDIDATES	8	/* 128 up to 16384 */
+
+/* how a build went, see atlas_options_t.stats */
+typedef struct {
+	uint32			size;			/* side of the baked image, 0 if nothing fit */
+	uint32			image_count;
+	uint32			image_area;		/* pixels covered by the (trimmed) images */
+	uint32			packed_area;	/* pixels covered by packed rects, gutters and alignment included */
+	uint32			wasted_area;	/* baked pixels not covered by any image */
+	float			fill_ratio;		/* image_area / baked area */
+	uint32			sizes_tried;	/* candidate sizes a pack was attempted at */
+	uint32			tried[ATLAS_SIZE_CANDIDATES];
+	uint32			nodes_peak;		/* most skyline nodes in use during the final pack */
+	uint32			node_capacity;	/* skyline nodes available to the final pack */
+	size_t			peak_temp_bytes;	/* most scratch memory live at once */
+	size_t			peak_bytes;		/* most memory live at once: scratch, sources held and baked images */
+	uint32			search_packs;	/* packs run by ATLAS_SEARCH_QUALITY */
+
+	/* milliseconds per phase */
+	double			sdf_ms;			/* distance fields, see atlas_options_t.sdf_spread */
+	double			trim_ms;
+	double			search_ms;		/* sorting and the sizes that did not fit */
+	double			pack_ms;		/* the packing that was kept */
+	double			blit_ms;
+	double			encode_ms;
+	double			total_ms;
+} atlas_stats_t;
+
+typedef struct {
+	uint32			alignment;		/* packed rects start and end on multiples of this (use 4 for BC formats) */
+	PIXEL_FORMAT	output_format;	/* PF_AUTO, PF_A8, PF_R8G8B8, PF_R8G8B8A8, a float format, or PF_BC1/PF_BC3/PF_BC7 to block compress the baked image */
+	bool			trim;			/* pack only the non transparent part of each image */
+	bool			allow_rotation;	/* images may be stored rotated, see atlas_image_rotated */
+	uint32			max_size;		/* largest baked image size to try, up to 16384 */
+	ATLAS_SKYLINE	skyline;		/* search strategy, only changes the speed */
+	ATLAS_SEARCH	search;			/* the smallest texture, then the densest packing, of several configurations */
+	double			search_budget_ms;	/* stop ATLAS_SEARCH_QUALITY after this long, 0 for no limit */
+	uint32			sdf_spread;		/* > 0 packs the PF_A8 images as distance fields, see image_sdf */
+	const char**	keys;			/* optional name per image (NULL entries allowed), see atlas_find */
+	ATLAS_UV_LAYOUT	uv_layout;		/* precompute a normalized uv table, see atlas_uv_table */
+	bool			uv_half_texel;	/* inset the uvs by half a texel */
+	atlas_stats_t*	stats;			/* filled by atlas_make when not NULL */
+	atlas_pool_t*	pool;			/* runs the stages worth threads, not from one of its tasks. NULL for the library's own */
+} atlas_options_t;
+
+/* where a trimmed image sits inside its source */
+typedef struct {
+	uint32			x, y;			/* offset of the packed region in the source image */
+	uint32			source_width;	/* size of the source image before trimming */
+	uint32			source_height;
+} atlas_trim_t;
+
+void					atlas_options_init(atlas_options_t* opts);
+
 atlas_t*				atlas_make(const image_t **images, uint32 image_count);
+atlas_t*				atlas_make_ex(const image_t **images, uint32 image_count, const atlas_options_t* opts);
 void					atlas_release(atlas_t* atlas);
 
+/*
+ * image 'index' of a consuming build, NULL on failure. the build owns the
+ * returned image and releases it
+ */
+typedef image_t*		(*atlas_produce_fun_t)(void* user, uint32 index);
+
+/*
+ * atlas_make_ex with the sources pulled from 'produce' rather than held
+ * by the caller: every image is produced twice, once to measure it and
+ * once to blit it, and released right after each. peak memory is then the
+ * baked image plus one source, see atlas_stats_t.peak_bytes
+ */
+atlas_t*				atlas_make_consume(uint32 image_count, atlas_produce_fun_t produce, void* user, const atlas_options_t* opts);
+
+/*
+ * one atlas per source format for mixed sets, so that none of them is
+ * promoted. fills atlases[0..n) with n <= ATLAS_SPLIT_MAX and returns n, 0
+ * on failure. image i ends up as image index_of[i] of atlases[atlas_of[i]].
+ * opts->stats is not filled
+ */
+#define ATLAS_SPLIT_MAX			6
+
+uint32					atlas_make_split(const image_t **images, uint32 image_count, const atlas_options_t* opts, atlas_t** atlases, uint32* atlas_of, uint32* index_of);
+
+/* one atlas of a batch, see atlas_make_batch */
+typedef struct {
+	const image_t**			images;
+	uint32					image_count;
+	const atlas_options_t*	opts;		/* NULL for the defaults */
+	atlas_t*				atlas;		/* the result, NULL if the build failed */
+} atlas_job_t;
+
+/*
+ * build independent atlases concurrently, largest jobs first, on 'pool' or
+ * on the pool the library keeps when NULL. the packing scratch is kept per
+ * worker across jobs. waits for its jobs, so it must not be called from
+ * one of the pool's tasks. false if any job failed
+ */
+bool					atlas_make_batch(atlas_job_t* jobs, uint32 job_count, atlas_pool_t* pool);
+
 const image_t*			atlas_baked_image(const atlas_t* atlas);
 uint32					atlas_image_count(const atlas_t* atlas);
 rect_t					atlas_image_coordinates(const atlas_t* atlas, uint32 img);
+atlas_trim_t			atlas_image_trim(const atlas_t* atlas, uint32 img);
+/* rotated images are stored transposed: source texel (x, y) is at (y, x) from the coordinates origin */
+bool					atlas_image_rotated(const atlas_t* atlas, uint32 img);
+const char*				atlas_image_key(const atlas_t* atlas, uint32 img);
+
+/* index of the image with this key, ATLAS_NOT_FOUND if there is none */
+uint32					atlas_find(const atlas_t* atlas, const char* key);
+
+/*
+ * normalized uv rects ready for upload. the table is 16 byte aligned, SoA
+ * arrays are padded to a multiple of 4 floats. rotated images get the uv
+ * rect of their footprint, see atlas_image_rotated
+ */
+void					atlas_build_uv_table(atlas_t* atlas, ATLAS_UV_LAYOUT layout, bool half_texel);
+const float*			atlas_uv_table(const atlas_t* atlas);
+uint32					atlas_uv_table_size(const atlas_t* atlas);		/* in bytes */
+uint32					atlas_uv_stride(const atlas_t* atlas);			/* floats between SoA arrays */
+
+/*
+ * async.c
+ *
+ * atlas_make_ex off the calling thread. the images, and the keys and
+ * stats the options point to, must outlive the build. a cancelled build
+ * stops at the next check: between the phases, the sizes tried and every
+ * few blitted rows
+ */
+typedef struct atlas_async_s atlas_async_t;
+
+typedef enum {
+	ATLAS_ASYNC_RUNNING,
+	ATLAS_ASYNC_DONE,
+	ATLAS_ASYNC_FAILED,
+	ATLAS_ASYNC_CANCELLED
+} ATLAS_ASYNC_STATE;
+
+/* called once on the building thread when the build is over, it must not wait for or release 'async' */
+typedef void			(*atlas_async_fun_t)(void* user, atlas_async_t* async, ATLAS_ASYNC_STATE state);
+
+/*
+ * runs as a task of 'pool', its stages not split any further, or on a
+ * thread of its own when NULL. 'done' may be NULL
+ */
+atlas_async_t*			atlas_make_async(const image_t** images, uint32 image_count, const atlas_options_t* opts, atlas_pool_t* pool, atlas_async_fun_t done, void* user);
+ATLAS_ASYNC_STATE		atlas_async_poll(atlas_async_t* async);
+/* block until the build is over, the atlas then belongs to the caller. NULL if it failed or was cancelled */
+atlas_t*				atlas_async_wait(atlas_async_t* async);
+void					atlas_async_cancel(atlas_async_t* async);
+/* waits, then releases the handle and the atlas if it was not taken */
+void					atlas_async_release(atlas_async_t* async);
+
+/*
+ * compact.c
+ *
+ * long lived atlases: images are removed and added in place, in the free
+ * space left between the others. a removed image keeps its index, with an
+ * empty rect and no key, until atlas_add reuses it. new images need an
+ * uncompressed, non indexed baked image
+ */
+atlas_t*				atlas_make_empty(uint32 size, PIXEL_FORMAT format);
+bool					atlas_remove(atlas_t* atlas, uint32 img);
+/* index of the new image, ATLAS_NOT_FOUND when no free space is large enough */
+uint32					atlas_add(atlas_t* atlas, const image_t* img, const char* key);
+bool					atlas_image_removed(const atlas_t* atlas, uint32 img);
+
+/* one image moved by atlas_compact, its (footprint) rect in the baked image */
+typedef struct {
+	uint32			image;
+	uint32			src_x, src_y;
+	uint32			dst_x, dst_y;
+	uint32			width, height;
+} atlas_move_t;
+
+/*
+ * repack the live images in a size x size baked image, 0 for the smallest
+ * power of two they fit in, leaving in place as many as possible. fills
+ * 'moves' (room for atlas_image_count) and returns their count, or
+ * ATLAS_NOT_FOUND if the images do not fit. the baked image is updated
+ * and the texels left behind are cleared. when *in_place no move writes
+ * what another one reads and they can be copied in any order, otherwise
+ * every source has to be read before any destination is written (through
+ * a staging texture). the top left size x size of the old texture, grown
+ * if needed, is then the new one
+ */
+uint32					atlas_compact(atlas_t* atlas, uint32 size, atlas_move_t* moves, bool* in_place);
+
+/*
+ * cache.c
+ *
+ * a fixed size atlas used as a cache of rasterized images, glyphs
+ * typically, looked up by key and size. a miss rasterizes the image and
+ * makes room by evicting the least recently used ones, except those used
+ * in the last 'frames_in_flight' frames that the GPU may still read
+ */
+typedef struct atlas_cache_s atlas_cache_t;
+
+/* the image for (key, size), NULL on failure. the cache releases it once copied */
+typedef image_t*		(*atlas_rasterize_fun_t)(void* user, const char* key, uint32 size);
+
+atlas_cache_t*			atlas_cache_make(uint32 size, PIXEL_FORMAT format, uint32 frames_in_flight);
+void					atlas_cache_release(atlas_cache_t* cache);
+
+/* the images used from here on belong to a new frame */
+void					atlas_cache_next_frame(atlas_cache_t* cache);
+
+/*
+ * index of the image for (key, size) in atlas_cache_atlas, rasterized on a
+ * miss. ATLAS_NOT_FOUND when it can't be rasterized or does not fit next
+ * to the pinned images. evicted indices are reused
+ */
+uint32					atlas_cache_get(atlas_cache_t* cache, const char* key, uint32 size, atlas_rasterize_fun_t fun, void* user);
+const atlas_t*			atlas_cache_atlas(const atlas_cache_t* cache);
+uint32					atlas_cache_count(const atlas_cache_t* cache);		/* images cached */
+uint32					atlas_cache_evictions(const atlas_cache_t* cache);
+/* see atlas_take_dirty_regions */
+const rect_t*			atlas_cache_take_dirty_regions(atlas_cache_t* cache, uint32* count);
+
+/*
+ * dirty.c
+ *
+ * the texels of the baked image written since the last take, for partial
+ * uploads. the rects are made of granularity x granularity cells, merged
+ * when they span the same columns, and clipped to the image. the first
+ * take of an atlas, or after atlas_compact resized it, is the whole image
+ */
+#define ATLAS_DIRTY_GRANULARITY	32
+
+/* the rects (valid until the next call) and count, the atlas is then clean */
+const rect_t*			atlas_take_dirty_regions(atlas_t* atlas, uint32* count);
+/* cell size, rounded up to 4 for block compressed atlases, 0 for the default */
+void					atlas_set_dirty_granularity(atlas_t* atlas, uint32 granularity);
+
+/*
+ * tiles.c
+ *
+ * the baked image cut in tile_size x tile_size pages that can be streamed
+ * in on their own. a tile image is (tile_size + 2 * border) square: its page
+ * and a border copied from the neighbouring pages (clamped at the atlas
+ * edges), atlas texel (x, y) is at (x % tile_size + border, y % tile_size +
+ * border) in tile (x / tile_size, y / tile_size). tiles are numbered row by
+ * row. block compressed atlases need a tile size and border multiple of 4
+ */
+typedef struct atlas_tiles_s atlas_tiles_t;
+
+/* page table entry: the block of tiles an image covers */
+typedef struct {
+	uint32			x, y;			/* first tile column and row */
+	uint32			columns, rows;	/* 0 for images that take no space */
+} atlas_tile_range_t;
+
+atlas_tiles_t*			atlas_tiles_make(const atlas_t* atlas, uint32 tile_size, uint32 border);
+void					atlas_tiles_release(atlas_tiles_t* tiles);
+
+uint32					atlas_tiles_size(const atlas_tiles_t* tiles);
+uint32					atlas_tiles_border(const atlas_tiles_t* tiles);
+uint32					atlas_tiles_columns(const atlas_tiles_t* tiles);
+uint32					atlas_tiles_rows(const atlas_tiles_t* tiles);
+atlas_tile_range_t		atlas_tiles_image_range(const atlas_tiles_t* tiles, uint32 img);
+/* false for tiles no image touches, they are never needed and not stored */
+bool					atlas_tiles_used(const atlas_tiles_t* tiles, uint32 tile);
+/* NULL while the tile is not resident */
+const image_t*			atlas_tiles_image(const atlas_tiles_t* tiles, uint32 tile);
+
+/*
+ * trace.c
+ */
+/*
+ * begin/end callbacks around the build phases, NULL to disable. they can be
+ * changed while builds run, each event then goes to the old or the new ones
+ */
+typedef void			(*atlas_trace_fun_t)(void* user, const char* name);
+
+void					atlas_trace_set(atlas_trace_fun_t begin, atlas_trace_fun_t end, void* user);
+
+/* emit a scope from the application through the same callbacks */
+void					atlas_trace_begin(const char* name);
+void					atlas_trace_end(const char* name);
+
+/* ready made sink writing Chrome trace event JSON, installs itself with atlas_trace_set */
+bool					atlas_trace_chrome_open(const char* path);
+void					atlas_trace_chrome_close(void);
+
+/*
+ * serialize.c
+ */
+bool					atlas_save(const atlas_t* atlas, const char* path);
+atlas_t*				atlas_load(const char* path);
+
+/* page table and every used tile, each tile stored as one block at its own offset */
+bool					atlas_tiles_save(const atlas_tiles_t* tiles, const char* path);
+/* reads only the page table, the file stays open for atlas_tiles_load_tile */
+atlas_tiles_t*			atlas_tiles_open(const char* path);
+bool					atlas_tiles_load_tile(atlas_tiles_t* tiles, uint32 tile);
+void					atlas_tiles_evict_tile(atlas_tiles_t* tiles, uint32 tile);
+
+/*
+ * shared.c
+ *
+ * baked atlases published in POSIX shared memory under a name ("/sprites"),
+ * the pixels and coordinates mapped read only, without a copy, by any
+ * process attaching to it. every publish is a new generation, the ones
+ * attached to the previous keep it until they release it
+ */
+/* the generation published, 0 on failure. one publisher per name */
+uint32					atlas_publish(const atlas_t* atlas, const char* name);
+/* the last generation, NULL if there is none. it can't be changed (atlas_add, atlas_remove, atlas_compact) */
+atlas_t*				atlas_attach(const char* name);
+uint32					atlas_generation(const atlas_t* atlas);	/* 0 unless attached */
+/* a newer generation was published, attach again to get it */
+bool					atlas_stale(const atlas_t* atlas);
+/* removes the name and the last generation, attached atlases stay valid */
+bool					atlas_unpublish(const char* name);
 
 #endif	/* __ATLAS_LIB__H__ */
@@ -0,0 +1,270 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#ifndef __ATLAS_PRIVATE__H__
+#define __ATLAS_PRIVATE__H__
+#include "atlas.h"
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * internals shared by the library translation units, not installed
+ */
+
+/* placement of one source image, uint32 only so it can be stored as is */
+typedef struct {
+	uint32			x, y;			/* top-left corner in the baked image */
+	uint32			width, height;	/* packed (trimmed) size */
+	uint32			trim_x, trim_y;	/* offset of the packed region in the source */
+	uint32			source_width;
+	uint32			source_height;
+	uint32			flags;			/* ATLAS_ENTRY_* */
+	uint32			key;			/* offset in the key blob, ATLAS_NO_KEY if none */
+} atlas_entry_t;
+
+#define ATLAS_ENTRY_ROTATED		0x1	/* stored transposed in the baked image */
+#define ATLAS_ENTRY_REMOVED		0x2	/* atlas_remove'd, the index is free for atlas_add */
+
+#define ATLAS_NO_KEY			0xFFFFFFFF
+
+/* free rectangles of a dynamic atlas, see compact.c */
+typedef struct {
+	uint32			x, y;
+	uint32			width, height;
+} atlas_area_t;
+
+typedef struct {
+	atlas_area_t*	areas;
+	uint32			count;
+	uint32			capacity;
+} atlas_areas_t;
+
+/* the segment naming the current generation of a published atlas, see shared.c */
+typedef struct {
+	uint32				magic;
+	volatile uint32		generation;		/* 0 until the first publish */
+} atlas_shared_control_t;
+
+struct atlas_s {
+	image_t*		baked_image;
+	uint32			image_count;
+	atlas_entry_t*	entries;
+
+	/* keys, NUL terminated and packed back to back */
+	char*			keys;
+	uint32			keys_size;
+
+	/* minimal perfect hash over the keyed entries, see hash.c */
+	uint32			key_count;
+	sint32*			buckets;		/* key_count displacements */
+	uint32*			slots;			/* key_count entry indices */
+
+	/* normalized uv table, see atlas_build_uv_table */
+	ATLAS_UV_LAYOUT	uv_layout;
+	uint32			uv_stride;		/* floats per SoA array */
+	void*			uv_block;		/* allocation backing 'uvs' */
+	float*			uvs;			/* 16 byte aligned */
+	bool			uv_half_texel;
+
+	/* dynamic atlases, see compact.c */
+	uint32			alignment;		/* of the packed rects, gutter included */
+	uint32			entry_capacity;
+	atlas_areas_t	free;			/* maximal free rectangles */
+	bool			free_valid;		/* built on the first atlas_add */
+	uint32*			removed;		/* removed indices, atlas_place takes the last one */
+	uint32			removed_count;
+	uint32			removed_capacity;
+	bool			removed_valid;	/* built on the first atlas_place */
+
+	/* texels written since the last take, see dirty.c */
+	uint32			dirty_granularity;	/* 0 until set or taken */
+	uint32			dirty_columns;
+	uint32			dirty_rows;
+	uint32*			dirty;			/* a bit per cell, rows padded to 32 bits. NULL: all dirty */
+	rect_t*			regions;		/* returned by atlas_take_dirty_regions */
+	uint32			region_count;
+	uint32			region_capacity;
+
+	/* attached atlases, see shared.c: the entries, keys, hash and pixels are in 'mapping' */
+	void*			mapping;
+	size_t			mapping_size;
+	const atlas_shared_control_t*	control;
+	uint32			generation;
+};
+
+/*
+ * atlas.c
+ */
+bool					atlas_build_keys(atlas_t* atlas, const char** keys);	/* false on duplicates */
+void					atlas_free_keys(atlas_t* atlas);
+
+/* atlas_make_ex with the stages split over 'pool' (NULL for serial ones), NULL once 'async' is cancelled */
+atlas_t*				atlas_build(const image_t** images, uint32 image_count, const atlas_options_t* opts, atlas_pool_t* pool, atlas_async_t* async);
+/* the pool for the stages of a build: the caller's, else the library's, NULL when none is worth threads */
+atlas_pool_t*			atlas_stage_pool(const atlas_options_t* opts);
+
+/*
+ * pool.c
+ */
+/* the pool of the builds given none, made on first use and kept until exit */
+atlas_pool_t*			atlas_pool_shared(void);
+
+/*
+ * async.c
+ */
+bool					atlas_async_cancelled(atlas_async_t* async);	/* NULL never is */
+
+/*
+ * compact.c
+ */
+/* 'img' as a new image at (x, y), room the caller found, under the last removed index or a new one */
+uint32					atlas_place(atlas_t* atlas, const image_t* img, uint32 x, uint32 y);
+
+/*
+ * dirty.c
+ */
+void					atlas_mark_dirty(atlas_t* atlas, uint32 x, uint32 y, uint32 width, uint32 height);
+void					atlas_dirty_all(atlas_t* atlas);	/* the baked image was replaced */
+
+/*
+ * shared.c
+ */
+void					atlas_detach(atlas_t* atlas);		/* unmaps an attached atlas, before its release */
+
+/*
+ * image.c
+ */
+uint32					image_format_pixel_size(PIXEL_FORMAT fmt);	/* bytes per texel, 0 if block compressed */
+uint32					image_format_block_size(PIXEL_FORMAT fmt);	/* bytes per 4x4 block, 0 if not */
+uint32					image_transparent_index(const image_t* img);	/* first palette entry with a 0 alpha, IMAGE_PALETTE_MAX if none */
+
+/*
+ * tiles.c
+ */
+struct atlas_tiles_s {
+	uint32				tile_size;
+	uint32				border;
+	uint32				columns;
+	uint32				rows;
+	PIXEL_FORMAT		format;
+	color4b_t			palette[IMAGE_PALETTE_MAX];		/* shared by the PF_I8 tiles */
+	uint32				palette_size;
+
+	/* page table */
+	uint32				image_count;
+	atlas_tile_range_t*	ranges;			/* per image */
+	uint8*				used;			/* per tile, touched by an image */
+
+	image_t**			images;			/* per tile, NULL when not resident */
+
+	/* backing file of atlas_tiles_open, NULL for atlas_tiles_make */
+	FILE*				fp;
+	uint64_t*			offsets;		/* per tile, 0 when not stored */
+};
+
+/*
+ * serialize.c
+ *
+ * binary atlas: header, entries, buckets, slots, keys (padded to 4 bytes)
+ * then the baked pixels and the palette of PF_I8 atlases, all in native
+ * byte order
+ */
+#define ATLAS_FILE_MAGIC		0x534C5441	/* "ATLS" */
+#define ATLAS_FILE_VERSION		3
+#define ATLAS_PIXELS_SIZE_MAX	0xFFFFFFFFu	/* the largest baked image a file holds, bakes are capped to it */
+
+typedef struct {
+	uint32			magic;
+	uint32			version;
+	uint32			entry_size;		/* sizeof(atlas_entry_t), catches layout changes */
+	uint32			image_count;
+	uint32			key_count;
+	uint32			keys_size;
+	uint32			width;
+	uint32			height;
+	uint32			format;
+	uint32			pixels_size;	/* at most ATLAS_PIXELS_SIZE_MAX */
+	uint32			palette_size;	/* color4b_t entries */
+	uint32			alignment;
+} atlas_file_header_t;
+
+bool					atlas_file_header(const atlas_t* atlas, atlas_file_header_t* hdr);	/* false if the pixels don't fit */
+bool					atlas_file_header_valid(const atlas_file_header_t* hdr);
+bool					atlas_file_tables_valid(const atlas_file_header_t* hdr, const atlas_entry_t* entries, const sint32* buckets, const uint32* slots, const char* keys);
+size_t					atlas_file_size(const atlas_file_header_t* hdr);	/* header included */
+
+/*
+ * tiles: header, the palette of PF_I8 tiles, the image ranges, one 64 bit
+ * file offset per tile (0 for the unused ones) then the stored tiles, each
+ * 'tile_bytes' long
+ */
+#define ATLAS_TILES_MAGIC		0x544C5441	/* "ATLT" */
+#define ATLAS_TILES_VERSION		2
+
+typedef struct {
+	uint32			magic;
+	uint32			version;
+	uint32			tile_size;
+	uint32			border;
+	uint32			columns;
+	uint32			rows;
+	uint32			format;
+	uint32			image_count;
+	uint32			tile_bytes;
+	uint32			palette_size;	/* color4b_t entries */
+} atlas_tiles_header_t;
+
+/*
+ * trace.c
+ *
+ * trace points mark whole phases: a disabled one costs a relaxed load of
+ * 'trace_on', building with ATLAS_NO_TRACE removes it entirely
+ */
+extern bool				trace_on;		/* a begin or end hook is set */
+void					trace_event(const char* name, bool begin);
+
+#if defined(__GNUC__)
+#define TRACE_ON()			__atomic_load_n(&trace_on, __ATOMIC_RELAXED)
+#else
+#define TRACE_ON()			true
+#endif
+
+#ifdef ATLAS_NO_TRACE
+#define TRACE_BEGIN(name)	do { } while(0)
+#define TRACE_END(name)		do { } while(0)
+#else
+#define TRACE_BEGIN(name)	do { if( TRACE_ON() ) trace_event((name), true); } while(0)
+#define TRACE_END(name)		do { if( TRACE_ON() ) trace_event((name), false); } while(0)
+#endif
+
+/*
+ * timer.c
+ */
+double					timer_now_ms(void);		/* monotonic */
+
+/*
+ * hash.c
+ */
+uint64_t				hash_key(const char* key);
+
+/* fill buckets/slots so that every hash lands in its own slot, false on duplicate hashes */
+bool					hash_build(const uint64_t* hashes, const uint32* values, uint32 count, sint32* buckets, uint32* slots);
+/* candidate slot for a hash, the caller must check the key stored there */
+uint32					hash_slot(uint64_t hash, const sint32* buckets, uint32 count);
+
+#endif	/* __ATLAS_PRIVATE__H__ */
@@ -0,0 +1,559 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * CPU block compressor: BC1, BC3 and BC7 (mode 6 only).
+ *
+ * Each 4x4 block is encoded independently: endpoints come from the (inset)
+ * bounding box of the block, oriented along the channel with the largest
+ * range, and texels are assigned by projecting them on the endpoint axis.
+ * The bounding box and the projections work on a whole block at once with
+ * SSE2 when it is available.
+ */
+
+/* 16 RGBA texels of a 4x4 block, row major */
+typedef struct {
+	uint8	texels[16 * 4];
+} block_t;
+
+static void
+fetch_block(const image_t* img, uint32 bx, uint32 by, block_t* blk) {
+	uint32	width	= image_width(img);
+	uint32	height	= image_height(img);
+	uint32	x, y;
+
+	if( image_format(img) == PF_R8G8B8A8 && bx + 4 <= width && by + 4 <= height ) {
+		const uint8*	src	= (const uint8*)image_pixels(img);
+		for( y = 0; y < 4; ++y ) {
+			memcpy(&blk->texels[y * 16], &src[((by + y) * width + bx) * 4], 16);
+		}
+		return;
+	}
+
+	/* partial blocks replicate the last row/column */
+	for( y = 0; y < 4; ++y ) {
+		uint32	sy	= by + y < height ? by + y : height - 1;
+		for( x = 0; x < 4; ++x ) {
+			uint32		sx	= bx + x < width ? bx + x : width - 1;
+			color4b_t	col	= image_get_pixelb(img, sx, sy);
+			uint8*		t	= &blk->texels[(y * 4 + x) * 4];
+			t[0]	= col.r;
+			t[1]	= col.g;
+			t[2]	= col.b;
+			t[3]	= col.a;
+		}
+	}
+}
+
+static void
+block_bounds(const block_t* blk, uint8 mn[4], uint8 mx[4]) {
+#if defined(__SSE2__)
+	__m128i	r0	= _mm_loadu_si128((const __m128i*)&blk->texels[0]);
+	__m128i	r1	= _mm_loadu_si128((const __m128i*)&blk->texels[16]);
+	__m128i	r2	= _mm_loadu_si128((const __m128i*)&blk->texels[32]);
+	__m128i	r3	= _mm_loadu_si128((const __m128i*)&blk->texels[48]);
+	__m128i	lo	= _mm_min_epu8(_mm_min_epu8(r0, r1), _mm_min_epu8(r2, r3));
+	__m128i	hi	= _mm_max_epu8(_mm_max_epu8(r0, r1), _mm_max_epu8(r2, r3));
+	sint32	v;
+
+	lo	= _mm_min_epu8(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+	lo	= _mm_min_epu8(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(2, 3, 0, 1)));
+	hi	= _mm_max_epu8(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+	hi	= _mm_max_epu8(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	v	= _mm_cvtsi128_si32(lo);
+	memcpy(mn, &v, 4);
+	v	= _mm_cvtsi128_si32(hi);
+	memcpy(mx, &v, 4);
+#else
+	uint32	i, c;
+	for( c = 0; c < 4; ++c ) {
+		mn[c]	= 255;
+		mx[c]	= 0;
+	}
+
+	for( i = 0; i < 16; ++i ) {
+		for( c = 0; c < 4; ++c ) {
+			uint8	t	= blk->texels[i * 4 + c];
+			if( t < mn[c] ) mn[c] = t;
+			if( t > mx[c] ) mx[c] = t;
+		}
+	}
+#endif
+}
+
+/*
+ * shrink the box by 1/16th of its range and orient the diagonal along the
+ * channel with the largest range: channels that decrease while the reference
+ * channel increases get their min/max swapped.
+ */
+static void
+orient_endpoints(const block_t* blk, uint32 channels, uint8 e0[4], uint8 e1[4]) {
+	uint32	ref		= 0;
+	uint32	i, c;
+	sint32	center[4];
+
+	for( c = 0; c < channels; ++c ) {
+		uint32	inset	= (uint32)(e1[c] - e0[c]) >> 4;
+		e0[c]	= (uint8)(e0[c] + inset);
+		e1[c]	= (uint8)(e1[c] - inset);
+		center[c]	= (e0[c] + e1[c]) / 2;
+		if( e1[c] - e0[c] > e1[ref] - e0[ref] ) ref = c;
+	}
+
+	for( c = 0; c < channels; ++c ) {
+		sint32	cov	= 0;
+		if( c == ref ) continue;
+
+		for( i = 0; i < 16; ++i ) {
+			cov	+= (blk->texels[i * 4 + ref] - center[ref]) * (blk->texels[i * 4 + c] - center[c]);
+		}
+
+		if( cov < 0 ) {
+			uint8	t	= e0[c];
+			e0[c]	= e1[c];
+			e1[c]	= t;
+		}
+	}
+}
+
+/*
+ * dots[i] = (texel[i] - e0) . (e1 - e0), restricted to the first 'channels'
+ * channels. returns |e1 - e0|^2
+ */
+static sint32
+project_block(const block_t* blk, const uint8 e0[4], const uint8 e1[4], uint32 channels, sint32 dots[16]) {
+	sint16	axis[4];
+	sint32	len2	= 0;
+	uint32	c;
+
+	for( c = 0; c < 4; ++c ) {
+		axis[c]	= c < channels ? (sint16)(e1[c] - e0[c]) : 0;
+		len2	+= axis[c] * axis[c];
+	}
+
+#if defined(__SSE2__)
+	{
+		__m128i	zero	= _mm_setzero_si128();
+		__m128i	base	= _mm_setr_epi16(e0[0], e0[1], e0[2], e0[3], e0[0], e0[1], e0[2], e0[3]);
+		__m128i	dir		= _mm_setr_epi16(axis[0], axis[1], axis[2], axis[3], axis[0], axis[1], axis[2], axis[3]);
+		uint32	row;
+
+		for( row = 0; row < 4; ++row ) {
+			__m128i	t	= _mm_loadu_si128((const __m128i*)&blk->texels[row * 16]);
+			__m128i	lo	= _mm_madd_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(t, zero), base), dir);
+			__m128i	hi	= _mm_madd_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(t, zero), base), dir);
+			/* lo/hi hold (rg, ba) partial sums for two texels each, add the pairs */
+			__m128	ev	= _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+			__m128	od	= _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+			_mm_storeu_si128((__m128i*)&dots[row * 4], _mm_add_epi32(_mm_castps_si128(ev), _mm_castps_si128(od)));
+		}
+	}
+#else
+	{
+		uint32	i;
+		for( i = 0; i < 16; ++i ) {
+			const uint8*	t	= &blk->texels[i * 4];
+			dots[i]	= 0;
+			for( c = 0; c < 4; ++c ) {
+				dots[i]	+= (t[c] - e0[c]) * axis[c];
+			}
+		}
+	}
+#endif
+
+	return len2;
+}
+
+/* round(dot / len2 * levels), clamped to [0, levels] */
+static inline uint32
+quantize_dot(sint32 dot, sint32 len2, uint32 levels) {
+	sint32	q;
+	if( len2 == 0 || dot <= 0 ) return 0;
+	q	= (dot * (sint32)levels * 2 + len2) / (len2 * 2);
+	return q > (sint32)levels ? levels : (uint32)q;
+}
+
+static inline uint16
+to_565(const uint8 c[3]) {
+	uint32	r	= (c[0] * 31 + 127) / 255;
+	uint32	g	= (c[1] * 63 + 127) / 255;
+	uint32	b	= (c[2] * 31 + 127) / 255;
+	return (uint16)((r << 11) | (g << 5) | b);
+}
+
+static inline void
+from_565(uint16 v, uint8 c[4]) {
+	uint32	r	= (v >> 11) & 31;
+	uint32	g	= (v >> 5) & 63;
+	uint32	b	= v & 31;
+	c[0]	= (uint8)((r << 3) | (r >> 2));
+	c[1]	= (uint8)((g << 2) | (g >> 4));
+	c[2]	= (uint8)((b << 3) | (b >> 2));
+	c[3]	= 0;
+}
+
+static inline void
+write_le16(uint8* out, uint16 v) {
+	out[0]	= (uint8)(v & 0xFF);
+	out[1]	= (uint8)(v >> 8);
+}
+
+static inline void
+write_le32(uint8* out, uint32 v) {
+	write_le16(out, (uint16)(v & 0xFFFF));
+	write_le16(out + 2, (uint16)(v >> 16));
+}
+
+/* 8 byte BC1 color block. 'punch_through' enables the 3 color + transparent mode */
+static void
+encode_bc1_color(const block_t* blk, bool punch_through, uint8* out) {
+	static const uint32	remap4[4]	= { 0, 2, 3, 1 };
+	static const uint32	remap3[3]	= { 0, 2, 1 };
+	uint8		e0[4], e1[4];
+	uint8		d0[4], d1[4];
+	uint16		c0, c1;
+	sint32		dots[16];
+	sint32		len2;
+	uint32		indices	= 0;
+	uint32		transparent	= 0;
+	uint32		i;
+
+	if( punch_through ) {
+		for( i = 0; i < 16; ++i ) {
+			if( blk->texels[i * 4 + 3] < 128 ) transparent |= 1u << i;
+		}
+	}
+
+	if( transparent == 0xFFFF ) {
+		write_le16(out, 0);
+		write_le16(out + 2, 0);
+		write_le32(out + 4, 0xFFFFFFFF);
+		return;
+	}
+
+	if( transparent ) {
+		/* endpoints from the opaque texels only */
+		uint32	c;
+		for( c = 0; c < 3; ++c ) {
+			e0[c]	= 255;
+			e1[c]	= 0;
+		}
+		for( i = 0; i < 16; ++i ) {
+			if( transparent & (1u << i) ) continue;
+			for( c = 0; c < 3; ++c ) {
+				uint8	t	= blk->texels[i * 4 + c];
+				if( t < e0[c] ) e0[c] = t;
+				if( t > e1[c] ) e1[c] = t;
+			}
+		}
+	} else {
+		block_bounds(blk, e0, e1);
+	}
+
+	orient_endpoints(blk, 3, e0, e1);
+
+	c0	= to_565(e0);
+	c1	= to_565(e1);
+
+	/* 4 color mode needs c0 > c1, 3 color mode needs c0 <= c1 */
+	if( (!transparent && c0 < c1) || (transparent && c0 > c1) ) {
+		uint16	t	= c0;
+		c0	= c1;
+		c1	= t;
+	}
+
+	from_565(c0, d0);
+	from_565(c1, d1);
+	len2	= project_block(blk, d0, d1, 3, dots);
+
+	for( i = 0; i < 16; ++i ) {
+		uint32	idx;
+		if( transparent & (1u << i) ) {
+			idx	= 3;
+		} else if( transparent ) {
+			idx	= remap3[quantize_dot(dots[i], len2, 2)];
+		} else if( c0 == c1 ) {
+			idx	= 0;
+		} else {
+			idx	= remap4[quantize_dot(dots[i], len2, 3)];
+		}
+		indices	|= idx << (i * 2);
+	}
+
+	write_le16(out, c0);
+	write_le16(out + 2, c1);
+	write_le32(out + 4, indices);
+}
+
+/* 8 byte BC3/BC4 alpha block, always in 8 value mode */
+static void
+encode_bc3_alpha(const block_t* blk, uint8* out) {
+	uint8		a0	= 0;
+	uint8		a1	= 255;
+	uint64_t	indices	= 0;
+	uint32		i;
+
+	for( i = 0; i < 16; ++i ) {
+		uint8	a	= blk->texels[i * 4 + 3];
+		if( a > a0 ) a0 = a;
+		if( a < a1 ) a1 = a;
+	}
+
+	if( a0 != a1 ) {
+		sint32	range	= a0 - a1;
+		for( i = 0; i < 16; ++i ) {
+			/* step 0 is a0, step 7 is a1, the rest are interpolated */
+			uint32	step	= quantize_dot(a0 - blk->texels[i * 4 + 3], range, 7);
+			uint64_t	idx	= step == 0 ? 0 : (step == 7 ? 1 : step + 1);
+			indices	|= idx << (i * 3);
+		}
+	}
+
+	out[0]	= a0;
+	out[1]	= a1;
+	for( i = 0; i < 6; ++i ) {
+		out[2 + i]	= (uint8)((indices >> (i * 8)) & 0xFF);
+	}
+}
+
+typedef struct {
+	uint64_t	bits[2];
+	uint32		pos;
+} bit_writer_t;
+
+static inline void
+put_bits(bit_writer_t* w, uint32 value, uint32 count) {
+	uint32	i;
+	for( i = 0; i < count; ++i, ++w->pos ) {
+		if( value & (1u << i) ) w->bits[w->pos >> 6] |= (uint64_t)1 << (w->pos & 63);
+	}
+}
+
+/* 7 bit endpoint + shared p-bit with the smallest reconstruction error */
+static void
+quantize_bc7_endpoint(const uint8 e[4], uint8 q[4], uint32* pbit) {
+	uint32	best_err	= 0xFFFFFFFF;
+	uint32	p, c;
+
+	for( p = 0; p < 2; ++p ) {
+		uint8	t[4];
+		uint32	err	= 0;
+		for( c = 0; c < 4; ++c ) {
+			sint32	v	= ((sint32)e[c] - (sint32)p + 1) >> 1;
+			sint32	d;
+			if( v < 0 ) v = 0;
+			if( v > 127 ) v = 127;
+			t[c]	= (uint8)v;
+			d		= (sint32)((v << 1) | p) - e[c];
+			err		+= (uint32)(d * d);
+		}
+
+		if( err < best_err ) {
+			best_err	= err;
+			*pbit		= p;
+			memcpy(q, t, 4);
+		}
+	}
+}
+
+/* 16 byte BC7 block in mode 6: one subset, RGBA 7.1 endpoints, 4 bit indices */
+static void
+encode_bc7_mode6(const block_t* blk, uint8* out) {
+	static const uint32	weights[16]	= { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+	uint8			e0[4], e1[4];
+	uint8			q0[4], q1[4];
+	uint8			d0[4], d1[4];
+	uint32			p0 = 0, p1 = 0;
+	uint32			idx[16];
+	sint32			dots[16];
+	sint32			len2;
+	uint32			i, c;
+	bit_writer_t	w;
+
+	block_bounds(blk, e0, e1);
+	orient_endpoints(blk, 4, e0, e1);
+
+	quantize_bc7_endpoint(e0, q0, &p0);
+	quantize_bc7_endpoint(e1, q1, &p1);
+
+	for( c = 0; c < 4; ++c ) {
+		d0[c]	= (uint8)((q0[c] << 1) | p0);
+		d1[c]	= (uint8)((q1[c] << 1) | p1);
+	}
+
+	len2	= project_block(blk, d0, d1, 4, dots);
+	for( i = 0; i < 16; ++i ) {
+		uint32	t	= quantize_dot(dots[i], len2, 64);
+		uint32	j	= 0;
+		/* nearest interpolation weight */
+		while( j < 15 && weights[j + 1] <= t ) ++j;
+		if( j < 15 && weights[j + 1] - t < t - weights[j] ) ++j;
+		idx[i]	= j;
+	}
+
+	/* the anchor texel index has an implicit 0 msb: flip the endpoints if needed */
+	if( idx[0] & 8 ) {
+		uint8	t[4];
+		uint32	p	= p0;
+		memcpy(t, q0, 4);
+		memcpy(q0, q1, 4);
+		memcpy(q1, t, 4);
+		p0	= p1;
+		p1	= p;
+		for( i = 0; i < 16; ++i ) idx[i] = 15 - idx[i];
+	}
+
+	memset(&w, 0, sizeof(w));
+	put_bits(&w, 1u << 6, 7);
+	for( c = 0; c < 4; ++c ) {
+		put_bits(&w, q0[c], 7);
+		put_bits(&w, q1[c], 7);
+	}
+	put_bits(&w, p0, 1);
+	put_bits(&w, p1, 1);
+	put_bits(&w, idx[0], 3);
+	for( i = 1; i < 16; ++i ) {
+		put_bits(&w, idx[i], 4);
+	}
+
+	assert( w.pos == 128 );
+	for( i = 0; i < 16; ++i ) {
+		out[i]	= (uint8)((w.bits[i >> 3] >> ((i & 7) * 8)) & 0xFF);
+	}
+}
+
+/* the block rows [begin, end) of 'out' */
+typedef struct {
+	const image_t*	img;
+	image_t*		out;
+	uint32			begin;
+	uint32			end;
+} stripe_t;
+
+static void
+stripe_task(void* arg) {
+	stripe_t*		st			= (stripe_t*)arg;
+	PIXEL_FORMAT	fmt			= image_format(st->out);
+	uint32			block_bytes	= image_format_block_size(fmt);
+	uint32			bw			= (image_width(st->img) + 3) / 4;
+	uint8*			data		= (uint8*)image_pixels(st->out);
+	uint32			x, y;
+
+	for( y = st->begin; y < st->end; ++y ) {
+		for( x = 0; x < bw; ++x ) {
+			block_t	blk;
+			uint8*	dst	= &data[((size_t)y * bw + x) * block_bytes];
+
+			fetch_block(st->img, x * 4, y * 4, &blk);
+
+			switch(fmt) {
+			case PF_BC1:
+				encode_bc1_color(&blk, true, dst);
+				break;
+			case PF_BC3:
+				encode_bc3_alpha(&blk, dst);
+				encode_bc1_color(&blk, false, dst + 8);
+				break;
+			default:
+				encode_bc7_mode6(&blk, dst);
+				break;
+			}
+		}
+	}
+}
+
+static void
+run_stripes(atlas_pool_t* pool, stripe_t* stripes, uint32 count) {
+	atlas_task_group_t	group;
+	uint32				s;
+
+	if( pool && count > 1 ) {
+		atlas_task_group_init(&group);
+		for( s = 0; s < count; ++s ) {
+			atlas_pool_submit_group(pool, &group, stripe_task, &stripes[s]);
+		}
+		atlas_pool_wait_group(pool, &group);
+	} else {
+		for( s = 0; s < count; ++s ) {
+			stripe_task(&stripes[s]);
+		}
+	}
+}
+
+image_t*
+image_compress(const image_t* img, PIXEL_FORMAT fmt, atlas_pool_t* pool) {
+	image_t*	out			= NULL;
+	uint32		count		= pool ? atlas_pool_thread_count(pool) * 4 : 1;
+	uint32		bh;
+	stripe_t*	stripes;
+	uint32		s;
+
+	switch(image_format(img)) {
+	case PF_A8:
+	case PF_R8G8B8:
+	case PF_R8G8B8A8:
+	case PF_I8:
+	case PF_R16G16B16A16F:
+	case PF_R32G32B32A32F:
+		break;
+	default:
+		fprintf(stderr, "ERROR: image_compress: unsupported source format 0x%X\n", image_format(img));
+		return NULL;
+	}
+
+	if( fmt != PF_BC1 && fmt != PF_BC3 && fmt != PF_BC7 ) {
+		fprintf(stderr, "ERROR: image_compress: unsupported target format 0x%X\n", fmt);
+		return NULL;
+	}
+
+	TRACE_BEGIN("image_compress");
+
+	out		= image_allocate(image_width(img), image_height(img), fmt);
+	assert( NULL != out );
+
+	/* a few stripes of block rows per thread, so that the slow ones even out */
+	bh		= (image_height(img) + 3) / 4;
+	if( count > bh ) count = bh ? bh : 1;
+	stripes	= (stripe_t*)malloc(sizeof(stripe_t) * count);
+	assert( NULL != stripes );
+
+	for( s = 0; s < count; ++s ) {
+		stripes[s].img		= img;
+		stripes[s].out		= out;
+		stripes[s].begin	= (uint32)((uint64_t)bh * s / count);
+		stripes[s].end		= (uint32)((uint64_t)bh * (s + 1) / count);
+	}
+
+	run_stripes(pool, stripes, count);
+	free(stripes);
+
+	TRACE_END("image_compress");
+
+	return out;
+}
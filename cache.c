@@ -0,0 +1,491 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * the images live in a dynamic atlas (see compact.c), an entry per atlas
+ * index. lookups go through an open addressed table of entry indices, the
+ * recency through a doubly linked list from the most recently used (head)
+ * to the least (tail): a hit moves its entry to the head, eviction takes
+ * the tail, both O(1).
+ *
+ * the room is handed out by shelves rather than the maximal rectangles of
+ * atlas_add, which do not merge what is freed: a shelf is a band of rows
+ * with its free spans of columns, freed spans merge with their neighbours
+ * and empty shelves with the empty ones around them
+ */
+
+#define CACHE_NONE			0xFFFFFFFF
+#define SHELF_ROUNDING		4		/* shelf heights are multiples of this */
+
+typedef struct {
+	uint32			x;
+	uint32			width;
+} span_t;
+
+typedef struct {
+	uint32			y;
+	uint32			height;
+	uint32			used;			/* images in the shelf, 0 for an empty one */
+	span_t*			spans;			/* free columns, sorted */
+	uint32			span_count;
+	uint32			span_capacity;
+} shelf_t;
+
+typedef struct {
+	char*			key;			/* NULL for free entries */
+	uint32			size;
+	uint64_t		hash;
+	uint32			prev;			/* towards the head */
+	uint32			next;
+	uint32			frame;			/* last used */
+} cache_entry_t;
+
+struct atlas_cache_s {
+	atlas_t*		atlas;
+	uint32			frame;
+	uint32			frames_in_flight;
+
+	cache_entry_t*	entries;		/* per atlas image */
+	uint32			entry_capacity;
+	uint32			count;
+
+	uint32*			table;			/* entry indices, CACHE_NONE when empty */
+	uint32			table_size;		/* power of two, at least twice count */
+
+	uint32			head;
+	uint32			tail;
+
+	shelf_t*		shelves;		/* top to bottom, covering the whole height */
+	uint32			shelf_count;
+	uint32			shelf_capacity;
+
+	uint32			evictions;
+};
+
+static inline uint64_t
+entry_hash(const char* key, uint32 size) {
+	return hash_key(key) ^ ((uint64_t)size * 0x9E3779B97F4A7C15ULL);
+}
+
+static inline uint32
+table_home(const atlas_cache_t* cache, uint64_t hash) {
+	return (uint32)(hash >> 32) & (cache->table_size - 1);
+}
+
+static uint32
+table_find(const atlas_cache_t* cache, const char* key, uint32 size, uint64_t hash) {
+	uint32	t	= table_home(cache, hash);
+
+	while( cache->table[t] != CACHE_NONE ) {
+		const cache_entry_t*	e	= &cache->entries[cache->table[t]];
+		if( e->hash == hash && e->size == size && strcmp(e->key, key) == 0 ) return cache->table[t];
+		t	= (t + 1) & (cache->table_size - 1);
+	}
+
+	return CACHE_NONE;
+}
+
+static void
+table_insert(atlas_cache_t* cache, uint32 index) {
+	uint32	t	= table_home(cache, cache->entries[index].hash);
+
+	while( cache->table[t] != CACHE_NONE ) {
+		t	= (t + 1) & (cache->table_size - 1);
+	}
+	cache->table[t]	= index;
+}
+
+/* backward shift deletion, the probe sequences stay unbroken without tombstones */
+static void
+table_remove(atlas_cache_t* cache, uint32 index) {
+	uint32	mask	= cache->table_size - 1;
+	uint32	t		= table_home(cache, cache->entries[index].hash);
+	uint32	next;
+
+	while( cache->table[t] != index ) {
+		t	= (t + 1) & mask;
+	}
+
+	for( next = (t + 1) & mask; cache->table[next] != CACHE_NONE; next = (next + 1) & mask ) {
+		uint32	home	= table_home(cache, cache->entries[cache->table[next]].hash);
+
+		/* move it back unless its home is cyclically in (t, next] */
+		if( ((next - home) & mask) >= ((next - t) & mask) ) {
+			cache->table[t]	= cache->table[next];
+			t				= next;
+		}
+	}
+
+	cache->table[t]	= CACHE_NONE;
+}
+
+static void
+table_grow(atlas_cache_t* cache) {
+	uint32	i;
+
+	free(cache->table);
+	cache->table_size	= cache->table_size ? cache->table_size * 2 : 64;
+	cache->table		= (uint32*)malloc(sizeof(uint32) * cache->table_size);
+	assert( NULL != cache->table );
+	memset(cache->table, 0xFF, sizeof(uint32) * cache->table_size);
+
+	for( i = 0; i < cache->entry_capacity; ++i ) {
+		if( cache->entries[i].key ) table_insert(cache, i);
+	}
+}
+
+static void
+lru_unlink(atlas_cache_t* cache, uint32 index) {
+	cache_entry_t*	e	= &cache->entries[index];
+
+	if( e->prev != CACHE_NONE ) cache->entries[e->prev].next = e->next;
+	else cache->head = e->next;
+	if( e->next != CACHE_NONE ) cache->entries[e->next].prev = e->prev;
+	else cache->tail = e->prev;
+}
+
+static void
+lru_push_head(atlas_cache_t* cache, uint32 index) {
+	cache_entry_t*	e	= &cache->entries[index];
+
+	e->prev	= CACHE_NONE;
+	e->next	= cache->head;
+	if( cache->head != CACHE_NONE ) cache->entries[cache->head].prev = index;
+	cache->head	= index;
+	if( cache->tail == CACHE_NONE ) cache->tail = index;
+}
+
+static void
+span_insert(shelf_t* shelf, uint32 at, uint32 x, uint32 width) {
+	if( shelf->span_count == shelf->span_capacity ) {
+		shelf->span_capacity	= shelf->span_capacity ? shelf->span_capacity * 2 : 8;
+		shelf->spans			= (span_t*)realloc(shelf->spans, sizeof(span_t) * shelf->span_capacity);
+		assert( NULL != shelf->spans );
+	}
+
+	memmove(&shelf->spans[at + 1], &shelf->spans[at], sizeof(span_t) * (shelf->span_count - at));
+	shelf->spans[at].x		= x;
+	shelf->spans[at].width	= width;
+	++shelf->span_count;
+}
+
+static void
+span_erase(shelf_t* shelf, uint32 at) {
+	memmove(&shelf->spans[at], &shelf->spans[at + 1], sizeof(span_t) * (shelf->span_count - at - 1));
+	--shelf->span_count;
+}
+
+/* a new empty shelf at position 'at' */
+static void
+shelf_insert(atlas_cache_t* cache, uint32 at, uint32 y, uint32 height) {
+	shelf_t*	shelf;
+
+	if( cache->shelf_count == cache->shelf_capacity ) {
+		cache->shelf_capacity	= cache->shelf_capacity ? cache->shelf_capacity * 2 : 16;
+		cache->shelves			= (shelf_t*)realloc(cache->shelves, sizeof(shelf_t) * cache->shelf_capacity);
+		assert( NULL != cache->shelves );
+	}
+
+	memmove(&cache->shelves[at + 1], &cache->shelves[at], sizeof(shelf_t) * (cache->shelf_count - at));
+	++cache->shelf_count;
+
+	shelf	= &cache->shelves[at];
+	memset(shelf, 0, sizeof(shelf_t));
+	shelf->y		= y;
+	shelf->height	= height;
+	span_insert(shelf, 0, 0, image_width(cache->atlas->baked_image));
+}
+
+static void
+shelf_erase(atlas_cache_t* cache, uint32 at) {
+	free(cache->shelves[at].spans);
+	memmove(&cache->shelves[at], &cache->shelves[at + 1], sizeof(shelf_t) * (cache->shelf_count - at - 1));
+	--cache->shelf_count;
+}
+
+/*
+ * room for width x height: the first span wide enough in the used shelf
+ * wasting the fewest rows, not more than half the height, or else the
+ * smallest empty shelf cut to the rounded height
+ */
+static bool
+shelf_alloc(atlas_cache_t* cache, uint32 width, uint32 height, uint32* x, uint32* y) {
+	uint32	rounded	= ((height + SHELF_ROUNDING - 1) / SHELF_ROUNDING) * SHELF_ROUNDING;
+	uint32	best	= CACHE_NONE;
+	uint32	best_span	= 0;
+	uint32	s, i;
+	shelf_t*	shelf;
+	span_t*		span;
+
+	for( s = 0; s < cache->shelf_count; ++s ) {
+		shelf	= &cache->shelves[s];
+		if( shelf->height < height ) continue;
+
+		if( shelf->used == 0 ) {
+			if( best == CACHE_NONE || (cache->shelves[best].used == 0 && shelf->height < cache->shelves[best].height) ) {
+				best		= s;
+				best_span	= 0;
+			}
+			continue;
+		}
+
+		if( shelf->height - height > height / 2 ) continue;
+		if( best != CACHE_NONE && cache->shelves[best].used != 0 && shelf->height >= cache->shelves[best].height ) continue;
+
+		for( i = 0; i < shelf->span_count; ++i ) {
+			if( shelf->spans[i].width >= width ) {
+				best		= s;
+				best_span	= i;
+				break;
+			}
+		}
+	}
+
+	if( best == CACHE_NONE ) return false;
+
+	/* an empty shelf keeps the rows it does not need as another empty one */
+	shelf	= &cache->shelves[best];
+	if( shelf->used == 0 && shelf->height > rounded ) {
+		shelf_insert(cache, best + 1, shelf->y + rounded, shelf->height - rounded);
+		shelf			= &cache->shelves[best];
+		shelf->height	= rounded;
+	}
+
+	span	= &shelf->spans[best_span];
+	if( span->width < width ) return false;
+
+	*x	= span->x;
+	*y	= shelf->y;
+	span->x		+= width;
+	span->width	-= width;
+	if( span->width == 0 ) span_erase(shelf, best_span);
+	++shelf->used;
+
+	return true;
+}
+
+static void
+shelf_free(atlas_cache_t* cache, uint32 x, uint32 y, uint32 width) {
+	uint32		s, i;
+	shelf_t*	shelf;
+
+	for( s = 0; cache->shelves[s].y + cache->shelves[s].height <= y; ++s ) {}
+	shelf	= &cache->shelves[s];
+
+	/* back in the spans, merged with the free columns on each side */
+	for( i = 0; i < shelf->span_count && shelf->spans[i].x < x; ++i ) {}
+	span_insert(shelf, i, x, width);
+	if( i + 1 < shelf->span_count && shelf->spans[i].x + shelf->spans[i].width == shelf->spans[i + 1].x ) {
+		shelf->spans[i].width	+= shelf->spans[i + 1].width;
+		span_erase(shelf, i + 1);
+	}
+	if( i > 0 && shelf->spans[i - 1].x + shelf->spans[i - 1].width == shelf->spans[i].x ) {
+		shelf->spans[i - 1].width	+= shelf->spans[i].width;
+		span_erase(shelf, i);
+	}
+
+	if( --shelf->used != 0 ) return;
+
+	/* an empty shelf joins the empty ones around it */
+	if( s + 1 < cache->shelf_count && cache->shelves[s + 1].used == 0 ) {
+		shelf->height	+= cache->shelves[s + 1].height;
+		shelf_erase(cache, s + 1);
+	}
+	if( s > 0 && cache->shelves[s - 1].used == 0 ) {
+		cache->shelves[s - 1].height	+= cache->shelves[s].height;
+		shelf_erase(cache, s);
+	}
+}
+
+static inline bool
+pinned(const atlas_cache_t* cache, uint32 index) {
+	return cache->frame - cache->entries[index].frame < cache->frames_in_flight;
+}
+
+/* the least recently used image out, false when it is pinned (and so are all the others) */
+static bool
+evict(atlas_cache_t* cache) {
+	uint32			index	= cache->tail;
+	cache_entry_t*	e;
+	rect_t			r;
+
+	if( index == CACHE_NONE || pinned(cache, index) ) return false;
+
+	e	= &cache->entries[index];
+	r	= atlas_image_coordinates(cache->atlas, index);
+
+	table_remove(cache, index);
+	lru_unlink(cache, index);
+	atlas_remove(cache->atlas, index);
+	shelf_free(cache, (uint32)r.x, (uint32)r.y, (uint32)r.width + 1);
+
+	free(e->key);
+	e->key	= NULL;
+	--cache->count;
+	++cache->evictions;
+
+	return true;
+}
+
+atlas_cache_t*
+atlas_cache_make(uint32 size, PIXEL_FORMAT format, uint32 frames_in_flight) {
+	atlas_cache_t*	cache;
+	atlas_t*		atlas	= atlas_make_empty(size, format);
+
+	if( NULL == atlas ) return NULL;
+
+	cache	= (atlas_cache_t*)malloc(sizeof(atlas_cache_t));
+	assert( NULL != cache );
+
+	memset(cache, 0, sizeof(atlas_cache_t));
+	cache->atlas			= atlas;
+	cache->frames_in_flight	= frames_in_flight;
+	cache->head				= CACHE_NONE;
+	cache->tail				= CACHE_NONE;
+	table_grow(cache);
+	shelf_insert(cache, 0, 0, size);
+
+	return cache;
+}
+
+void
+atlas_cache_release(atlas_cache_t* cache) {
+	uint32	i;
+
+	for( i = 0; i < cache->entry_capacity; ++i ) {
+		free(cache->entries[i].key);
+	}
+	for( i = 0; i < cache->shelf_count; ++i ) {
+		free(cache->shelves[i].spans);
+	}
+
+	atlas_release(cache->atlas);
+	free(cache->shelves);
+	free(cache->entries);
+	free(cache->table);
+	free(cache);
+}
+
+void
+atlas_cache_next_frame(atlas_cache_t* cache) {
+	++cache->frame;
+}
+
+const atlas_t*
+atlas_cache_atlas(const atlas_cache_t* cache) {
+	return cache->atlas;
+}
+
+uint32
+atlas_cache_count(const atlas_cache_t* cache) {
+	return cache->count;
+}
+
+uint32
+atlas_cache_evictions(const atlas_cache_t* cache) {
+	return cache->evictions;
+}
+
+const rect_t*
+atlas_cache_take_dirty_regions(atlas_cache_t* cache, uint32* count) {
+	return atlas_take_dirty_regions(cache->atlas, count);
+}
+
+/* the image in the atlas, evicting until it fits */
+static uint32
+insert(atlas_cache_t* cache, const image_t* img) {
+	uint32	x, y;
+
+	while( !shelf_alloc(cache, image_width(img) + 1, image_height(img) + 1, &x, &y) ) {
+		if( !evict(cache) ) return ATLAS_NOT_FOUND;
+	}
+
+	return atlas_place(cache->atlas, img, x, y);
+}
+
+uint32
+atlas_cache_get(atlas_cache_t* cache, const char* key, uint32 size, atlas_rasterize_fun_t fun, void* user) {
+	uint64_t		hash	= entry_hash(key, size);
+	uint32			index	= table_find(cache, key, size, hash);
+	cache_entry_t*	e;
+	image_t*		img;
+
+	if( index != CACHE_NONE ) {
+		cache->entries[index].frame	= cache->frame;
+		lru_unlink(cache, index);
+		lru_push_head(cache, index);
+		return index;
+	}
+
+	TRACE_BEGIN("atlas_cache_miss");
+
+	img	= fun(user, key, size);
+	if( NULL == img ) {
+		TRACE_END("atlas_cache_miss");
+		return ATLAS_NOT_FOUND;
+	}
+
+	if( image_width(img) >= image_width(cache->atlas->baked_image) || image_height(img) >= image_height(cache->atlas->baked_image) ) {
+		fprintf(stderr, "ERROR: atlas_cache_get: %s (%u) is larger than the cache\n", key, size);
+		index	= ATLAS_NOT_FOUND;
+	} else {
+		index	= insert(cache, img);
+	}
+
+	image_release(img);
+
+	if( index == ATLAS_NOT_FOUND ) {
+		TRACE_END("atlas_cache_miss");
+		return ATLAS_NOT_FOUND;
+	}
+
+	/* the atlas reuses indices, the entries follow */
+	if( index >= cache->entry_capacity ) {
+		uint32	capacity	= cache->entry_capacity ? cache->entry_capacity * 2 : 64;
+		while( capacity <= index ) capacity *= 2;
+
+		cache->entries	= (cache_entry_t*)realloc(cache->entries, sizeof(cache_entry_t) * capacity);
+		assert( NULL != cache->entries );
+		memset(&cache->entries[cache->entry_capacity], 0, sizeof(cache_entry_t) * (capacity - cache->entry_capacity));
+		cache->entry_capacity	= capacity;
+	}
+
+	e			= &cache->entries[index];
+	e->key		= (char*)malloc(strlen(key) + 1);
+	assert( NULL != e->key );
+	strcpy(e->key, key);
+	e->size		= size;
+	e->hash		= hash;
+	e->frame	= cache->frame;
+	lru_push_head(cache, index);
+
+	if( ++cache->count * 2 > cache->table_size ) {
+		table_grow(cache);
+	} else {
+		table_insert(cache, index);
+	}
+
+	TRACE_END("atlas_cache_miss");
+
+	return index;
+}
@@ -0,0 +1,656 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * the free space is a list of maximal rectangles: placing a rect splits
+ * every free one it overlaps in up to 4, then the ones contained in
+ * another are dropped. a freed rect is added back as is
+ */
+
+static inline uint32
+align_up(uint32 v, uint32 alignment) {
+	return ((v + alignment - 1) / alignment) * alignment;
+}
+
+/* the packed rect of an entry, gutter and alignment included, empty for removed and fully trimmed images */
+static atlas_area_t
+footprint(const atlas_t* atlas, const atlas_entry_t* e) {
+	atlas_area_t	a;
+	bool			rot	= (e->flags & ATLAS_ENTRY_ROTATED) != 0;
+
+	a.x			= e->x;
+	a.y			= e->y;
+	a.width		= 0;
+	a.height	= 0;
+
+	if( !(e->flags & ATLAS_ENTRY_REMOVED) && e->width != 0 && e->height != 0 ) {
+		a.width		= align_up((rot ? e->height : e->width) + 1, atlas->alignment);
+		a.height	= align_up((rot ? e->width : e->height) + 1, atlas->alignment);
+	}
+
+	return a;
+}
+
+static inline bool
+overlaps(const atlas_area_t* a, const atlas_area_t* b) {
+	return a->x < b->x + b->width && b->x < a->x + a->width && a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+static inline bool
+contains(const atlas_area_t* a, const atlas_area_t* b) {
+	return b->x >= a->x && b->y >= a->y && b->x + b->width <= a->x + a->width && b->y + b->height <= a->y + a->height;
+}
+
+static void
+areas_push(atlas_areas_t* list, uint32 x, uint32 y, uint32 width, uint32 height) {
+	if( width == 0 || height == 0 ) return;
+
+	if( list->count == list->capacity ) {
+		list->capacity	= list->capacity ? list->capacity * 2 : 64;
+		list->areas		= (atlas_area_t*)realloc(list->areas, sizeof(atlas_area_t) * list->capacity);
+		assert( NULL != list->areas );
+	}
+
+	list->areas[list->count].x		= x;
+	list->areas[list->count].y		= y;
+	list->areas[list->count].width	= width;
+	list->areas[list->count].height	= height;
+	++list->count;
+}
+
+static void
+areas_reset(atlas_areas_t* list, uint32 size) {
+	list->count	= 0;
+	areas_push(list, 0, 0, size, size);
+}
+
+/* drop the areas from 'first' on that another one contains, and the older ones they contain */
+static void
+areas_prune(atlas_areas_t* list, uint32 first) {
+	atlas_area_t*	a	= list->areas;
+	uint32			i, j;
+
+	for( i = first; i < list->count; ) {
+		bool	dropped	= false;
+
+		for( j = 0; j < list->count; ++j ) {
+			if( j != i && contains(&a[j], &a[i]) ) {
+				dropped	= true;
+				break;
+			}
+		}
+
+		if( dropped ) {
+			a[i]	= a[--list->count];
+			continue;
+		}
+
+		for( j = 0; j < list->count; ) {
+			if( j != i && contains(&a[i], &a[j]) ) {
+				/* the last one moves to j, which may be i itself */
+				if( list->count - 1 == i ) i = j;
+				a[j]	= a[--list->count];
+				continue;
+			}
+			++j;
+		}
+		++i;
+	}
+}
+
+/* take 'r' out of the free space */
+static void
+areas_occupy(atlas_areas_t* list, const atlas_area_t* r) {
+	uint32	n		= list->count;	/* [0, n) are the areas not looked at yet */
+	uint32	first;
+	uint32	i;
+
+	if( r->width == 0 || r->height == 0 ) return;
+
+	for( i = 0; i < n; ) {
+		atlas_area_t	a	= list->areas[i];
+
+		if( !overlaps(&a, r) ) {
+			++i;
+			continue;
+		}
+
+		list->areas[i]		= list->areas[n - 1];
+		list->areas[n - 1]	= list->areas[list->count - 1];
+		--list->count;
+		--n;
+
+		/* what is left on each side of r */
+		if( r->x > a.x )						areas_push(list, a.x, a.y, r->x - a.x, a.height);
+		if( r->x + r->width < a.x + a.width )	areas_push(list, r->x + r->width, a.y, a.x + a.width - r->x - r->width, a.height);
+		if( r->y > a.y )						areas_push(list, a.x, a.y, a.width, r->y - a.y);
+		if( r->y + r->height < a.y + a.height )	areas_push(list, a.x, r->y + r->height, a.width, a.y + a.height - r->y - r->height);
+	}
+
+	first	= n;
+	areas_prune(list, first);
+}
+
+static void
+areas_release(atlas_areas_t* list, const atlas_area_t* r) {
+	uint32	first	= list->count;
+	areas_push(list, r->x, r->y, r->width, r->height);
+	areas_prune(list, first);
+}
+
+/* best short side fit, false if no area can hold width x height */
+static bool
+areas_find(const atlas_areas_t* list, uint32 width, uint32 height, uint32* x, uint32* y) {
+	uint32	best_short	= 0xFFFFFFFF;
+	uint32	best_long	= 0xFFFFFFFF;
+	uint32	i;
+
+	for( i = 0; i < list->count; ++i ) {
+		const atlas_area_t*	a	= &list->areas[i];
+		uint32				dw, dh, s, l;
+
+		if( a->width < width || a->height < height ) continue;
+
+		dw	= a->width - width;
+		dh	= a->height - height;
+		s	= dw < dh ? dw : dh;
+		l	= dw < dh ? dh : dw;
+		if( s < best_short || (s == best_short && l < best_long) ) {
+			best_short	= s;
+			best_long	= l;
+			*x			= a->x;
+			*y			= a->y;
+		}
+	}
+
+	return best_short != 0xFFFFFFFF;
+}
+
+/* the free space of the baked image, from the live images */
+static void
+build_free(atlas_t* atlas) {
+	uint32	i;
+
+	areas_reset(&atlas->free, image_width(atlas->baked_image));
+	for( i = 0; i < atlas->image_count; ++i ) {
+		atlas_area_t	a	= footprint(atlas, &atlas->entries[i]);
+		areas_occupy(&atlas->free, &a);
+	}
+
+	atlas->free_valid	= true;
+}
+
+/* the texels of an empty area: the transparent entry of an indexed image, zero otherwise */
+static uint8
+clear_value(const image_t* img) {
+	uint32	i	= image_format(img) == PF_I8 ? image_transparent_index(img) : 0;
+	return i < IMAGE_PALETTE_MAX ? (uint8)i : 0;
+}
+
+/* rows of 'width' x 'height' texels from one image to another, NULL 'src' clears */
+static void
+copy_rect(image_t* dst, uint32 dx, uint32 dy, const uint8* src, uint32 src_pitch, uint32 width, uint32 height) {
+	uint32	ps		= image_format_pixel_size(image_format(dst));
+	uint8*	pixels	= (uint8*)image_pixels(dst);
+	uint8	clear	= src ? 0 : clear_value(dst);
+	uint32	r;
+
+	for( r = 0; r < height; ++r ) {
+		uint8*	d	= pixels + ((size_t)(dy + r) * image_width(dst) + dx) * ps;
+		if( src ) {
+			memcpy(d, src + (size_t)r * src_pitch, (size_t)width * ps);
+		} else {
+			memset(d, clear, (size_t)width * ps);
+		}
+	}
+}
+
+atlas_t*
+atlas_make_empty(uint32 size, PIXEL_FORMAT format) {
+	atlas_t*	atlas;
+
+	if( size == 0 || image_format_pixel_size(format) == 0 || format == PF_I8 ) {
+		fprintf(stderr, "ERROR: atlas_make_empty: needs a size and an uncompressed, non indexed format\n");
+		return NULL;
+	}
+
+	atlas	= (atlas_t*)malloc(sizeof(atlas_t));
+	assert( NULL != atlas );
+
+	memset(atlas, 0, sizeof(atlas_t));
+	atlas->baked_image	= image_allocate(size, size, format);
+	atlas->alignment	= 1;
+	assert( NULL != atlas->baked_image );
+
+	return atlas;
+}
+
+static void
+push_removed(atlas_t* atlas, uint32 img) {
+	if( atlas->removed_count == atlas->removed_capacity ) {
+		atlas->removed_capacity	= atlas->removed_capacity ? atlas->removed_capacity * 2 : 16;
+		atlas->removed			= (uint32*)realloc(atlas->removed, sizeof(uint32) * atlas->removed_capacity);
+		assert( NULL != atlas->removed );
+	}
+	atlas->removed[atlas->removed_count++]	= img;
+}
+
+/* the removed indices of a built or loaded atlas, the lowest on top */
+static void
+build_removed(atlas_t* atlas) {
+	uint32	i;
+
+	atlas->removed_count	= 0;
+	for( i = atlas->image_count; i-- > 0; ) {
+		if( atlas->entries[i].flags & ATLAS_ENTRY_REMOVED ) push_removed(atlas, i);
+	}
+	atlas->removed_valid	= true;
+}
+
+bool
+atlas_image_removed(const atlas_t* atlas, uint32 img) {
+	return (atlas->entries[img].flags & ATLAS_ENTRY_REMOVED) != 0;
+}
+
+bool
+atlas_remove(atlas_t* atlas, uint32 img) {
+	atlas_entry_t*	e;
+	atlas_area_t	a;
+
+	if( img >= atlas->image_count || atlas_image_removed(atlas, img) ) {
+		fprintf(stderr, "ERROR: atlas_remove: no image %u\n", img);
+		return false;
+	}
+
+	if( image_format_pixel_size(image_format(atlas->baked_image)) == 0 || atlas->mapping ) {
+		fprintf(stderr, "ERROR: atlas_remove: block compressed and attached atlases can't be changed\n");
+		return false;
+	}
+
+	e	= &atlas->entries[img];
+	a	= footprint(atlas, e);
+
+	/* cleared so that the next image placed there gets a clean gutter */
+	copy_rect(atlas->baked_image, a.x, a.y, NULL, 0, a.width, a.height);
+	atlas_mark_dirty(atlas, a.x, a.y, a.width, a.height);
+	if( atlas->free_valid ) areas_release(&atlas->free, &a);
+	if( atlas->removed_valid ) push_removed(atlas, img);
+
+	e->flags	|= ATLAS_ENTRY_REMOVED;
+	e->key		= ATLAS_NO_KEY;
+	e->width	= 0;
+	e->height	= 0;
+
+	if( atlas->uv_layout != ATLAS_UV_NONE ) {
+		atlas_build_uv_table(atlas, atlas->uv_layout, atlas->uv_half_texel);
+	}
+
+	return true;
+}
+
+/* the keys of the live images plus 'key' for image 'img', rebuilt from scratch */
+static bool
+add_key(atlas_t* atlas, uint32 img, const char* key) {
+	const char**	keys	= (const char**)malloc(sizeof(char*) * atlas->image_count);
+	char*			old		= atlas->keys;
+	uint32			i;
+	bool			ok;
+
+	assert( NULL != keys );
+	for( i = 0; i < atlas->image_count; ++i ) {
+		keys[i]	= i == img ? key : atlas_image_key(atlas, i);
+	}
+
+	/* the old blob backs the keys until the new one is built */
+	atlas->keys	= NULL;
+	atlas_free_keys(atlas);
+	ok	= atlas_build_keys(atlas, keys);
+
+	free(old);
+	free(keys);
+	return ok;
+}
+
+uint32
+atlas_place(atlas_t* atlas, const image_t* img, uint32 x, uint32 y) {
+	atlas_entry_t*	e;
+	uint32			index;
+
+	/* the last removed index, or a new one */
+	if( !atlas->removed_valid ) build_removed(atlas);
+
+	if( atlas->removed_count ) {
+		index	= atlas->removed[--atlas->removed_count];
+	} else {
+		index	= atlas->image_count;
+		if( atlas->image_count == atlas->entry_capacity ) {
+			atlas->entry_capacity	= atlas->entry_capacity ? atlas->entry_capacity * 2 : 16;
+			atlas->entries			= (atlas_entry_t*)realloc(atlas->entries, sizeof(atlas_entry_t) * atlas->entry_capacity);
+			assert( NULL != atlas->entries );
+		}
+		++atlas->image_count;
+	}
+
+	e	= &atlas->entries[index];
+	memset(e, 0, sizeof(atlas_entry_t));
+	e->x				= x;
+	e->y				= y;
+	e->width			= image_width(img);
+	e->height			= image_height(img);
+	e->source_width		= e->width;
+	e->source_height	= e->height;
+	e->key				= ATLAS_NO_KEY;
+
+	image_blit(atlas->baked_image, x, y, img, 0, 0, e->width, e->height);
+	atlas_mark_dirty(atlas, x, y, e->width, e->height);
+
+	if( atlas->uv_layout != ATLAS_UV_NONE ) {
+		atlas_build_uv_table(atlas, atlas->uv_layout, atlas->uv_half_texel);
+	}
+
+	return index;
+}
+
+uint32
+atlas_add(atlas_t* atlas, const image_t* img, const char* key) {
+	PIXEL_FORMAT	fmt		= image_format(atlas->baked_image);
+	atlas_area_t	a;
+	uint32			index;
+
+	if( image_format_pixel_size(fmt) == 0 || fmt == PF_I8 || atlas->mapping ) {
+		fprintf(stderr, "ERROR: atlas_add: can't add to a block compressed, indexed or attached atlas\n");
+		return ATLAS_NOT_FOUND;
+	}
+
+	if( key && atlas_find(atlas, key) != ATLAS_NOT_FOUND ) {
+		fprintf(stderr, "ERROR: atlas_add: key %s is already used\n", key);
+		return ATLAS_NOT_FOUND;
+	}
+
+	if( !atlas->free_valid ) build_free(atlas);
+
+	memset(&a, 0, sizeof(a));
+	if( image_width(img) != 0 && image_height(img) != 0 ) {
+		a.width		= align_up(image_width(img) + 1, atlas->alignment);
+		a.height	= align_up(image_height(img) + 1, atlas->alignment);
+		if( !areas_find(&atlas->free, a.width, a.height, &a.x, &a.y) ) return ATLAS_NOT_FOUND;
+		areas_occupy(&atlas->free, &a);
+	}
+
+	index	= atlas_place(atlas, img, a.x, a.y);
+
+	if( key && !add_key(atlas, index, key) ) {
+		atlas_remove(atlas, index);
+		return ATLAS_NOT_FOUND;
+	}
+
+	return index;
+}
+
+/* a live image and where compaction puts it */
+typedef struct {
+	uint32			image;
+	atlas_area_t	from;
+	uint32			x, y;
+} slot_t;
+
+static int
+compare_slot_size(const void* a, const void* b) {
+	const slot_t*	sa	= (const slot_t*)a;
+	const slot_t*	sb	= (const slot_t*)b;
+	uint32			ma	= sa->from.width > sa->from.height ? sa->from.width : sa->from.height;
+	uint32			mb	= sb->from.width > sb->from.height ? sb->from.width : sb->from.height;
+	uint64_t		aa	= (uint64_t)sa->from.width * sa->from.height;
+	uint64_t		ab	= (uint64_t)sb->from.width * sb->from.height;
+
+	if( ma != mb ) return ma > mb ? -1 : 1;
+	if( aa != ab ) return aa > ab ? -1 : 1;
+	return sa->image < sb->image ? -1 : (sa->image > sb->image ? 1 : 0);
+}
+
+/*
+ * keep slots[0, kept) in place and put the others in the free space of a
+ * size x size image, largest first. 'busy' slots, which are not moved,
+ * still hold their texels and are not free either
+ */
+static bool
+place(atlas_areas_t* list, uint32 size, slot_t* slots, uint32 kept, uint32 busy, uint32 count) {
+	slot_t*	movers	= &slots[kept];
+	uint32	i;
+
+	areas_reset(list, size);
+	for( i = 0; i < busy; ++i ) {
+		atlas_area_t	a	= slots[i].from;
+
+		/* clipped to the new size, the part outside is gone anyway */
+		if( a.x >= size || a.y >= size ) continue;
+		if( a.x + a.width > size ) a.width = size - a.x;
+		if( a.y + a.height > size ) a.height = size - a.y;
+		areas_occupy(list, &a);
+	}
+
+	qsort(movers, count - kept, sizeof(slot_t), compare_slot_size);
+
+	for( i = 0; i < count - kept; ++i ) {
+		atlas_area_t	a	= movers[i].from;
+		if( !areas_find(list, a.width, a.height, &a.x, &a.y) ) return false;
+		areas_occupy(list, &a);
+		movers[i].x	= a.x;
+		movers[i].y	= a.y;
+	}
+
+	return true;
+}
+
+static int
+compare_slot_area(const void* a, const void* b) {
+	const slot_t*	sa	= (const slot_t*)a;
+	const slot_t*	sb	= (const slot_t*)b;
+	uint64_t		aa	= (uint64_t)sa->from.width * sa->from.height;
+	uint64_t		ab	= (uint64_t)sb->from.width * sb->from.height;
+
+	if( aa != ab ) return aa > ab ? -1 : 1;
+	return sa->image < sb->image ? -1 : (sa->image > sb->image ? 1 : 0);
+}
+
+/*
+ * the images already inside size x size stay. first try to move the
+ * others without touching any live texel, then give up the place of the
+ * smallest of the ones inside, doubling their number each time
+ */
+static bool
+plan(atlas_areas_t* list, uint32 size, slot_t* slots, uint32 count, bool* in_place) {
+	uint32	inside	= 0;
+	uint32	dropped;
+	uint32	i;
+
+	/* the ones inside first, largest first, nothing placed by an earlier attempt */
+	for( i = 0; i < count; ++i ) {
+		slots[i].x	= slots[i].from.x;
+		slots[i].y	= slots[i].from.y;
+
+		if( slots[i].from.x + slots[i].from.width <= size && slots[i].from.y + slots[i].from.height <= size ) {
+			slot_t	s		= slots[inside];
+			slots[inside++]	= slots[i];
+			slots[i]		= s;
+		}
+	}
+	qsort(slots, inside, sizeof(slot_t), compare_slot_area);
+
+	*in_place	= true;
+	if( place(list, size, slots, inside, count, count) ) return true;
+
+	*in_place	= false;
+	for( dropped = 1; ; dropped *= 2 ) {
+		uint32	kept	= dropped < inside ? inside - dropped : 0;
+
+		if( place(list, size, slots, kept, kept, count) ) return true;
+		if( kept == 0 ) return false;
+	}
+}
+
+uint32
+atlas_compact(atlas_t* atlas, uint32 size, atlas_move_t* moves, bool* in_place) {
+	static const uint32	sizes[]	= { 128, 256, 512, 1024, 2048, 4096, 8192, 16384 };
+	image_t*		tex		= atlas->baked_image;
+	uint32			old		= image_width(tex);
+	uint32			ps		= image_format_pixel_size(image_format(tex));
+	atlas_areas_t	list;
+	slot_t*			slots;
+	uint8*			staging;
+	size_t			staged	= 0;
+	uint32			count	= 0;
+	uint32			move_count	= 0;
+	uint64_t		area	= 0;
+	bool			ok		= false;
+	uint32			i, s;
+
+	if( ps == 0 || atlas->mapping ) {
+		fprintf(stderr, "ERROR: atlas_compact: block compressed and attached atlases can't be changed\n");
+		return ATLAS_NOT_FOUND;
+	}
+
+	TRACE_BEGIN("atlas_compact");
+
+	slots	= (slot_t*)malloc(sizeof(slot_t) * (atlas->image_count ? atlas->image_count : 1));
+	assert( NULL != slots );
+
+	for( i = 0; i < atlas->image_count; ++i ) {
+		atlas_area_t	a	= footprint(atlas, &atlas->entries[i]);
+
+		/* fully trimmed images take no space, anywhere will do */
+		if( a.width == 0 ) {
+			atlas->entries[i].x	= 0;
+			atlas->entries[i].y	= 0;
+			continue;
+		}
+
+		slots[count].image	= i;
+		slots[count].from	= a;
+		slots[count].x		= a.x;
+		slots[count].y		= a.y;
+		area	+= (uint64_t)a.width * a.height;
+		++count;
+	}
+
+	memset(&list, 0, sizeof(list));
+
+	if( size ) {
+		ok	= plan(&list, size, slots, count, in_place);
+	} else {
+		/* the smallest that works, the current size always does */
+		for( s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] < old && !ok; ++s ) {
+			if( (uint64_t)sizes[s] * sizes[s] < area ) continue;
+			size	= sizes[s];
+			ok		= plan(&list, size, slots, count, in_place);
+		}
+		if( !ok ) {
+			size	= old;
+			ok		= plan(&list, size, slots, count, in_place);
+		}
+	}
+
+	free(list.areas);
+
+	if( !ok ) {
+		free(slots);
+		TRACE_END("atlas_compact");
+		return ATLAS_NOT_FOUND;
+	}
+
+	/* the moves, their images staged since a destination may overlap another source */
+	for( i = 0; i < count; ++i ) {
+		const atlas_entry_t*	e	= &atlas->entries[slots[i].image];
+		bool					rot	= (e->flags & ATLAS_ENTRY_ROTATED) != 0;
+		atlas_move_t*			m;
+
+		if( slots[i].x == slots[i].from.x && slots[i].y == slots[i].from.y ) continue;
+
+		m			= &moves[move_count++];
+		m->image	= slots[i].image;
+		m->src_x	= e->x;
+		m->src_y	= e->y;
+		m->dst_x	= slots[i].x;
+		m->dst_y	= slots[i].y;
+		m->width	= rot ? e->height : e->width;
+		m->height	= rot ? e->width : e->height;
+		staged		+= (size_t)m->width * m->height * ps;
+	}
+
+	staging	= (uint8*)malloc(staged ? staged : 1);
+	assert( NULL != staging );
+
+	for( i = 0, staged = 0; i < move_count; ++i ) {
+		const atlas_move_t*	m	= &moves[i];
+		uint32				r;
+
+		for( r = 0; r < m->height; ++r ) {
+			memcpy(staging + staged, (const uint8*)image_pixels(tex) + ((size_t)(m->src_y + r) * old + m->src_x) * ps, (size_t)m->width * ps);
+			staged	+= (size_t)m->width * ps;
+		}
+		copy_rect(tex, m->src_x, m->src_y, NULL, 0, m->width, m->height);
+		atlas_mark_dirty(atlas, m->src_x, m->src_y, m->width, m->height);
+	}
+
+	for( i = 0, staged = 0; i < move_count; ++i ) {
+		const atlas_move_t*	m	= &moves[i];
+
+		copy_rect(tex, m->dst_x, m->dst_y, staging + staged, m->width * ps, m->width, m->height);
+		atlas_mark_dirty(atlas, m->dst_x, m->dst_y, m->width, m->height);
+		staged	+= (size_t)m->width * m->height * ps;
+
+		atlas->entries[m->image].x	= m->dst_x;
+		atlas->entries[m->image].y	= m->dst_y;
+	}
+
+	free(staging);
+
+	/* cropped or grown */
+	if( size != old ) {
+		image_t*	resized	= image_allocate(size, size, image_format(tex));
+		uint32		side	= size < old ? size : old;
+
+		assert( NULL != resized );
+		if( image_format(tex) == PF_I8 ) {
+			image_set_palette(resized, image_palette(tex), image_palette_size(tex));
+			memset(image_pixels(resized), clear_value(resized), image_data_size(resized));
+		}
+		copy_rect(resized, 0, 0, (const uint8*)image_pixels(tex), old * ps, side, side);
+
+		image_release(tex);
+		atlas->baked_image	= resized;
+		atlas_dirty_all(atlas);
+	}
+
+	atlas->free_valid	= false;
+
+	if( atlas->uv_layout != ATLAS_UV_NONE ) {
+		atlas_build_uv_table(atlas, atlas->uv_layout, atlas->uv_half_texel);
+	}
+
+	free(slots);
+
+	TRACE_END("atlas_compact");
+
+	return move_count;
+}
@@ -0,0 +1,206 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * the baked image is cut in granularity x granularity cells, one bit per
+ * cell set when a texel in it is written. until the first take every cell
+ * is dirty and no bitmap is kept: a new, loaded or resized baked image
+ * has to be uploaded whole anyway
+ */
+
+static inline uint32
+cell_words(uint32 columns) {
+	return (columns + 31) / 32;
+}
+
+/* a clean bitmap for the current size and granularity */
+static void
+dirty_reset(atlas_t* atlas) {
+	uint32	g	= atlas->dirty_granularity;
+
+	atlas->dirty_columns	= (image_width(atlas->baked_image) + g - 1) / g;
+	atlas->dirty_rows		= (image_height(atlas->baked_image) + g - 1) / g;
+
+	free(atlas->dirty);
+	atlas->dirty	= (uint32*)calloc((size_t)cell_words(atlas->dirty_columns) * atlas->dirty_rows, sizeof(uint32));
+	assert( NULL != atlas->dirty );
+}
+
+void
+atlas_mark_dirty(atlas_t* atlas, uint32 x, uint32 y, uint32 width, uint32 height) {
+	uint32	g	= atlas->dirty_granularity;
+	uint32	words, x0, x1, y0, y1, r, c;
+
+	if( NULL == atlas->dirty || width == 0 || height == 0 ) return;
+
+	words	= cell_words(atlas->dirty_columns);
+	x0		= x / g;
+	y0		= y / g;
+	x1		= (x + width - 1) / g;
+	y1		= (y + height - 1) / g;
+	if( x1 >= atlas->dirty_columns ) x1 = atlas->dirty_columns - 1;
+	if( y1 >= atlas->dirty_rows ) y1 = atlas->dirty_rows - 1;
+
+	for( r = y0; r <= y1; ++r ) {
+		uint32*	row	= &atlas->dirty[(size_t)r * words];
+		for( c = x0; c <= x1; ++c ) {
+			row[c / 32]	|= 1u << (c % 32);
+		}
+	}
+}
+
+void
+atlas_dirty_all(atlas_t* atlas) {
+	free(atlas->dirty);
+	atlas->dirty	= NULL;
+}
+
+static void
+push_region(atlas_t* atlas, uint32 x, uint32 y, uint32 width, uint32 height) {
+	rect_t*	r;
+
+	if( atlas->region_count == atlas->region_capacity ) {
+		atlas->region_capacity	= atlas->region_capacity ? atlas->region_capacity * 2 : 16;
+		atlas->regions			= (rect_t*)realloc(atlas->regions, sizeof(rect_t) * atlas->region_capacity);
+		assert( NULL != atlas->regions );
+	}
+
+	r			= &atlas->regions[atlas->region_count++];
+	r->x		= x;
+	r->y		= y;
+	r->width	= width;
+	r->height	= height;
+}
+
+/*
+ * the runs of dirty cells of each row, a run spanning the same columns as
+ * one in the row above extends it downwards. 'open' holds the runs of the
+ * previous row: first column, last column and first row
+ */
+static void
+collect_regions(atlas_t* atlas) {
+	uint32	g		= atlas->dirty_granularity;
+	uint32	width	= image_width(atlas->baked_image);
+	uint32	height	= image_height(atlas->baked_image);
+	uint32	words	= cell_words(atlas->dirty_columns);
+	uint32*	open	= (uint32*)malloc(sizeof(uint32) * 3 * (atlas->dirty_columns + 1));
+	uint32*	next	= (uint32*)malloc(sizeof(uint32) * 3 * (atlas->dirty_columns + 1));
+	uint32	open_count	= 0;
+	uint32	r, c, i, o;
+
+	assert( NULL != open );
+	assert( NULL != next );
+
+	for( r = 0; r <= atlas->dirty_rows; ++r ) {
+		const uint32*	row			= r < atlas->dirty_rows ? &atlas->dirty[(size_t)r * words] : NULL;
+		uint32			next_count	= 0;
+
+		/* runs of this row, none past the last one */
+		for( c = 0; row && c < atlas->dirty_columns; ) {
+			if( row[c / 32] == 0 ) {
+				c	= (c / 32 + 1) * 32;
+				continue;
+			}
+			if( !(row[c / 32] & (1u << (c % 32))) ) {
+				++c;
+				continue;
+			}
+
+			next[next_count * 3]		= c;
+			while( c < atlas->dirty_columns && (row[c / 32] & (1u << (c % 32))) ) ++c;
+			next[next_count * 3 + 1]	= c;
+			next[next_count * 3 + 2]	= r;
+			++next_count;
+		}
+
+		/* both lists are sorted: a run carries over the start row of an identical open one, the others close */
+		for( o = 0, i = 0; o < open_count; ++o ) {
+			while( i < next_count && next[i * 3] < open[o * 3] ) ++i;
+
+			if( i < next_count && next[i * 3] == open[o * 3] && next[i * 3 + 1] == open[o * 3 + 1] ) {
+				next[i * 3 + 2]	= open[o * 3 + 2];
+			} else {
+				uint32	x0	= open[o * 3] * g;
+				uint32	x1	= open[o * 3 + 1] * g;
+				uint32	y0	= open[o * 3 + 2] * g;
+				uint32	y1	= r * g;
+
+				push_region(atlas, x0, y0, (x1 < width ? x1 : width) - x0, (y1 < height ? y1 : height) - y0);
+			}
+		}
+
+		{
+			uint32*	t	= open;
+			open		= next;
+			next		= t;
+			open_count	= next_count;
+		}
+	}
+
+	free(open);
+	free(next);
+}
+
+const rect_t*
+atlas_take_dirty_regions(atlas_t* atlas, uint32* count) {
+	TRACE_BEGIN("atlas_take_dirty_regions");
+
+	if( atlas->dirty_granularity == 0 ) atlas->dirty_granularity = ATLAS_DIRTY_GRANULARITY;
+
+	atlas->region_count	= 0;
+	if( NULL == atlas->dirty ) {
+		push_region(atlas, 0, 0, image_width(atlas->baked_image), image_height(atlas->baked_image));
+	} else {
+		collect_regions(atlas);
+	}
+
+	dirty_reset(atlas);
+
+	TRACE_END("atlas_take_dirty_regions");
+
+	*count	= atlas->region_count;
+	return atlas->regions;
+}
+
+void
+atlas_set_dirty_granularity(atlas_t* atlas, uint32 granularity) {
+	uint32			block	= image_format_block_size(image_format(atlas->baked_image)) ? 4 : 1;
+	const rect_t*	regions;
+	uint32			count, i;
+
+	if( granularity == 0 ) granularity = ATLAS_DIRTY_GRANULARITY;
+	granularity	= ((granularity + block - 1) / block) * block;
+
+	if( NULL == atlas->dirty ) {
+		atlas->dirty_granularity	= granularity;
+		return;
+	}
+
+	/* the dirty cells carried over to the new grid */
+	regions	= atlas_take_dirty_regions(atlas, &count);
+	atlas->dirty_granularity	= granularity;
+	dirty_reset(atlas);
+	for( i = 0; i < count; ++i ) {
+		atlas_mark_dirty(atlas, (uint32)regions[i].x, (uint32)regions[i].y, (uint32)regions[i].width, (uint32)regions[i].height);
+	}
+}
@@ -0,0 +1,197 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Minimal perfect hash ("hash and displace").
+ *
+ * Keys are spread over 'count' buckets. Buckets are then placed from the
+ * largest to the smallest: a bucket with several keys searches for the first
+ * displacement d that sends all of its keys to free slots, a bucket with one
+ * key takes the next free slot directly and stores it as -(slot + 1).
+ * A lookup is one string hash, one bucket read and at most one remix.
+ */
+
+#define HASH_MAX_DISPLACEMENT	(1 << 24)
+
+/* 64 bit FNV-1a */
+uint64_t
+hash_key(const char* key) {
+	uint64_t	h	= 0xCBF29CE484222325ULL;
+	while( *key ) {
+		h	^= (uint8)*key++;
+		h	*= 0x100000001B3ULL;
+	}
+	return h;
+}
+
+/* murmur3 finalizer */
+static inline uint64_t
+mix(uint64_t h) {
+	h	^= h >> 33;
+	h	*= 0xFF51AFD7ED558CCDULL;
+	h	^= h >> 33;
+	h	*= 0xC4CEB9FE1A85EC53ULL;
+	h	^= h >> 33;
+	return h;
+}
+
+static inline uint32
+displaced_slot(uint64_t hash, uint32 d, uint32 count) {
+	return (uint32)(mix(hash + (uint64_t)d * 0x9E3779B97F4A7C15ULL) % count);
+}
+
+static inline uint32
+bucket_of(uint64_t hash, uint32 count) {
+	return (uint32)(mix(hash) % count);
+}
+
+uint32
+hash_slot(uint64_t hash, const sint32* buckets, uint32 count) {
+	sint32	d	= buckets[bucket_of(hash, count)];
+	if( d < 0 ) return (uint32)(-d - 1);
+	return displaced_slot(hash, (uint32)d, count);
+}
+
+bool
+hash_build(const uint64_t* hashes, const uint32* values, uint32 count, sint32* buckets, uint32* slots) {
+	uint32*		sizes	= NULL;	/* keys per bucket */
+	uint32*		starts	= NULL;	/* first key of each bucket in 'members' */
+	uint32*		members	= NULL;	/* keys grouped by bucket */
+	uint32*		order	= NULL;	/* buckets, largest first */
+	uint8*		used	= NULL;
+	uint32		tmp[64];
+	uint32		max_size	= 0;
+	uint32		free_slot	= 0;
+	bool		ok		= true;
+	uint32		i, b;
+
+	if( count == 0 ) return true;
+
+	sizes	= (uint32*)calloc(count, sizeof(uint32));
+	starts	= (uint32*)calloc(count + 1, sizeof(uint32));
+	members	= (uint32*)malloc(sizeof(uint32) * count);
+	order	= (uint32*)malloc(sizeof(uint32) * count);
+	used	= (uint8*)calloc(count, 1);
+	assert( NULL != sizes && NULL != starts && NULL != members && NULL != order && NULL != used );
+
+	for( i = 0; i < count; ++i ) {
+		++sizes[bucket_of(hashes[i], count)];
+	}
+
+	for( b = 0; b < count; ++b ) {
+		starts[b + 1]	= starts[b] + sizes[b];
+		if( sizes[b] > max_size ) max_size = sizes[b];
+	}
+
+	/* group the keys: reuse 'order' as the fill cursor */
+	memcpy(order, starts, sizeof(uint32) * count);
+	for( i = 0; i < count; ++i ) {
+		b	= bucket_of(hashes[i], count);
+		members[order[b]++]	= i;
+	}
+
+	/* counting sort of the buckets by size, largest first */
+	{
+		uint32*	first	= (uint32*)calloc(max_size + 2, sizeof(uint32));
+		assert( NULL != first );
+		for( b = 0; b < count; ++b ) ++first[max_size - sizes[b] + 1];
+		for( i = 1; i <= max_size + 1; ++i ) first[i] += first[i - 1];
+		for( b = 0; b < count; ++b ) order[first[max_size - sizes[b]]++] = b;
+		free(first);
+	}
+
+	for( i = 0; i < count && ok; ++i ) {
+		uint32	bucket	= order[i];
+		uint32	n		= sizes[bucket];
+		uint32*	keys	= &members[starts[bucket]];
+		uint32	d;
+
+		if( n == 0 ) {
+			/* every remaining bucket is empty */
+			break;
+		}
+
+		if( n == 1 ) {
+			while( used[free_slot] ) ++free_slot;
+			used[free_slot]		= 1;
+			slots[free_slot]	= values[keys[0]];
+			buckets[bucket]		= -(sint32)free_slot - 1;
+			continue;
+		}
+
+		if( n > sizeof(tmp) / sizeof(uint32) ) {
+			ok	= false;
+			break;
+		}
+
+		/* identical hashes collide for every displacement */
+		for( d = 0; d < n && ok; ++d ) {
+			for( b = d + 1; b < n; ++b ) {
+				if( hashes[keys[d]] == hashes[keys[b]] ) {
+					ok	= false;
+					break;
+				}
+			}
+		}
+		if( !ok ) break;
+
+		for( d = 0; d < HASH_MAX_DISPLACEMENT; ++d ) {
+			uint32	k;
+			for( k = 0; k < n; ++k ) {
+				uint32	s	= displaced_slot(hashes[keys[k]], d, count);
+				uint32	j;
+				if( used[s] ) break;
+				for( j = 0; j < k; ++j ) {
+					if( tmp[j] == s ) break;
+				}
+				if( j != k ) break;
+				tmp[k]	= s;
+			}
+
+			if( k == n ) break;
+		}
+
+		if( d == HASH_MAX_DISPLACEMENT ) {
+			ok	= false;
+			break;
+		}
+
+		for( b = 0; b < n; ++b ) {
+			used[tmp[b]]	= 1;
+			slots[tmp[b]]	= values[keys[b]];
+		}
+		buckets[bucket]	= (sint32)d;
+	}
+
+	/* empty buckets still need a valid (unused) displacement */
+	for( ; i < count; ++i ) {
+		buckets[order[i]]	= 0;
+	}
+
+	free(used);
+	free(order);
+	free(members);
+	free(starts);
+	free(sizes);
+	return ok;
+}
@@ -16,18 +16,31 @@
 ** <http://www.gnu.org/licenses/>.
 **
 */
-#include "atlas.h"
+#include "atlas_private.h"
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
 #include <assert.h>
 #include <png.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* x86 builds with GCC or clang carry an F16C path picked at run time */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_F16C
+#include <immintrin.h>
+#endif
+
 struct image_s {
 	uint32			width;
 	uint32			height;
 	PIXEL_FORMAT	format;
 	void*			pixels;
+	color4b_t*		palette;		/* PF_I8 only, IMAGE_PALETTE_MAX entries */
+	uint32			palette_size;	/* entries set */
+	bool			borrowed;		/* 'pixels' belong to the caller of image_wrap */
 };
 
 uint32
@@ -45,37 +58,284 @@ image_format(const image_t* img) {
 	return img->format;
 }
 
-static inline image_t*
-image_allocate(uint32 width, uint32 height, PIXEL_FORMAT fmt) {
-	uint32		ps	= 0;
-	image_t*	ret	= NULL;
+/* bytes per 4x4 block for block compressed formats, 0 for plain formats */
+static inline uint32
+block_size(PIXEL_FORMAT fmt) {
+	switch(fmt) {
+	case PF_BC1		: return 8;
+	case PF_BC3		: return 16;
+	case PF_BC7		: return 16;
+	default			: return 0;
+	}
+}
 
+static inline uint32
+pixel_size(PIXEL_FORMAT fmt) {
 	switch(fmt) {
-	case PF_A8		: ps = 1; break;
-	case PF_R8G8B8	: ps = 3; break;
-	case PF_R8G8B8A8: ps = 4; break;
-	default:
-		fprintf(stderr, "ERROR: image_allocate: unsupported input format 0x%X\n", fmt);
-		return NULL;
+	case PF_A8		: return 1;
+	case PF_I8		: return 1;
+	case PF_R8G8B8	: return 3;
+	case PF_R8G8B8A8: return 4;
+	case PF_R16G16B16A16F: return 8;
+	case PF_R32G32B32A32F: return 16;
+	default			: return 0;
 	}
+}
+
+static inline bool
+is_float(PIXEL_FORMAT fmt) {
+	return fmt == PF_R16G16B16A16F || fmt == PF_R32G32B32A32F;
+}
+
+/* in size_t, a 16384 x 16384 float image is 4 GiB */
+static inline size_t
+data_size(uint32 width, uint32 height, PIXEL_FORMAT fmt) {
+	if( block_size(fmt) ) {
+		return (size_t)((width + 3) / 4) * ((height + 3) / 4) * block_size(fmt);
+	} else {
+		return (size_t)width * height * pixel_size(fmt);
+	}
+}
+
+uint32
+image_format_pixel_size(PIXEL_FORMAT fmt) {
+	return pixel_size(fmt);
+}
 
-	ret	= (image_t*)malloc(sizeof(image_t));
+uint32
+image_format_block_size(PIXEL_FORMAT fmt) {
+	return block_size(fmt);
+}
+
+static image_t*
+make_image(uint32 width, uint32 height, PIXEL_FORMAT fmt, void* pixels, bool borrowed) {
+	image_t*	ret	= (image_t*)malloc(sizeof(image_t));
 	assert( NULL != ret );
 
-	ret->width	= width;
-	ret->height	= height;
-	ret->format	= fmt;
-	ret->pixels	= malloc(width * height * ps);
-	assert( NULL != ret->pixels );
+	ret->width		= width;
+	ret->height		= height;
+	ret->format		= fmt;
+	ret->pixels		= pixels;
+	ret->borrowed	= borrowed;
+
+	/* indexed images start with an all transparent palette */
+	ret->palette		= NULL;
+	ret->palette_size	= 0;
+	if( fmt == PF_I8 ) {
+		ret->palette	= (color4b_t*)calloc(IMAGE_PALETTE_MAX, sizeof(color4b_t));
+		assert( NULL != ret->palette );
+	}
 
 	return ret;
 }
 
+image_t*
+image_allocate(uint32 width, uint32 height, PIXEL_FORMAT fmt) {
+	void*	pixels;
+
+	if( pixel_size(fmt) == 0 && block_size(fmt) == 0 ) {
+		fprintf(stderr, "ERROR: image_allocate: unsupported input format 0x%X\n", fmt);
+		return NULL;
+	}
+
+	/* zeroed, so that gutters between packed images stay transparent */
+	pixels	= calloc(1, data_size(width, height, fmt));
+	assert( NULL != pixels );
+
+	return make_image(width, height, fmt, pixels, false);
+}
+
+image_t*
+image_wrap(uint32 width, uint32 height, PIXEL_FORMAT fmt, void* pixels) {
+	if( pixel_size(fmt) == 0 && block_size(fmt) == 0 ) {
+		fprintf(stderr, "ERROR: image_wrap: unsupported input format 0x%X\n", fmt);
+		return NULL;
+	}
+
+	return make_image(width, height, fmt, pixels, true);
+}
+
+void*
+image_pixels(const image_t* img) {
+	return img->pixels;
+}
+
+size_t
+image_data_size(const image_t* img) {
+	return data_size(img->width, img->height, img->format);
+}
+
+const color4b_t*
+image_palette(const image_t* img) {
+	return img->palette;
+}
+
+uint32
+image_palette_size(const image_t* img) {
+	return img->palette_size;
+}
+
+void
+image_set_palette(image_t* img, const color4b_t* colors, uint32 count) {
+	assert( img->format == PF_I8 && count <= IMAGE_PALETTE_MAX );
+	memcpy(img->palette, colors, sizeof(color4b_t) * count);
+	memset(&img->palette[count], 0, sizeof(color4b_t) * (IMAGE_PALETTE_MAX - count));
+	img->palette_size	= count;
+}
+
+uint32
+image_transparent_index(const image_t* img) {
+	uint32	i;
+
+	for( i = 0; i < img->palette_size; ++i ) {
+		if( img->palette[i].a == 0 ) return i;
+	}
+
+	return IMAGE_PALETTE_MAX;
+}
+
+/* palette entry closest to a colour, squared distance over the 4 channels */
+static uint8
+nearest_index(const image_t* img, color4b_t col) {
+	uint32	best		= 0;
+	uint32	best_dist	= 0xFFFFFFFF;
+	uint32	i;
+
+	for( i = 0; i < img->palette_size; ++i ) {
+		const color4b_t*	p	= &img->palette[i];
+		sint32	dr	= (sint32)p->r - col.r, dg = (sint32)p->g - col.g;
+		sint32	db	= (sint32)p->b - col.b, da = (sint32)p->a - col.a;
+		uint32	d	= (uint32)(dr * dr + dg * dg + db * db + da * da);
+		if( d < best_dist ) {
+			best		= i;
+			best_dist	= d;
+			if( d == 0 ) break;
+		}
+	}
+
+	return (uint8)best;
+}
+
 typedef void		(*pixel_setb_fun_t)(void*, color4b_t);
 typedef void		(*pixel_setf_fun_t)(void*, color4_t);
 typedef color4b_t	(*pixel_getb_fun_t)(void*);
 typedef color4_t	(*pixel_getf_fun_t)(void*);
 
+/* [0, 1] to 8 bits, rounded to the nearest and clamped (NaN gives 0) */
+static inline uint8
+unorm8(float v) {
+	return v > 0.0f ? (v < 1.0f ? (uint8)(v * 255.0f + 0.5f) : 0xFF) : 0;
+}
+
+/*
+ * half floats, rounded to the nearest even. rows are converted 8 values
+ * at a time with F16C on the CPUs that have it, whatever the build targets
+ */
+static inline uint16
+half_from_float(float f) {
+	uint32	x, sign, h, rem, shift;
+
+	memcpy(&x, &f, sizeof(x));
+	sign	= (x >> 16) & 0x8000;
+	x		&= 0x7FFFFFFF;
+
+	if( x >= 0x7F800000 ) return (uint16)(sign | (x > 0x7F800000 ? 0x7E00 : 0x7C00));	/* NaN stays quiet */
+	if( x >= 0x477FF000 ) return (uint16)(sign | 0x7C00);	/* 65520 and up round to infinity */
+	if( x <= 0x33000000 ) return (uint16)sign;			/* 2^-25 and below round to zero */
+
+	if( x < 0x38800000 ) {
+		/* subnormal half: the mantissa with its implicit bit, in units of 2^-24 */
+		shift	= 126 - (x >> 23);
+		x		= (x & 0x7FFFFF) | 0x800000;
+		h		= x >> shift;
+		rem		= x & ((1u << shift) - 1);
+		if( rem > (1u << (shift - 1)) || (rem == (1u << (shift - 1)) && (h & 1)) ) ++h;
+		return (uint16)(sign | h);
+	}
+
+	/* rebias the exponent, a carry out of the mantissa correctly bumps it */
+	x	-= 0x38000000;
+	h	= x >> 13;
+	rem	= x & 0x1FFF;
+	if( rem > 0x1000 || (rem == 0x1000 && (h & 1)) ) ++h;
+	return (uint16)(sign | h);
+}
+
+static inline float
+float_from_half(uint16 h) {
+	uint32	sign	= (uint32)(h & 0x8000) << 16;
+	uint32	e		= (h >> 10) & 0x1F;
+	uint32	m		= h & 0x3FF;
+	uint32	x;
+	float	f;
+
+	if( e == 0x1F ) {
+		x	= sign | 0x7F800000 | (m << 13);
+	} else if( e ) {
+		x	= sign | ((e + 112) << 23) | (m << 13);
+	} else {
+		f	= (float)m * (1.0f / 16777216.0f);
+		memcpy(&x, &f, sizeof(x));
+		x	|= sign;
+	}
+
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+#if defined(IMAGE_F16C)
+static inline bool
+has_f16c(void) {
+#if defined(__F16C__)
+	return true;
+#else
+	return __builtin_cpu_supports("f16c") != 0;
+#endif
+}
+
+/* the 8 value blocks of a row, the count converted */
+__attribute__((target("avx,f16c")))
+static uint32
+half_to_float_f16c(float* d, const uint16* s, uint32 count) {
+	uint32	i	= 0;
+	for( ; i + 8 <= count; i += 8 ) {
+		_mm256_storeu_ps(d + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(s + i))));
+	}
+	return i;
+}
+
+__attribute__((target("avx,f16c")))
+static uint32
+float_to_half_f16c(uint16* d, const float* s, uint32 count) {
+	uint32	i	= 0;
+	for( ; i + 8 <= count; i += 8 ) {
+		_mm_storeu_si128((__m128i*)(d + i), _mm256_cvtps_ph(_mm256_loadu_ps(s + i), _MM_FROUND_TO_NEAREST_INT));
+	}
+	return i;
+}
+#endif
+
+static void
+half_to_float_row(float* d, const uint16* s, uint32 count) {
+	uint32	i	= 0;
+#if defined(IMAGE_F16C)
+	if( has_f16c() ) i = half_to_float_f16c(d, s, count);
+#endif
+	for( ; i < count; ++i ) {
+		d[i]	= float_from_half(s[i]);
+	}
+}
+
+static void
+float_to_half_row(uint16* d, const float* s, uint32 count) {
+	uint32	i	= 0;
+#if defined(IMAGE_F16C)
+	if( has_f16c() ) i = float_to_half_f16c(d, s, count);
+#endif
+	for( ; i < count; ++i ) {
+		d[i]	= half_from_float(s[i]);
+	}
+}
 
 static inline void
 set_pixelb_a8(void* img, color4b_t col) {
@@ -100,28 +360,71 @@ set_pixelb_r8g8b8a8(void* img, color4b_t col) {
 	d[3]	= col.a;
 }
 
+static inline void
+set_pixelb_rgba16f(void* img, color4b_t col) {
+	uint16*	d	= (uint16*)img;
+	d[0]	= half_from_float((float)col.r / 255.0f);
+	d[1]	= half_from_float((float)col.g / 255.0f);
+	d[2]	= half_from_float((float)col.b / 255.0f);
+	d[3]	= half_from_float((float)col.a / 255.0f);
+}
+
+static inline void
+set_pixelb_rgba32f(void* img, color4b_t col) {
+	float*	d	= (float*)img;
+	d[0]	= (float)col.r / 255.0f;
+	d[1]	= (float)col.g / 255.0f;
+	d[2]	= (float)col.b / 255.0f;
+	d[3]	= (float)col.a / 255.0f;
+}
+
 static inline void
 set_pixelf_a8(void* img, color4_t col) {
 	uint8*	d	= (uint8*)img;
-	d[0]	= (uint8)(col.a * 255.0f);
+	d[0]	= unorm8(col.a);
 }
 
 static inline void
 set_pixelf_r8g8b8(void* img, color4_t col) {
 	uint8*	d	= (uint8*)img;
-	d[0]	= (uint8)(col.r * 255.0f);
-	d[1]	= (uint8)(col.g * 255.0f);
-	d[2]	= (uint8)(col.b * 255.0f);
+	d[0]	= unorm8(col.r);
+	d[1]	= unorm8(col.g);
+	d[2]	= unorm8(col.b);
 }
 
 static inline void
 set_pixelf_r8g8b8a8(void* img, color4_t col) {
 	uint8*	d	= (uint8*)img;
-	color4b_t	rgba	= color4b((uint8)(col.r * 255.0f), (uint8)(col.g * 255.0f), (uint8)(col.b * 255.0f), (uint8)(col.a * 255.0f));
-	d[0]	= rgba.r;
-	d[1]	= rgba.g;
-	d[2]	= rgba.b;
-	d[3]	= rgba.a;
+	d[0]	= unorm8(col.r);
+	d[1]	= unorm8(col.g);
+	d[2]	= unorm8(col.b);
+	d[3]	= unorm8(col.a);
+}
+
+static inline void
+set_pixelf_rgba16f(void* img, color4_t col) {
+	uint16*	d	= (uint16*)img;
+	d[0]	= half_from_float(col.r);
+	d[1]	= half_from_float(col.g);
+	d[2]	= half_from_float(col.b);
+	d[3]	= half_from_float(col.a);
+}
+
+static inline void
+set_pixelf_rgba32f(void* img, color4_t col) {
+	float*	d	= (float*)img;
+	d[0]	= col.r;
+	d[1]	= col.g;
+	d[2]	= col.b;
+	d[3]	= col.a;
+}
+
+/* PF_I8 version of an RGBA8 image, which is released */
+static image_t*
+quantize_and_release(image_t* rgba) {
+	image_t*	img	= image_quantize(rgba, IMAGE_PALETTE_MAX, NULL);
+	image_release(rgba);
+	return img;
 }
 
 image_t*
@@ -129,18 +432,32 @@ image_initb(uint32 width, uint32 height, PIXEL_FORMAT fmt, void* initial_state,
 	void*		state	= initial_state;
 	image_t*	img	= image_allocate(width, height, fmt);
 	uint32		pixel_size	= 0;
-	uint8*		data	= (uint8*)img->pixels;
+	uint8*		data;
 	pixel_setb_fun_t	fun	= NULL;
 
+	if( NULL == img ) return NULL;
+	data	= (uint8*)img->pixels;
+
 	switch(fmt) {
 	case PF_A8:			pixel_size	= 1; fun	= set_pixelb_a8;		break;
 	case PF_R8G8B8:		pixel_size	= 3; fun	= set_pixelb_r8g8b8;	break;
 	case PF_R8G8B8A8:	pixel_size	= 4; fun	= set_pixelb_r8g8b8a8;	break;
+	case PF_R16G16B16A16F:	pixel_size	= 8; fun	= set_pixelb_rgba16f;	break;
+	case PF_R32G32B32A32F:	pixel_size	= 16; fun	= set_pixelb_rgba32f;	break;
+	case PF_I8:
+		/* the colours are only known at the end, filled as RGBA8 then quantized */
+		image_release(img);
+		img	= image_initb(width, height, PF_R8G8B8A8, initial_state, filler);
+		return img ? quantize_and_release(img) : NULL;
+	default:
+		fprintf(stderr, "ERROR: image_initb: unsupported format 0x%X\n", fmt);
+		image_release(img);
+		return NULL;
 	}
 
 	for( uint32 y = 0; y < height; ++y ) {
 		for( uint32 x = 0; x < width; ++x ) {
-			uint32		offset	= (x + y * width) * pixel_size;
+			size_t		offset	= ((size_t)y * width + x) * pixel_size;
 			color4b_t	col	= filler(state, x, y);
 			fun(&data[offset], col);
 		}
@@ -154,18 +471,31 @@ image_initf(uint32 width, uint32 height, PIXEL_FORMAT fmt, void* initial_state,
 	void*		state	= initial_state;
 	image_t*	img	= image_allocate(width, height, fmt);
 	uint32		pixel_size	= 0;
-	uint8*		data	= (uint8*)img->pixels;
+	uint8*		data;
 	pixel_setf_fun_t	fun	= NULL;
 
+	if( NULL == img ) return NULL;
+	data	= (uint8*)img->pixels;
+
 	switch(fmt) {
 	case PF_A8:			pixel_size	= 1; fun	= set_pixelf_a8;		break;
 	case PF_R8G8B8:		pixel_size	= 3; fun	= set_pixelf_r8g8b8;	break;
 	case PF_R8G8B8A8:	pixel_size	= 4; fun	= set_pixelf_r8g8b8a8;	break;
+	case PF_R16G16B16A16F:	pixel_size	= 8; fun	= set_pixelf_rgba16f;	break;
+	case PF_R32G32B32A32F:	pixel_size	= 16; fun	= set_pixelf_rgba32f;	break;
+	case PF_I8:
+		image_release(img);
+		img	= image_initf(width, height, PF_R8G8B8A8, initial_state, filler);
+		return img ? quantize_and_release(img) : NULL;
+	default:
+		fprintf(stderr, "ERROR: image_initf: unsupported format 0x%X\n", fmt);
+		image_release(img);
+		return NULL;
 	}
 
 	for( uint32 y = 0; y < height; ++y ) {
 		for( uint32 x = 0; x < width; ++x ) {
-			uint32		offset	= (x + y * width) * pixel_size;
+			size_t		offset	= ((size_t)y * width + x) * pixel_size;
 			color4_t	col	= filler(state, x, y);
 			fun(&data[offset], col);
 		}
@@ -192,6 +522,18 @@ get_pixelb_r8g8b8a8(void* img) {
 	return color4b(pixels[0], pixels[1], pixels[2], pixels[3]);
 }
 
+static inline color4b_t
+get_pixelb_rgba16f(void* img) {
+	uint16*	p	= (uint16*)img;
+	return color4b(unorm8(float_from_half(p[0])), unorm8(float_from_half(p[1])), unorm8(float_from_half(p[2])), unorm8(float_from_half(p[3])));
+}
+
+static inline color4b_t
+get_pixelb_rgba32f(void* img) {
+	float*	p	= (float*)img;
+	return color4b(unorm8(p[0]), unorm8(p[1]), unorm8(p[2]), unorm8(p[3]));
+}
+
 static inline color4_t
 get_pixelf_a8(void* img) {
 	uint8*	pixels	= (uint8*)img;
@@ -210,6 +552,346 @@ get_pixelf_r8g8b8a8(void* img) {
 	return color4(((float)pixels[0]) / 255.0f, ((float)pixels[1]) / 255.0f, ((float)pixels[2]) / 255.0f, ((float)pixels[3]) / 255.0f);
 }
 
+static inline color4_t
+get_pixelf_rgba16f(void* img) {
+	uint16*	p	= (uint16*)img;
+	return color4(float_from_half(p[0]), float_from_half(p[1]), float_from_half(p[2]), float_from_half(p[3]));
+}
+
+static inline color4_t
+get_pixelf_rgba32f(void* img) {
+	float*	p	= (float*)img;
+	return color4(p[0], p[1], p[2], p[3]);
+}
+
+/* a palette entry as a float colour */
+static inline color4_t
+palette_colorf(color4b_t c) {
+	return color4((float)c.r / 255.0f, (float)c.g / 255.0f, (float)c.b / 255.0f, (float)c.a / 255.0f);
+}
+
+color4b_t
+image_get_pixelb(const image_t* img, uint32 x, uint32 y) {
+	uint8*	data	= (uint8*)img->pixels;
+	size_t	offset	= ((size_t)y * img->width + x) * pixel_size(img->format);
+
+	switch(img->format) {
+	case PF_A8:			return get_pixelb_a8(&data[offset]);
+	case PF_I8:			return img->palette[data[offset]];
+	case PF_R8G8B8:		return get_pixelb_r8g8b8(&data[offset]);
+	case PF_R8G8B8A8:	return get_pixelb_r8g8b8a8(&data[offset]);
+	case PF_R16G16B16A16F:	return get_pixelb_rgba16f(&data[offset]);
+	case PF_R32G32B32A32F:	return get_pixelb_rgba32f(&data[offset]);
+	default:
+		fprintf(stderr, "ERROR: image_get_pixelb: unsupported format 0x%X\n", img->format);
+		return color4b(0, 0, 0, 0);
+	}
+}
+
+void
+image_set_pixelb(image_t* img, uint32 x, uint32 y, color4b_t col) {
+	uint8*	data	= (uint8*)img->pixels;
+	size_t	offset	= ((size_t)y * img->width + x) * pixel_size(img->format);
+
+	switch(img->format) {
+	case PF_A8:			set_pixelb_a8(&data[offset], col);			break;
+	case PF_I8:			data[offset]	= nearest_index(img, col);	break;
+	case PF_R8G8B8:		set_pixelb_r8g8b8(&data[offset], col);		break;
+	case PF_R8G8B8A8:	set_pixelb_r8g8b8a8(&data[offset], col);	break;
+	case PF_R16G16B16A16F:	set_pixelb_rgba16f(&data[offset], col);	break;
+	case PF_R32G32B32A32F:	set_pixelb_rgba32f(&data[offset], col);	break;
+	default:
+		fprintf(stderr, "ERROR: image_set_pixelb: unsupported format 0x%X\n", img->format);
+		break;
+	}
+}
+
+color4_t
+image_get_pixelf(const image_t* img, uint32 x, uint32 y) {
+	uint8*	data	= (uint8*)img->pixels;
+	size_t	offset	= ((size_t)y * img->width + x) * pixel_size(img->format);
+
+	switch(img->format) {
+	case PF_A8:			return get_pixelf_a8(&data[offset]);
+	case PF_I8:			return palette_colorf(img->palette[data[offset]]);
+	case PF_R8G8B8:		return get_pixelf_r8g8b8(&data[offset]);
+	case PF_R8G8B8A8:	return get_pixelf_r8g8b8a8(&data[offset]);
+	case PF_R16G16B16A16F:	return get_pixelf_rgba16f(&data[offset]);
+	case PF_R32G32B32A32F:	return get_pixelf_rgba32f(&data[offset]);
+	default:
+		fprintf(stderr, "ERROR: image_get_pixelf: unsupported format 0x%X\n", img->format);
+		return color4(0.0f, 0.0f, 0.0f, 0.0f);
+	}
+}
+
+void
+image_set_pixelf(image_t* img, uint32 x, uint32 y, color4_t col) {
+	uint8*	data	= (uint8*)img->pixels;
+	size_t	offset	= ((size_t)y * img->width + x) * pixel_size(img->format);
+
+	switch(img->format) {
+	case PF_A8:			set_pixelf_a8(&data[offset], col);			break;
+	case PF_I8:			data[offset]	= nearest_index(img, color4b(unorm8(col.r), unorm8(col.g), unorm8(col.b), unorm8(col.a)));	break;
+	case PF_R8G8B8:		set_pixelf_r8g8b8(&data[offset], col);		break;
+	case PF_R8G8B8A8:	set_pixelf_r8g8b8a8(&data[offset], col);	break;
+	case PF_R16G16B16A16F:	set_pixelf_rgba16f(&data[offset], col);	break;
+	case PF_R32G32B32A32F:	set_pixelf_rgba32f(&data[offset], col);	break;
+	default:
+		fprintf(stderr, "ERROR: image_set_pixelf: unsupported format 0x%X\n", img->format);
+		break;
+	}
+}
+
+/*
+ * blitting
+ */
+static inline pixel_getb_fun_t
+getb_fun(PIXEL_FORMAT fmt) {
+	switch(fmt) {
+	case PF_A8:			return get_pixelb_a8;
+	case PF_R8G8B8:		return get_pixelb_r8g8b8;
+	case PF_R8G8B8A8:	return get_pixelb_r8g8b8a8;
+	case PF_R16G16B16A16F:	return get_pixelb_rgba16f;
+	case PF_R32G32B32A32F:	return get_pixelb_rgba32f;
+	default:			return NULL;
+	}
+}
+
+static inline pixel_getf_fun_t
+getf_fun(PIXEL_FORMAT fmt) {
+	switch(fmt) {
+	case PF_A8:			return get_pixelf_a8;
+	case PF_R8G8B8:		return get_pixelf_r8g8b8;
+	case PF_R8G8B8A8:	return get_pixelf_r8g8b8a8;
+	case PF_R16G16B16A16F:	return get_pixelf_rgba16f;
+	case PF_R32G32B32A32F:	return get_pixelf_rgba32f;
+	default:			return NULL;
+	}
+}
+
+static inline pixel_setb_fun_t
+setb_fun(PIXEL_FORMAT fmt) {
+	switch(fmt) {
+	case PF_A8:			return set_pixelb_a8;
+	case PF_R8G8B8:		return set_pixelb_r8g8b8;
+	case PF_R8G8B8A8:	return set_pixelb_r8g8b8a8;
+	case PF_R16G16B16A16F:	return set_pixelb_rgba16f;
+	case PF_R32G32B32A32F:	return set_pixelb_rgba32f;
+	default:			return NULL;
+	}
+}
+
+static inline pixel_setf_fun_t
+setf_fun(PIXEL_FORMAT fmt) {
+	switch(fmt) {
+	case PF_A8:			return set_pixelf_a8;
+	case PF_R8G8B8:		return set_pixelf_r8g8b8;
+	case PF_R8G8B8A8:	return set_pixelf_r8g8b8a8;
+	case PF_R16G16B16A16F:	return set_pixelf_rgba16f;
+	case PF_R32G32B32A32F:	return set_pixelf_rgba32f;
+	default:			return NULL;
+	}
+}
+
+/* one texel between formats, indexed ones go through their palette */
+static inline void
+convert_pixel(const image_t* dst, uint8* d, pixel_setb_fun_t set, const image_t* src, const uint8* s, pixel_getb_fun_t get) {
+	color4b_t	col	= get ? get((void*)s) : src->palette[s[0]];
+	if( set ) {
+		set(d, col);
+	} else {
+		d[0]	= nearest_index(dst, col);
+	}
+}
+
+/* same through floats, so that float formats keep their range and precision */
+static inline void
+convert_pixelf(const image_t* dst, uint8* d, pixel_setf_fun_t set, const image_t* src, const uint8* s, pixel_getf_fun_t get) {
+	color4_t	col	= get ? get((void*)s) : palette_colorf(src->palette[s[0]]);
+	if( set ) {
+		set(d, col);
+	} else {
+		d[0]	= nearest_index(dst, color4b(unorm8(col.r), unorm8(col.g), unorm8(col.b), unorm8(col.a)));
+	}
+}
+
+/* a row of 'count' texels between the two float formats */
+static inline void
+convert_float_row(uint8* d, PIXEL_FORMAT dfmt, const uint8* s, uint32 count) {
+	if( dfmt == PF_R32G32B32A32F ) {
+		half_to_float_row((float*)d, (const uint16*)s, count * 4);
+	} else {
+		float_to_half_row((uint16*)d, (const float*)s, count * 4);
+	}
+}
+
+/*
+ * the destination index of each source one when both images are indexed
+ * and the destination has a palette of its own. false when the indices
+ * copy as is
+ */
+static bool
+index_lut(const image_t* dst, const image_t* src, uint8* lut) {
+	uint32	i;
+
+	if( src->format != PF_I8 || dst->format != PF_I8 || dst->palette_size == 0 ) return false;
+	if( src->palette_size == dst->palette_size && memcmp(src->palette, dst->palette, sizeof(color4b_t) * src->palette_size) == 0 ) return false;
+
+	/* indices past the source palette read as its zeroed entries */
+	for( i = 0; i < IMAGE_PALETTE_MAX; ++i ) {
+		lut[i]	= nearest_index(dst, src->palette[i]);
+	}
+
+	return true;
+}
+
+/* same format regions are copied as is, indexed ones through index_lut */
+void
+image_blit(image_t* dst, uint32 dx, uint32 dy, const image_t* src, uint32 sx, uint32 sy, uint32 width, uint32 height) {
+	uint32			sps		= pixel_size(src->format);
+	uint32			dps		= pixel_size(dst->format);
+	const uint8*	sdata	= (const uint8*)src->pixels;
+	uint8*			ddata	= (uint8*)dst->pixels;
+	uint8			lut[IMAGE_PALETTE_MAX];
+	uint32			y;
+
+	assert( sps != 0 && dps != 0 );
+	assert( sx + width <= src->width && sy + height <= src->height );
+	assert( dx + width <= dst->width && dy + height <= dst->height );
+
+	if( index_lut(dst, src, lut) ) {
+		for( y = 0; y < height; ++y ) {
+			const uint8*	s	= &sdata[(size_t)(sy + y) * src->width + sx];
+			uint8*			d	= &ddata[(size_t)(dy + y) * dst->width + dx];
+			uint32			x;
+			for( x = 0; x < width; ++x ) {
+				d[x]	= lut[s[x]];
+			}
+		}
+	} else if( src->format == dst->format ) {
+		for( y = 0; y < height; ++y ) {
+			memcpy(&ddata[((size_t)(dy + y) * dst->width + dx) * dps], &sdata[((size_t)(sy + y) * src->width + sx) * sps], width * sps);
+		}
+	} else if( is_float(src->format) && is_float(dst->format) ) {
+		for( y = 0; y < height; ++y ) {
+			convert_float_row(&ddata[((size_t)(dy + y) * dst->width + dx) * dps], dst->format, &sdata[((size_t)(sy + y) * src->width + sx) * sps], width);
+		}
+	} else if( is_float(src->format) || is_float(dst->format) ) {
+		pixel_getf_fun_t	get	= getf_fun(src->format);
+		pixel_setf_fun_t	set	= setf_fun(dst->format);
+
+		for( y = 0; y < height; ++y ) {
+			const uint8*	s	= &sdata[((size_t)(sy + y) * src->width + sx) * sps];
+			uint8*			d	= &ddata[((size_t)(dy + y) * dst->width + dx) * dps];
+			uint32			x;
+			for( x = 0; x < width; ++x ) {
+				convert_pixelf(dst, &d[x * dps], set, src, &s[x * sps], get);
+			}
+		}
+	} else {
+		pixel_getb_fun_t	get	= getb_fun(src->format);
+		pixel_setb_fun_t	set	= setb_fun(dst->format);
+
+		for( y = 0; y < height; ++y ) {
+			const uint8*	s	= &sdata[((size_t)(sy + y) * src->width + sx) * sps];
+			uint8*			d	= &ddata[((size_t)(dy + y) * dst->width + dx) * dps];
+			uint32			x;
+			for( x = 0; x < width; ++x ) {
+				convert_pixel(dst, &d[x * dps], set, src, &s[x * sps], get);
+			}
+		}
+	}
+}
+
+#define BLIT_TILE	16
+
+#if defined(__SSE2__)
+/* transpose a 4x4 block of 32 bit pixels */
+static inline void
+transpose4x4_32(const uint8* s, size_t sstride, uint8* d, size_t dstride) {
+	__m128	r0	= _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(s)));
+	__m128	r1	= _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(s + sstride)));
+	__m128	r2	= _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(s + sstride * 2)));
+	__m128	r3	= _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(s + sstride * 3)));
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_si128((__m128i*)(d), _mm_castps_si128(r0));
+	_mm_storeu_si128((__m128i*)(d + dstride), _mm_castps_si128(r1));
+	_mm_storeu_si128((__m128i*)(d + dstride * 2), _mm_castps_si128(r2));
+	_mm_storeu_si128((__m128i*)(d + dstride * 3), _mm_castps_si128(r3));
+}
+#endif
+
+void
+image_blit_transposed(image_t* dst, uint32 dx, uint32 dy, const image_t* src, uint32 sx, uint32 sy, uint32 width, uint32 height) {
+	uint32				sps		= pixel_size(src->format);
+	uint32				dps		= pixel_size(dst->format);
+	size_t				sstride	= (size_t)src->width * sps;
+	size_t				dstride	= (size_t)dst->width * dps;
+	const uint8*		sdata	= (const uint8*)src->pixels + sy * sstride + sx * sps;
+	uint8*				ddata	= (uint8*)dst->pixels + dy * dstride + dx * dps;
+	pixel_getb_fun_t	get		= getb_fun(src->format);
+	pixel_setb_fun_t	set		= setb_fun(dst->format);
+	pixel_getf_fun_t	getf	= getf_fun(src->format);
+	pixel_setf_fun_t	setf	= setf_fun(dst->format);
+	bool				floats	= is_float(src->format) || is_float(dst->format);
+	uint8				lut[IMAGE_PALETTE_MAX];
+	bool				remap	= index_lut(dst, src, lut);
+	uint32				tx, ty;
+
+	assert( sps != 0 && dps != 0 );
+	assert( sx + width <= src->width && sy + height <= src->height );
+	assert( dx + height <= dst->width && dy + width <= dst->height );
+
+	/* source (x, y) goes to destination (y, x), walked in tiles to keep both sides in cache */
+	for( ty = 0; ty < height; ty += BLIT_TILE ) {
+		uint32	th	= height - ty < BLIT_TILE ? height - ty : BLIT_TILE;
+		for( tx = 0; tx < width; tx += BLIT_TILE ) {
+			uint32	tw	= width - tx < BLIT_TILE ? width - tx : BLIT_TILE;
+			uint32	x, y;
+
+#if defined(__SSE2__)
+			if( sps == 4 && src->format == dst->format && tw == BLIT_TILE && th == BLIT_TILE ) {
+				for( y = 0; y < BLIT_TILE; y += 4 ) {
+					for( x = 0; x < BLIT_TILE; x += 4 ) {
+						transpose4x4_32(&sdata[(ty + y) * sstride + (tx + x) * 4], sstride,
+										&ddata[(tx + x) * dstride + (ty + y) * 4], dstride);
+					}
+				}
+				continue;
+			}
+#endif
+
+			if( remap ) {
+				for( y = 0; y < th; ++y ) {
+					const uint8*	s	= &sdata[(ty + y) * sstride + tx];
+					for( x = 0; x < tw; ++x ) {
+						ddata[(tx + x) * dstride + ty + y]	= lut[s[x]];
+					}
+				}
+			} else if( src->format == dst->format ) {
+				for( y = 0; y < th; ++y ) {
+					const uint8*	s	= &sdata[(ty + y) * sstride + tx * sps];
+					for( x = 0; x < tw; ++x ) {
+						memcpy(&ddata[(tx + x) * dstride + (ty + y) * dps], &s[x * sps], sps);
+					}
+				}
+			} else {
+				for( y = 0; y < th; ++y ) {
+					const uint8*	s	= &sdata[(ty + y) * sstride + tx * sps];
+					for( x = 0; x < tw; ++x ) {
+						uint8*	d	= &ddata[(tx + x) * dstride + (ty + y) * dps];
+						if( floats ) {
+							convert_pixelf(dst, d, setf, src, &s[x * sps], getf);
+						} else {
+							convert_pixel(dst, d, set, src, &s[x * sps], get);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
 void*
 image_foldb(const image_t* img, void* initial_state, image_foldb_fun_t f) {
 	void*				state	= initial_state;
@@ -222,14 +904,20 @@ image_foldb(const image_t* img, void* initial_state, image_foldb_fun_t f) {
 
 	switch(img->format) {
 	case PF_A8:			pixel_size	= 1; fun	= get_pixelb_a8;		break;
+	case PF_I8:			pixel_size	= 1; fun	= NULL;					break;
 	case PF_R8G8B8:		pixel_size	= 3; fun	= get_pixelb_r8g8b8;	break;
 	case PF_R8G8B8A8:	pixel_size	= 4; fun	= get_pixelb_r8g8b8a8;	break;
+	case PF_R16G16B16A16F:	pixel_size	= 8; fun	= get_pixelb_rgba16f;	break;
+	case PF_R32G32B32A32F:	pixel_size	= 16; fun	= get_pixelb_rgba32f;	break;
+	default:
+		fprintf(stderr, "ERROR: image_foldb: unsupported format 0x%X\n", img->format);
+		return state;
 	}
 
 	for( uint32 y = 0; y < height; ++y ) {
 		for( uint32 x = 0; x < width; ++x ) {
-			uint32	offset	= (x + y * width) * pixel_size;
-			col		= fun(&data[offset]);
+			size_t	offset	= ((size_t)y * width + x) * pixel_size;
+			col		= fun ? fun(&data[offset]) : img->palette[data[offset]];
 			state	= f(state, x, y, col);
 		}
 	}
@@ -249,14 +937,20 @@ image_foldf(const image_t* img, void* initial_state, image_foldf_fun_t f) {
 
 	switch(img->format) {
 	case PF_A8:			pixel_size	= 1; fun	= get_pixelf_a8;		break;
+	case PF_I8:			pixel_size	= 1; fun	= NULL;					break;
 	case PF_R8G8B8:		pixel_size	= 3; fun	= get_pixelf_r8g8b8;	break;
 	case PF_R8G8B8A8:	pixel_size	= 4; fun	= get_pixelf_r8g8b8a8;	break;
+	case PF_R16G16B16A16F:	pixel_size	= 8; fun	= get_pixelf_rgba16f;	break;
+	case PF_R32G32B32A32F:	pixel_size	= 16; fun	= get_pixelf_rgba32f;	break;
+	default:
+		fprintf(stderr, "ERROR: image_foldf: unsupported format 0x%X\n", img->format);
+		return state;
 	}
 
 	for( uint32 y = 0; y < height; ++y ) {
 		for( uint32 x = 0; x < width; ++x ) {
-			uint32	offset	= (x + y * width) * pixel_size;
-			col		= fun(&data[offset]);
+			size_t	offset	= ((size_t)y * width + x) * pixel_size;
+			col		= fun ? fun(&data[offset]) : palette_colorf(img->palette[data[offset]]);
 			state	= f(state, x, y, col);
 		}
 	}
@@ -266,7 +960,184 @@ image_foldf(const image_t* img, void* initial_state, image_foldf_fun_t f) {
 
 void
 image_release(image_t* img) {
-	free(img->pixels);
+	free(img->palette);
+	if( !img->borrowed ) free(img->pixels);
 	free(img);
 }
 
+
+/*
+ * alpha bounding box
+ */
+
+/* bit i set when pixel i of the next group has a non-zero alpha */
+static inline uint32
+opaque_mask(const uint8* p, PIXEL_FORMAT fmt) {
+#if defined(__SSE2__)
+	__m128i	v	= _mm_loadu_si128((const __m128i*)p);
+	if( fmt == PF_R8G8B8A8 ) {
+		v	= _mm_and_si128(v, _mm_set1_epi32((int)0xFF000000));
+		return ~(uint32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, _mm_setzero_si128()))) & 0xF;
+	} else {
+		return ~(uint32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) & 0xFFFF;
+	}
+#else
+	uint32	mask	= 0;
+	uint32	i;
+	if( fmt == PF_R8G8B8A8 ) {
+		for( i = 0; i < 4; ++i ) mask |= (p[i * 4 + 3] != 0) << i;
+	} else {
+		for( i = 0; i < 16; ++i ) mask |= (p[i] != 0) << i;
+	}
+	return mask;
+#endif
+}
+
+/* first pixel in [from, to) with a non-zero alpha, 'to' if there is none */
+static uint32
+scan_forward(const uint8* row, uint32 from, uint32 to, PIXEL_FORMAT fmt) {
+	uint32	ps		= pixel_size(fmt);
+	uint32	group	= 16 / ps;
+	uint32	x		= from;
+
+	for( ; x + group <= to; x += group ) {
+		uint32	mask	= opaque_mask(&row[x * ps], fmt);
+		if( mask ) {
+			while( !(mask & 1) ) { mask >>= 1; ++x; }
+			return x;
+		}
+	}
+
+	for( ; x < to; ++x ) {
+		if( row[x * ps + ps - 1] ) return x;
+	}
+
+	return to;
+}
+
+/* one past the last pixel in [from, to) with a non-zero alpha, 'from' if there is none */
+static uint32
+scan_backward(const uint8* row, uint32 from, uint32 to, PIXEL_FORMAT fmt) {
+	uint32	ps		= pixel_size(fmt);
+	uint32	group	= 16 / ps;
+	uint32	x		= to;
+
+	for( ; x >= from + group; x -= group ) {
+		uint32	mask	= opaque_mask(&row[(x - group) * ps], fmt);
+		if( mask ) {
+			uint32	top	= 1u << (group - 1);
+			while( !(mask & top) ) { mask <<= 1; --x; }
+			return x;
+		}
+	}
+
+	for( ; x > from; --x ) {
+		if( row[(x - 1) * ps + ps - 1] ) return x;
+	}
+
+	return from;
+}
+
+/* non-zero alpha of texel c of a PF_I8 or float row, 'opaque' tells the palette entries apart */
+static inline bool
+texel_opaque(PIXEL_FORMAT fmt, const uint8* row, uint32 c, const uint8* opaque) {
+	uint32	bits;
+
+	switch(fmt) {
+	case PF_I8:
+		return opaque[row[c]] != 0;
+	case PF_R16G16B16A16F:
+		return (((const uint16*)row)[c * 4 + 3] & 0x7FFF) != 0;
+	default:
+		memcpy(&bits, &row[c * 16 + 12], sizeof(bits));
+		return (bits & 0x7FFFFFFF) != 0;
+	}
+}
+
+/* same for PF_I8, through the alpha of the palette entries, and for the float formats */
+static bool
+texel_alpha_bounds(const image_t* img, uint32* x, uint32* y, uint32* width, uint32* height) {
+	const uint8*	data	= (const uint8*)img->pixels;
+	size_t			stride	= (size_t)img->width * pixel_size(img->format);
+	uint8			opaque[IMAGE_PALETTE_MAX];
+	uint32			left	= img->width, right = 0, top = img->height, bottom = 0;
+	uint32			r, c;
+
+	for( c = 0; c < IMAGE_PALETTE_MAX; ++c ) {
+		opaque[c]	= img->palette && img->palette[c].a != 0;
+	}
+
+	for( r = 0; r < img->height; ++r ) {
+		const uint8*	row	= &data[(size_t)r * stride];
+		for( c = 0; c < img->width; ++c ) {
+			if( !texel_opaque(img->format, row, c, opaque) ) continue;
+			if( c < left ) left = c;
+			if( c + 1 > right ) right = c + 1;
+			if( r < top ) top = r;
+			bottom	= r + 1;
+		}
+	}
+
+	if( bottom == 0 ) {
+		*x = *y = *width = *height = 0;
+		return false;
+	}
+
+	*x		= left;
+	*y		= top;
+	*width	= right - left;
+	*height	= bottom - top;
+	return true;
+}
+
+bool
+image_alpha_bounds(const image_t* img, uint32* x, uint32* y, uint32* width, uint32* height) {
+	const uint8*	data	= (const uint8*)img->pixels;
+	size_t			stride	= (size_t)img->width * pixel_size(img->format);
+	uint32			top, bottom, left, right;
+	uint32			r;
+
+	if( img->format == PF_I8 || is_float(img->format) ) {
+		return texel_alpha_bounds(img, x, y, width, height);
+	}
+
+	if( img->format != PF_A8 && img->format != PF_R8G8B8A8 ) {
+		/* no alpha, or block compressed: everything counts */
+		*x		= 0;
+		*y		= 0;
+		*width	= img->width;
+		*height	= img->height;
+		return img->width && img->height;
+	}
+
+	/* first and last rows that are not fully transparent */
+	for( top = 0; top < img->height; ++top ) {
+		if( scan_forward(&data[top * stride], 0, img->width, img->format) != img->width ) break;
+	}
+
+	if( top == img->height ) {
+		*x = *y = *width = *height = 0;
+		return false;
+	}
+
+	for( bottom = img->height; bottom > top + 1; --bottom ) {
+		if( scan_forward(&data[(bottom - 1) * stride], 0, img->width, img->format) != img->width ) break;
+	}
+
+	/* columns: each row only needs to look outside the current span */
+	left	= img->width;
+	right	= 0;
+	for( r = top; r < bottom; ++r ) {
+		const uint8*	row	= &data[r * stride];
+		uint32			l	= scan_forward(row, 0, left, img->format);
+		uint32			rr	= scan_backward(row, right, img->width, img->format);
+		if( l < left ) left = l;
+		if( rr > right ) right = rr;
+	}
+
+	*x		= left;
+	*y		= top;
+	*width	= right - left;
+	*height	= bottom - top;
+	return true;
+}
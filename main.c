@@ -1,6 +1,21 @@
+#define _POSIX_C_SOURCE 200112L
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
 #include <png.h>
 #include "atlas.h"
+#include "stb/stb_rect_pack.h"
 
 image_t*
 image_load_png(const char* path) {
@@ -25,6 +40,8 @@ image_load_png(const char* path) {
 		return NULL;
 	}
 
+	atlas_trace_begin("image_load_png");
+
 	/* Create and initialize the png_struct
 	* with the desired error handler
 	* functions. If you want to use the
@@ -41,6 +58,8 @@ image_load_png(const char* path) {
 		fclose(fp);
 
 		fprintf(stderr, "ERROR: load_png: %s: invalid PNG format\n", path);
+		atlas_trace_end("image_load_png");
+		return NULL;
 	}
 
 	/* Allocate/initialize the memory
@@ -51,6 +70,7 @@ image_load_png(const char* path) {
 		png_destroy_read_struct(&png_ptr, NULL, NULL);
 
 		fprintf(stderr, "ERROR: load_png: %s: not enough memory or format not supported\n", path);
+		atlas_trace_end("image_load_png");
 		return NULL;
 	}
 
@@ -71,6 +91,7 @@ image_load_png(const char* path) {
 		/* If we get here, we had a
 			* problem reading the file */
 		fprintf(stderr, "ERROR: load_png: inconsistant file %s\n", path);
+		atlas_trace_end("image_load_png");
 		return NULL;
 	}
 
@@ -107,10 +128,14 @@ image_load_png(const char* path) {
 
 	switch( color_type ) {
 	case PNG_COLOR_TYPE_GRAY:
-	case PNG_COLOR_TYPE_GRAY_ALPHA:
 		sf	= PF_A8;
 		pixel_size	= 1;
 		break;
+	case PNG_COLOR_TYPE_GRAY_ALPHA:
+		/* gray and alpha pairs, widened to RGBA while copying the rows */
+		sf	= PF_R8G8B8A8;
+		pixel_size	= 4;
+		break;
 	case PNG_COLOR_TYPE_RGB:
 		sf	= PF_R8G8B8;
 		pixel_size	= 3;
@@ -132,17 +157,31 @@ image_load_png(const char* path) {
 		/* Close the file */
 		fclose(fp);
 
+		atlas_trace_end("image_load_png");
 		return tex;
 	}
 
-	buff			= (char*)tex->pixels;
+	buff			= (char*)image_pixels(tex);
 	row_pointers	= png_get_rows(png_ptr, info_ptr);
 
 	for( r = 0; r < height; r++ ) {
 		// note that png is ordered top to
 		// bottom, but OpenGL expect it bottom to top
 		// so the order or swapped
-		memcpy(&(buff[width_size * r]), row_pointers[r], width_size);
+		if( color_type == PNG_COLOR_TYPE_GRAY_ALPHA ) {
+			uint8*			dst	= (uint8*)&buff[width_size * r];
+			const png_byte*	src	= row_pointers[r];
+			uint32			c;
+
+			for( c = 0; c < width; ++c ) {
+				dst[c * 4]		= src[c * 2];
+				dst[c * 4 + 1]	= src[c * 2];
+				dst[c * 4 + 2]	= src[c * 2];
+				dst[c * 4 + 3]	= src[c * 2 + 1];
+			}
+		} else {
+			memcpy(&(buff[width_size * r]), row_pointers[r], width_size);
+		}
 	}
 
 	/* Clean up after the read,
@@ -151,11 +190,3565 @@ image_load_png(const char* path) {
 	/* Close the file */
 	fclose(fp);
 
+	atlas_trace_end("image_load_png");
 	return tex;
 }
 
-int main(int argc, char *argv[])
-{
-	printf("Hello World!\n");
-	return 0;
+static double
+now_ms(void) {
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+/* xorshift, so that every run packs the same data */
+static uint32	rng_state	= 0x12345678;
+
+static uint32
+rng_next(void) {
+	rng_state	^= rng_state << 13;
+	rng_state	^= rng_state >> 17;
+	rng_state	^= rng_state << 5;
+	return rng_state;
+}
+
+static uint32
+rng_range(uint32 lo, uint32 hi) {
+	return lo + rng_next() % (hi - lo + 1);
+}
+
+/* every rect packed, inside the target and not overlapping any other */
+static bool
+check_packing(const stbrp_rect* rects, uint32 count, uint32 size) {
+	uint32*	coverage	= (uint32*)calloc(((size_t)size * size + 31) / 32, sizeof(uint32));
+	bool	ok			= true;
+	uint32	r;
+
+	for( r = 0; r < count && ok; ++r ) {
+		uint32	x, y;
+		if( !rects[r].was_packed || (uint32)rects[r].x + rects[r].w > size || (uint32)rects[r].y + rects[r].h > size ) {
+			fprintf(stderr, "ERROR: rect %u is not packed inside the target\n", r);
+			ok	= false;
+			break;
+		}
+
+		for( y = rects[r].y; y < (uint32)rects[r].y + rects[r].h && ok; ++y ) {
+			for( x = rects[r].x; x < (uint32)rects[r].x + rects[r].w; ++x ) {
+				size_t	bit	= (size_t)y * size + x;
+				if( coverage[bit / 32] & (1u << (bit % 32)) ) {
+					fprintf(stderr, "ERROR: rect %u overlaps another one at (%u, %u)\n", r, x, y);
+					ok	= false;
+					break;
+				}
+				coverage[bit / 32]	|= 1u << (bit % 32);
+			}
+		}
+	}
+
+	free(coverage);
+	return ok;
+}
+
+/* height then width descending, like stbrp_pack_rects */
+static const stbrp_rect*	sorted_rects	= NULL;
+
+static int
+compare_rect_order(const void* a, const void* b) {
+	const stbrp_rect*	p	= &sorted_rects[*(const sint32*)a];
+	const stbrp_rect*	q	= &sorted_rects[*(const sint32*)b];
+	if( p->h != q->h ) return p->h > q->h ? -1 : 1;
+	if( p->w != q->w ) return p->w > q->w ? -1 : 1;
+	return *(const sint32*)a - *(const sint32*)b;
+}
+
+/*
+ * pack glyph sized rects (8..48) filling 60% of 4096, 8192 and 16384
+ * targets, with the stb node list and with the skyline index, report the
+ * memory and the time each takes and check they place every rect the same
+ */
+static int
+bench_large(void) {
+	static const uint32	sizes[]	= { 4096, 8192, 16384 };
+	uint32	s;
+	int		ret	= 0;
+
+	printf("%8s %10s %12s %10s %12s %10s %14s\n", "size", "rects", "node bytes", "list ms", "index bytes", "index ms", "us per rect");
+	for( s = 0; s < sizeof(sizes) / sizeof(uint32); ++s ) {
+		uint32			size	= sizes[s];
+		uint64_t		target	= (uint64_t)size * size * 6 / 10;
+		uint64_t		area	= 0;
+		uint32			count	= 0;
+		uint32			cap		= (uint32)(target / 64);
+		stbrp_rect*		rects	= (stbrp_rect*)malloc(sizeof(stbrp_rect) * cap);
+		stbrp_rect*		copy	= (stbrp_rect*)malloc(sizeof(stbrp_rect) * cap);
+		sint32*			order	= (sint32*)malloc(sizeof(sint32) * cap);
+		stbrp_node*		nodes	= (stbrp_node*)malloc(sizeof(stbrp_node) * size * 2);
+		void*			index	= malloc((size_t)stbrp_index_size((int)size));
+		stbrp_context	ctx;
+		double			start, list_ms, index_ms;
+		uint32			r;
+
+		while( area < target && count < cap ) {
+			memset(&rects[count], 0, sizeof(stbrp_rect));
+			rects[count].id	= (int)count;
+			rects[count].w	= (stbrp_coord)rng_range(8, 48);
+			rects[count].h	= (stbrp_coord)rng_range(8, 48);
+			area	+= (uint64_t)rects[count].w * rects[count].h;
+			++count;
+		}
+
+		/* same order for both, so that only the search differs */
+		for( r = 0; r < count; ++r ) {
+			order[r]	= (sint32)r;
+		}
+		sorted_rects	= rects;
+		qsort(order, count, sizeof(sint32), compare_rect_order);
+		memcpy(copy, rects, sizeof(stbrp_rect) * count);
+
+		start	= now_ms();
+		stbrp_init_target(&ctx, (int)size, (int)size, nodes, (int)size * 2);
+		stbrp_pack_rects_ordered(&ctx, rects, order, (int)count);
+		list_ms	= now_ms() - start;
+
+		start	= now_ms();
+		stbrp_init_target(&ctx, (int)size, (int)size, nodes, 1);
+		stbrp_setup_index(&ctx, index);
+		stbrp_pack_rects_ordered(&ctx, copy, order, (int)count);
+		index_ms	= now_ms() - start;
+
+		printf("%8u %10u %12lu %10.1f %12d %10.1f %14.3f\n", size, count, (unsigned long)(sizeof(stbrp_node) * size * 2), list_ms, stbrp_index_size((int)size), index_ms, index_ms * 1000.0 / count);
+
+		if( !check_packing(rects, count, size) ) ret = 1;
+		for( r = 0; r < count && ret == 0; ++r ) {
+			if( copy[r].x != rects[r].x || copy[r].y != rects[r].y || copy[r].was_packed != rects[r].was_packed ) {
+				fprintf(stderr, "ERROR: rect %u is placed differently by the skyline index\n", r);
+				ret	= 1;
+			}
+		}
+
+		free(index);
+		free(nodes);
+		free(order);
+		free(copy);
+		free(rects);
+	}
+
+	return ret;
+}
+
+static color4b_t
+id_color(void* state, uint32 x, uint32 y) {
+	uint32	id	= (uint32)(uintptr_t)state;
+	(void)x;
+	(void)y;
+	return color4b((uint8)(id & 0xFF), (uint8)((id >> 8) & 0xFF), (uint8)((id >> 16) & 0xFF), 0xFF);
+}
+
+/* more than 65535 images must not alias: every one reads back its own id */
+static int
+test_large_ids(void) {
+	uint32			count	= 70000;
+	const image_t**	images	= (const image_t**)malloc(sizeof(image_t*) * count);
+	atlas_t*		atlas	= NULL;
+	int				ret		= 0;
+	uint32			i;
+
+	for( i = 0; i < count; ++i ) {
+		images[i]	= image_initb(1 + i % 3, 1 + i % 2, PF_R8G8B8A8, (void*)(uintptr_t)i, id_color);
+	}
+
+	atlas	= atlas_make(images, count);
+	if( NULL == atlas ) {
+		ret	= 1;
+	} else {
+		for( i = 0; i < count && ret == 0; ++i ) {
+			rect_t		r	= atlas_image_coordinates(atlas, i);
+			color4b_t	c	= image_get_pixelb(atlas_baked_image(atlas), (uint32)r.x, (uint32)r.y);
+			if( (uint32)c.r + ((uint32)c.g << 8) + ((uint32)c.b << 16) != i ) {
+				fprintf(stderr, "ERROR: image %u reads back as another image\n", i);
+				ret	= 1;
+			}
+		}
+
+		printf("%u images packed in %ux%u\n", count, image_width(atlas_baked_image(atlas)), image_height(atlas_baked_image(atlas)));
+		atlas_release(atlas);
+	}
+
+	for( i = 0; i < count; ++i ) {
+		image_release((image_t*)images[i]);
+	}
+	free(images);
+
+	return ret;
+}
+
+/* random pixels, RGBA8 ones get a random fully transparent border to trim */
+static image_t*
+random_image(uint32 max_side) {
+	static const PIXEL_FORMAT	formats[]	= { PF_A8, PF_R8G8B8, PF_R8G8B8A8, PF_R8G8B8A8 };
+	PIXEL_FORMAT	fmt		= formats[rng_next() % 4];
+	uint32			w		= rng_range(1, max_side);
+	uint32			h		= rng_range(1, max_side);
+	image_t*		img		= image_allocate(w, h, fmt);
+	uint8*			pixels	= (uint8*)image_pixels(img);
+	size_t			size	= image_data_size(img);
+	size_t			i;
+
+	for( i = 0; i < size; ++i ) {
+		pixels[i]	= (uint8)rng_next();
+	}
+
+	if( fmt == PF_R8G8B8A8 ) {
+		uint32	l	= rng_range(0, w / 3), r = rng_range(0, w / 3);
+		uint32	t	= rng_range(0, h / 3), b = rng_range(0, h / 3);
+		uint32	x, y;
+		for( y = 0; y < h; ++y ) {
+			for( x = 0; x < w; ++x ) {
+				if( x < l || x >= w - r || y < t || y >= h - b ) {
+					pixels[(y * w + x) * 4 + 3]	= 0;
+				}
+			}
+		}
+	}
+
+	return img;
+}
+
+static bool
+same_color(color4b_t a, color4b_t b) {
+	return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+/* a source texel against a baked one, as the baked format stores it */
+static bool
+same_texel(const image_t* src, uint32 u, uint32 v, const image_t* tex, uint32 x, uint32 y) {
+	PIXEL_FORMAT	fmt	= image_format(tex);
+	image_t*		one;
+	uint32			ps;
+	bool			same;
+
+	if( fmt != PF_R16G16B16A16F && fmt != PF_R32G32B32A32F ) {
+		return same_color(image_get_pixelb(src, u, v), image_get_pixelb(tex, x, y));
+	}
+
+	one		= image_allocate(1, 1, fmt);
+	ps		= image_data_size(one);
+	image_blit(one, 0, 0, src, u, v, 1, 1);
+	same	= memcmp(image_pixels(one), (const uint8*)image_pixels(tex) + ((size_t)y * image_width(tex) + x) * ps, ps) == 0;
+	image_release(one);
+	return same;
+}
+
+/*
+ * every image inside the texture, no two images overlapping, and every
+ * source pixel found back in the baked image (trimmed borders must be
+ * transparent). removed images are skipped
+ */
+static bool
+check_atlas(const atlas_t* atlas, const image_t** images, uint32 count) {
+	const image_t*	tex		= atlas_baked_image(atlas);
+	uint32			size	= image_width(tex);
+	uint32*			coverage	= (uint32*)calloc(((size_t)size * image_height(tex) + 31) / 32, sizeof(uint32));
+	bool			ok		= true;
+	uint32			i;
+
+	assert( NULL != coverage );
+
+	for( i = 0; i < count && ok; ++i ) {
+		rect_t			r		= atlas_image_coordinates(atlas, i);
+		atlas_trim_t	trim	= atlas_image_trim(atlas, i);
+		bool			rot		= atlas_image_rotated(atlas, i);
+		uint32			x		= (uint32)r.x, y = (uint32)r.y;
+		uint32			w		= (uint32)r.width, h = (uint32)r.height;
+		uint32			sw		= rot ? h : w, sh = rot ? w : h;
+		uint32			u, v;
+
+		if( atlas_image_removed(atlas, i) ) continue;
+
+		if( x + w > size || y + h > image_height(tex) ) {
+			fprintf(stderr, "ERROR: image %u is outside the texture\n", i);
+			ok	= false;
+			break;
+		}
+
+		for( v = 0; v < h && ok; ++v ) {
+			for( u = 0; u < w; ++u ) {
+				size_t	bit	= (size_t)(y + v) * size + x + u;
+				if( coverage[bit / 32] & (1u << (bit % 32)) ) {
+					fprintf(stderr, "ERROR: image %u overlaps another one at (%u, %u)\n", i, x + u, y + v);
+					ok	= false;
+					break;
+				}
+				coverage[bit / 32]	|= 1u << (bit % 32);
+			}
+		}
+
+		/* source (u, v) of the trimmed region lands at (v, u) when rotated */
+		for( v = 0; v < trim.source_height && ok; ++v ) {
+			for( u = 0; u < trim.source_width; ++u ) {
+				bool		in	= u >= trim.x && u < trim.x + sw && v >= trim.y && v < trim.y + sh;
+
+				if( !in ) {
+					if( image_get_pixelf(images[i], u, v).a != 0.0f ) {
+						fprintf(stderr, "ERROR: image %u lost an opaque pixel at (%u, %u) to trimming\n", i, u, v);
+						ok	= false;
+						break;
+					}
+				} else {
+					uint32		bx	= x + (rot ? v - trim.y : u - trim.x);
+					uint32		by	= y + (rot ? u - trim.x : v - trim.y);
+					if( !same_texel(images[i], u, v, tex, bx, by) ) {
+						fprintf(stderr, "ERROR: image %u pixel (%u, %u) is not preserved\n", i, u, v);
+						ok	= false;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	/* what no image covers is clear, indexed atlases keep an entry for it */
+	if( ok && image_format(tex) == PF_I8 ) {
+		size_t	bit;
+		for( bit = 0; bit < (size_t)size * image_height(tex); ++bit ) {
+			if( !(coverage[bit / 32] & (1u << (bit % 32))) && image_get_pixelb(tex, (uint32)(bit % size), (uint32)(bit / size)).a != 0 ) {
+				fprintf(stderr, "ERROR: the gap at (%u, %u) is not transparent\n", (uint32)(bit % size), (uint32)(bit / size));
+				ok	= false;
+				break;
+			}
+		}
+	}
+
+	free(coverage);
+	return ok;
+}
+
+/* atlas_make properties over trim, rotation and alignment combinations */
+static int
+test_properties(void) {
+	uint32	config;
+	int		ret	= 0;
+
+	for( config = 0; config < 8 && ret == 0; ++config ) {
+		uint32			count	= 300 + config * 50;
+		const image_t**	images	= (const image_t**)malloc(sizeof(image_t*) * count);
+		atlas_options_t	opts;
+		atlas_t*		atlas;
+		uint32			i;
+
+		atlas_options_init(&opts);
+		opts.trim			= (config & 1) != 0;
+		opts.allow_rotation	= (config & 2) != 0;
+		opts.alignment		= (config & 4) ? 4 : 1;
+
+		for( i = 0; i < count; ++i ) {
+			images[i]	= random_image(i % 10 == 0 ? 128 : 40);
+		}
+
+		opts.skyline	= ATLAS_SKYLINE_INDEXED;
+		atlas	= atlas_make_ex(images, count, &opts);
+		if( NULL == atlas || !check_atlas(atlas, images, count) ) {
+			ret	= 1;
+		}
+
+		/* the node list search must place everything the same */
+		if( ret == 0 ) {
+			atlas_t*	list;
+			opts.skyline	= ATLAS_SKYLINE_LIST;
+			list	= atlas_make_ex(images, count, &opts);
+			for( i = 0; list && i < count && ret == 0; ++i ) {
+				rect_t	a	= atlas_image_coordinates(atlas, i);
+				rect_t	b	= atlas_image_coordinates(list, i);
+				if( a.x != b.x || a.y != b.y || a.width != b.width || a.height != b.height ) {
+					fprintf(stderr, "ERROR: image %u is placed differently by the node list search\n", i);
+					ret	= 1;
+				}
+			}
+			if( NULL == list ) ret = 1;
+			else atlas_release(list);
+		}
+
+		printf("%-4s trim %d rotation %d alignment %u: %u images\n", ret ? "FAIL" : "ok", opts.trim, opts.allow_rotation, opts.alignment, count);
+
+		if( atlas ) atlas_release(atlas);
+		for( i = 0; i < count; ++i ) {
+			image_release((image_t*)images[i]);
+		}
+		free(images);
+	}
+
+	return ret;
+}
+
+/* every rect of the uv table against atlas_image_coordinates */
+static bool
+check_uv_table(const atlas_t* atlas, ATLAS_UV_LAYOUT layout, bool half_texel) {
+	const float*	uvs		= atlas_uv_table(atlas);
+	uint32			count	= atlas_image_count(atlas);
+	uint32			stride	= atlas_uv_stride(atlas);
+	float			inv_w	= 1.0f / (float)image_width(atlas_baked_image(atlas));
+	float			inv_h	= 1.0f / (float)image_height(atlas_baked_image(atlas));
+	float			inset	= half_texel ? 0.5f : 0.0f;
+	uint32			i, c;
+
+	if( NULL == uvs || ((uintptr_t)uvs & 15) != 0 || stride % 4 != 0 || stride < count || stride >= count + 4
+	 || atlas_uv_table_size(atlas) != sizeof(float) * 4 * (layout == ATLAS_UV_AOS ? count : stride) ) {
+		fprintf(stderr, "ERROR: the uv table is not laid out as documented\n");
+		return false;
+	}
+
+	for( i = 0; i < count; ++i ) {
+		rect_t	r	= atlas_image_coordinates(atlas, i);
+		float	want[4];
+
+		want[0]	= (r.x + inset) * inv_w;
+		want[1]	= (r.y + inset) * inv_h;
+		want[2]	= (r.x + r.width - inset) * inv_w;
+		want[3]	= (r.y + r.height - inset) * inv_h;
+
+		for( c = 0; c < 4; ++c ) {
+			float	got	= layout == ATLAS_UV_AOS ? uvs[i * 4 + c] : uvs[i + stride * c];
+			if( fabsf(got - want[c]) > 1e-6f ) {
+				fprintf(stderr, "ERROR: image %u uv %u is %f instead of %f\n", i, c, got, want[c]);
+				return false;
+			}
+		}
+	}
+
+	/* and the SoA padding is zeroed */
+	for( i = count; layout == ATLAS_UV_SOA && i < stride; ++i ) {
+		for( c = 0; c < 4; ++c ) {
+			if( uvs[i + stride * c] != 0.0f ) {
+				fprintf(stderr, "ERROR: the uv padding is not zeroed\n");
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* both uv layouts, the inset, and the table following atlas_remove, atlas_add and atlas_compact */
+static int
+test_uv(void) {
+	uint32			count	= 150;
+	const image_t**	images	= (const image_t**)malloc(sizeof(image_t*) * count);
+	atlas_move_t*	moves	= NULL;
+	atlas_options_t	opts;
+	atlas_t*		atlas;
+	bool			in_place;
+	int				ret		= 0;
+	uint32			i;
+
+	assert( NULL != images );
+	for( i = 0; i < count; ++i ) {
+		images[i]	= random_image(40);
+	}
+
+	atlas_options_init(&opts);
+	opts.trim			= true;
+	opts.allow_rotation	= true;
+	opts.output_format	= PF_R8G8B8A8;
+	opts.uv_layout		= ATLAS_UV_AOS;
+	opts.uv_half_texel	= true;
+	atlas	= atlas_make_ex(images, count, &opts);
+	if( NULL == atlas || !check_uv_table(atlas, ATLAS_UV_AOS, true) ) ret = 1;
+	printf("%-4s AoS table, half texel inset\n", ret ? "FAIL" : "ok");
+
+	if( ret == 0 ) {
+		atlas_build_uv_table(atlas, ATLAS_UV_SOA, false);
+		if( !check_uv_table(atlas, ATLAS_UV_SOA, false) ) ret = 1;
+	}
+	printf("%-4s SoA table, stride %u for %u images\n", ret ? "FAIL" : "ok", atlas ? atlas_uv_stride(atlas) : 0, count);
+
+	/* the table is rebuilt in the layout it was last built with */
+	if( ret == 0 ) {
+		for( i = 0; i < count; i += 3 ) {
+			atlas_remove(atlas, i);
+		}
+		if( !check_uv_table(atlas, ATLAS_UV_SOA, false) ) ret = 1;
+
+		for( i = 0; i < 80 && ret == 0; ++i ) {
+			image_t*	img	= random_image(16);
+			atlas_add(atlas, img, NULL);
+			image_release(img);
+		}
+		if( ret == 0 && !check_uv_table(atlas, ATLAS_UV_SOA, false) ) ret = 1;
+
+		moves	= (atlas_move_t*)malloc(sizeof(atlas_move_t) * atlas_image_count(atlas));
+		assert( NULL != moves );
+		if( ret == 0 && (atlas_compact(atlas, 0, moves, &in_place) == ATLAS_NOT_FOUND || !check_uv_table(atlas, ATLAS_UV_SOA, false)) ) ret = 1;
+	}
+	printf("%-4s after remove, add and compact: %u images\n", ret ? "FAIL" : "ok", atlas ? atlas_image_count(atlas) : 0);
+
+	free(moves);
+	if( atlas ) atlas_release(atlas);
+	for( i = 0; i < count; ++i ) {
+		image_release((image_t*)images[i]);
+	}
+	free(images);
+
+	return ret;
+}
+
+static pthread_mutex_t	slow_lock	= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	slow_open	= PTHREAD_COND_INITIALIZER;
+static bool				slow_opened	= false;
+static bool				slow_done	= false;
+
+/* runs until slow_opened is set, or for 5 seconds */
+static void
+slow_task(void* arg) {
+	struct timespec	until;
+
+	(void)arg;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec	+= 5;
+
+	pthread_mutex_lock(&slow_lock);
+	while( !slow_opened && pthread_cond_timedwait(&slow_open, &slow_lock, &until) == 0 ) {}
+	slow_done	= true;
+	pthread_mutex_unlock(&slow_lock);
+}
+
+static void
+count_task(void* arg) {
+	++*(uint32*)arg;
+}
+
+/*
+ * atlas_make_batch against one atlas_make_ex per job: jobs from a few to
+ * thousands of images, with different options, must come out the same
+ */
+static int
+test_batch(void) {
+	enum { JOB_COUNT = 24 };
+	atlas_job_t		jobs[JOB_COUNT];
+	atlas_options_t	opts[JOB_COUNT];
+	atlas_options_t	defaults;
+	atlas_pool_t*	pool	= atlas_pool_make(4);
+	double			serial_ms	= 0.0;
+	double			batch_ms;
+	int				ret		= 0;
+	uint32			j, i;
+
+	if( NULL == pool ) return 1;
+
+	atlas_options_init(&defaults);
+	for( j = 0; j < JOB_COUNT; ++j ) {
+		uint32			count	= j % 6 == 0 ? 2000 + j * 50 : rng_range(1, 200);
+		const image_t**	images	= (const image_t**)malloc(sizeof(image_t*) * count);
+
+		for( i = 0; i < count; ++i ) {
+			images[i]	= random_image(j % 6 == 0 ? 24 : 64);
+		}
+
+		atlas_options_init(&opts[j]);
+		opts[j].trim			= (j & 1) != 0;
+		opts[j].allow_rotation	= (j & 2) != 0;
+		opts[j].alignment		= (j & 4) ? 4 : 1;
+
+		jobs[j].images		= images;
+		jobs[j].image_count	= count;
+		jobs[j].opts		= j == 3 ? NULL : &opts[j];
+	}
+
+	batch_ms	= now_ms();
+	if( !atlas_make_batch(jobs, JOB_COUNT, pool) ) {
+		fprintf(stderr, "ERROR: a batch job failed\n");
+		ret	= 1;
+	}
+	batch_ms	= now_ms() - batch_ms;
+
+	for( j = 0; j < JOB_COUNT && ret == 0; ++j ) {
+		double		t		= now_ms();
+		atlas_t*	serial	= atlas_make_ex(jobs[j].images, jobs[j].image_count, jobs[j].opts ? jobs[j].opts : &defaults);
+
+		serial_ms	+= now_ms() - t;
+
+		if( NULL == serial || !check_atlas(jobs[j].atlas, jobs[j].images, jobs[j].image_count) ) {
+			ret	= 1;
+		}
+
+		for( i = 0; ret == 0 && i < jobs[j].image_count; ++i ) {
+			rect_t	a	= atlas_image_coordinates(jobs[j].atlas, i);
+			rect_t	b	= atlas_image_coordinates(serial, i);
+			if( a.x != b.x || a.y != b.y || a.width != b.width || a.height != b.height ) {
+				fprintf(stderr, "ERROR: job %u image %u is placed differently than by atlas_make_ex\n", j, i);
+				ret	= 1;
+			}
+		}
+
+		if( serial ) atlas_release(serial);
+	}
+
+	printf("%-4s %u jobs on %u threads: batch %.2f ms, serial %.2f ms\n", ret ? "FAIL" : "ok", JOB_COUNT, atlas_pool_thread_count(pool), batch_ms, serial_ms);
+
+	/* a group is waited for without the other tasks of the pool */
+	if( ret == 0 ) {
+		atlas_task_group_t	group;
+		uint32				counts[64];
+		bool				waited;
+
+		memset(counts, 0, sizeof(counts));
+		atlas_task_group_init(&group);
+		atlas_pool_submit(pool, slow_task, NULL);
+		for( i = 0; i < 64; ++i ) {
+			atlas_pool_submit_group(pool, &group, count_task, &counts[i]);
+		}
+		atlas_pool_wait_group(pool, &group);
+
+		pthread_mutex_lock(&slow_lock);
+		waited		= slow_done;
+		slow_opened	= true;
+		pthread_cond_broadcast(&slow_open);
+		pthread_mutex_unlock(&slow_lock);
+		atlas_pool_wait(pool);
+
+		for( i = 0; i < 64; ++i ) {
+			if( counts[i] != 1 ) ret = 1;
+		}
+		if( waited ) {
+			fprintf(stderr, "ERROR: waiting for a group waited for the whole pool\n");
+			ret	= 1;
+		}
+	}
+	printf("%-4s task group waited for alone\n", ret ? "FAIL" : "ok");
+
+	for( j = 0; j < JOB_COUNT; ++j ) {
+		if( jobs[j].atlas ) atlas_release(jobs[j].atlas);
+		for( i = 0; i < jobs[j].image_count; ++i ) {
+			image_release((image_t*)jobs[j].images[i]);
+		}
+		free((void*)jobs[j].images);
+	}
+
+	atlas_pool_release(pool);
+	return ret;
+}
+
+/* tile texels against the clamped baked texels, the page table and a save/open round trip */
+static bool
+check_tiles(const atlas_t* atlas, atlas_tiles_t* tiles) {
+	const image_t*	baked	= atlas_baked_image(atlas);
+	uint32			size	= atlas_tiles_size(tiles);
+	uint32			border	= atlas_tiles_border(tiles);
+	uint32			side	= size + 2 * border;
+	uint32			t, i, x, y;
+
+	for( i = 0; i < atlas_image_count(atlas); ++i ) {
+		rect_t				r	= atlas_image_coordinates(atlas, i);
+		atlas_tile_range_t	tr	= atlas_tiles_image_range(tiles, i);
+		uint32				cx	= (uint32)r.x + (uint32)r.width - 1;
+		uint32				cy	= (uint32)r.y + (uint32)r.height - 1;
+
+		if( tr.x != (uint32)r.x / size || tr.y != (uint32)r.y / size || tr.x + tr.columns - 1 != cx / size || tr.y + tr.rows - 1 != cy / size ) {
+			fprintf(stderr, "ERROR: image %u has a wrong tile range\n", i);
+			return false;
+		}
+	}
+
+	for( t = 0; t < atlas_tiles_columns(tiles) * atlas_tiles_rows(tiles); ++t ) {
+		const image_t*	tile	= atlas_tiles_image(tiles, t);
+		sint32			ox		= (sint32)((t % atlas_tiles_columns(tiles)) * size) - (sint32)border;
+		sint32			oy		= (sint32)((t / atlas_tiles_columns(tiles)) * size) - (sint32)border;
+
+		if( !atlas_tiles_used(tiles, t) ) continue;
+		if( NULL == tile || image_width(tile) != side || image_height(tile) != side ) {
+			fprintf(stderr, "ERROR: tile %u is missing\n", t);
+			return false;
+		}
+
+		for( y = 0; y < side; ++y ) {
+			for( x = 0; x < side; ++x ) {
+				sint32	bx	= ox + (sint32)x, by = oy + (sint32)y;
+				uint32	cx	= bx < 0 ? 0 : ((uint32)bx >= image_width(baked) ? image_width(baked) - 1 : (uint32)bx);
+				uint32	cy	= by < 0 ? 0 : ((uint32)by >= image_height(baked) ? image_height(baked) - 1 : (uint32)by);
+				if( !same_color(image_get_pixelb(tile, x, y), image_get_pixelb(baked, cx, cy)) ) {
+					fprintf(stderr, "ERROR: tile %u texel (%u, %u) is wrong\n", t, x, y);
+					return false;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+static int
+test_tiles(void) {
+	static const uint32	configs[][2]	= { { 128, 0 }, { 64, 2 }, { 100, 3 }, { 256, 8 } };
+	const char*		path	= "atlas-test-tiles.tmp";
+	uint32			count	= 400;
+	const image_t**	images	= (const image_t**)malloc(sizeof(image_t*) * count);
+	atlas_options_t	opts;
+	atlas_t*		atlas;
+	uint32			c, i;
+	int				ret		= 0;
+
+	for( i = 0; i < count; ++i ) {
+		images[i]	= random_image(i % 10 == 0 ? 128 : 40);
+	}
+
+	atlas_options_init(&opts);
+	opts.trim			= true;
+	opts.allow_rotation	= true;
+	atlas	= atlas_make_ex(images, count, &opts);
+	if( NULL == atlas ) ret = 1;
+
+	for( c = 0; c < sizeof(configs) / sizeof(configs[0]) && ret == 0; ++c ) {
+		atlas_tiles_t*	tiles	= atlas_tiles_make(atlas, configs[c][0], configs[c][1]);
+		atlas_tiles_t*	loaded	= NULL;
+		uint32			t, used	= 0;
+
+		if( NULL == tiles || !check_tiles(atlas, tiles) || !atlas_tiles_save(tiles, path) ) ret = 1;
+		if( ret == 0 && NULL == (loaded = atlas_tiles_open(path)) ) ret = 1;
+
+		/* stream every tile in and out again */
+		for( t = 0; ret == 0 && t < atlas_tiles_columns(tiles) * atlas_tiles_rows(tiles); ++t ) {
+			if( atlas_tiles_used(tiles, t) != atlas_tiles_used(loaded, t) ) ret = 1;
+			if( ret != 0 || !atlas_tiles_used(tiles, t) ) continue;
+
+			++used;
+			if( atlas_tiles_image(loaded, t) || !atlas_tiles_load_tile(loaded, t)
+			 || memcmp(image_pixels(atlas_tiles_image(loaded, t)), image_pixels(atlas_tiles_image(tiles, t)), image_data_size(atlas_tiles_image(tiles, t))) != 0 ) {
+				fprintf(stderr, "ERROR: tile %u does not load back\n", t);
+				ret	= 1;
+			}
+			atlas_tiles_evict_tile(loaded, t);
+		}
+		for( i = 0; ret == 0 && i < count; ++i ) {
+			atlas_tile_range_t	a	= atlas_tiles_image_range(tiles, i);
+			atlas_tile_range_t	b	= atlas_tiles_image_range(loaded, i);
+			if( memcmp(&a, &b, sizeof(a)) != 0 ) ret = 1;
+		}
+
+		printf("%-4s %u tiles, border %u: %u of %u used\n", ret ? "FAIL" : "ok", configs[c][0], configs[c][1], used, tiles ? atlas_tiles_columns(tiles) * atlas_tiles_rows(tiles) : 0);
+
+		if( loaded ) atlas_tiles_release(loaded);
+		if( tiles ) atlas_tiles_release(tiles);
+	}
+	remove(path);
+
+	if( atlas ) atlas_release(atlas);
+	for( i = 0; i < count; ++i ) {
+		image_release((image_t*)images[i]);
+	}
+	free(images);
+
+	return ret;
+}
+
+/* random images all in one format */
+static const image_t**
+random_images(uint32 count, PIXEL_FORMAT fmt) {
+	const image_t**	images	= (const image_t**)malloc(sizeof(image_t*) * count);
+	uint32			i;
+
+	assert( NULL != images );
+	for( i = 0; i < count; ++i ) {
+		image_t*	img;
+		do {
+			img	= random_image(40);
+			if( image_format(img) != fmt ) {
+				image_release(img);
+				img	= NULL;
+			}
+		} while( NULL == img );
+		images[i]	= img;
+	}
+
+	return images;
+}
+
+static void
+release_images(const image_t** images, uint32 count) {
+	uint32	i;
+	for( i = 0; i < count; ++i ) {
+		image_release((image_t*)images[i]);
+	}
+	free(images);
+}
+
+static color4_t
+grey_texel(void* state, uint32 x, uint32 y) {
+	(void)state;
+	(void)x;
+	(void)y;
+	return color4(0.5f, 0.5f, 0.5f, 1.0f);
+}
+
+/* the baked format follows the images unless asked for, mixed sets split per format */
+static int
+test_formats(void) {
+	static const PIXEL_FORMAT	formats[]	= { PF_A8, PF_R8G8B8, PF_R8G8B8A8 };
+	atlas_options_t	opts;
+	const image_t**	mixed;
+	const char**	keys;
+	atlas_t*		atlases[ATLAS_SPLIT_MAX];
+	uint32			atlas_of[200], index_of[200];
+	uint32			f, i, n;
+	int				ret		= 0;
+
+	atlas_options_init(&opts);
+
+	for( f = 0; f < 3 && ret == 0; ++f ) {
+		const image_t**	images	= random_images(100, formats[f]);
+		atlas_t*		atlas	= atlas_make_ex(images, 100, &opts);
+		atlas_t*		rgba;
+
+		opts.output_format	= PF_R8G8B8A8;
+		rgba	= atlas_make_ex(images, 100, &opts);
+		opts.output_format	= PF_AUTO;
+
+		if( NULL == atlas || NULL == rgba || !check_atlas(atlas, images, 100) || !check_atlas(rgba, images, 100) ) {
+			ret	= 1;
+		} else if( image_format(atlas_baked_image(atlas)) != formats[f] || image_format(atlas_baked_image(rgba)) != PF_R8G8B8A8 ) {
+			fprintf(stderr, "ERROR: format 0x%X baked as 0x%X\n", formats[f], image_format(atlas_baked_image(atlas)));
+			ret	= 1;
+		} else {
+			printf("ok   format 0x%X: %lu bytes instead of %lu\n", formats[f], (unsigned long)image_data_size(atlas_baked_image(atlas)), (unsigned long)image_data_size(atlas_baked_image(rgba)));
+		}
+
+		if( atlas ) atlas_release(atlas);
+		if( rgba ) atlas_release(rgba);
+		release_images(images, 100);
+	}
+
+	/* a mixed set: one atlas, promoted, or one per format */
+	mixed	= (const image_t**)malloc(sizeof(image_t*) * 200);
+	keys	= (const char**)malloc(sizeof(char*) * 200);
+	assert( NULL != mixed && NULL != keys );
+	for( i = 0; i < 200; ++i ) {
+		char*	key	= (char*)malloc(16);
+		assert( NULL != key );
+		sprintf(key, "img%u", i);
+		mixed[i]	= random_image(40);
+		keys[i]		= key;
+	}
+
+	opts.keys	= keys;
+	n	= ret == 0 ? atlas_make_split(mixed, 200, &opts, atlases, atlas_of, index_of) : 0;
+	if( n == 0 ) ret = 1;
+
+	for( f = 0; f < n; ++f ) {
+		const image_t*	sub[200];
+		uint32			count	= 0;
+
+		for( i = 0; i < 200 && ret == 0; ++i ) {
+			if( atlas_of[i] != f ) continue;
+			sub[index_of[i]]	= mixed[i];
+			++count;
+			if( image_format(mixed[i]) != image_format(atlas_baked_image(atlases[f])) || atlas_find(atlases[f], keys[i]) != index_of[i] ) {
+				fprintf(stderr, "ERROR: image %u is not in the atlas of its format\n", i);
+				ret	= 1;
+			}
+		}
+
+		if( ret == 0 && (count != atlas_image_count(atlases[f]) || !check_atlas(atlases[f], sub, count)) ) ret = 1;
+		atlas_release(atlases[f]);
+	}
+
+	printf("%-4s mixed set split in %u atlases\n", ret ? "FAIL" : "ok", n);
+
+	for( i = 0; i < 200; ++i ) {
+		free((void*)keys[i]);
+	}
+	free(keys);
+	release_images(mixed, 200);
+
+	/* formats the fillers can't write give no image */
+	if( NULL != image_initb(4, 4, (PIXEL_FORMAT)0x7777, NULL, id_color) || NULL != image_initb(4, 4, PF_BC1, NULL, id_color)
+	 || NULL != image_initf(4, 4, (PIXEL_FORMAT)0x7777, NULL, grey_texel) || NULL != image_initf(4, 4, PF_BC7, NULL, grey_texel) ) {
+		fprintf(stderr, "ERROR: an image was filled in an unsupported format\n");
+		ret	= 1;
+	}
+	printf("%-4s fillers reject unsupported formats\n", ret ? "FAIL" : "ok");
+
+	return ret;
+}
+
+/* a smooth gradient, far more colours than a palette holds */
+static color4b_t
+gradient_texel(void* state, uint32 x, uint32 y) {
+	(void)state;
+	return color4b((uint8)x, (uint8)y, (uint8)((x + y) / 2), (uint8)(255 - x / 4));
+}
+
+/* a fixed set of colours, picked at random */
+static color4b_t
+swatch_texel(void* state, uint32 x, uint32 y) {
+	const color4b_t*	swatches	= (const color4b_t*)state;
+	(void)x;
+	(void)y;
+	return swatches[rng_next() % 16];
+}
+
+static void*
+sum_alpha(void* state, uint32 x, uint32 y, color4b_t col) {
+	(void)x;
+	(void)y;
+	*(uint64_t*)state	+= col.a;
+	return state;
+}
+
+/* an indexed image out of a random set of 16 colours */
+static image_t*
+swatch_image(uint32 max_side) {
+	color4b_t	swatches[16];
+	uint32		i;
+
+	for( i = 0; i < 16; ++i ) {
+		swatches[i]	= color4b((uint8)rng_next(), (uint8)rng_next(), (uint8)rng_next(), (uint8)rng_next());
+	}
+
+	return image_initb(rng_range(1, max_side), rng_range(1, max_side), PF_I8, swatches, swatch_texel);
+}
+
+/* every texel of 'a' against 'b', the largest channel difference */
+static uint32
+max_difference(const image_t* a, const image_t* b) {
+	uint32	worst	= 0;
+	uint32	x, y;
+
+	for( y = 0; y < image_height(a); ++y ) {
+		for( x = 0; x < image_width(a); ++x ) {
+			color4b_t	ca	= image_get_pixelb(a, x, y);
+			color4b_t	cb	= image_get_pixelb(b, x, y);
+			uint32		d[4];
+			uint32		c;
+
+			d[0]	= (uint32)abs((int)ca.r - (int)cb.r);
+			d[1]	= (uint32)abs((int)ca.g - (int)cb.g);
+			d[2]	= (uint32)abs((int)ca.b - (int)cb.b);
+			d[3]	= (uint32)abs((int)ca.a - (int)cb.a);
+			for( c = 0; c < 4; ++c ) {
+				if( d[c] > worst ) worst = d[c];
+			}
+		}
+	}
+
+	return worst;
+}
+
+/* two colours per 4x4 block, the pair and the pick hashed from the coordinates */
+static uint32
+hash_xy(uint32 x, uint32 y) {
+	uint32	h	= x * 0x9E3779B1u ^ y * 0x85EBCA77u;
+	h	^= h >> 15;
+	h	*= 0x2C1B3C6Du;
+	h	^= h >> 12;
+	return h;
+}
+
+static color4b_t
+duotone_texel(void* state, uint32 x, uint32 y) {
+	uint32	h	= hash_xy(x / 4, y / 4) + (hash_xy(x, y) & 1) * 0x51ED27u;
+	(void)state;
+	return color4b((uint8)h, (uint8)(h >> 8), (uint8)(h >> 16), (uint8)(h >> 24));
+}
+
+static color4b_t
+expand_565(uint32 c) {
+	uint32	r	= (c >> 11) & 31;
+	uint32	g	= (c >> 5) & 63;
+	uint32	b	= c & 31;
+	return color4b((uint8)((r << 3) | (r >> 2)), (uint8)((g << 2) | (g >> 4)), (uint8)((b << 3) | (b >> 2)), 255);
+}
+
+static uint8
+mix_channel(uint32 a, uint32 b, uint32 wa, uint32 wb, uint32 d) {
+	return (uint8)((wa * a + wb * b + d / 2) / d);
+}
+
+static color4b_t
+mix_color(color4b_t a, color4b_t b, uint32 wa, uint32 wb, uint32 d) {
+	return color4b(mix_channel(a.r, b.r, wa, wb, d), mix_channel(a.g, b.g, wa, wb, d), mix_channel(a.b, b.b, wa, wb, d), 255);
+}
+
+/* a BC1 colour block as the format describes it, c0 <= c1 only selects 3 colours when allowed */
+static void
+decode_bc1_block(const uint8* src, bool three_colors, color4b_t* out) {
+	uint32		c0		= (uint32)src[0] | ((uint32)src[1] << 8);
+	uint32		c1		= (uint32)src[2] | ((uint32)src[3] << 8);
+	uint32		bits	= (uint32)src[4] | ((uint32)src[5] << 8) | ((uint32)src[6] << 16) | ((uint32)src[7] << 24);
+	color4b_t	pal[4];
+	uint32		i;
+
+	pal[0]	= expand_565(c0);
+	pal[1]	= expand_565(c1);
+	if( c0 > c1 || !three_colors ) {
+		pal[2]	= mix_color(pal[0], pal[1], 2, 1, 3);
+		pal[3]	= mix_color(pal[0], pal[1], 1, 2, 3);
+	} else {
+		pal[2]	= mix_color(pal[0], pal[1], 1, 1, 2);
+		pal[3]	= color4b(0, 0, 0, 0);
+	}
+
+	for( i = 0; i < 16; ++i ) {
+		out[i]	= pal[(bits >> (i * 2)) & 3];
+	}
+}
+
+/* the BC3 alpha block, 8 interpolated values or 6 and the two extremes */
+static void
+decode_bc3_alpha(const uint8* src, color4b_t* out) {
+	uint32	a0	= src[0];
+	uint32	a1	= src[1];
+	uint64_t	bits	= 0;
+	uint32	val[8];
+	uint32	i;
+
+	for( i = 0; i < 6; ++i ) {
+		bits	|= (uint64_t)src[2 + i] << (i * 8);
+	}
+
+	val[0]	= a0;
+	val[1]	= a1;
+	if( a0 > a1 ) {
+		for( i = 2; i < 8; ++i ) {
+			val[i]	= ((8 - i) * a0 + (i - 1) * a1 + 3) / 7;
+		}
+	} else {
+		for( i = 2; i < 6; ++i ) {
+			val[i]	= ((6 - i) * a0 + (i - 1) * a1 + 2) / 5;
+		}
+		val[6]	= 0;
+		val[7]	= 255;
+	}
+
+	for( i = 0; i < 16; ++i ) {
+		out[i].a	= (uint8)val[(bits >> (i * 3)) & 7];
+	}
+}
+
+static uint32
+read_bits(const uint8* src, uint32* pos, uint32 count) {
+	uint32	v	= 0;
+	uint32	i;
+
+	for( i = 0; i < count; ++i, ++*pos ) {
+		v	|= (uint32)((src[*pos / 8] >> (*pos % 8)) & 1) << i;
+	}
+	return v;
+}
+
+/* a BC7 block, only mode 6 is expected out of the encoder */
+static bool
+decode_bc7_block(const uint8* src, color4b_t* out) {
+	static const uint32	weights[16]	= { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+	uint32	pos	= 0;
+	uint32	e[2][4];
+	uint32	c, i;
+
+	if( read_bits(src, &pos, 7) != 0x40 ) return false;
+
+	for( c = 0; c < 4; ++c ) {
+		e[0][c]	= read_bits(src, &pos, 7) << 1;
+		e[1][c]	= read_bits(src, &pos, 7) << 1;
+	}
+	for( i = 0; i < 2; ++i ) {
+		uint32	p	= read_bits(src, &pos, 1);
+		for( c = 0; c < 4; ++c ) {
+			e[i][c]	|= p;
+		}
+	}
+
+	for( i = 0; i < 16; ++i ) {
+		uint32	w	= weights[read_bits(src, &pos, i == 0 ? 3 : 4)];
+		uint32	v[4];
+		for( c = 0; c < 4; ++c ) {
+			v[c]	= ((64 - w) * e[0][c] + w * e[1][c] + 32) >> 6;
+		}
+		out[i]	= color4b((uint8)v[0], (uint8)v[1], (uint8)v[2], (uint8)v[3]);
+	}
+
+	return true;
+}
+
+/* decode 'packed' block per block and measure it against 'src', BC1 alpha is a 128 threshold */
+static bool
+compare_compressed(const image_t* src, const image_t* packed, double* mean, uint32* worst) {
+	PIXEL_FORMAT	fmt			= image_format(packed);
+	const uint8*	data		= (const uint8*)image_pixels(packed);
+	uint32			block_bytes	= fmt == PF_BC1 ? 8 : 16;
+	uint32			bw			= (image_width(src)  + 3) / 4;
+	uint32			bh			= (image_height(src) + 3) / 4;
+	uint64_t		total		= 0;
+	uint64_t		samples		= 0;
+	uint32			bx, by, i, c;
+
+	*worst	= 0;
+	for( by = 0; by < bh; ++by ) {
+		for( bx = 0; bx < bw; ++bx ) {
+			const uint8*	blk	= &data[(by * bw + bx) * block_bytes];
+			color4b_t		dec[16];
+
+			switch(fmt) {
+			case PF_BC1:
+				decode_bc1_block(blk, true, dec);
+				break;
+			case PF_BC3:
+				decode_bc1_block(blk + 8, false, dec);
+				decode_bc3_alpha(blk, dec);
+				break;
+			default:
+				if( !decode_bc7_block(blk, dec) ) {
+					fprintf(stderr, "ERROR: block %u, %u is not a mode 6 BC7 block\n", bx, by);
+					return false;
+				}
+				break;
+			}
+
+			for( i = 0; i < 16; ++i ) {
+				uint32		x	= bx * 4 + i % 4;
+				uint32		y	= by * 4 + i / 4;
+				color4b_t	ref;
+				int			want[4];
+				int			got[4];
+
+				if( x >= image_width(src) || y >= image_height(src) ) continue;
+
+				ref		= image_get_pixelb(src, x, y);
+				want[0]	= ref.r;	want[1]	= ref.g;	want[2]	= ref.b;	want[3]	= ref.a;
+				got[0]	= dec[i].r;	got[1]	= dec[i].g;	got[2]	= dec[i].b;	got[3]	= dec[i].a;
+
+				if( fmt == PF_BC1 ) {
+					/* punch through: only the alpha of transparent texels is defined */
+					want[3]	= ref.a < 128 ? 0 : 255;
+					if( want[3] != got[3] ) {
+						fprintf(stderr, "ERROR: texel %u, %u alpha %d, expected %d\n", x, y, got[3], want[3]);
+						return false;
+					}
+					if( want[3] == 0 ) continue;
+				}
+
+				for( c = 0; c < 4; ++c ) {
+					uint32	d	= (uint32)abs(want[c] - got[c]);
+					total	+= d;
+					if( d > *worst ) *worst = d;
+				}
+				samples	+= 4;
+			}
+		}
+	}
+
+	*mean	= samples ? (double)total / (double)samples : 0.0;
+	return true;
+}
+
+/* BC1, BC3 and BC7 output decoded from the block layouts and checked against the source texels */
+static int
+test_bc(void) {
+	static const struct {
+		PIXEL_FORMAT	fmt;
+		const char*		name;
+		double			mean[2];
+		uint32			worst[2];
+	} cases[]	= {
+		{ PF_BC1, "bc1", { 1.5, 5.0 }, { 8, 24 } },
+		{ PF_BC3, "bc3", { 1.5, 5.0 }, { 8, 24 } },
+		{ PF_BC7, "bc7", { 1.0, 5.0 }, { 4, 24 } },
+	};
+	image_t*		sources[2];
+	atlas_pool_t*	pool	= atlas_pool_make(4);
+	int				ret		= 0;
+	uint32			i, s;
+
+	/* a smooth gradient, then hard edges in a size that leaves partial blocks */
+	sources[0]	= image_initb(256, 256, PF_R8G8B8A8, NULL, gradient_texel);
+	sources[1]	= image_initb(37, 21, PF_R8G8B8A8, NULL, duotone_texel);
+
+	for( i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i ) {
+		for( s = 0; s < 2; ++s ) {
+			image_t*	packed		= image_compress(sources[s], cases[i].fmt, NULL);
+			image_t*	threaded	= image_compress(sources[s], cases[i].fmt, pool);
+			double		mean		= 0.0;
+			uint32		worst		= 0;
+			bool		ok			= NULL != packed && compare_compressed(sources[s], packed, &mean, &worst);
+
+			/* the blocks are independent, the threads change nothing */
+			if( ok && (NULL == threaded || memcmp(image_pixels(packed), image_pixels(threaded), image_data_size(packed)) != 0) ) {
+				fprintf(stderr, "ERROR: the threaded %s encoder differs from the serial one\n", cases[i].name);
+				ok	= false;
+			}
+
+			ok	= ok && mean <= cases[i].mean[s] && worst <= cases[i].worst[s];
+			printf("%-4s %s %ux%u: mean error %.2f (max %.2f), worst %u (max %u)\n", ok ? "ok" : "FAIL", cases[i].name, image_width(sources[s]), image_height(sources[s]), mean, cases[i].mean[s], worst, cases[i].worst[s]);
+			if( !ok ) ret = 1;
+			if( threaded ) image_release(threaded);
+			if( packed ) image_release(packed);
+		}
+	}
+
+	image_release(sources[0]);
+	image_release(sources[1]);
+	atlas_pool_release(pool);
+
+	return ret;
+}
+
+/* exact and quantized palettes, indexed atlases with a shared palette and their round trip */
+static int
+test_palette(void) {
+	const char*		path	= "atlas-test-palette.tmp";
+	atlas_pool_t*	pool	= atlas_pool_make(4);
+	image_t*		rgba	= image_initb(256, 256, PF_R8G8B8A8, NULL, gradient_texel);
+	image_t*		serial	= image_quantize(rgba, 256, NULL);
+	image_t*		threaded	= image_quantize(rgba, 256, pool);
+	image_t*		exact;
+	const image_t**	images;
+	atlas_options_t	opts;
+	atlas_t*		atlas	= NULL;
+	atlas_t*		loaded	= NULL;
+	uint64_t		alpha_a	= 0, alpha_b = 0;
+	uint32			i;
+	int				ret		= 0;
+
+	/* more colours than entries: close, and the same with threads */
+	if( NULL == serial || NULL == threaded || image_palette_size(serial) > IMAGE_PALETTE_MAX
+	 || image_palette_size(serial) != image_palette_size(threaded)
+	 || memcmp(image_palette(serial), image_palette(threaded), sizeof(color4b_t) * image_palette_size(serial)) != 0
+	 || memcmp(image_pixels(serial), image_pixels(threaded), image_data_size(serial)) != 0 ) {
+		fprintf(stderr, "ERROR: the threaded quantizer differs from the serial one\n");
+		ret	= 1;
+	} else if( max_difference(rgba, serial) > 24 ) {
+		fprintf(stderr, "ERROR: the quantized gradient is off by %u\n", max_difference(rgba, serial));
+		ret	= 1;
+	}
+	printf("%-4s quantized gradient: %u entries, off by at most %u\n", ret ? "FAIL" : "ok", serial ? image_palette_size(serial) : 0, serial ? max_difference(rgba, serial) : 0);
+
+	/* few colours: lossless, the fold sees the palette colours */
+	exact	= swatch_image(64);
+	if( ret == 0 ) {
+		image_t*	again	= image_quantize(exact, 256, pool);
+		image_foldb(exact, &alpha_a, sum_alpha);
+		image_foldb(again, &alpha_b, sum_alpha);
+		if( image_palette_size(exact) > 16 || max_difference(exact, again) != 0 || alpha_a != alpha_b ) {
+			fprintf(stderr, "ERROR: the exact palette is lossy\n");
+			ret	= 1;
+		}
+		image_release(again);
+	}
+	printf("%-4s exact palette: %u entries\n", ret ? "FAIL" : "ok", image_palette_size(exact));
+
+	/* indices copied between two palettes keep their colours */
+	if( ret == 0 ) {
+		color4b_t	colors[IMAGE_PALETTE_MAX];
+		uint32		n		= image_palette_size(exact);
+		uint32		w		= image_width(exact), h = image_height(exact);
+		image_t*	other	= image_allocate(w + h, w + h, PF_I8);
+		uint32		x, y;
+
+		colors[0]	= color4b(1, 2, 3, 4);
+		for( i = 0; i < n; ++i ) {
+			colors[n - i]	= image_palette(exact)[i];
+		}
+		image_set_palette(other, colors, n + 1);
+		image_blit(other, 0, 0, exact, 0, 0, w, h);
+		image_blit_transposed(other, w, 0, exact, 0, 0, w, h);
+		for( y = 0; y < h && ret == 0; ++y ) {
+			for( x = 0; x < w; ++x ) {
+				if( !same_color(image_get_pixelb(exact, x, y), image_get_pixelb(other, x, y)) || !same_color(image_get_pixelb(exact, x, y), image_get_pixelb(other, w + y, x)) ) {
+					fprintf(stderr, "ERROR: the blit lost the colour of (%u, %u)\n", x, y);
+					ret	= 1;
+					break;
+				}
+			}
+		}
+		image_release(other);
+	}
+	printf("%-4s indices between palettes\n", ret ? "FAIL" : "ok");
+
+	/* indexed images with their own palettes share the atlas one, exactly while it fits */
+	images	= (const image_t**)malloc(sizeof(image_t*) * 100);
+	assert( NULL != images );
+	for( i = 0; i < 100; ++i ) {
+		images[i]	= swatch_image(40);
+	}
+
+	atlas_options_init(&opts);
+	opts.trim			= true;
+	opts.allow_rotation	= true;
+	if( ret == 0 ) {
+		atlas	= atlas_make_ex(images, 12, &opts);
+		if( NULL == atlas || image_format(atlas_baked_image(atlas)) != PF_I8 || !check_atlas(atlas, images, 12) ) ret = 1;
+
+		/* removed, moved and grown out areas are clear too */
+		if( ret == 0 ) {
+			atlas_move_t	moves[12];
+			bool			in_place;
+			uint32			size	= image_width(atlas_baked_image(atlas));
+
+			for( i = 0; i < 12; i += 2 ) {
+				if( !atlas_remove(atlas, i) ) ret = 1;
+			}
+			if( ret == 0 && !check_atlas(atlas, images, 12) ) ret = 1;
+			if( ret == 0 && (atlas_compact(atlas, 0, moves, &in_place) == ATLAS_NOT_FOUND || !check_atlas(atlas, images, 12)) ) ret = 1;
+			if( ret == 0 && (atlas_compact(atlas, size * 2, moves, &in_place) == ATLAS_NOT_FOUND || !check_atlas(atlas, images, 12)) ) ret = 1;
+			printf("%-4s indexed atlas cleared after remove and compact\n", ret ? "FAIL" : "ok");
+		}
+		if( atlas ) atlas_release(atlas);
+
+		atlas	= atlas_make_ex(images, 100, &opts);
+		if( NULL == atlas || image_format(atlas_baked_image(atlas)) != PF_I8 || image_palette_size(atlas_baked_image(atlas)) > IMAGE_PALETTE_MAX ) ret = 1;
+	}
+
+	/* and the round trip keeps the palette */
+	if( ret == 0 && (!atlas_save(atlas, path) || NULL == (loaded = atlas_load(path))
+	 || image_palette_size(atlas_baked_image(loaded)) != image_palette_size(atlas_baked_image(atlas))
+	 || max_difference(atlas_baked_image(atlas), atlas_baked_image(loaded)) != 0) ) {
+		fprintf(stderr, "ERROR: the indexed atlas does not load back\n");
+		ret	= 1;
+	}
+	printf("%-4s indexed atlas: %u entries\n", ret ? "FAIL" : "ok", atlas ? image_palette_size(atlas_baked_image(atlas)) : 0);
+	remove(path);
+	if( loaded ) atlas_release(loaded);
+	if( atlas ) atlas_release(atlas);
+	release_images(images, 100);
+
+	/* direct colour images baked into an indexed atlas */
+	images	= random_images(50, PF_R8G8B8A8);
+	opts.output_format	= PF_I8;
+	atlas	= ret == 0 ? atlas_make_ex(images, 50, &opts) : NULL;
+	if( ret == 0 && (NULL == atlas || image_format(atlas_baked_image(atlas)) != PF_I8 || image_palette_size(atlas_baked_image(atlas)) == 0) ) {
+		fprintf(stderr, "ERROR: direct colour images were not quantized\n");
+		ret	= 1;
+	}
+	printf("%-4s quantized atlas: %u entries\n", ret ? "FAIL" : "ok", atlas ? image_palette_size(atlas_baked_image(atlas)) : 0);
+
+	/* the caller's pool gives the same atlas as the library's */
+	opts.pool	= pool;
+	loaded		= ret == 0 ? atlas_make_ex(images, 50, &opts) : NULL;
+	if( ret == 0 && (NULL == loaded || image_palette_size(atlas_baked_image(loaded)) != image_palette_size(atlas_baked_image(atlas))
+	 || max_difference(atlas_baked_image(atlas), atlas_baked_image(loaded)) != 0) ) {
+		fprintf(stderr, "ERROR: the caller's pool gives another atlas\n");
+		ret	= 1;
+	}
+	printf("%-4s quantized atlas on the caller's pool\n", ret ? "FAIL" : "ok");
+	if( loaded ) atlas_release(loaded);
+	if( atlas ) atlas_release(atlas);
+	release_images(images, 50);
+
+	image_release(exact);
+	if( threaded ) image_release(threaded);
+	if( serial ) image_release(serial);
+	image_release(rgba);
+	atlas_pool_release(pool);
+
+	return ret;
+}
+
+/* random blobs of opaque texels */
+static image_t*
+random_glyph(uint32 width, uint32 height) {
+	image_t*	img		= image_allocate(width, height, PF_A8);
+	uint8*		pixels	= (uint8*)image_pixels(img);
+	uint32		blobs	= rng_range(0, 4);
+	uint32		b, x, y;
+
+	for( b = 0; b < blobs; ++b ) {
+		sint32	cx	= (sint32)rng_range(0, width - 1);
+		sint32	cy	= (sint32)rng_range(0, height - 1);
+		sint32	r	= (sint32)rng_range(1, 12);
+		for( y = 0; y < height; ++y ) {
+			for( x = 0; x < width; ++x ) {
+				sint32	dx	= (sint32)x - cx, dy = (sint32)y - cy;
+				if( dx * dx + dy * dy <= r * r ) pixels[y * width + x] = (uint8)rng_range(128, 255);
+			}
+		}
+	}
+
+	return img;
+}
+
+/* image_sdf against a brute force search of the nearest texel on the other side */
+static bool
+check_sdf(const image_t* glyph, const image_t* field, uint32 spread) {
+	uint32			w		= image_width(field);
+	uint32			h		= image_height(field);
+	const uint8*	src		= (const uint8*)image_pixels(glyph);
+	const uint8*	dst		= (const uint8*)image_pixels(field);
+	uint32			x, y, u, v;
+
+	if( w != image_width(glyph) + 2 * spread || h != image_height(glyph) + 2 * spread ) {
+		fprintf(stderr, "ERROR: distance field is %ux%u\n", w, h);
+		return false;
+	}
+
+	for( y = 0; y < h; ++y ) {
+		for( x = 0; x < w; ++x ) {
+			double	best	= (double)(w + h) * (w + h);
+			bool	in		= false;
+			double	s, expected;
+
+			#define SDF_INSIDE(px, py)	((px) >= spread && (py) >= spread && (px) - spread < image_width(glyph) && (py) - spread < image_height(glyph) \
+										 && src[((py) - spread) * image_width(glyph) + (px) - spread] > 127)
+
+			in	= SDF_INSIDE(x, y);
+			for( v = 0; v < h; ++v ) {
+				for( u = 0; u < w; ++u ) {
+					double	du	= (double)u - x, dv = (double)v - y;
+					if( SDF_INSIDE(u, v) != in && du * du + dv * dv < best ) best = du * du + dv * dv;
+				}
+			}
+			#undef SDF_INSIDE
+
+			if( best >= (double)(w + h) * (w + h) ) {
+				/* nothing on the other side */
+				expected	= in ? 255.0 : 0.0;
+			} else {
+				s			= in ? -sqrt(best) + 0.5 : sqrt(best) - 0.5;
+				expected	= 128.0 - s * 127.5 / spread;
+				expected	= expected < 0.0 ? 0.0 : (expected > 255.0 ? 255.0 : expected);
+			}
+
+			if( fabs((double)dst[y * w + x] - (int)expected) > 1.0 ) {
+				fprintf(stderr, "ERROR: distance field texel (%u, %u) is %u, expected %.2f\n", x, y, dst[y * w + x], expected);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static int
+test_sdf(void) {
+	atlas_pool_t*	pool	= atlas_pool_make(3);
+	const image_t*	images[40];
+	atlas_options_t	opts;
+	atlas_t*		atlas;
+	int				ret		= 0;
+	uint32			i;
+
+	if( NULL == pool ) return 1;
+
+	memset(images, 0, sizeof(images));
+	for( i = 0; i < 40 && ret == 0; ++i ) {
+		image_t*	glyph	= random_glyph(rng_range(1, 37), rng_range(1, 37));
+		uint32		spread	= rng_range(1, 8);
+		image_t*	serial	= image_sdf(glyph, spread, NULL);
+		image_t*	split	= image_sdf(glyph, spread, pool);
+
+		if( NULL == serial || NULL == split || !check_sdf(glyph, serial, spread) ) {
+			ret	= 1;
+		} else if( memcmp(image_pixels(serial), image_pixels(split), image_data_size(serial)) != 0 ) {
+			fprintf(stderr, "ERROR: the threaded distance field differs\n");
+			ret	= 1;
+		}
+
+		if( serial ) image_release(serial);
+		if( split ) image_release(split);
+		images[i]	= glyph;
+	}
+
+	/* in the atlas, every glyph comes out 'spread' larger on each side */
+	atlas_options_init(&opts);
+	opts.sdf_spread	= 4;
+	atlas	= ret == 0 ? atlas_make_ex(images, 40, &opts) : NULL;
+	if( ret == 0 && NULL == atlas ) ret = 1;
+	for( i = 0; ret == 0 && i < 40; ++i ) {
+		rect_t	r	= atlas_image_coordinates(atlas, i);
+		if( (uint32)r.width != image_width(images[i]) + 8 || (uint32)r.height != image_height(images[i]) + 8 ) {
+			fprintf(stderr, "ERROR: glyph %u was not packed as a distance field\n", i);
+			ret	= 1;
+		}
+	}
+	if( atlas ) atlas_release(atlas);
+
+	printf("%-4s distance fields\n", ret ? "FAIL" : "ok");
+
+	for( i = 0; i < 40 && images[i]; ++i ) {
+		image_release((image_t*)images[i]);
+	}
+	atlas_pool_release(pool);
+	return ret;
+}
+
+/* the moves against the texture they were made from: the live images must land where the compacted atlas has them */
+static bool
+check_moves(const image_t* old, const atlas_t* atlas, const atlas_move_t* moves, uint32 move_count, bool in_place) {
+	const image_t*	tex		= atlas_baked_image(atlas);
+	uint32			size	= image_width(tex);
+	uint32			side	= image_width(old) > size ? image_width(old) : size;
+	image_t*		gpu		= image_allocate(side, side, image_format(old));
+	image_t*		staging	= image_allocate(side, side, image_format(old));
+	uint32			i;
+	bool			ok		= true;
+
+	assert( NULL != gpu && NULL != staging );
+	image_blit(gpu, 0, 0, old, 0, 0, image_width(old), image_height(old));
+
+	/* in place moves straight on the texture, the others through a staging copy of their sources */
+	for( i = 0; i < move_count; ++i ) {
+		const atlas_move_t*	m	= &moves[i];
+		if( in_place ) {
+			image_blit(gpu, m->dst_x, m->dst_y, gpu, m->src_x, m->src_y, m->width, m->height);
+		} else {
+			image_blit(staging, m->src_x, m->src_y, gpu, m->src_x, m->src_y, m->width, m->height);
+		}
+	}
+	for( i = 0; i < move_count && !in_place; ++i ) {
+		const atlas_move_t*	m	= &moves[i];
+		image_blit(gpu, m->dst_x, m->dst_y, staging, m->src_x, m->src_y, m->width, m->height);
+	}
+
+	for( i = 0; i < atlas_image_count(atlas) && ok; ++i ) {
+		rect_t	r	= atlas_image_coordinates(atlas, i);
+		uint32	x, y;
+
+		for( y = (uint32)r.y; y < (uint32)(r.y + r.height) && ok; ++y ) {
+			for( x = (uint32)r.x; x < (uint32)(r.x + r.width); ++x ) {
+				if( !same_color(image_get_pixelb(gpu, x, y), image_get_pixelb(tex, x, y)) ) {
+					fprintf(stderr, "ERROR: the moves do not give image %u back\n", i);
+					ok	= false;
+					break;
+				}
+			}
+		}
+	}
+
+	image_release(staging);
+	image_release(gpu);
+	return ok;
+}
+
+/* remove 'percent' of the live images at random and compact to the smallest size */
+static bool
+thin_and_compact(atlas_t* atlas, const image_t** images, atlas_move_t* moves, uint32 percent, bool* staged) {
+	const image_t*	baked	= atlas_baked_image(atlas);
+	image_t*		old		= image_allocate(image_width(baked), image_height(baked), image_format(baked));
+	uint32			before	= image_width(baked);
+	uint32			live	= 0;
+	uint32			n, i;
+	bool			in_place;
+	bool			ok		= true;
+
+	memcpy(image_pixels(old), image_pixels(baked), image_data_size(baked));
+
+	for( i = 0; i < atlas_image_count(atlas); ++i ) {
+		if( images[i] && rng_next() % 100 < percent ) {
+			atlas_remove(atlas, i);
+			image_release((image_t*)images[i]);
+			images[i]	= NULL;
+		}
+		if( images[i] ) ++live;
+	}
+
+	n	= atlas_compact(atlas, 0, moves, &in_place);
+	if( n == ATLAS_NOT_FOUND || image_width(atlas_baked_image(atlas)) > before
+	 || !check_atlas(atlas, images, atlas_image_count(atlas)) || !check_moves(old, atlas, moves, n, in_place) ) {
+		ok	= false;
+	}
+	printf("%-4s compacted %u to %u: %u of %u images moved %s\n", ok ? "ok" : "FAIL", before, image_width(atlas_baked_image(atlas)), n == ATLAS_NOT_FOUND ? 0 : n, live, in_place ? "in place" : "through staging");
+
+	if( staged ) *staged = !in_place;
+	image_release(old);
+	return ok;
+}
+
+/* removes and adds on a long lived atlas, then compaction */
+static int
+test_compact(void) {
+	uint32			capacity	= 4096;
+	const image_t**	images	= (const image_t**)calloc(capacity, sizeof(image_t*));
+	const char**	keys	= (const char**)calloc(capacity, sizeof(char*));
+	const char**	named	= (const char**)calloc(capacity, sizeof(char*));	/* the key of each index */
+	atlas_move_t*	moves	= (atlas_move_t*)malloc(sizeof(atlas_move_t) * capacity);
+	atlas_options_t	opts;
+	atlas_t*		atlas;
+	uint32			round, i, count	= 300;
+	uint32			next	= count;	/* first unused key */
+	bool			staged	= false;
+	int				ret		= 0;
+
+	assert( NULL != images && NULL != keys && NULL != named && NULL != moves );
+
+	for( i = 0; i < capacity; ++i ) {
+		char*	key	= (char*)malloc(16);
+		assert( NULL != key );
+		sprintf(key, "img%u", i);
+		keys[i]	= key;
+	}
+
+	for( i = 0; i < count; ++i ) {
+		images[i]	= random_image(40);
+		named[i]	= keys[i];
+	}
+
+	atlas_options_init(&opts);
+	opts.trim			= true;
+	opts.allow_rotation	= true;
+	opts.output_format	= PF_R8G8B8A8;
+	opts.keys			= keys;
+	opts.uv_layout		= ATLAS_UV_AOS;
+	atlas	= atlas_make_ex(images, count, &opts);
+	if( NULL == atlas ) ret = 1;
+
+	/* churn: a third removed, then new images until one does not fit */
+	for( round = 0; round < 4 && ret == 0; ++round ) {
+		uint32	removed	= 0, added = 0;
+
+		for( i = 0; i < atlas_image_count(atlas); ++i ) {
+			if( NULL == images[i] || rng_next() % 3 != 0 ) continue;
+			atlas_remove(atlas, i);
+			image_release((image_t*)images[i]);
+			images[i]	= NULL;
+			++removed;
+		}
+
+		for( ;; ) {
+			image_t*	img		= random_image(24);
+			uint32		before	= atlas_image_count(atlas);
+			uint32		n		= next < capacity ? atlas_add(atlas, img, keys[next]) : ATLAS_NOT_FOUND;
+
+			if( n == ATLAS_NOT_FOUND ) {
+				image_release(img);
+				break;
+			}
+
+			/* a removed index is reused before a new one is taken */
+			if( NULL != images[n] || (n == before && removed > added) ) {
+				fprintf(stderr, "ERROR: image %u was added over a live image or past a removed one\n", n);
+				ret	= 1;
+			}
+			images[n]	= img;
+			named[n]	= keys[next++];
+			++added;
+		}
+
+		if( !check_atlas(atlas, images, atlas_image_count(atlas)) ) ret = 1;
+		for( i = 0; ret == 0 && i < atlas_image_count(atlas); ++i ) {
+			if( atlas_find(atlas, named[i]) != (images[i] ? i : ATLAS_NOT_FOUND) ) {
+				fprintf(stderr, "ERROR: key %s does not find its image\n", named[i]);
+				ret	= 1;
+			}
+		}
+		printf("%-4s round %u: %u removed, %u added\n", ret ? "FAIL" : "ok", round, removed, added);
+	}
+
+	/* thinned out until it fits smaller sizes */
+	for( round = 0; round < 3 && ret == 0; ++round ) {
+		if( !thin_and_compact(atlas, images, moves, 50, NULL) ) ret = 1;
+	}
+
+	/* larger images leave holes too small for the ones outside, some have to make room */
+	for( round = 0; round < 8 && ret == 0 && !staged; ++round ) {
+		const image_t**	sprites	= (const image_t**)malloc(sizeof(image_t*) * 400);
+		atlas_t*		sheet;
+
+		assert( NULL != sprites );
+		for( i = 0; i < 400; ++i ) {
+			sprites[i]	= random_image(64);
+		}
+
+		opts.keys		= NULL;
+		opts.uv_layout	= ATLAS_UV_NONE;
+		opts.trim		= false;
+		sheet	= atlas_make_ex(sprites, 400, &opts);
+		if( NULL == sheet || !thin_and_compact(sheet, sprites, moves, 48, &staged) ) ret = 1;
+
+		if( sheet ) atlas_release(sheet);
+		for( i = 0; i < 400; ++i ) {
+			if( sprites[i] ) image_release((image_t*)sprites[i]);
+		}
+		free(sprites);
+	}
+
+	if( ret == 0 && !staged ) {
+		fprintf(stderr, "ERROR: no compaction had to stage its moves\n");
+		ret	= 1;
+	}
+
+	if( atlas ) atlas_release(atlas);
+	for( i = 0; i < capacity; ++i ) {
+		if( images[i] ) image_release((image_t*)images[i]);
+		free((void*)keys[i]);
+	}
+	free(moves);
+	free(named);
+	free(keys);
+	free(images);
+
+	return ret;
+}
+
+/* a square of texels that only depend on the key and the size */
+static image_t*
+rasterize_glyph(void* user, const char* key, uint32 size) {
+	image_t*	img		= image_allocate(size, size, PF_A8);
+	uint8*		pixels	= (uint8*)image_pixels(img);
+	uint32		seed	= (uint32)strlen(key) * 31 + size;
+	uint32		x, y;
+
+	while( *key ) seed = seed * 131 + (uint8)*key++;
+	for( y = 0; y < size; ++y ) {
+		for( x = 0; x < size; ++x ) {
+			pixels[y * size + x]	= (uint8)(seed + x * 7 + y * 13);
+		}
+	}
+
+	++*(uint32*)user;
+	return img;
+}
+
+/* the cached texels of (key, size) against a fresh rasterization */
+static bool
+check_cached(const atlas_cache_t* cache, uint32 index, const char* key, uint32 size) {
+	const atlas_t*	atlas	= atlas_cache_atlas(cache);
+	rect_t			r		= atlas_image_coordinates(atlas, index);
+	uint32			calls	= 0;
+	image_t*		img		= rasterize_glyph(&calls, key, size);
+	bool			ok		= (uint32)r.width == size && (uint32)r.height == size;
+	uint32			x, y;
+
+	for( y = 0; y < size && ok; ++y ) {
+		for( x = 0; x < size && ok; ++x ) {
+			ok	= same_color(image_get_pixelb(img, x, y), image_get_pixelb(atlas_baked_image(atlas), (uint32)r.x + x, (uint32)r.y + y));
+		}
+	}
+
+	if( !ok ) fprintf(stderr, "ERROR: cached %s (%u) is wrong\n", key, size);
+	image_release(img);
+	return ok;
+}
+
+/* a cache full of 30x30 squares, 4 of them fit */
+static int
+test_cache_lru(void) {
+	static const char*	keys[]	= { "a", "b", "c", "d", "e" };
+	atlas_cache_t*	cache	= atlas_cache_make(64, PF_A8, 1);
+	uint32			calls	= 0;
+	uint32			first[5];
+	uint32			i;
+	int				ret		= 0;
+
+	for( i = 0; i < 4; ++i ) {
+		first[i]	= atlas_cache_get(cache, keys[i], 30, rasterize_glyph, &calls);
+	}
+	atlas_cache_next_frame(cache);
+
+	/* a is used again: b is now the least recently used */
+	if( atlas_cache_get(cache, "a", 30, rasterize_glyph, &calls) != first[0] || calls != 4 ) ret = 1;
+	atlas_cache_next_frame(cache);
+
+	first[4]	= atlas_cache_get(cache, "e", 30, rasterize_glyph, &calls);
+	if( first[4] != first[1] || calls != 5 || atlas_cache_evictions(cache) != 1 ) ret = 1;
+	if( atlas_cache_get(cache, "a", 30, rasterize_glyph, &calls) != first[0] || calls != 5 ) ret = 1;
+	if( ret == 0 && !check_cached(cache, first[4], "e", 30) ) ret = 1;
+
+	printf("%-4s least recently used evicted\n", ret ? "FAIL" : "ok");
+	atlas_cache_release(cache);
+
+	/* two frames in flight: what the last frame used can't go */
+	cache	= atlas_cache_make(64, PF_A8, 2);
+	calls	= 0;
+	for( i = 0; i < 4; ++i ) {
+		atlas_cache_get(cache, keys[i], 30, rasterize_glyph, &calls);
+	}
+	atlas_cache_next_frame(cache);
+	if( atlas_cache_get(cache, "e", 30, rasterize_glyph, &calls) != ATLAS_NOT_FOUND || atlas_cache_evictions(cache) != 0 ) ret = 1;
+	atlas_cache_next_frame(cache);
+	if( atlas_cache_get(cache, "e", 30, rasterize_glyph, &calls) == ATLAS_NOT_FOUND || atlas_cache_evictions(cache) != 1 ) ret = 1;
+
+	printf("%-4s pinned frames kept\n", ret ? "FAIL" : "ok");
+	atlas_cache_release(cache);
+
+	return ret;
+}
+
+/* text like traffic: a few glyphs used all the time, many rarely */
+static int
+test_cache(void) {
+	atlas_cache_t*	cache	= atlas_cache_make(512, PF_A8, 2);
+	char			keys[2][40][16];
+	uint32			sizes[2][40];
+	uint32			indices[2][40];
+	uint32			calls	= 0;
+	uint32			gets	= 0;
+	uint32			frame, i, k;
+	int				ret		= test_cache_lru();
+
+	for( frame = 0; frame < 400 && ret == 0; ++frame ) {
+		uint32	cur	= frame % 2;
+
+		for( i = 0; i < 40; ++i ) {
+			uint32	r	= rng_next() % 3000;
+			uint32	g	= (r * r) / 3000;		/* skewed towards the small ids */
+
+			sprintf(keys[cur][i], "g%u", g);
+			sizes[cur][i]	= 8 + g % 25;
+			indices[cur][i]	= atlas_cache_get(cache, keys[cur][i], sizes[cur][i], rasterize_glyph, &calls);
+			++gets;
+			if( indices[cur][i] == ATLAS_NOT_FOUND ) {
+				fprintf(stderr, "ERROR: %s did not fit\n", keys[cur][i]);
+				ret	= 1;
+				break;
+			}
+		}
+
+		/* this frame and the previous one are in flight, none of their glyphs may have moved */
+		for( k = 0; k < 2 && ret == 0 && frame > 0; ++k ) {
+			for( i = 0; i < 40 && ret == 0; ++i ) {
+				if( !check_cached(cache, indices[k][i], keys[k][i], sizes[k][i]) ) ret = 1;
+			}
+		}
+
+		atlas_cache_next_frame(cache);
+	}
+
+	printf("%-4s %u gets: %u misses, %u evictions, %u cached\n", ret ? "FAIL" : "ok", gets, calls, atlas_cache_evictions(cache), atlas_cache_count(cache));
+	if( ret == 0 && atlas_cache_evictions(cache) == 0 ) {
+		fprintf(stderr, "ERROR: the cache never filled up\n");
+		ret	= 1;
+	}
+
+	atlas_cache_release(cache);
+	return ret;
+}
+
+/*
+ * a texture kept up to date with the dirty regions only, then compared to
+ * the baked image. 'area' accumulates the texels uploaded
+ */
+static bool
+upload_dirty(image_t** gpu, const image_t* baked, const rect_t* regions, uint32 count, uint32 granularity, uint64_t* area) {
+	uint32	i;
+	bool	ok	= true;
+
+	if( NULL == *gpu || image_width(*gpu) != image_width(baked) || image_height(*gpu) != image_height(baked) || image_format(*gpu) != image_format(baked) ) {
+		if( *gpu ) image_release(*gpu);
+		*gpu	= image_allocate(image_width(baked), image_height(baked), image_format(baked));
+		assert( NULL != *gpu );
+	}
+
+	for( i = 0; i < count; ++i ) {
+		const rect_t*	r	= &regions[i];
+
+		if( (uint32)r->x % granularity || (uint32)r->y % granularity || r->width <= 0 || r->height <= 0
+		 || (uint32)(r->x + r->width) > image_width(baked) || (uint32)(r->y + r->height) > image_height(baked) ) {
+			fprintf(stderr, "ERROR: dirty region %u (%g, %g, %g, %g) is off the grid\n", i, r->x, r->y, r->width, r->height);
+			return false;
+		}
+
+		image_blit(*gpu, (uint32)r->x, (uint32)r->y, baked, (uint32)r->x, (uint32)r->y, (uint32)r->width, (uint32)r->height);
+		*area	+= (uint64_t)r->width * r->height;
+	}
+
+	if( memcmp(image_pixels(*gpu), image_pixels(baked), image_data_size(baked)) != 0 ) {
+		fprintf(stderr, "ERROR: the dirty regions missed some texels\n");
+		ok	= false;
+	}
+
+	return ok;
+}
+
+/* partial uploads after adds, removes, compaction and through a cache */
+static int
+test_dirty(void) {
+	const image_t*	images[256];
+	atlas_move_t	moves[256];
+	atlas_t*		atlas	= atlas_make_empty(512, PF_R8G8B8A8);
+	atlas_cache_t*	cache;
+	image_t*		gpu		= NULL;
+	const rect_t*	regions;
+	uint64_t		area	= 0;
+	uint64_t		full	= 0;
+	uint32			count, round, i, calls = 0;
+	uint32			granularity	= ATLAS_DIRTY_GRANULARITY;
+	bool			in_place;
+	int				ret		= 0;
+
+	memset(images, 0, sizeof(images));
+
+	/* everything is dirty at first, then nothing */
+	regions	= atlas_take_dirty_regions(atlas, &count);
+	if( count != 1 || !upload_dirty(&gpu, atlas_baked_image(atlas), regions, count, granularity, &area) || area != 512 * 512 ) ret = 1;
+	atlas_take_dirty_regions(atlas, &count);
+	if( count != 0 ) ret = 1;
+	area	= 0;
+
+	/* churn, a finer grid half way */
+	for( round = 0; round < 20 && ret == 0; ++round ) {
+		if( round == 10 ) {
+			granularity	= 8;
+			atlas_set_dirty_granularity(atlas, granularity);
+		}
+
+		for( i = 0; i < 256; ++i ) {
+			if( images[i] && rng_next() % 3 == 0 ) {
+				atlas_remove(atlas, i);
+				image_release((image_t*)images[i]);
+				images[i]	= NULL;
+			}
+		}
+		for( i = 0; i < 20; ++i ) {
+			image_t*	img		= random_image(40);
+			uint32		index	= atlas_add(atlas, img, NULL);
+			if( index == ATLAS_NOT_FOUND ) {
+				image_release(img);
+				break;
+			}
+			if( images[index] ) image_release((image_t*)images[index]);
+			images[index]	= img;
+		}
+
+		regions	= atlas_take_dirty_regions(atlas, &count);
+		if( !upload_dirty(&gpu, atlas_baked_image(atlas), regions, count, granularity, &area) ) ret = 1;
+		full	+= 512 * 512;
+	}
+
+	/* compaction: the moved texels, then the whole image once it shrinks */
+	for( i = 0; i < 256; ++i ) {
+		if( images[i] && rng_next() % 2 == 0 ) {
+			atlas_remove(atlas, i);
+			image_release((image_t*)images[i]);
+			images[i]	= NULL;
+		}
+	}
+	if( ret == 0 && atlas_compact(atlas, 512, moves, &in_place) == ATLAS_NOT_FOUND ) ret = 1;
+	regions	= atlas_take_dirty_regions(atlas, &count);
+	if( ret == 0 && !upload_dirty(&gpu, atlas_baked_image(atlas), regions, count, granularity, &area) ) ret = 1;
+	if( ret == 0 && atlas_compact(atlas, 0, moves, &in_place) == ATLAS_NOT_FOUND ) ret = 1;
+	regions	= atlas_take_dirty_regions(atlas, &count);
+	if( ret == 0 && (image_width(atlas_baked_image(atlas)) == 512 || count != 1 || !upload_dirty(&gpu, atlas_baked_image(atlas), regions, count, granularity, &area)) ) ret = 1;
+
+	printf("%-4s %.1f%% of the texels uploaded\n", ret ? "FAIL" : "ok", 100.0 * (double)area / (double)full);
+	if( ret == 0 && area * 2 > full ) {
+		fprintf(stderr, "ERROR: the dirty regions are not much smaller than the atlas\n");
+		ret	= 1;
+	}
+
+	for( i = 0; i < 256; ++i ) {
+		if( images[i] ) image_release((image_t*)images[i]);
+	}
+	atlas_release(atlas);
+
+	/* glyphs coming and going */
+	cache	= atlas_cache_make(256, PF_A8, 1);
+	area	= 0;
+	for( round = 0; round < 100 && ret == 0; ++round ) {
+		for( i = 0; i < 10; ++i ) {
+			char	key[16];
+			uint32	g	= rng_next() % 400;
+			sprintf(key, "g%u", g);
+			atlas_cache_get(cache, key, 8 + g % 25, rasterize_glyph, &calls);
+		}
+		atlas_cache_next_frame(cache);
+
+		regions	= atlas_cache_take_dirty_regions(cache, &count);
+		if( !upload_dirty(&gpu, atlas_baked_image(atlas_cache_atlas(cache)), regions, count, ATLAS_DIRTY_GRANULARITY, &area) ) ret = 1;
+	}
+
+	printf("%-4s cache uploads: %u evictions\n", ret ? "FAIL" : "ok", atlas_cache_evictions(cache));
+	atlas_cache_release(cache);
+
+	if( gpu ) image_release(gpu);
+	return ret;
+}
+
+/* how an asynchronous build ended, from its callback */
+typedef struct {
+	uint32				calls;
+	ATLAS_ASYNC_STATE	state;
+} async_done_t;
+
+static void
+async_done(void* user, atlas_async_t* async, ATLAS_ASYNC_STATE state) {
+	async_done_t*	done	= (async_done_t*)user;
+	(void)async;
+	++done->calls;
+	done->state	= state;
+}
+
+/* held by the test to keep a pool busy, then the build cancelled as it starts blitting */
+static pthread_mutex_t	async_gate		= PTHREAD_MUTEX_INITIALIZER;
+static atlas_async_t*	cancel_at_blit	= NULL;
+
+static void
+gate_task(void* arg) {
+	(void)arg;
+	pthread_mutex_lock(&async_gate);
+	pthread_mutex_unlock(&async_gate);
+}
+
+static void
+cancel_trace(void* user, const char* name) {
+	(void)user;
+	/* once, the pool has a single worker */
+	if( cancel_at_blit && strcmp(name, "blit") == 0 ) {
+		atlas_async_cancel(cancel_at_blit);
+		cancel_at_blit	= NULL;
+	}
+}
+
+static bool
+check_async(atlas_async_t* async, const async_done_t* done, ATLAS_ASYNC_STATE expected, const char* what) {
+	atlas_t*	atlas	= atlas_async_wait(async);
+	bool		ok		= atlas_async_poll(async) == expected && done->calls == 1 && done->state == expected && (atlas != NULL) == (expected == ATLAS_ASYNC_DONE);
+
+	printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+	if( atlas ) atlas_release(atlas);
+	atlas_async_release(async);
+	return ok;
+}
+
+/* builds on their own thread and on a pool, cancelled before and while running */
+static int
+test_async(void) {
+	uint32			count	= 3000;
+	const image_t**	images	= (const image_t**)malloc(sizeof(image_t*) * count);
+	atlas_pool_t*	pool	= atlas_pool_make(1);
+	atlas_options_t	opts;
+	async_done_t	done[4];
+	atlas_async_t*	async[4];
+	atlas_t*		serial;
+	atlas_t*		atlas;
+	uint32			i;
+	int				ret		= 0;
+
+	assert( NULL != images && NULL != pool );
+	memset(done, 0, sizeof(done));
+
+	for( i = 0; i < count; ++i ) {
+		images[i]	= random_image(40);
+	}
+
+	atlas_options_init(&opts);
+	opts.trim			= true;
+	opts.allow_rotation	= true;
+	serial	= atlas_make_ex(images, count, &opts);
+
+	/* same result as atlas_make_ex */
+	async[0]	= atlas_make_async(images, count, &opts, NULL, async_done, &done[0]);
+	atlas		= atlas_async_wait(async[0]);
+	if( NULL == atlas || NULL == serial || done[0].calls != 1 || done[0].state != ATLAS_ASYNC_DONE || atlas_async_poll(async[0]) != ATLAS_ASYNC_DONE ) ret = 1;
+	for( i = 0; ret == 0 && i < count; ++i ) {
+		rect_t	a	= atlas_image_coordinates(atlas, i);
+		rect_t	b	= atlas_image_coordinates(serial, i);
+		if( a.x != b.x || a.y != b.y || a.width != b.width || a.height != b.height ) {
+			fprintf(stderr, "ERROR: image %u is placed differently than by atlas_make_ex\n", i);
+			ret	= 1;
+		}
+	}
+	if( ret == 0 && memcmp(image_pixels(atlas_baked_image(atlas)), image_pixels(atlas_baked_image(serial)), image_data_size(atlas_baked_image(serial))) != 0 ) ret = 1;
+	if( atlas ) atlas_release(atlas);
+	atlas_async_release(async[0]);
+	printf("%-4s built on its own thread\n", ret ? "FAIL" : "ok");
+
+	/* the pool is kept busy while the builds are queued: one is cancelled before it runs, the other once it blits */
+	pthread_mutex_lock(&async_gate);
+	atlas_pool_submit(pool, gate_task, NULL);
+	async[1]	= atlas_make_async(images, count, &opts, pool, async_done, &done[1]);
+	async[2]	= atlas_make_async(images, count, &opts, pool, async_done, &done[2]);
+	async[3]	= atlas_make_async(images, count, &opts, pool, async_done, &done[3]);
+	atlas_async_cancel(async[1]);
+	cancel_at_blit	= async[2];
+	atlas_trace_set(cancel_trace, NULL, NULL);
+	pthread_mutex_unlock(&async_gate);
+
+	if( !check_async(async[1], &done[1], ATLAS_ASYNC_CANCELLED, "cancelled before it started") ) ret = 1;
+	if( !check_async(async[2], &done[2], ATLAS_ASYNC_CANCELLED, "cancelled while blitting") ) ret = 1;
+	if( !check_async(async[3], &done[3], ATLAS_ASYNC_DONE, "built on a pool") ) ret = 1;
+	atlas_trace_set(NULL, NULL, NULL);
+
+	/* too small a texture */
+	opts.max_size	= 128;
+	memset(done, 0, sizeof(done));
+	async[0]	= atlas_make_async(images, count, &opts, NULL, async_done, &done[0]);
+	if( !check_async(async[0], &done[0], ATLAS_ASYNC_FAILED, "failed build reported") ) ret = 1;
+
+	/* released without waiting */
+	async[0]	= atlas_make_async(images, count, NULL, NULL, NULL, NULL);
+	atlas_async_release(async[0]);
+
+	if( serial ) atlas_release(serial);
+	for( i = 0; i < count; ++i ) {
+		image_release((image_t*)images[i]);
+	}
+	free(images);
+	atlas_pool_release(pool);
+	return ret;
+}
+
+/* packed area, gutters included, over the box around the packed rects */
+static double
+packed_density(const atlas_t* atlas) {
+	double	area	= 0.0;
+	float	right	= 0.0f;
+	float	bottom	= 0.0f;
+	uint32	i;
+
+	for( i = 0; i < atlas_image_count(atlas); ++i ) {
+		rect_t	r	= atlas_image_coordinates(atlas, i);
+		if( r.width <= 0 || r.height <= 0 ) continue;
+		area	+= (double)(r.width + 1) * (r.height + 1);
+		if( r.x + r.width + 1 > right ) right = r.x + r.width + 1;
+		if( r.y + r.height + 1 > bottom ) bottom = r.y + r.height + 1;
+	}
+
+	return area > 0.0 ? area / ((double)right * bottom) : 0.0;
+}
+
+/* the quality search against the default one: never larger, often smaller or denser, and within its budget */
+static int
+test_search(void) {
+	uint32			smaller	= 0;
+	uint32			denser	= 0;
+	uint32			set, i;
+	int				ret		= 0;
+
+	for( set = 0; set < 24 && ret == 0; ++set ) {
+		uint32			count	= rng_range(20, 400);
+		uint32			side	= set % 3 == 0 ? 128 : 48;
+		const image_t**	images	= (const image_t**)malloc(sizeof(image_t*) * count);
+		atlas_options_t	opts;
+		atlas_stats_t	fast_stats, quality_stats;
+		atlas_t*		fast;
+		atlas_t*		quality;
+
+		assert( NULL != images );
+		for( i = 0; i < count; ++i ) {
+			images[i]	= random_image(side);
+		}
+
+		atlas_options_init(&opts);
+		opts.allow_rotation	= (set & 1) != 0;
+		opts.trim			= (set & 2) != 0;
+		opts.stats			= &fast_stats;
+		fast	= atlas_make_ex(images, count, &opts);
+
+		opts.search		= ATLAS_SEARCH_QUALITY;
+		opts.stats		= &quality_stats;
+		quality	= atlas_make_ex(images, count, &opts);
+
+		if( NULL == fast || NULL == quality || !check_atlas(quality, images, count) ) {
+			ret	= 1;
+		} else if( quality_stats.size > fast_stats.size || (quality_stats.size == fast_stats.size && packed_density(quality) + 1e-9 < packed_density(fast)) ) {
+			fprintf(stderr, "ERROR: set %u: the quality search did worse (%u, %.3f) than the default (%u, %.3f)\n", set, quality_stats.size, packed_density(quality), fast_stats.size, packed_density(fast));
+			ret	= 1;
+		} else if( quality_stats.size < fast_stats.size ) {
+			++smaller;
+		} else if( packed_density(quality) > packed_density(fast) + 1e-9 ) {
+			++denser;
+		}
+
+		if( fast ) atlas_release(fast);
+		if( quality ) atlas_release(quality);
+		for( i = 0; i < count; ++i ) {
+			image_release((image_t*)images[i]);
+		}
+		free(images);
+	}
+
+	printf("%-4s quality search: %u of 24 atlases smaller, %u denser\n", ret ? "FAIL" : "ok", smaller, denser);
+	if( ret == 0 && smaller + denser == 0 ) {
+		fprintf(stderr, "ERROR: the quality search never did better\n");
+		ret	= 1;
+	}
+
+	/* a budget already spent packs as the default search */
+	if( ret == 0 ) {
+		const image_t**	images	= random_images(2000, PF_R8G8B8A8);
+		atlas_options_t	opts;
+		atlas_stats_t	stats;
+		atlas_t*		atlas;
+
+		atlas_options_init(&opts);
+		opts.search				= ATLAS_SEARCH_QUALITY;
+		opts.search_budget_ms	= 1e-6;
+		opts.stats				= &stats;
+		atlas	= atlas_make_ex(images, 2000, &opts);
+		if( NULL == atlas || stats.search_packs != 0 || !check_atlas(atlas, images, 2000) ) ret = 1;
+		printf("%-4s search budget respected\n", ret ? "FAIL" : "ok");
+
+		if( atlas ) atlas_release(atlas);
+		release_images(images, 2000);
+	}
+
+	return ret;
+}
+
+/* same images, keys and texels */
+static bool
+same_atlas(const atlas_t* a, const atlas_t* b) {
+	const image_t*	ta	= atlas_baked_image(a);
+	const image_t*	tb	= atlas_baked_image(b);
+	uint32			i;
+
+	if( atlas_image_count(a) != atlas_image_count(b) || image_format(ta) != image_format(tb) || image_width(ta) != image_width(tb)
+	 || image_data_size(ta) != image_data_size(tb) || memcmp(image_pixels(ta), image_pixels(tb), image_data_size(ta)) != 0 ) {
+		return false;
+	}
+
+	for( i = 0; i < atlas_image_count(a); ++i ) {
+		rect_t		ra	= atlas_image_coordinates(a, i);
+		rect_t		rb	= atlas_image_coordinates(b, i);
+		const char*	key	= atlas_image_key(a, i);
+
+		if( ra.x != rb.x || ra.y != rb.y || ra.width != rb.width || ra.height != rb.height ) return false;
+		if( key && atlas_find(b, key) != i ) return false;
+	}
+
+	return true;
+}
+
+/* publish, attach from this and another process, republish, unpublish */
+static int
+test_shared(void) {
+	const image_t**	images[2];
+	const char*		keys[300];
+	char			names[300][16];
+	char			name[64];
+	atlas_options_t	opts;
+	atlas_t*		atlases[2];
+	atlas_t*		attached;
+	atlas_t*		current;
+	uint8			pixels[16 * 16 * 4];
+	image_t*		wrapped;
+	pid_t			child;
+	int				status	= 1;
+	int				ret		= 0;
+	uint32			i;
+
+	/* borrowed pixels are written through and outlive the image */
+	memset(pixels, 0, sizeof(pixels));
+	wrapped	= image_wrap(16, 16, PF_R8G8B8A8, pixels);
+	image_set_pixelb(wrapped, 3, 2, color4b(1, 2, 3, 4));
+	image_release(wrapped);
+	if( pixels[(2 * 16 + 3) * 4] != 1 || pixels[(2 * 16 + 3) * 4 + 3] != 4 ) ret = 1;
+	printf("%-4s wrapped pixels\n", ret ? "FAIL" : "ok");
+
+	for( i = 0; i < 300; ++i ) {
+		sprintf(names[i], "img%u", i);
+		keys[i]	= names[i];
+	}
+
+	atlas_options_init(&opts);
+	opts.keys		= keys;
+	images[0]		= random_images(300, PF_R8G8B8A8);
+	images[1]		= random_images(200, PF_A8);
+	atlases[0]		= atlas_make_ex(images[0], 300, &opts);
+	atlases[1]		= atlas_make_ex(images[1], 200, &opts);
+	if( NULL == atlases[0] || NULL == atlases[1] ) return 1;
+
+	sprintf(name, "/atlas-test-%ld", (long)getpid());
+
+	/* this process */
+	attached	= atlas_publish(atlases[0], name) == 1 ? atlas_attach(name) : NULL;
+	if( NULL == attached || atlas_generation(attached) != 1 || atlas_stale(attached) || !same_atlas(atlases[0], attached) ) ret = 1;
+	if( attached && (atlas_remove(attached, 0) || atlas_compact(attached, 0, NULL, NULL) != ATLAS_NOT_FOUND) ) ret = 1;
+	printf("%-4s attached in this process\n", ret ? "FAIL" : "ok");
+
+	/* another one, which only sees the segment */
+	child	= fork();
+	if( child == 0 ) {
+		atlas_t*	other	= atlas_attach(name);
+		bool		ok		= NULL != other && same_atlas(atlases[0], other);
+		if( other ) atlas_release(other);
+		_exit(ok ? 0 : 1);
+	}
+	if( child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) ret = 1;
+	printf("%-4s attached in another process\n", ret ? "FAIL" : "ok");
+
+	/* a new generation: the attached one is stale but still readable */
+	current	= atlas_publish(atlases[1], name) == 2 ? atlas_attach(name) : NULL;
+	if( NULL == current || atlas_generation(current) != 2 || !same_atlas(atlases[1], current) ) ret = 1;
+	if( attached && (!atlas_stale(attached) || !same_atlas(atlases[0], attached)) ) ret = 1;
+	printf("%-4s republished as generation 2\n", ret ? "FAIL" : "ok");
+
+	if( !atlas_unpublish(name) ) ret = 1;
+	if( current && !same_atlas(atlases[1], current) ) ret = 1;
+	if( atlas_attach(name) != NULL ) ret = 1;
+	printf("%-4s unpublished\n", ret ? "FAIL" : "ok");
+
+	if( attached ) atlas_release(attached);
+	if( current ) atlas_release(current);
+	for( i = 0; i < 2; ++i ) {
+		atlas_release(atlases[i]);
+		release_images(images[i], i ? 200 : 300);
+	}
+	return ret;
+}
+
+/* 'size' bytes of 'path', NULL if it can't be read */
+static uint8*
+read_file(const char* path, size_t* size) {
+	FILE*	fp		= fopen(path, "rb");
+	uint8*	data	= NULL;
+	long	len;
+
+	if( NULL == fp ) return NULL;
+	if( fseek(fp, 0, SEEK_END) == 0 && (len = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0 ) {
+		data	= (uint8*)malloc((size_t)len);
+		assert( NULL != data );
+		if( fread(data, 1, (size_t)len, fp) != (size_t)len ) {
+			free(data);
+			data	= NULL;
+		}
+		*size	= (size_t)len;
+	}
+	fclose(fp);
+	return data;
+}
+
+/* writes a copy of 'data' with 'len' bytes at 'offset' replaced */
+static bool
+write_patched(const uint8* data, size_t size, size_t offset, const void* value, size_t len, const char* path) {
+	uint8*	copy	= (uint8*)malloc(size);
+	FILE*	fp;
+	bool	written;
+
+	assert( NULL != copy );
+	memcpy(copy, data, size);
+	memcpy(&copy[offset], value, len);
+
+	fp		= fopen(path, "wb");
+	written	= NULL != fp && fwrite(copy, 1, size, fp) == size;
+	if( fp && fclose(fp) != 0 ) written = false;
+	free(copy);
+
+	return written;
+}
+
+/* the patched copy must not load */
+static bool
+rejects_corrupt(const uint8* data, size_t size, size_t offset, const void* value, size_t len, const char* path) {
+	atlas_t*	atlas;
+
+	if( !write_patched(data, size, offset, value, len, path) ) return false;
+
+	atlas	= atlas_load(path);
+	if( atlas ) atlas_release(atlas);
+	return NULL == atlas;
+}
+
+static bool
+rejects_corrupt_tiles(const uint8* data, size_t size, size_t offset, const void* value, size_t len, const char* path) {
+	atlas_tiles_t*	tiles;
+
+	if( !write_patched(data, size, offset, value, len, path) ) return false;
+
+	tiles	= atlas_tiles_open(path);
+	if( tiles ) atlas_tiles_release(tiles);
+	return NULL == tiles;
+}
+
+/*
+ * atlas files, published segments and tile files whose tables point
+ * outside of themselves are rejected. the offsets follow the layouts of
+ * serialize.c: a 12 word header, 10 word entries, the buckets, the slots
+ * then the key blob; for tiles a 10 word header, the palette, the ranges
+ * then the tile offsets
+ */
+static int
+test_load(void) {
+	const char*		path	= "atlas-test-load.tmp";
+	const char*		bad		= "atlas-test-load-bad.tmp";
+	const char*		keys[50];
+	char			names[50][16];
+	atlas_options_t	opts;
+	const image_t**	images	= random_images(50, PF_R8G8B8A8);
+	atlas_t*		atlas;
+	atlas_t*		loaded	= NULL;
+	uint8*			data	= NULL;
+	size_t			size	= 0;
+	int				ret		= 0;
+	uint32			i;
+
+	for( i = 0; i < 50; ++i ) {
+		sprintf(names[i], "img%u", i);
+		keys[i]	= names[i];
+	}
+
+	atlas_options_init(&opts);
+	opts.keys	= keys;
+	atlas		= atlas_make_ex(images, 50, &opts);
+
+	if( NULL == atlas || !atlas_save(atlas, path) || NULL == (data = read_file(path, &size))
+	 || NULL == (loaded = atlas_load(path)) || !same_atlas(atlas, loaded) ) {
+		ret	= 1;
+	}
+	printf("%-4s keyed atlas loads back\n", ret ? "FAIL" : "ok");
+
+	if( ret == 0 ) {
+		const uint32*	hdr			= (const uint32*)data;
+		uint32			count		= hdr[3];
+		uint32			key_count	= hdr[4];
+		uint32			keys_size	= hdr[5];
+		size_t			entries		= 12 * sizeof(uint32);
+		size_t			buckets		= entries + 10 * sizeof(uint32) * count;
+		size_t			slots		= buckets + sizeof(uint32) * key_count;
+		size_t			blob		= slots + sizeof(uint32) * key_count;
+		sint32			bucket		= -(sint32)key_count - 1;
+		char			unterminated	= 'x';
+
+		if( key_count == 0 || keys_size == 0
+		 || !rejects_corrupt(data, size, slots + sizeof(uint32) * 7, &count, sizeof(uint32), bad)
+		 || !rejects_corrupt(data, size, entries + 10 * sizeof(uint32) * 3 + 9 * sizeof(uint32), &keys_size, sizeof(uint32), bad)
+		 || !rejects_corrupt(data, size, blob + keys_size - 1, &unterminated, 1, bad)
+		 || !rejects_corrupt(data, size, buckets + sizeof(uint32) * 5, &bucket, sizeof(sint32), bad) ) {
+			fprintf(stderr, "ERROR: an atlas with tables out of range loads\n");
+			ret	= 1;
+		}
+		printf("%-4s slots, key offsets, key blob and buckets are checked\n", ret ? "FAIL" : "ok");
+	}
+
+	/* a published segment gets the same checks: corrupt it in place, then attach */
+	if( ret == 0 ) {
+		const uint32*	hdr			= (const uint32*)data;
+		size_t			slots		= 12 * sizeof(uint32) + 10 * sizeof(uint32) * hdr[3] + sizeof(uint32) * hdr[4];
+		size_t			pixels_size	= 9 * sizeof(uint32);
+		uint32			wrong		= hdr[9] + 1;
+		atlas_t*		attached[3]	= { NULL, NULL, NULL };
+		uint8*			mapping		= (uint8*)MAP_FAILED;
+		char			name[64];
+		char			segment[80];
+		int				fd;
+
+		sprintf(name, "/atlas-test-load-%ld", (long)getpid());
+		sprintf(segment, "%s.1", name);
+		fd	= atlas_publish(atlas, name) == 1 ? shm_open(segment, O_RDWR, 0) : -1;
+		if( fd >= 0 ) {
+			mapping	= (uint8*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+		}
+
+		if( mapping != (uint8*)MAP_FAILED ) {
+			memcpy(&mapping[slots], &hdr[3], sizeof(uint32));
+			attached[0]	= atlas_attach(name);
+			memcpy(&mapping[slots], &data[slots], sizeof(uint32));
+
+			memcpy(&mapping[pixels_size], &wrong, sizeof(uint32));
+			attached[1]	= atlas_attach(name);
+			memcpy(&mapping[pixels_size], &data[pixels_size], sizeof(uint32));
+
+			attached[2]	= atlas_attach(name);
+			munmap(mapping, size);
+		}
+
+		if( NULL != attached[0] || NULL != attached[1] || NULL == attached[2] || !same_atlas(atlas, attached[2]) ) {
+			fprintf(stderr, "ERROR: a corrupt segment attaches\n");
+			ret	= 1;
+		}
+		printf("%-4s published segments are checked\n", ret ? "FAIL" : "ok");
+
+		for( i = 0; i < 3; ++i ) {
+			if( attached[i] ) atlas_release(attached[i]);
+		}
+		atlas_unpublish(name);
+	}
+
+	/* tile files: header, offsets and tile indices */
+	if( ret == 0 ) {
+		atlas_tiles_t*	tiles		= atlas_tiles_make(atlas, 64, 2);
+		atlas_tiles_t*	opened		= NULL;
+		uint8*			file		= NULL;
+		size_t			file_size	= 0;
+
+		if( NULL == tiles || !atlas_tiles_save(tiles, path) || NULL == (file = read_file(path, &file_size)) || NULL == (opened = atlas_tiles_open(path)) ) {
+			ret	= 1;
+		} else {
+			const uint32*	hdr			= (const uint32*)file;
+			size_t			offsets		= 10 * sizeof(uint32) + sizeof(color4b_t) * hdr[9] + sizeof(atlas_tile_range_t) * hdr[7];
+			uint32			tile_count	= hdr[4] * hdr[5];
+			uint32			format		= 0x1234;
+			uint32			huge[2]		= { 0x10000, 0x10001 };
+			uint64_t		past_end	= file_size;
+			uint32			t;
+
+			for( t = 0; t < tile_count && !atlas_tiles_used(opened, t); ++t );
+
+			if( t == tile_count
+			 || !rejects_corrupt_tiles(file, file_size, 6 * sizeof(uint32), &format, sizeof(uint32), bad)
+			 || !rejects_corrupt_tiles(file, file_size, 4 * sizeof(uint32), huge, sizeof(huge), bad)
+			 || !rejects_corrupt_tiles(file, file_size, offsets + sizeof(uint64_t) * t, &past_end, sizeof(uint64_t), bad)
+			 || !atlas_tiles_load_tile(opened, t)
+			 || atlas_tiles_load_tile(opened, tile_count) ) {
+				fprintf(stderr, "ERROR: a tile file or tile out of range is accepted\n");
+				ret	= 1;
+			}
+		}
+		printf("%-4s tile formats, grid sizes, offsets and indices are checked\n", ret ? "FAIL" : "ok");
+
+		free(file);
+		if( opened ) atlas_tiles_release(opened);
+		if( tiles ) atlas_tiles_release(tiles);
+	}
+
+	remove(path);
+	remove(bad);
+	free(data);
+	if( loaded ) atlas_release(loaded);
+	if( atlas ) atlas_release(atlas);
+	release_images(images, 50);
+
+	return ret;
+}
+
+/* the chrome sink writes event names as JSON strings, whatever they hold */
+static int
+test_trace(void) {
+	const char*	path	= "atlas-test-trace.tmp";
+	const char*	name	= "say \"hi\"\\\n\t\x01";
+	const char*	escaped	= "\"name\":\"say \\\"hi\\\"\\\\\\u000a\\u0009\\u0001\"";
+	uint8*		data	= NULL;
+	char*		text	= NULL;
+	size_t		size	= 0;
+	size_t		i;
+	int			ret		= 0;
+
+	if( !atlas_trace_chrome_open(path) ) return 1;
+	atlas_trace_begin(name);
+	atlas_trace_end(name);
+	atlas_trace_chrome_close();
+
+	if( NULL != (data = read_file(path, &size)) ) {
+		text	= (char*)malloc(size + 1);
+		assert( NULL != text );
+		memcpy(text, data, size);
+		text[size]	= '\0';
+	}
+
+	if( NULL == text || NULL == strstr(text, escaped) || NULL == strstr(strstr(text, escaped) + 1, escaped) ) ret = 1;
+	for( i = 0; text && i < size; ++i ) {
+		if( (uint8)text[i] < 0x20 && text[i] != '\n' ) ret = 1;
+	}
+	printf("%-4s event names are escaped\n", ret ? "FAIL" : "ok");
+
+	remove(path);
+	free(text);
+	free(data);
+	return ret;
+}
+
+/* copies of a set of images, as if decoded from disk on every call */
+typedef struct {
+	const image_t**	images;
+	uint32			calls;
+	uint32			fail_at;		/* the call that gives no image, ~0u for none */
+} producer_t;
+
+static image_t*
+produce_copy(void* user, uint32 index) {
+	producer_t*		p	= (producer_t*)user;
+	const image_t*	src	= p->images[index];
+	image_t*		img;
+
+	if( p->calls++ == p->fail_at ) return NULL;
+
+	img	= image_allocate(image_width(src), image_height(src), image_format(src));
+	image_blit(img, 0, 0, src, 0, 0, image_width(src), image_height(src));
+	if( image_palette_size(src) ) image_set_palette(img, image_palette(src), image_palette_size(src));
+	return img;
+}
+
+/* a consuming build against atlas_make_ex of the same images, with its peak memory bound */
+static bool
+check_consume(const image_t** images, uint32 count, atlas_options_t* opts, const char* what) {
+	producer_t		producer;
+	atlas_stats_t	stats[2];
+	atlas_t*		made;
+	atlas_t*		consumed;
+	size_t			largest	= 0;
+	bool			ok;
+	uint32			i;
+
+	for( i = 0; i < count; ++i ) {
+		if( image_data_size(images[i]) > largest ) largest = image_data_size(images[i]);
+	}
+
+	opts->stats	= &stats[0];
+	made		= atlas_make_ex(images, count, opts);
+
+	producer.images		= images;
+	producer.calls		= 0;
+	producer.fail_at	= ~0u;
+	opts->stats	= &stats[1];
+	consumed	= atlas_make_consume(count, produce_copy, &producer, opts);
+	opts->stats	= NULL;
+
+	ok	= made && consumed && same_atlas(made, consumed) && producer.calls == 2 * count;
+
+	/* the baked image and one source at a time, instead of all of them */
+	if( ok && opts->sdf_spread == 0 ) {
+		ok	= stats[1].peak_bytes < stats[0].peak_bytes
+		   && stats[1].peak_bytes <= image_data_size(atlas_baked_image(consumed)) + largest + stats[1].peak_temp_bytes;
+	}
+
+	printf("%-4s %s, peak %lu bytes instead of %lu\n", ok ? "ok" : "FAIL", what, (unsigned long)stats[1].peak_bytes, (unsigned long)stats[0].peak_bytes);
+
+	if( made ) atlas_release(made);
+	if( consumed ) atlas_release(consumed);
+	return ok;
+}
+
+/* atlas_make_consume bakes what atlas_make_ex does with a fraction of the memory */
+static int
+test_consume(void) {
+	const image_t**	images	= random_images(400, PF_R8G8B8A8);
+	const image_t**	indexed	= (const image_t**)malloc(sizeof(image_t*) * 60);
+	const image_t**	glyphs	= (const image_t**)malloc(sizeof(image_t*) * 60);
+	atlas_options_t	opts;
+	producer_t		producer;
+	atlas_t*		atlas;
+	int				ret		= 0;
+	uint32			i;
+
+	assert( NULL != indexed && NULL != glyphs );
+	for( i = 0; i < 60; ++i ) {
+		indexed[i]	= image_quantize(images[i], 16, NULL);
+		glyphs[i]	= random_glyph(rng_range(4, 40), rng_range(4, 40));
+		assert( NULL != indexed[i] );
+	}
+
+	atlas_options_init(&opts);
+	opts.trim			= true;
+	opts.allow_rotation	= true;
+	if( !check_consume(images, 400, &opts, "trimmed and rotated") ) ret = 1;
+
+	atlas_options_init(&opts);
+	if( !check_consume(indexed, 60, &opts, "indexed images, merged palette") ) ret = 1;
+
+	opts.output_format	= PF_BC3;
+	opts.alignment		= 4;
+	if( !check_consume(images, 400, &opts, "block compressed") ) ret = 1;
+
+	atlas_options_init(&opts);
+	opts.sdf_spread		= 4;
+	opts.trim			= true;
+	if( !check_consume(glyphs, 60, &opts, "distance fields") ) ret = 1;
+
+	/* a producer failing on either pass fails the build */
+	atlas_options_init(&opts);
+	producer.images		= images;
+	for( i = 0; i < 2; ++i ) {
+		producer.calls		= 0;
+		producer.fail_at	= i ? 500 : 100;
+		atlas	= atlas_make_consume(400, produce_copy, &producer, &opts);
+		if( atlas ) {
+			atlas_release(atlas);
+			ret	= 1;
+		}
+	}
+	printf("%-4s failing producer\n", ret ? "FAIL" : "ok");
+
+	release_images(glyphs, 60);
+	release_images(indexed, 60);
+	release_images(images, 400);
+	return ret;
+}
+
+/* HDR texels up to 16 with transparent borders, stored as 'fmt' */
+static image_t*
+hdr_image(uint32 max_side, PIXEL_FORMAT fmt) {
+	uint32		w	= rng_range(1, max_side);
+	uint32		h	= rng_range(1, max_side);
+	uint32		l	= rng_range(0, w / 3), r = rng_range(0, w / 3);
+	uint32		t	= rng_range(0, h / 3), b = rng_range(0, h / 3);
+	image_t*	img	= image_allocate(w, h, fmt);
+	uint32		x, y;
+
+	for( y = 0; y < h; ++y ) {
+		for( x = 0; x < w; ++x ) {
+			bool	in	= x >= l && x < w - r && y >= t && y < h - b;
+			image_set_pixelf(img, x, y, color4((float)(rng_next() % 65536) / 4096.0f, (float)(rng_next() % 65536) / 4096.0f,
+				(float)(rng_next() % 65536) / 4096.0f, in ? (float)(rng_next() % 1024 + 1) / 1024.0f : 0.0f));
+		}
+	}
+
+	return img;
+}
+
+/* the value of half 'h', from its definition */
+static float
+half_value(uint16 h) {
+	uint32	e	= (h >> 10) & 0x1F;
+	uint32	m	= h & 0x3FF;
+	float	v	= e ? ldexpf((float)(0x400 | m), (int)e - 25) : ldexpf((float)m, -24);
+	return (h & 0x8000) ? -v : v;
+}
+
+/* float to half on one texel, through a row conversion and through image_set_pixelf */
+static bool
+check_half(float v, uint16 expected) {
+	image_t*	f32	= image_allocate(1, 1, PF_R32G32B32A32F);
+	image_t*	f16	= image_allocate(1, 1, PF_R16G16B16A16F);
+	image_t*	one	= image_allocate(1, 1, PF_R16G16B16A16F);
+	bool		ok;
+
+	image_set_pixelf(f32, 0, 0, color4(v, v, v, v));
+	image_blit(f16, 0, 0, f32, 0, 0, 1, 1);
+	image_set_pixelf(one, 0, 0, color4(v, v, v, v));
+	ok	= ((const uint16*)image_pixels(f16))[0] == expected && ((const uint16*)image_pixels(one))[3] == expected;
+	if( !ok ) {
+		fprintf(stderr, "ERROR: %g gave half 0x%04X and 0x%04X, expected 0x%04X\n", (double)v,
+			((const uint16*)image_pixels(f16))[0], ((const uint16*)image_pixels(one))[3], expected);
+	}
+
+	image_release(one);
+	image_release(f16);
+	image_release(f32);
+	return ok;
+}
+
+/* the float formats: half conversions, 8 bit rounding and HDR atlases */
+static int
+test_hdr(void) {
+	image_t*		halves	= image_allocate(16384, 1, PF_R16G16B16A16F);
+	image_t*		floats	= image_allocate(16384, 1, PF_R32G32B32A32F);
+	image_t*		back	= image_allocate(16384, 1, PF_R16G16B16A16F);
+	image_t*		rgba	= image_allocate(1, 1, PF_R8G8B8A8);
+	const image_t*	images[300];
+	atlas_options_t	opts;
+	atlas_t*		atlas;
+	atlas_t*		loaded;
+	atlas_t*		atlases[ATLAS_SPLIT_MAX];
+	uint32			atlas_of[300], index_of[300];
+	const uint16*	h;
+	const float*	f;
+	const uint8*	p;
+	int				ret		= 0;
+	uint32			i, n;
+
+	/* every half to float and back, NaNs only need to stay NaNs */
+	h	= (const uint16*)image_pixels(halves);
+	for( i = 0; i < 65536; ++i ) {
+		((uint16*)image_pixels(halves))[i]	= (uint16)i;
+	}
+	image_blit(floats, 0, 0, halves, 0, 0, 16384, 1);
+	image_blit(back, 0, 0, floats, 0, 0, 16384, 1);
+	f	= (const float*)image_pixels(floats);
+	for( i = 0; i < 65536 && ret == 0; ++i ) {
+		uint16	b	= ((const uint16*)image_pixels(back))[i];
+		bool	nan	= (h[i] & 0x7C00) == 0x7C00 && (h[i] & 0x3FF);
+
+		if( nan ? !isnan(f[i]) || (b & 0x7C00) != 0x7C00 || !(b & 0x3FF) : b != h[i] || (((h[i] & 0x7C00) != 0x7C00) && f[i] != half_value(h[i])) ) {
+			fprintf(stderr, "ERROR: half 0x%04X gave %g and 0x%04X\n", h[i], (double)f[i], b);
+			ret	= 1;
+		}
+	}
+	printf("%-4s every half through float and back\n", ret ? "FAIL" : "ok");
+
+	/* float to half rounds to the nearest even, and overflows to infinity */
+	if( !check_half(1.0f + ldexpf(1.0f, -11), 0x3C00)
+	 || !check_half(1.0f + 3.0f * ldexpf(1.0f, -11), 0x3C02)
+	 || !check_half(-2.0f, 0xC000)
+	 || !check_half(65519.0f, 0x7BFF)
+	 || !check_half(65520.0f, 0x7C00)
+	 || !check_half(1e30f, 0x7C00)
+	 || !check_half(ldexpf(1.0f, -25), 0x0000)
+	 || !check_half(nextafterf(ldexpf(1.0f, -25), 1.0f), 0x0001)
+	 || !check_half(3.0f * ldexpf(1.0f, -25), 0x0002)
+	 || !check_half(ldexpf(1.0f, -14) - ldexpf(1.0f, -25), 0x0400) ) {
+		ret	= 1;
+	}
+	printf("%-4s float to half rounding\n", ret ? "FAIL" : "ok");
+
+	/* 8 bit formats round to the nearest and clamp */
+	p	= (const uint8*)image_pixels(rgba);
+	image_set_pixelf(rgba, 0, 0, color4(0.5f, 1.5f, -0.25f, 0.999f));
+	if( p[0] != 128 || p[1] != 255 || p[2] != 0 || p[3] != 255 ) ret = 1;
+	image_set_pixelf(rgba, 0, 0, color4(127.4f / 255.0f, 127.6f / 255.0f, NAN, 0.6f / 255.0f));
+	if( p[0] != 127 || p[1] != 128 || p[2] != 0 || p[3] != 1 ) ret = 1;
+	printf("%-4s float to 8 bit rounding and clamping\n", ret ? "FAIL" : "ok");
+
+	/* float sets bake in their format, or in the widest float one when mixed */
+	for( i = 0; i < 300; ++i ) {
+		images[i]	= hdr_image(40, i % 2 ? PF_R32G32B32A32F : PF_R16G16B16A16F);
+	}
+
+	for( n = 0; n < 5; ++n ) {
+		static const PIXEL_FORMAT	expected[]	= { PF_R16G16B16A16F, PF_R32G32B32A32F, PF_R16G16B16A16F, PF_R16G16B16A16F, PF_R8G8B8A8 };
+		const image_t*	set[300];
+		uint32			count	= 0;
+
+		atlas_options_init(&opts);
+		opts.trim			= true;
+		opts.allow_rotation	= n % 2 == 0;
+		for( i = 0; i < 300; ++i ) {
+			/* F16 only, everything, F16 with RGBA8, everything as F16, everything as RGBA8 */
+			if( n == 0 && i % 2 ) continue;
+			if( n == 2 && i % 2 ) {
+				set[count++]	= random_image(40);
+				continue;
+			}
+			set[count++]	= images[i];
+		}
+		if( n == 3 ) opts.output_format = PF_R16G16B16A16F;
+		if( n == 4 ) opts.output_format = PF_R8G8B8A8;
+
+		atlas	= atlas_make_ex(set, count, &opts);
+		if( NULL == atlas || image_format(atlas_baked_image(atlas)) != expected[n] || !check_atlas(atlas, set, count) ) ret = 1;
+
+		/* the binary atlas keeps the float texels as they are */
+		if( atlas && n == 1 ) {
+			loaded	= atlas_save(atlas, "test_hdr.atlas") ? atlas_load("test_hdr.atlas") : NULL;
+			if( NULL == loaded || !same_atlas(atlas, loaded) ) ret = 1;
+			if( loaded ) atlas_release(loaded);
+			remove("test_hdr.atlas");
+		}
+
+		if( atlas ) atlas_release(atlas);
+		if( n == 2 ) {
+			for( i = 1; i < count; i += 2 ) image_release((image_t*)set[i]);
+		}
+	}
+	printf("%-4s HDR atlases\n", ret ? "FAIL" : "ok");
+
+	/* and get their own atlases when split */
+	atlas_options_init(&opts);
+	n	= atlas_make_split(images, 300, &opts, atlases, atlas_of, index_of);
+	if( n != 2 ) ret = 1;
+	for( i = 0; i < n; ++i ) {
+		if( image_format(atlas_baked_image(atlases[i])) != image_format(images[atlas_of[0] == i ? 0 : 1]) ) ret = 1;
+		atlas_release(atlases[i]);
+	}
+	printf("%-4s split per float format\n", ret ? "FAIL" : "ok");
+
+	/* a 16384 float texture is 4 GiB: sized in full, and never baked */
+	{
+		image_t*		wide	= image_allocate(8193, 1, PF_R32G32B32A32F);
+		image_t*		huge	= image_wrap(16384, 16384, PF_R32G32B32A32F, wide);
+		const image_t*	one		= wide;
+
+		if( sizeof(size_t) > 4 && image_data_size(huge) != (size_t)16384 * 16384 * 16 ) ret = 1;
+		atlas_options_init(&opts);
+		atlas	= atlas_make_ex(&one, 1, &opts);
+		if( NULL != atlas ) {
+			fprintf(stderr, "ERROR: a %ux%u float atlas was baked\n", image_width(atlas_baked_image(atlas)), image_height(atlas_baked_image(atlas)));
+			atlas_release(atlas);
+			ret	= 1;
+		}
+		image_release(huge);
+		image_release(wide);
+	}
+	printf("%-4s float atlases over 4 GiB\n", ret ? "FAIL" : "ok");
+
+	for( i = 0; i < 300; ++i ) {
+		image_release((image_t*)images[i]);
+	}
+	image_release(rgba);
+	image_release(back);
+	image_release(floats);
+	image_release(halves);
+	return ret;
+}
+
+/*
+ * fixed synthetic datasets measured against baselines: the pack time
+ * (search + final pack) and the blit throughput may be off by the
+ * tolerance, the occupancy is deterministic and may not drop at all
+ */
+typedef struct {
+	const char*	name;
+	uint32		count;
+	uint32		min_side;
+	uint32		max_side;
+	bool		rotation;
+} perf_dataset_t;
+
+static const perf_dataset_t	perf_datasets[]	= {
+	{ "glyphs",		16000,	8,	48,		false },
+	{ "sprites",	600,	16,	256,	true },
+};
+
+static int
+perf_test(const char* name, double pack_ms, double blit_mbps, double fill, double tolerance) {
+	const perf_dataset_t*	ds	= NULL;
+	const image_t**			images;
+	atlas_options_t			opts;
+	atlas_stats_t			stats;
+	double					best_pack	= 1e30, best_blit = 1e30;
+	double					bytes		= 0.0, mbps;
+	float					fill_ratio	= 0.0f;
+	int						ret			= 0;
+	uint32					i, run;
+
+	for( i = 0; i < sizeof(perf_datasets) / sizeof(perf_dataset_t); ++i ) {
+		if( strcmp(perf_datasets[i].name, name) == 0 ) ds = &perf_datasets[i];
+	}
+
+	if( NULL == ds ) {
+		fprintf(stderr, "ERROR: perf_test: unknown dataset %s\n", name);
+		return 1;
+	}
+
+	rng_state	= 0x12345678;
+	images		= (const image_t**)malloc(sizeof(image_t*) * ds->count);
+	assert( NULL != images );
+
+	for( i = 0; i < ds->count; ++i ) {
+		image_t*	img	= image_allocate(rng_range(ds->min_side, ds->max_side), rng_range(ds->min_side, ds->max_side), PF_R8G8B8A8);
+		memset(image_pixels(img), (int)(i & 0xFF), image_data_size(img));
+		bytes		+= (double)image_data_size(img);
+		images[i]	= img;
+	}
+
+	atlas_options_init(&opts);
+	opts.allow_rotation	= ds->rotation;
+	opts.stats			= &stats;
+
+	/* best of a few runs to keep the noise out */
+	for( run = 0; run < 3 && ret == 0; ++run ) {
+		atlas_t*	atlas	= atlas_make_ex(images, ds->count, &opts);
+		if( NULL == atlas ) {
+			ret	= 1;
+			break;
+		}
+
+		if( stats.search_ms + stats.pack_ms < best_pack )	best_pack	= stats.search_ms + stats.pack_ms;
+		if( stats.blit_ms < best_blit )						best_blit	= stats.blit_ms;
+		fill_ratio	= stats.fill_ratio;
+
+		atlas_release(atlas);
+	}
+
+	for( i = 0; i < ds->count; ++i ) {
+		image_release((image_t*)images[i]);
+	}
+	free(images);
+
+	if( ret != 0 ) return ret;
+
+	mbps	= bytes / (1024.0 * 1024.0) / (best_blit > 0.001 ? best_blit / 1000.0 : 0.000001);
+
+	printf("%s: %u images, %ux%u\n", ds->name, ds->count, stats.size, stats.size);
+	printf("  pack       %10.2f ms     (baseline %.2f)\n", best_pack, pack_ms);
+	printf("  blit       %10.1f MiB/s  (baseline %.1f)\n", mbps, blit_mbps);
+	printf("  occupancy  %10.4f        (baseline %.4f)\n", fill_ratio, fill);
+
+	/* plus half a millisecond of timer noise for the small datasets */
+	if( best_pack > pack_ms * (1.0 + tolerance) + 0.5 ) {
+		fprintf(stderr, "ERROR: %s: pack time regressed beyond %.0f%%\n", ds->name, tolerance * 100.0);
+		ret	= 1;
+	}
+
+	if( mbps < blit_mbps / (1.0 + tolerance) ) {
+		fprintf(stderr, "ERROR: %s: blit throughput regressed beyond %.0f%%\n", ds->name, tolerance * 100.0);
+		ret	= 1;
+	}
+
+	if( fill_ratio + 0.0001 < fill ) {
+		fprintf(stderr, "ERROR: %s: occupancy regressed\n", ds->name);
+		ret	= 1;
+	}
+
+	return ret;
+}
+
+bool
+image_save_png(const image_t* img, const char* path) {
+	png_structp		png_ptr;
+	png_infop		info_ptr;
+	FILE*			fp;
+	int				color_type;
+	uint32			pixel_size;
+	const uint8*	pixels		= (const uint8*)image_pixels(img);
+	uint32			r;
+
+	switch( image_format(img) ) {
+	case PF_A8:			color_type = PNG_COLOR_TYPE_GRAY;		pixel_size = 1; break;
+	case PF_R8G8B8:		color_type = PNG_COLOR_TYPE_RGB;		pixel_size = 3; break;
+	case PF_R8G8B8A8:	color_type = PNG_COLOR_TYPE_RGB_ALPHA;	pixel_size = 4; break;
+	case PF_I8:			color_type = PNG_COLOR_TYPE_PALETTE;	pixel_size = 1; break;
+	default:
+		fprintf(stderr, "ERROR: save_png: %s: compressed formats can't be written as PNG\n", path);
+		return false;
+	}
+
+	if( (fp = fopen(path, "wb")) == NULL ) {
+		fprintf(stderr, "ERROR: save_png: can't create %s\n", path);
+		return false;
+	}
+
+	atlas_trace_begin("image_save_png");
+
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_ptr ? png_create_info_struct(png_ptr) : NULL;
+	if( info_ptr == NULL || setjmp(png_jmpbuf(png_ptr)) ) {
+		png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : NULL);
+		fclose(fp);
+
+		fprintf(stderr, "ERROR: save_png: failed writing %s\n", path);
+		atlas_trace_end("image_save_png");
+		return false;
+	}
+
+	png_init_io(png_ptr, fp);
+	png_set_IHDR(png_ptr, info_ptr, image_width(img), image_height(img), 8, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+	/* the palette goes to PLTE, its alpha to tRNS */
+	if( color_type == PNG_COLOR_TYPE_PALETTE ) {
+		png_color	colors[IMAGE_PALETTE_MAX];
+		png_byte	alphas[IMAGE_PALETTE_MAX];
+		uint32		count	= image_palette_size(img) ? image_palette_size(img) : 1;
+
+		for( r = 0; r < count; ++r ) {
+			colors[r].red	= image_palette(img)[r].r;
+			colors[r].green	= image_palette(img)[r].g;
+			colors[r].blue	= image_palette(img)[r].b;
+			alphas[r]		= image_palette(img)[r].a;
+		}
+
+		png_set_PLTE(png_ptr, info_ptr, colors, (int)count);
+		png_set_tRNS(png_ptr, info_ptr, alphas, (int)count, NULL);
+	}
+
+	png_write_info(png_ptr, info_ptr);
+
+	for( r = 0; r < image_height(img); ++r ) {
+		png_write_row(png_ptr, (png_const_bytep)&pixels[(size_t)r * image_width(img) * pixel_size]);
+	}
+
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	fclose(fp);
+
+	atlas_trace_end("image_save_png");
+	return true;
+}
+
+/*
+ * builder: collect the input PNGs, load them in parallel, pack and write
+ * the baked image with a manifest of the coordinates
+ */
+
+typedef struct {
+	char**		paths;
+	uint32		count;
+	uint32		capacity;
+} path_list_t;
+
+static void
+path_list_add(path_list_t* list, const char* path) {
+	if( list->count == list->capacity ) {
+		list->capacity	= list->capacity ? list->capacity * 2 : 64;
+		list->paths		= (char**)realloc(list->paths, sizeof(char*) * list->capacity);
+		assert( NULL != list->paths );
+	}
+
+	list->paths[list->count]	= (char*)malloc(strlen(path) + 1);
+	assert( NULL != list->paths[list->count] );
+	strcpy(list->paths[list->count], path);
+	++list->count;
+}
+
+static bool
+has_png_extension(const char* name) {
+	size_t	len	= strlen(name);
+	return len > 4 && (strcmp(name + len - 4, ".png") == 0 || strcmp(name + len - 4, ".PNG") == 0);
+}
+
+/* directories are walked recursively, only .png files are picked from them */
+static bool
+collect_inputs(path_list_t* list, const char* path) {
+	struct stat		st;
+	DIR*			dir;
+	struct dirent*	ent;
+
+	if( stat(path, &st) != 0 ) {
+		fprintf(stderr, "ERROR: collect_inputs: %s not found\n", path);
+		return false;
+	}
+
+	if( !S_ISDIR(st.st_mode) ) {
+		path_list_add(list, path);
+		return true;
+	}
+
+	if( (dir = opendir(path)) == NULL ) {
+		fprintf(stderr, "ERROR: collect_inputs: can't open directory %s\n", path);
+		return false;
+	}
+
+	while( (ent = readdir(dir)) != NULL ) {
+		char*	child;
+		bool	ok	= true;
+
+		if( ent->d_name[0] == '.' ) continue;
+
+		child	= (char*)malloc(strlen(path) + strlen(ent->d_name) + 2);
+		assert( NULL != child );
+		sprintf(child, "%s/%s", path, ent->d_name);
+
+		if( stat(child, &st) == 0 && (S_ISDIR(st.st_mode) || has_png_extension(ent->d_name)) ) {
+			ok	= collect_inputs(list, child);
+		}
+
+		free(child);
+		if( !ok ) {
+			closedir(dir);
+			return false;
+		}
+	}
+
+	closedir(dir);
+	return true;
+}
+
+static int
+compare_paths(const void* a, const void* b) {
+	return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/* the same file given twice would make a duplicate key */
+static void
+unique_paths(path_list_t* list) {
+	uint32	i, count	= 0;
+
+	for( i = 0; i < list->count; ++i ) {
+		if( count != 0 && strcmp(list->paths[count - 1], list->paths[i]) == 0 ) {
+			free(list->paths[i]);
+		} else {
+			list->paths[count++]	= list->paths[i];
+		}
+	}
+
+	list->count	= count;
+}
+
+typedef struct {
+	const char*	path;
+	image_t*	image;
+} load_task_t;
+
+static void
+load_task(void* arg) {
+	load_task_t*	task	= (load_task_t*)arg;
+	task->image	= image_load_png(task->path);
+}
+
+static bool
+write_manifest(const atlas_t* atlas, const char* const* names, const char* path) {
+	FILE*	fp	= fopen(path, "w");
+	uint32	i;
+
+	if( fp == NULL ) {
+		fprintf(stderr, "ERROR: write_manifest: can't create %s\n", path);
+		return false;
+	}
+
+	fprintf(fp, "# %ux%u\n", image_width(atlas_baked_image(atlas)), image_height(atlas_baked_image(atlas)));
+	fprintf(fp, "# name x y width height rotated trim_x trim_y source_width source_height\n");
+	for( i = 0; i < atlas_image_count(atlas); ++i ) {
+		rect_t			r	= atlas_image_coordinates(atlas, i);
+		atlas_trim_t	t	= atlas_image_trim(atlas, i);
+		fprintf(fp, "%s %u %u %u %u %d %u %u %u %u\n", names[i],
+			(uint32)r.x, (uint32)r.y, (uint32)r.width, (uint32)r.height,
+			atlas_image_rotated(atlas, i) ? 1 : 0,
+			t.x, t.y, t.source_width, t.source_height);
+	}
+
+	fclose(fp);
+	return true;
+}
+
+static void
+print_report(const atlas_stats_t* stats, uint32 jobs, double load_ms, double write_ms) {
+	uint32	i;
+
+	printf("atlas %ux%u, %u images\n", stats->size, stats->size, stats->image_count);
+	printf("  occupancy   %.1f%% (%llu of %llu texels used, %llu unused)\n",
+		stats->fill_ratio * 100.0f,
+		(unsigned long long)stats->image_area,
+		(unsigned long long)stats->size * stats->size,
+		(unsigned long long)stats->wasted_area);
+	printf("  sizes tried");
+	for( i = 0; i < stats->sizes_tried && i < ATLAS_SIZE_CANDIDATES; ++i ) {
+		printf(" %u", stats->tried[i]);
+	}
+	printf("\n");
+	if( stats->search_packs ) {
+		printf("  search      %u more packs\n", stats->search_packs);
+	}
+	printf("  skyline     %u of %u nodes at peak, %lu bytes of scratch\n", stats->nodes_peak, stats->node_capacity, (unsigned long)stats->peak_temp_bytes);
+	printf("  memory      %lu bytes at peak\n", (unsigned long)stats->peak_bytes);
+	printf("  load        %9.2f ms (%u jobs)\n", load_ms, jobs);
+	if( stats->sdf_ms > 0.0 ) {
+		printf("  sdf         %9.2f ms\n", stats->sdf_ms);
+	}
+	printf("  trim        %9.2f ms\n", stats->trim_ms);
+	printf("  search      %9.2f ms\n", stats->search_ms);
+	printf("  pack        %9.2f ms\n", stats->pack_ms);
+	printf("  blit        %9.2f ms\n", stats->blit_ms);
+	printf("  encode      %9.2f ms\n", stats->encode_ms);
+	printf("  write       %9.2f ms\n", write_ms);
+	printf("  total       %9.2f ms\n", load_ms + stats->total_ms + write_ms);
+}
+
+/* NAME.png (or NAME.atlas when compressed), the NAME.txt manifest and the optional binary atlas and tiles */
+static int
+write_outputs(const atlas_t* atlas, const char* const* names, const char* output, bool save_binary, uint32 tile_size, uint32 tile_border) {
+	PIXEL_FORMAT	fmt		= image_format(atlas_baked_image(atlas));
+	char*			path	= (char*)malloc(strlen(output) + 8);
+	int				ret		= 0;
+
+	assert( NULL != path );
+
+	if( fmt == PF_A8 || fmt == PF_R8G8B8 || fmt == PF_R8G8B8A8 || fmt == PF_I8 ) {
+		sprintf(path, "%s.png", output);
+		if( !image_save_png(atlas_baked_image(atlas), path) ) ret = 1;
+	} else {
+		/* block compressed and float output only go to the binary atlas */
+		save_binary	= true;
+	}
+
+	sprintf(path, "%s.txt", output);
+	if( !write_manifest(atlas, names, path) ) ret = 1;
+
+	if( save_binary ) {
+		sprintf(path, "%s.atlas", output);
+		if( !atlas_save(atlas, path) ) ret = 1;
+	}
+
+	if( tile_size ) {
+		atlas_tiles_t*	tiles	= atlas_tiles_make(atlas, tile_size, tile_border);
+		sprintf(path, "%s.tiles", output);
+		if( NULL == tiles || !atlas_tiles_save(tiles, path) ) ret = 1;
+		if( tiles ) atlas_tiles_release(tiles);
+	}
+
+	free(path);
+	return ret;
+}
+
+/* one atlas per source format, NAME-a8, NAME-rgb8, NAME-rgba8 and NAME-i8 */
+static int
+build_split(const image_t** images, const char** names, uint32 count, const char* output, const atlas_options_t* opts, bool save_binary, uint32 tile_size, uint32 tile_border) {
+	atlas_t*		atlases[ATLAS_SPLIT_MAX];
+	uint32*			atlas_of	= (uint32*)malloc(sizeof(uint32) * count);
+	uint32*			index_of	= (uint32*)malloc(sizeof(uint32) * count);
+	const char**	sub_names	= (const char**)malloc(sizeof(char*) * count);
+	char*			name		= (char*)malloc(strlen(output) + 8);
+	uint32			n, a, i;
+	int				ret			= 0;
+
+	assert( NULL != atlas_of && NULL != index_of && NULL != sub_names && NULL != name );
+
+	n	= atlas_make_split(images, count, opts, atlases, atlas_of, index_of);
+	if( n == 0 ) ret = 1;
+
+	for( a = 0; a < n; ++a ) {
+		const char*	suffix	= "rgba8";
+
+		for( i = 0; i < count; ++i ) {
+			if( atlas_of[i] != a ) continue;
+			sub_names[index_of[i]]	= names[i];
+			if( image_format(images[i]) == PF_A8 )			suffix = "a8";
+			else if( image_format(images[i]) == PF_R8G8B8 )	suffix = "rgb8";
+			else if( image_format(images[i]) == PF_I8 )		suffix = "i8";
+			else if( image_format(images[i]) == PF_R16G16B16A16F )	suffix = "rgba16f";
+			else if( image_format(images[i]) == PF_R32G32B32A32F )	suffix = "rgba32f";
+		}
+
+		sprintf(name, "%s-%s", output, suffix);
+		if( write_outputs(atlases[a], sub_names, name, save_binary, tile_size, tile_border) != 0 ) ret = 1;
+		printf("%s: %ux%u, %u images\n", name, image_width(atlas_baked_image(atlases[a])), image_height(atlas_baked_image(atlases[a])), atlas_image_count(atlases[a]));
+
+		atlas_release(atlases[a]);
+	}
+
+	free(name);
+	free(sub_names);
+	free(index_of);
+	free(atlas_of);
+	return ret;
+}
+
+static int
+build(const path_list_t* inputs, const char* output, uint32 jobs, const atlas_options_t* base, bool save_binary, bool split, uint32 tile_size, uint32 tile_border) {
+	load_task_t*		tasks	= (load_task_t*)malloc(sizeof(load_task_t) * inputs->count);
+	const image_t**		images	= (const image_t**)malloc(sizeof(image_t*) * inputs->count);
+	const char**		names	= (const char**)malloc(sizeof(char*) * inputs->count);
+	atlas_pool_t*		pool	= NULL;
+	atlas_t*			atlas	= NULL;
+	atlas_options_t		opts	= *base;
+	atlas_stats_t		stats;
+	uint32				count	= 0;
+	double				load_ms, write_ms;
+	int					ret		= 0;
+	uint32				i;
+
+	assert( NULL != tasks && NULL != images && NULL != names );
+
+	load_ms	= now_ms();
+	pool	= atlas_pool_make(jobs);
+	if( NULL == pool ) {
+		ret	= 1;
+		goto done;
+	}
+
+	jobs	= atlas_pool_thread_count(pool);
+	for( i = 0; i < inputs->count; ++i ) {
+		tasks[i].path	= inputs->paths[i];
+		tasks[i].image	= NULL;
+		atlas_pool_submit(pool, load_task, &tasks[i]);
+	}
+	atlas_pool_wait(pool);
+	atlas_pool_release(pool);
+
+	/* unreadable files were already reported, pack what loaded */
+	for( i = 0; i < inputs->count; ++i ) {
+		if( tasks[i].image ) {
+			images[count]	= tasks[i].image;
+			names[count]	= tasks[i].path;
+			++count;
+		}
+	}
+	load_ms	= now_ms() - load_ms;
+
+	if( count == 0 ) {
+		fprintf(stderr, "ERROR: build: no image loaded\n");
+		ret	= 1;
+		goto done;
+	}
+
+	if( split ) {
+		ret	= build_split(images, names, count, output, &opts, save_binary, tile_size, tile_border);
+		goto done;
+	}
+
+	opts.keys	= names;
+	opts.stats	= &stats;
+	atlas		= atlas_make_ex(images, count, &opts);
+	if( NULL == atlas ) {
+		ret	= 1;
+		goto done;
+	}
+
+	write_ms	= now_ms();
+	ret			= write_outputs(atlas, names, output, save_binary, tile_size, tile_border);
+	write_ms	= now_ms() - write_ms;
+
+	print_report(&stats, jobs, load_ms, write_ms);
+
+done:
+	if( atlas ) atlas_release(atlas);
+	for( i = 0; i < inputs->count; ++i ) {
+		if( tasks[i].image ) image_release(tasks[i].image);
+	}
+	free(names);
+	free(images);
+	free(tasks);
+
+	return ret;
+}
+
+/* the pngs decoded on demand by atlas_make_consume */
+static image_t*
+produce_png(void* user, uint32 index) {
+	return image_load_png(((const path_list_t*)user)->paths[index]);
+}
+
+/* --low-memory: every png is decoded to be measured and again to be blitted, never all of them at once */
+static int
+build_consume(const path_list_t* inputs, const char* output, const atlas_options_t* base, bool save_binary, uint32 tile_size, uint32 tile_border) {
+	atlas_options_t		opts	= *base;
+	atlas_stats_t		stats;
+	atlas_t*			atlas;
+	double				write_ms;
+	int					ret;
+
+	opts.keys	= (const char**)inputs->paths;
+	opts.stats	= &stats;
+	atlas		= atlas_make_consume(inputs->count, produce_png, (void*)inputs, &opts);
+	if( NULL == atlas ) return 1;
+
+	write_ms	= now_ms();
+	ret			= write_outputs(atlas, (const char* const*)inputs->paths, output, save_binary, tile_size, tile_border);
+	write_ms	= now_ms() - write_ms;
+
+	/* the decoding is part of the trim and blit phases */
+	print_report(&stats, 1, 0.0, write_ms);
+
+	atlas_release(atlas);
+	return ret;
+}
+
+static void
+usage(const char* name) {
+	printf("usage: %s [options] <png file or directory>...\n", name);
+	printf("       %s [--trace out.json] --bench-large | --test-large-ids | --test-properties | --test-batch | --test-tiles | --test-sdf | --test-formats | --test-palette | --test-compact | --test-cache | --test-dirty | --test-async | --test-search | --test-shared | --test-consume | --test-hdr | --test-bc | --test-load | --test-uv | --test-trace\n", name);
+	printf("       %s --perf DATASET PACK_MS BLIT_MIBPS OCCUPANCY TOLERANCE\n", name);
+	printf("options:\n");
+	printf("  -o, --output NAME    write NAME.png and the NAME.txt manifest (default: atlas)\n");
+	printf("  -j, --jobs N         load the inputs with N threads (default: one per cpu)\n");
+	printf("  --trim               strip transparent borders\n");
+	printf("  --rotate             allow 90 degree rotations\n");
+	printf("  --align N            align every image to N texels\n");
+	printf("  --max-size N         largest atlas side to try\n");
+	printf("  --sdf N              pack grayscale images as distance fields N texels wide\n");
+	printf("  --skyline S          auto, index or list (same result, different speed)\n");
+	printf("  --quality MS         try more heuristics for a smaller or denser atlas, for up to MS ms (0: no limit)\n");
+	printf("  --format F           auto (default), a8, rgb8, rgba8, i8, rgba16f, rgba32f, bc1, bc3 or bc7 (float and compressed output imply --binary)\n");
+	printf("  --split              one atlas per source format: NAME-a8, NAME-rgb8, NAME-rgba8, NAME-i8, NAME-rgba16f and NAME-rgba32f\n");
+	printf("  --low-memory         decode the inputs as they are packed instead of up front, any unreadable one fails the build\n");
+	printf("  --binary             also write NAME.atlas (see atlas_load)\n");
+	printf("  --tiles N            also write NAME.tiles, N x N pages for streaming\n");
+	printf("  --tile-border N      texels copied around every tile (default: 0)\n");
+	printf("  --trace FILE         write a chrome trace of the build\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char*		mode	= NULL;
+	const char*		trace	= NULL;
+	const char*		output	= "atlas";
+	uint32			jobs	= 0;
+	bool			binary	= false;
+	bool			split	= false;
+	bool			low_memory	= false;
+	uint32			tile_size	= 0;
+	uint32			tile_border	= 0;
+	char**			perf_args	= NULL;
+	atlas_options_t	opts;
+	path_list_t		inputs;
+	int				ret		= 0;
+	int				i;
+
+	atlas_options_init(&opts);
+	memset(&inputs, 0, sizeof(path_list_t));
+
+	for( i = 1; i < argc && ret == 0; ++i ) {
+		const char*	arg		= argv[i];
+		bool		has_val	= i + 1 < argc;
+
+		if( strcmp(arg, "--trace") == 0 && has_val ) {
+			trace	= argv[++i];
+		} else if( (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) && has_val ) {
+			output	= argv[++i];
+		} else if( (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) && has_val ) {
+			jobs	= (uint32)strtoul(argv[++i], NULL, 10);
+		} else if( strcmp(arg, "--trim") == 0 ) {
+			opts.trim	= true;
+		} else if( strcmp(arg, "--rotate") == 0 ) {
+			opts.allow_rotation	= true;
+		} else if( strcmp(arg, "--align") == 0 && has_val ) {
+			opts.alignment	= (uint32)strtoul(argv[++i], NULL, 10);
+		} else if( strcmp(arg, "--sdf") == 0 && has_val ) {
+			opts.sdf_spread	= (uint32)strtoul(argv[++i], NULL, 10);
+		} else if( strcmp(arg, "--max-size") == 0 && has_val ) {
+			opts.max_size	= (uint32)strtoul(argv[++i], NULL, 10);
+		} else if( strcmp(arg, "--skyline") == 0 && has_val ) {
+			const char*	k	= argv[++i];
+			if( strcmp(k, "auto") == 0 )		opts.skyline = ATLAS_SKYLINE_AUTO;
+			else if( strcmp(k, "index") == 0 )	opts.skyline = ATLAS_SKYLINE_INDEXED;
+			else if( strcmp(k, "list") == 0 )	opts.skyline = ATLAS_SKYLINE_LIST;
+			else {
+				fprintf(stderr, "ERROR: unknown skyline search %s\n", k);
+				ret	= 1;
+			}
+		} else if( strcmp(arg, "--quality") == 0 && has_val ) {
+			opts.search				= ATLAS_SEARCH_QUALITY;
+			opts.search_budget_ms	= atof(argv[++i]);
+		} else if( strcmp(arg, "--format") == 0 && has_val ) {
+			const char*	f	= argv[++i];
+			if( strcmp(f, "auto") == 0 )		opts.output_format = PF_AUTO;
+			else if( strcmp(f, "a8") == 0 )		opts.output_format = PF_A8;
+			else if( strcmp(f, "rgb8") == 0 )	opts.output_format = PF_R8G8B8;
+			else if( strcmp(f, "rgba8") == 0 )	opts.output_format = PF_R8G8B8A8;
+			else if( strcmp(f, "i8") == 0 )		opts.output_format = PF_I8;
+			else if( strcmp(f, "rgba16f") == 0 )	opts.output_format = PF_R16G16B16A16F;
+			else if( strcmp(f, "rgba32f") == 0 )	opts.output_format = PF_R32G32B32A32F;
+			else if( strcmp(f, "bc1") == 0 )	opts.output_format = PF_BC1;
+			else if( strcmp(f, "bc3") == 0 )	opts.output_format = PF_BC3;
+			else if( strcmp(f, "bc7") == 0 )	opts.output_format = PF_BC7;
+			else {
+				fprintf(stderr, "ERROR: unknown format %s\n", f);
+				ret	= 1;
+			}
+		} else if( strcmp(arg, "--binary") == 0 ) {
+			binary	= true;
+		} else if( strcmp(arg, "--split") == 0 ) {
+			split	= true;
+		} else if( strcmp(arg, "--low-memory") == 0 ) {
+			low_memory	= true;
+		} else if( strcmp(arg, "--tiles") == 0 && has_val ) {
+			tile_size	= (uint32)strtoul(argv[++i], NULL, 10);
+		} else if( strcmp(arg, "--tile-border") == 0 && has_val ) {
+			tile_border	= (uint32)strtoul(argv[++i], NULL, 10);
+		} else if( strcmp(arg, "--bench-large") == 0 || strcmp(arg, "--test-large-ids") == 0 || strcmp(arg, "--test-properties") == 0 || strcmp(arg, "--test-batch") == 0 || strcmp(arg, "--test-tiles") == 0 || strcmp(arg, "--test-sdf") == 0 || strcmp(arg, "--test-formats") == 0 || strcmp(arg, "--test-palette") == 0 || strcmp(arg, "--test-compact") == 0 || strcmp(arg, "--test-cache") == 0 || strcmp(arg, "--test-dirty") == 0 || strcmp(arg, "--test-async") == 0 || strcmp(arg, "--test-search") == 0 || strcmp(arg, "--test-shared") == 0 || strcmp(arg, "--test-consume") == 0 || strcmp(arg, "--test-hdr") == 0 || strcmp(arg, "--test-bc") == 0 || strcmp(arg, "--test-load") == 0 || strcmp(arg, "--test-uv") == 0 || strcmp(arg, "--test-trace") == 0 ) {
+			mode	= arg;
+		} else if( strcmp(arg, "--perf") == 0 && i + 5 < argc ) {
+			mode		= arg;
+			perf_args	= &argv[i + 1];
+			i			+= 5;
+		} else if( arg[0] == '-' ) {
+			fprintf(stderr, "ERROR: unknown option %s\n", arg);
+			ret	= 1;
+		} else if( !collect_inputs(&inputs, arg) ) {
+			ret	= 1;
+		}
+	}
+
+	if( ret == 0 && trace && !atlas_trace_chrome_open(trace) ) {
+		ret	= 1;
+	}
+
+	if( ret != 0 ) {
+		/* already reported */
+	} else if( mode && strcmp(mode, "--bench-large") == 0 ) {
+		ret	= bench_large();
+	} else if( mode && strcmp(mode, "--test-large-ids") == 0 ) {
+		ret	= test_large_ids();
+	} else if( mode && strcmp(mode, "--test-properties") == 0 ) {
+		ret	= test_properties();
+	} else if( mode && strcmp(mode, "--test-batch") == 0 ) {
+		ret	= test_batch();
+	} else if( mode && strcmp(mode, "--test-tiles") == 0 ) {
+		ret	= test_tiles();
+	} else if( mode && strcmp(mode, "--test-sdf") == 0 ) {
+		ret	= test_sdf();
+	} else if( mode && strcmp(mode, "--test-formats") == 0 ) {
+		ret	= test_formats();
+	} else if( mode && strcmp(mode, "--test-palette") == 0 ) {
+		ret	= test_palette();
+	} else if( mode && strcmp(mode, "--test-compact") == 0 ) {
+		ret	= test_compact();
+	} else if( mode && strcmp(mode, "--test-cache") == 0 ) {
+		ret	= test_cache();
+	} else if( mode && strcmp(mode, "--test-dirty") == 0 ) {
+		ret	= test_dirty();
+	} else if( mode && strcmp(mode, "--test-async") == 0 ) {
+		ret	= test_async();
+	} else if( mode && strcmp(mode, "--test-search") == 0 ) {
+		ret	= test_search();
+	} else if( mode && strcmp(mode, "--test-shared") == 0 ) {
+		ret	= test_shared();
+	} else if( mode && strcmp(mode, "--test-consume") == 0 ) {
+		ret	= test_consume();
+	} else if( mode && strcmp(mode, "--test-hdr") == 0 ) {
+		ret	= test_hdr();
+	} else if( mode && strcmp(mode, "--test-bc") == 0 ) {
+		ret	= test_bc();
+	} else if( mode && strcmp(mode, "--test-load") == 0 ) {
+		ret	= test_load();
+	} else if( mode && strcmp(mode, "--test-uv") == 0 ) {
+		ret	= test_uv();
+	} else if( mode && strcmp(mode, "--test-trace") == 0 ) {
+		ret	= test_trace();
+	} else if( mode && strcmp(mode, "--perf") == 0 ) {
+		ret	= perf_test(perf_args[0], atof(perf_args[1]), atof(perf_args[2]), atof(perf_args[3]), atof(perf_args[4]));
+	} else if( inputs.count != 0 ) {
+		/* same order whatever the file system returns */
+		qsort(inputs.paths, inputs.count, sizeof(char*), compare_paths);
+		unique_paths(&inputs);
+		if( low_memory && !split ) {
+			ret	= build_consume(&inputs, output, &opts, binary, tile_size, tile_border);
+		} else {
+			ret	= build(&inputs, output, jobs, &opts, binary, split, tile_size, tile_border);
+		}
+	} else {
+		usage(argv[0]);
+	}
+
+	for( i = 0; i < (int)inputs.count; ++i ) {
+		free(inputs.paths[i]);
+	}
+	free(inputs.paths);
+
+	atlas_trace_chrome_close();
+	return ret;
 }
@@ -0,0 +1,382 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * palette building: an exact pass through a small hash of the colours
+ * seen so far, which gives up past max_colors, then a median cut over a
+ * 4 bits per channel histogram. the histogram and the final mapping are
+ * done per stripe of rows
+ */
+
+#define EXACT_HASH_SIZE		1024	/* power of two, well over IMAGE_PALETTE_MAX */
+#define BIN_COUNT			65536	/* 4 bits of r, g, b and a */
+
+static inline uint32
+pack_color(color4b_t c) {
+	return (uint32)c.r | ((uint32)c.g << 8) | ((uint32)c.b << 16) | ((uint32)c.a << 24);
+}
+
+static inline uint32
+color_bin(color4b_t c) {
+	return ((uint32)c.r >> 4) | (((uint32)c.g >> 4) << 4) | (((uint32)c.b >> 4) << 8) | (((uint32)c.a >> 4) << 12);
+}
+
+static inline uint32
+bin_channel(uint32 bin, uint32 c) {
+	return (bin >> (c * 4)) & 0xF;
+}
+
+/* one row as RGBA8 colours, converted in 'scratch' unless it already is */
+static const color4b_t*
+row_colors(const image_t* img, uint32 y, image_t* scratch) {
+	if( image_format(img) == PF_R8G8B8A8 ) {
+		return (const color4b_t*)image_pixels(img) + (size_t)y * image_width(img);
+	}
+	image_blit(scratch, 0, 0, img, 0, y, image_width(img), 1);
+	return (const color4b_t*)image_pixels(scratch);
+}
+
+/* every distinct colour gets an entry, false when there are more than max_colors */
+static bool
+exact_palette(const image_t* img, uint32 max_colors, image_t* out) {
+	uint32		keys[EXACT_HASH_SIZE];
+	uint8		slots[EXACT_HASH_SIZE];
+	uint8		filled[EXACT_HASH_SIZE];
+	color4b_t	palette[IMAGE_PALETTE_MAX];
+	uint32		count	= 0;
+	uint8*		dst		= (uint8*)image_pixels(out);
+	image_t*	scratch	= image_allocate(image_width(img), 1, PF_R8G8B8A8);
+	bool		ok		= true;
+	uint32		x, y;
+
+	assert( NULL != scratch );
+	memset(filled, 0, sizeof(filled));
+
+	for( y = 0; y < image_height(img) && ok; ++y ) {
+		const color4b_t*	row	= row_colors(img, y, scratch);
+
+		for( x = 0; x < image_width(img); ++x ) {
+			uint32	key		= pack_color(row[x]);
+			uint32	h		= (key * 0x9E3779B1u) >> 22;	/* top 10 bits */
+
+			while( filled[h] && keys[h] != key ) {
+				h	= (h + 1) & (EXACT_HASH_SIZE - 1);
+			}
+
+			if( !filled[h] ) {
+				if( count == max_colors ) {
+					ok	= false;
+					break;
+				}
+				filled[h]		= 1;
+				keys[h]			= key;
+				slots[h]		= (uint8)count;
+				palette[count]	= row[x];
+				++count;
+			}
+
+			dst[(size_t)y * image_width(img) + x]	= slots[h];
+		}
+	}
+
+	if( ok ) image_set_palette(out, palette, count);
+
+	image_release(scratch);
+	return ok;
+}
+
+/* histogram of the rows [begin, end), or their mapping through 'lut' */
+typedef struct {
+	const image_t*	img;
+	image_t*		out;
+	uint32			begin;
+	uint32			end;
+	uint32*			counts;			/* BIN_COUNT */
+	uint64_t*		sums;			/* BIN_COUNT x 4 channels */
+	const uint8*	lut;			/* bin to palette entry, NULL while counting */
+} stripe_t;
+
+static void
+stripe_task(void* arg) {
+	stripe_t*		st		= (stripe_t*)arg;
+	uint32			w		= image_width(st->img);
+	uint8*			dst		= (uint8*)image_pixels(st->out);
+	image_t*		scratch	= image_allocate(w, 1, PF_R8G8B8A8);
+	uint32			x, y;
+
+	assert( NULL != scratch );
+
+	for( y = st->begin; y < st->end; ++y ) {
+		const color4b_t*	row	= row_colors(st->img, y, scratch);
+
+		if( st->lut ) {
+			for( x = 0; x < w; ++x ) {
+				dst[(size_t)y * w + x]	= st->lut[color_bin(row[x])];
+			}
+			continue;
+		}
+
+		for( x = 0; x < w; ++x ) {
+			uint32		b	= color_bin(row[x]);
+			uint64_t*	s	= &st->sums[b * 4];
+			++st->counts[b];
+			s[0]	+= row[x].r;
+			s[1]	+= row[x].g;
+			s[2]	+= row[x].b;
+			s[3]	+= row[x].a;
+		}
+	}
+
+	image_release(scratch);
+}
+
+static void
+run_stripes(atlas_pool_t* pool, stripe_t* stripes, uint32 count) {
+	atlas_task_group_t	group;
+	uint32				s;
+
+	if( pool && count > 1 ) {
+		atlas_task_group_init(&group);
+		for( s = 0; s < count; ++s ) {
+			atlas_pool_submit_group(pool, &group, stripe_task, &stripes[s]);
+		}
+		atlas_pool_wait_group(pool, &group);
+	} else {
+		for( s = 0; s < count; ++s ) {
+			stripe_task(&stripes[s]);
+		}
+	}
+}
+
+/* a box of histogram bins, ids[begin, end) */
+typedef struct {
+	uint32			begin;
+	uint32			end;
+	uint64_t		count;
+	uint32			lo[4];
+	uint32			hi[4];
+} box_t;
+
+static void
+box_update(box_t* box, const uint32* ids, const uint32* counts) {
+	uint32	i, c;
+
+	box->count	= 0;
+	for( c = 0; c < 4; ++c ) {
+		box->lo[c]	= 15;
+		box->hi[c]	= 0;
+	}
+
+	for( i = box->begin; i < box->end; ++i ) {
+		box->count	+= counts[ids[i]];
+		for( c = 0; c < 4; ++c ) {
+			uint32	v	= bin_channel(ids[i], c);
+			if( v < box->lo[c] ) box->lo[c] = v;
+			if( v > box->hi[c] ) box->hi[c] = v;
+		}
+	}
+}
+
+static uint32
+box_widest(const box_t* box) {
+	uint32	best	= 0;
+	uint32	c;
+	for( c = 1; c < 4; ++c ) {
+		if( box->hi[c] - box->lo[c] > box->hi[best] - box->lo[best] ) best = c;
+	}
+	return best;
+}
+
+/*
+ * split the most populated box that still spans several bins at the
+ * weighted median of its widest channel, until there are max_colors boxes
+ */
+static uint32
+median_cut(uint32* ids, uint32 id_count, const uint32* counts, box_t* boxes, uint32 max_colors) {
+	uint32*	tmp			= (uint32*)malloc(sizeof(uint32) * (id_count ? id_count : 1));
+	uint32	box_count	= 1;
+
+	assert( NULL != tmp );
+
+	boxes[0].begin	= 0;
+	boxes[0].end	= id_count;
+	box_update(&boxes[0], ids, counts);
+
+	while( box_count < max_colors ) {
+		box_t*		box		= NULL;
+		uint64_t	best	= 0;
+		uint64_t	hist[16];
+		uint32		first[16];
+		uint64_t	half, sum;
+		uint32		b, c, v, i, split;
+
+		for( b = 0; b < box_count; ++b ) {
+			c	= box_widest(&boxes[b]);
+			if( boxes[b].hi[c] > boxes[b].lo[c] && boxes[b].count * (boxes[b].hi[c] - boxes[b].lo[c]) > best ) {
+				best	= boxes[b].count * (boxes[b].hi[c] - boxes[b].lo[c]);
+				box		= &boxes[b];
+			}
+		}
+
+		if( NULL == box ) break;
+
+		/* counting sort of the box on its widest channel */
+		c	= box_widest(box);
+		memset(hist, 0, sizeof(hist));
+		memset(first, 0, sizeof(first));
+		for( i = box->begin; i < box->end; ++i ) {
+			v	= bin_channel(ids[i], c);
+			hist[v]	+= counts[ids[i]];
+			++first[v];
+		}
+		for( v = 0, i = box->begin; v < 16; ++v ) {
+			uint32	n	= first[v];
+			first[v]	= i;
+			i			+= n;
+		}
+		for( i = box->begin; i < box->end; ++i ) {
+			tmp[first[bin_channel(ids[i], c)]++]	= ids[i];
+		}
+		memcpy(&ids[box->begin], &tmp[box->begin], sizeof(uint32) * (box->end - box->begin));
+
+		/* values up to v go left, v is kept inside [lo, hi) so both sides get bins */
+		half	= box->count / 2;
+		sum		= 0;
+		for( v = box->lo[c]; v < box->hi[c] - 1; ++v ) {
+			sum	+= hist[v];
+			if( sum >= half ) break;
+		}
+		split	= first[v];
+
+		boxes[box_count].begin	= split;
+		boxes[box_count].end	= box->end;
+		box->end				= split;
+		box_update(box, ids, counts);
+		box_update(&boxes[box_count], ids, counts);
+		++box_count;
+	}
+
+	free(tmp);
+	return box_count;
+}
+
+image_t*
+image_quantize(const image_t* img, uint32 max_colors, atlas_pool_t* pool) {
+	uint32		width	= image_width(img);
+	uint32		height	= image_height(img);
+	uint32		count	= pool ? atlas_pool_thread_count(pool) : 1;
+	color4b_t	palette[IMAGE_PALETTE_MAX];
+	box_t		boxes[IMAGE_PALETTE_MAX];
+	uint8*		lut;
+	uint32*		ids;
+	uint32		id_count	= 0;
+	uint32		box_count;
+	stripe_t*	stripes;
+	image_t*	out;
+	uint32		s, b, i;
+
+	if( max_colors == 0 || max_colors > IMAGE_PALETTE_MAX || image_format_pixel_size(image_format(img)) == 0 ) {
+		fprintf(stderr, "ERROR: image_quantize: needs an uncompressed image and 1 to %u colours\n", IMAGE_PALETTE_MAX);
+		return NULL;
+	}
+
+	TRACE_BEGIN("image_quantize");
+
+	out	= image_allocate(width, height, PF_I8);
+	assert( NULL != out );
+
+	if( exact_palette(img, max_colors, out) ) {
+		TRACE_END("image_quantize");
+		return out;
+	}
+
+	/* histogram per stripe, merged in the first one */
+	if( count > height ) count = height ? height : 1;
+	stripes	= (stripe_t*)malloc(sizeof(stripe_t) * count);
+	assert( NULL != stripes );
+
+	for( s = 0; s < count; ++s ) {
+		stripes[s].img		= img;
+		stripes[s].out		= out;
+		stripes[s].begin	= (uint32)((uint64_t)height * s / count);
+		stripes[s].end		= (uint32)((uint64_t)height * (s + 1) / count);
+		stripes[s].counts	= (uint32*)calloc(BIN_COUNT, sizeof(uint32));
+		stripes[s].sums		= (uint64_t*)calloc(BIN_COUNT * 4, sizeof(uint64_t));
+		stripes[s].lut		= NULL;
+		assert( NULL != stripes[s].counts && NULL != stripes[s].sums );
+	}
+
+	run_stripes(pool, stripes, count);
+
+	for( s = 1; s < count; ++s ) {
+		for( b = 0; b < BIN_COUNT; ++b ) {
+			stripes[0].counts[b]	+= stripes[s].counts[b];
+		}
+		for( b = 0; b < BIN_COUNT * 4; ++b ) {
+			stripes[0].sums[b]		+= stripes[s].sums[b];
+		}
+	}
+
+	ids	= (uint32*)malloc(sizeof(uint32) * BIN_COUNT);
+	lut	= (uint8*)calloc(BIN_COUNT, 1);
+	assert( NULL != ids && NULL != lut );
+
+	for( b = 0; b < BIN_COUNT; ++b ) {
+		if( stripes[0].counts[b] ) ids[id_count++] = b;
+	}
+
+	/* an entry per box: the mean of its texels */
+	box_count	= median_cut(ids, id_count, stripes[0].counts, boxes, max_colors);
+	for( b = 0; b < box_count; ++b ) {
+		uint64_t	sum[4]	= { 0, 0, 0, 0 };
+		uint64_t	n		= boxes[b].count ? boxes[b].count : 1;
+
+		for( i = boxes[b].begin; i < boxes[b].end; ++i ) {
+			uint32	c;
+			for( c = 0; c < 4; ++c ) {
+				sum[c]	+= stripes[0].sums[ids[i] * 4 + c];
+			}
+			lut[ids[i]]	= (uint8)b;
+		}
+
+		palette[b]	= color4b((uint8)((sum[0] + n / 2) / n), (uint8)((sum[1] + n / 2) / n), (uint8)((sum[2] + n / 2) / n), (uint8)((sum[3] + n / 2) / n));
+	}
+	image_set_palette(out, palette, box_count);
+
+	for( s = 0; s < count; ++s ) {
+		stripes[s].lut	= lut;
+	}
+	run_stripes(pool, stripes, count);
+
+	for( s = 0; s < count; ++s ) {
+		free(stripes[s].sums);
+		free(stripes[s].counts);
+	}
+	free(stripes);
+	free(lut);
+	free(ids);
+
+	TRACE_END("image_quantize");
+
+	return out;
+}
@@ -0,0 +1,326 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#define _POSIX_C_SOURCE 200112L
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * fixed size work stealing thread pool: every worker owns a queue, runs it
+ * front to back and steals from the front of the others when it is empty.
+ * tasks keep their submission order, so submitting the largest jobs first
+ * gets close to longest processing time scheduling
+ */
+
+typedef struct {
+	atlas_task_fun_t	fun;
+	void*				arg;
+	atlas_task_group_t*	group;		/* NULL outside of any */
+} task_t;
+
+typedef struct {
+	pthread_mutex_t	lock;
+	task_t*			tasks;		/* ring buffer */
+	uint32			capacity;
+	uint32			head;
+	uint32			count;
+} task_queue_t;
+
+typedef struct {
+	atlas_pool_t*	pool;
+	uint32			index;
+	pthread_t		thread;
+	task_queue_t	queue;
+} worker_t;
+
+struct atlas_pool_s {
+	worker_t*		workers;
+	uint32			thread_count;	/* workers and queues */
+	uint32			started;		/* threads running */
+	pthread_key_t	self;		/* worker_t* of the calling thread */
+
+	pthread_mutex_t	lock;
+	pthread_cond_t	has_work;	/* 'queued' went up or shutting down */
+	pthread_cond_t	idle;		/* 'pending' or the one of a group dropped to 0 */
+
+	sint32			queued;		/* tasks in the queues, can dip below 0 while a push is counted */
+	uint32			pending;	/* queued or running */
+	uint32			next;		/* round robin queue for tasks from outside the pool */
+	bool			shutdown;
+};
+
+static void
+queue_push(task_queue_t* q, const task_t* task) {
+	pthread_mutex_lock(&q->lock);
+
+	if( q->count == q->capacity ) {
+		/* grow and unwrap the ring */
+		task_t*	tasks	= (task_t*)malloc(sizeof(task_t) * q->capacity * 2);
+		uint32	i;
+		assert( NULL != tasks );
+		for( i = 0; i < q->count; ++i ) {
+			tasks[i]	= q->tasks[(q->head + i) % q->capacity];
+		}
+		free(q->tasks);
+		q->tasks	= tasks;
+		q->head		= 0;
+		q->capacity	*= 2;
+	}
+
+	q->tasks[(q->head + q->count) % q->capacity]	= *task;
+	++q->count;
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+static bool
+queue_pop_front(task_queue_t* q, task_t* task) {
+	bool	found	= false;
+
+	pthread_mutex_lock(&q->lock);
+	if( q->count != 0 ) {
+		*task		= q->tasks[q->head];
+		q->head		= (q->head + 1) % q->capacity;
+		--q->count;
+		found		= true;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return found;
+}
+
+/* own queue first, then the others starting with the next worker */
+static bool
+take_task(worker_t* w, task_t* task) {
+	atlas_pool_t*	pool	= w->pool;
+	uint32			i;
+
+	for( i = 0; i < pool->thread_count; ++i ) {
+		if( queue_pop_front(&pool->workers[(w->index + i) % pool->thread_count].queue, task) ) {
+			pthread_mutex_lock(&pool->lock);
+			--pool->queued;
+			pthread_mutex_unlock(&pool->lock);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void*
+worker(void* arg) {
+	worker_t*		w		= (worker_t*)arg;
+	atlas_pool_t*	pool	= w->pool;
+
+	pthread_setspecific(pool->self, w);
+
+	for( ;; ) {
+		task_t	task;
+
+		if( take_task(w, &task) ) {
+			bool	idle;
+
+			task.fun(task.arg);
+
+			/* the group may be gone as soon as the lock is released */
+			pthread_mutex_lock(&pool->lock);
+			idle	= --pool->pending == 0;
+			if( task.group && --task.group->pending == 0 ) idle = true;
+			if( idle ) {
+				pthread_cond_broadcast(&pool->idle);
+			}
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while( pool->queued <= 0 && !pool->shutdown ) {
+			pthread_cond_wait(&pool->has_work, &pool->lock);
+		}
+
+		if( pool->queued <= 0 ) {
+			/* shutting down and nothing left */
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+static pthread_once_t	shared_once	= PTHREAD_ONCE_INIT;
+static atlas_pool_t*	shared_pool	= NULL;
+
+static void
+make_shared_pool(void) {
+	shared_pool	= atlas_pool_make(0);
+}
+
+atlas_pool_t*
+atlas_pool_shared(void) {
+	pthread_once(&shared_once, make_shared_pool);
+	return shared_pool;
+}
+
+uint32
+atlas_cpu_count(void) {
+	long	n	= sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (uint32)n : 1;
+}
+
+atlas_pool_t*
+atlas_pool_make(uint32 thread_count) {
+	atlas_pool_t*	pool	= (atlas_pool_t*)malloc(sizeof(atlas_pool_t));
+	uint32			t;
+
+	assert( NULL != pool );
+
+	if( thread_count == 0 ) thread_count = atlas_cpu_count();
+
+	memset(pool, 0, sizeof(atlas_pool_t));
+	pool->workers	= (worker_t*)malloc(sizeof(worker_t) * thread_count);
+	assert( NULL != pool->workers );
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->has_work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pthread_key_create(&pool->self, NULL);
+
+	/* every queue exists before the first worker can steal from it */
+	for( t = 0; t < thread_count; ++t ) {
+		worker_t*	w	= &pool->workers[t];
+		w->pool				= pool;
+		w->index			= t;
+		w->queue.capacity	= 16;
+		w->queue.head		= 0;
+		w->queue.count		= 0;
+		w->queue.tasks		= (task_t*)malloc(sizeof(task_t) * w->queue.capacity);
+		assert( NULL != w->queue.tasks );
+		pthread_mutex_init(&w->queue.lock, NULL);
+	}
+	pool->thread_count	= thread_count;
+
+	for( t = 0; t < thread_count; ++t ) {
+		if( pthread_create(&pool->workers[t].thread, NULL, worker, &pool->workers[t]) != 0 ) {
+			fprintf(stderr, "ERROR: atlas_pool_make: can't start thread %u\n", t);
+			atlas_pool_release(pool);
+			return NULL;
+		}
+		++pool->started;
+	}
+
+	return pool;
+}
+
+uint32
+atlas_pool_thread_count(const atlas_pool_t* pool) {
+	return pool->thread_count;
+}
+
+uint32
+atlas_pool_worker(const atlas_pool_t* pool) {
+	worker_t*	w	= (worker_t*)pthread_getspecific(pool->self);
+	return w ? w->index : pool->thread_count;
+}
+
+void
+atlas_task_group_init(atlas_task_group_t* group) {
+	group->pending	= 0;
+}
+
+void
+atlas_pool_submit(atlas_pool_t* pool, atlas_task_fun_t fun, void* arg) {
+	atlas_pool_submit_group(pool, NULL, fun, arg);
+}
+
+void
+atlas_pool_submit_group(atlas_pool_t* pool, atlas_task_group_t* group, atlas_task_fun_t fun, void* arg) {
+	worker_t*	w	= (worker_t*)pthread_getspecific(pool->self);
+	task_t		task;
+	uint32		q;
+
+	task.fun	= fun;
+	task.arg	= arg;
+	task.group	= group;
+
+	/* counted first so that a wait can't miss a task being pushed */
+	pthread_mutex_lock(&pool->lock);
+	++pool->pending;
+	if( group ) ++group->pending;
+	q			= w ? w->index : pool->next;
+	pool->next	= (pool->next + 1) % pool->thread_count;
+	pthread_mutex_unlock(&pool->lock);
+
+	/* tasks submitted by a task stay on its worker */
+	queue_push(&pool->workers[q].queue, &task);
+
+	pthread_mutex_lock(&pool->lock);
+	++pool->queued;
+	pthread_cond_signal(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+atlas_pool_wait(atlas_pool_t* pool) {
+	pthread_mutex_lock(&pool->lock);
+	while( pool->pending != 0 ) {
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+atlas_pool_wait_group(atlas_pool_t* pool, atlas_task_group_t* group) {
+	pthread_mutex_lock(&pool->lock);
+	while( group->pending != 0 ) {
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void
+atlas_pool_release(atlas_pool_t* pool) {
+	uint32	t;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown	= true;
+	pthread_cond_broadcast(&pool->has_work);
+	pthread_mutex_unlock(&pool->lock);
+
+	/* queued tasks still run before the workers exit */
+	for( t = 0; t < pool->started; ++t ) {
+		pthread_join(pool->workers[t].thread, NULL);
+	}
+
+	for( t = 0; t < pool->thread_count; ++t ) {
+		pthread_mutex_destroy(&pool->workers[t].queue.lock);
+		free(pool->workers[t].queue.tasks);
+	}
+
+	pthread_key_delete(pool->self);
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->has_work);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
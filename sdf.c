@@ -0,0 +1,308 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * exact euclidean distance transform (Meijster et al. / Felzenszwalb and
+ * Huttenlocher): a column scan gives the vertical distance to the nearest
+ * feature, then the lower envelope of parabolas along every row gives the
+ * squared distance. it runs twice, to the nearest inside and to the nearest
+ * outside texel. columns are independent in the first pass and rows in the
+ * second, both are cut in stripes for the pool
+ */
+
+typedef struct {
+	uint32			width;			/* of the field: the source plus 'spread' on every side */
+	uint32			height;
+	float			scale;			/* 127.5 / spread */
+	float			far;			/* larger than any distance in the field */
+	const uint8*	inside;			/* 0xFF inside, 0 outside */
+	float*			to_inside;		/* column distance, then squared distance */
+	float*			to_outside;
+	uint8*			dst;
+} sdf_t;
+
+typedef struct {
+	sdf_t*			sdf;
+	uint32			begin;			/* columns, then rows */
+	uint32			end;
+} sdf_stripe_t;
+
+#define SDF_INSIDE_THRESHOLD	127
+
+/* first pass over the columns [begin, end): down then up, 4 columns at a time */
+static void
+sdf_columns(void* arg) {
+	sdf_stripe_t*	st		= (sdf_stripe_t*)arg;
+	sdf_t*			sdf		= st->sdf;
+	uint32			w		= sdf->width;
+	uint32			h		= sdf->height;
+	uint32			x		= st->begin;
+	uint32			y;
+
+#if defined(__SSE2__)
+	for( ; x + 4 <= st->end; x += 4 ) {
+		__m128	one		= _mm_set1_ps(1.0f);
+		__m128	in_d	= _mm_set1_ps(sdf->far);
+		__m128	out_d	= _mm_set1_ps(sdf->far);
+
+		for( y = 0; y < h; ++y ) {
+			uint32	bytes;
+			__m128i	b;
+			__m128	mask;
+			memcpy(&bytes, &sdf->inside[y * w + x], 4);
+			/* 0xFF bytes widened to all ones lanes */
+			b		= _mm_cvtsi32_si128((int)bytes);
+			b		= _mm_unpacklo_epi8(b, b);
+			mask	= _mm_castsi128_ps(_mm_unpacklo_epi16(b, b));
+			in_d	= _mm_andnot_ps(mask, _mm_add_ps(in_d, one));
+			out_d	= _mm_and_ps(mask, _mm_add_ps(out_d, one));
+			_mm_storeu_ps(&sdf->to_inside[y * w + x], in_d);
+			_mm_storeu_ps(&sdf->to_outside[y * w + x], out_d);
+		}
+
+		for( y = h - 1; y-- > 0; ) {
+			in_d	= _mm_min_ps(_mm_loadu_ps(&sdf->to_inside[y * w + x]), _mm_add_ps(_mm_loadu_ps(&sdf->to_inside[(y + 1) * w + x]), one));
+			out_d	= _mm_min_ps(_mm_loadu_ps(&sdf->to_outside[y * w + x]), _mm_add_ps(_mm_loadu_ps(&sdf->to_outside[(y + 1) * w + x]), one));
+			_mm_storeu_ps(&sdf->to_inside[y * w + x], in_d);
+			_mm_storeu_ps(&sdf->to_outside[y * w + x], out_d);
+		}
+	}
+#endif
+
+	for( ; x < st->end; ++x ) {
+		float	in_d	= sdf->far;
+		float	out_d	= sdf->far;
+
+		for( y = 0; y < h; ++y ) {
+			bool	inside	= sdf->inside[y * w + x] != 0;
+			in_d	= inside ? 0.0f : in_d + 1.0f;
+			out_d	= inside ? out_d + 1.0f : 0.0f;
+			sdf->to_inside[y * w + x]	= in_d;
+			sdf->to_outside[y * w + x]	= out_d;
+		}
+
+		for( y = h - 1; y-- > 0; ) {
+			float*	i	= &sdf->to_inside[y * w + x];
+			float*	o	= &sdf->to_outside[y * w + x];
+			if( i[w] + 1.0f < *i ) *i = i[w] + 1.0f;
+			if( o[w] + 1.0f < *o ) *o = o[w] + 1.0f;
+		}
+	}
+}
+
+/* abscissa where the parabolas rooted at q and p cross */
+static inline float
+intersect(const float* f, uint32 q, uint32 p) {
+	float	fq	= (float)q;
+	float	fp	= (float)p;
+	return ((f[q] + fq * fq) - (f[p] + fp * fp)) / (2.0f * (fq - fp));
+}
+
+/* squared distance along a row from the column distances in place, lower envelope of parabolas */
+static void
+edt_row(float* d, uint32 n, float* f, uint32* v, float* z) {
+	uint32	k	= 0;
+	uint32	q;
+
+	for( q = 0; q < n; ++q ) {
+		f[q]	= d[q] * d[q];
+	}
+
+	v[0]	= 0;
+	z[0]	= -HUGE_VALF;
+	z[1]	= HUGE_VALF;
+	for( q = 1; q < n; ++q ) {
+		float	s	= intersect(f, q, v[k]);
+		/* z[0] is -inf, k never goes below 0 */
+		while( s <= z[k] ) {
+			--k;
+			s	= intersect(f, q, v[k]);
+		}
+		++k;
+		v[k]		= q;
+		z[k]		= s;
+		z[k + 1]	= HUGE_VALF;
+	}
+
+	k	= 0;
+	for( q = 0; q < n; ++q ) {
+		float	dq;
+		while( z[k + 1] < (float)q ) ++k;
+		dq		= (float)q - (float)v[k];
+		d[q]	= dq * dq + f[v[k]];
+	}
+}
+
+/*
+ * signed distance s (positive outside) moved half a texel towards the edge,
+ * since both transforms measure between texel centers, mapped to
+ * 127.5 - s * 127.5 / spread and clamped
+ */
+static void
+map_row(const float* to_inside, const float* to_outside, uint8* dst, uint32 n, float scale) {
+	uint32	x	= 0;
+
+#if defined(__SSE2__)
+	__m128	zero	= _mm_setzero_ps();
+	__m128	half	= _mm_set1_ps(0.5f);
+	__m128	mhalf	= _mm_set1_ps(-0.5f);
+	__m128	mid		= _mm_set1_ps(128.0f);	/* 127.5 and the rounding of the truncation */
+	__m128	top		= _mm_set1_ps(255.0f);
+	__m128	vscale	= _mm_set1_ps(scale);
+
+	for( ; x + 4 <= n; x += 4 ) {
+		__m128	s		= _mm_sub_ps(_mm_sqrt_ps(_mm_loadu_ps(&to_inside[x])), _mm_sqrt_ps(_mm_loadu_ps(&to_outside[x])));
+		__m128	pos		= _mm_cmpgt_ps(s, zero);
+		__m128	v;
+		__m128i	i;
+		uint32	packed;
+
+		s	= _mm_sub_ps(s, _mm_or_ps(_mm_and_ps(pos, half), _mm_andnot_ps(pos, mhalf)));
+		v	= _mm_min_ps(_mm_max_ps(_mm_sub_ps(mid, _mm_mul_ps(s, vscale)), zero), top);
+		i	= _mm_cvttps_epi32(v);
+		i	= _mm_packus_epi16(_mm_packs_epi32(i, i), i);
+		packed	= (uint32)_mm_cvtsi128_si32(i);
+		memcpy(&dst[x], &packed, 4);
+	}
+#endif
+
+	for( ; x < n; ++x ) {
+		float	s	= sqrtf(to_inside[x]) - sqrtf(to_outside[x]);
+		float	v;
+
+		s	+= s > 0.0f ? -0.5f : 0.5f;
+		v	= 128.0f - s * scale;
+		if( v < 0.0f ) v = 0.0f;
+		if( v > 255.0f ) v = 255.0f;
+		dst[x]	= (uint8)v;
+	}
+}
+
+/* second pass over the rows [begin, end) and the mapping to A8 */
+static void
+sdf_rows(void* arg) {
+	sdf_stripe_t*	st		= (sdf_stripe_t*)arg;
+	sdf_t*			sdf		= st->sdf;
+	uint32			w		= sdf->width;
+	float*			f		= (float*)malloc(sizeof(float) * (w * 2 + 1));
+	uint32*			v		= (uint32*)malloc(sizeof(uint32) * w);
+	uint32			y;
+
+	assert( NULL != f && NULL != v );
+
+	for( y = st->begin; y < st->end; ++y ) {
+		edt_row(&sdf->to_inside[y * w], w, f, v, f + w);
+		edt_row(&sdf->to_outside[y * w], w, f, v, f + w);
+		map_row(&sdf->to_inside[y * w], &sdf->to_outside[y * w], &sdf->dst[y * w], w, sdf->scale);
+	}
+
+	free(v);
+	free(f);
+}
+
+/* run fun over [0, count) in stripes of 'step' multiples, on the pool when there is one */
+static void
+run_stripes(atlas_pool_t* pool, sdf_t* sdf, atlas_task_fun_t fun, uint32 count, uint32 step) {
+	uint32			stripes	= pool ? atlas_pool_thread_count(pool) * 4 : 1;
+	uint32			size	= ((count + stripes - 1) / stripes + step - 1) / step * step;
+	sdf_stripe_t*	st;
+	atlas_task_group_t	group;
+	uint32			s;
+
+	if( size == 0 ) size = step;
+	stripes	= (count + size - 1) / size;
+
+	st	= (sdf_stripe_t*)malloc(sizeof(sdf_stripe_t) * (stripes ? stripes : 1));
+	assert( NULL != st );
+
+	atlas_task_group_init(&group);
+	for( s = 0; s < stripes; ++s ) {
+		st[s].sdf	= sdf;
+		st[s].begin	= s * size;
+		st[s].end	= s * size + size < count ? s * size + size : count;
+		if( pool && stripes > 1 ) {
+			atlas_pool_submit_group(pool, &group, fun, &st[s]);
+		} else {
+			fun(&st[s]);
+		}
+	}
+
+	if( pool && stripes > 1 ) atlas_pool_wait_group(pool, &group);
+
+	free(st);
+}
+
+image_t*
+image_sdf(const image_t* img, uint32 spread, atlas_pool_t* pool) {
+	uint32			sw		= image_width(img);
+	uint32			sh		= image_height(img);
+	const uint8*	src		= (const uint8*)image_pixels(img);
+	uint8*			inside;
+	image_t*		field;
+	sdf_t			sdf;
+	uint32			y, x;
+
+	if( image_format(img) != PF_A8 || spread == 0 ) {
+		fprintf(stderr, "ERROR: image_sdf: needs a PF_A8 image and a non zero spread\n");
+		return NULL;
+	}
+
+	TRACE_BEGIN("image_sdf");
+
+	sdf.width		= sw + 2 * spread;
+	sdf.height		= sh + 2 * spread;
+	sdf.scale		= 127.5f / (float)spread;
+	sdf.far			= (float)(sdf.width + sdf.height);
+
+	field			= image_allocate(sdf.width, sdf.height, PF_A8);
+	inside			= (uint8*)calloc((size_t)sdf.width * sdf.height, 1);
+	sdf.to_inside	= (float*)malloc(sizeof(float) * sdf.width * sdf.height);
+	sdf.to_outside	= (float*)malloc(sizeof(float) * sdf.width * sdf.height);
+	assert( NULL != field && NULL != inside && NULL != sdf.to_inside && NULL != sdf.to_outside );
+
+	/* threshold the source into the padded feature map */
+	for( y = 0; y < sh; ++y ) {
+		for( x = 0; x < sw; ++x ) {
+			inside[(y + spread) * sdf.width + x + spread]	= src[y * sw + x] > SDF_INSIDE_THRESHOLD ? 0xFF : 0;
+		}
+	}
+
+	sdf.inside	= inside;
+	sdf.dst		= (uint8*)image_pixels(field);
+
+	run_stripes(pool, &sdf, sdf_columns, sdf.width, 4);
+	run_stripes(pool, &sdf, sdf_rows, sdf.height, 1);
+
+	free(sdf.to_outside);
+	free(sdf.to_inside);
+	free(inside);
+
+	TRACE_END("image_sdf");
+
+	return field;
+}
@@ -0,0 +1,415 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#define _POSIX_C_SOURCE 200112L
+#define _FILE_OFFSET_BITS 64
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static inline uint32
+padded(uint32 size) {
+	return (size + 3) & ~3u;
+}
+
+bool
+atlas_file_header(const atlas_t* atlas, atlas_file_header_t* hdr) {
+	hdr->magic			= ATLAS_FILE_MAGIC;
+	hdr->version		= ATLAS_FILE_VERSION;
+	hdr->entry_size		= sizeof(atlas_entry_t);
+	hdr->image_count	= atlas->image_count;
+	hdr->key_count		= atlas->key_count;
+	hdr->keys_size		= atlas->keys_size;
+	hdr->width			= image_width(atlas->baked_image);
+	hdr->height			= image_height(atlas->baked_image);
+	hdr->format			= (uint32)image_format(atlas->baked_image);
+	hdr->pixels_size	= image_data_size(atlas->baked_image);
+	hdr->palette_size	= image_palette_size(atlas->baked_image);
+	hdr->alignment		= atlas->alignment;
+
+	return image_data_size(atlas->baked_image) <= ATLAS_PIXELS_SIZE_MAX;
+}
+
+/* in 64 bit, so that a forged size can't wrap around to the stored one */
+static uint64_t
+pixels_size(const atlas_file_header_t* hdr) {
+	uint64_t	block	= image_format_block_size((PIXEL_FORMAT)hdr->format);
+
+	if( block ) return (((uint64_t)hdr->width + 3) / 4) * (((uint64_t)hdr->height + 3) / 4) * block;
+	return (uint64_t)hdr->width * hdr->height * image_format_pixel_size((PIXEL_FORMAT)hdr->format);
+}
+
+bool
+atlas_file_header_valid(const atlas_file_header_t* hdr) {
+	return hdr->magic == ATLAS_FILE_MAGIC
+		&& hdr->version == ATLAS_FILE_VERSION
+		&& hdr->entry_size == sizeof(atlas_entry_t)
+		&& hdr->palette_size <= IMAGE_PALETTE_MAX
+		&& (hdr->palette_size != 0) == (hdr->format == PF_I8)
+		&& pixels_size(hdr) == hdr->pixels_size;
+}
+
+/* every key, slot and bucket in range, so that lookups stay inside the tables */
+bool
+atlas_file_tables_valid(const atlas_file_header_t* hdr, const atlas_entry_t* entries, const sint32* buckets, const uint32* slots, const char* keys) {
+	uint32	i;
+
+	if( hdr->keys_size != 0 && keys[hdr->keys_size - 1] != '\0' ) return false;
+
+	for( i = 0; i < hdr->image_count; ++i ) {
+		if( entries[i].key != ATLAS_NO_KEY && entries[i].key >= hdr->keys_size ) return false;
+	}
+
+	for( i = 0; i < hdr->key_count; ++i ) {
+		/* a negative bucket is -(slot + 1), a displacement otherwise */
+		if( slots[i] >= hdr->image_count || buckets[i] < -(sint32)hdr->key_count ) return false;
+	}
+
+	return true;
+}
+
+size_t
+atlas_file_size(const atlas_file_header_t* hdr) {
+	return sizeof(atlas_file_header_t)
+		+ sizeof(atlas_entry_t) * hdr->image_count
+		+ (sizeof(sint32) + sizeof(uint32)) * hdr->key_count
+		+ padded(hdr->keys_size)
+		+ hdr->pixels_size
+		+ sizeof(color4b_t) * hdr->palette_size;
+}
+
+bool
+atlas_save(const atlas_t* atlas, const char* path) {
+	static const uint8	zero[4]	= { 0, 0, 0, 0 };
+	atlas_file_header_t	hdr;
+	FILE*				fp;
+	bool				ok;
+
+	if( !atlas_file_header(atlas, &hdr) ) {
+		fprintf(stderr, "ERROR: atlas_save: the baked image of %s is too large to save\n", path);
+		return false;
+	}
+
+	if( (fp = fopen(path, "wb")) == NULL ) {
+		fprintf(stderr, "ERROR: atlas_save: can't open %s\n", path);
+		return false;
+	}
+
+	ok	= fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+		&& fwrite(atlas->entries, sizeof(atlas_entry_t), atlas->image_count, fp) == atlas->image_count
+		&& fwrite(atlas->buckets, sizeof(sint32), atlas->key_count, fp) == atlas->key_count
+		&& fwrite(atlas->slots, sizeof(uint32), atlas->key_count, fp) == atlas->key_count
+		&& fwrite(atlas->keys, 1, atlas->keys_size, fp) == atlas->keys_size
+		&& fwrite(zero, 1, padded(atlas->keys_size) - atlas->keys_size, fp) == padded(atlas->keys_size) - atlas->keys_size
+		&& fwrite(image_pixels(atlas->baked_image), 1, hdr.pixels_size, fp) == hdr.pixels_size
+		&& fwrite(image_palette(atlas->baked_image), sizeof(color4b_t), hdr.palette_size, fp) == hdr.palette_size;
+
+	if( fclose(fp) != 0 ) ok = false;
+
+	if( !ok ) {
+		fprintf(stderr, "ERROR: atlas_save: failed to write %s\n", path);
+	}
+
+	return ok;
+}
+
+atlas_t*
+atlas_load(const char* path) {
+	atlas_file_header_t	hdr;
+	color4b_t			palette[IMAGE_PALETTE_MAX];
+	atlas_t*			atlas	= NULL;
+	FILE*				fp;
+	bool				ok;
+
+	if( (fp = fopen(path, "rb")) == NULL ) {
+		fprintf(stderr, "ERROR: atlas_load: %s not found\n", path);
+		return NULL;
+	}
+
+	if( fread(&hdr, sizeof(hdr), 1, fp) != 1 || !atlas_file_header_valid(&hdr) ) {
+		fprintf(stderr, "ERROR: atlas_load: %s is not a compatible atlas\n", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	atlas	= (atlas_t*)malloc(sizeof(atlas_t));
+	assert( NULL != atlas );
+
+	memset(atlas, 0, sizeof(atlas_t));
+	atlas->image_count	= hdr.image_count;
+	atlas->entry_capacity	= hdr.image_count;
+	atlas->alignment	= hdr.alignment ? hdr.alignment : 1;
+	atlas->key_count	= hdr.key_count;
+	atlas->keys_size	= hdr.keys_size;
+	atlas->entries		= (atlas_entry_t*)malloc(sizeof(atlas_entry_t) * (hdr.image_count ? hdr.image_count : 1));
+	atlas->buckets		= (sint32*)malloc(sizeof(sint32) * (hdr.key_count ? hdr.key_count : 1));
+	atlas->slots		= (uint32*)malloc(sizeof(uint32) * (hdr.key_count ? hdr.key_count : 1));
+	atlas->keys			= (char*)malloc(padded(hdr.keys_size) ? padded(hdr.keys_size) : 1);
+	atlas->baked_image	= image_allocate(hdr.width, hdr.height, (PIXEL_FORMAT)hdr.format);
+	assert( NULL != atlas->entries && NULL != atlas->buckets && NULL != atlas->slots && NULL != atlas->keys );
+
+	ok	= NULL != atlas->baked_image
+		&& image_data_size(atlas->baked_image) == hdr.pixels_size
+		&& fread(atlas->entries, sizeof(atlas_entry_t), hdr.image_count, fp) == hdr.image_count
+		&& fread(atlas->buckets, sizeof(sint32), hdr.key_count, fp) == hdr.key_count
+		&& fread(atlas->slots, sizeof(uint32), hdr.key_count, fp) == hdr.key_count
+		&& fread(atlas->keys, 1, padded(hdr.keys_size), fp) == padded(hdr.keys_size)
+		&& fread(image_pixels(atlas->baked_image), 1, hdr.pixels_size, fp) == hdr.pixels_size
+		&& fread(palette, sizeof(color4b_t), hdr.palette_size, fp) == hdr.palette_size;
+
+	fclose(fp);
+
+	if( ok && hdr.palette_size ) {
+		image_set_palette(atlas->baked_image, palette, hdr.palette_size);
+	}
+
+	if( !ok ) {
+		fprintf(stderr, "ERROR: atlas_load: %s is truncated\n", path);
+		atlas_release(atlas);
+		return NULL;
+	}
+
+	if( !atlas_file_tables_valid(&hdr, atlas->entries, atlas->buckets, atlas->slots, atlas->keys) ) {
+		fprintf(stderr, "ERROR: atlas_load: %s has keys or hash tables out of range\n", path);
+		atlas_release(atlas);
+		return NULL;
+	}
+
+	return atlas;
+}
+
+static uint32
+tile_bytes(const atlas_tiles_t* tiles) {
+	uint32		side	= tiles->tile_size + 2 * tiles->border;
+	uint32		block	= image_format_block_size(tiles->format);
+
+	return block ? (side / 4) * (side / 4) * block : side * side * image_format_pixel_size(tiles->format);
+}
+
+bool
+atlas_tiles_save(const atlas_tiles_t* tiles, const char* path) {
+	uint32					tile_count	= tiles->columns * tiles->rows;
+	uint64_t*				offsets;
+	uint64_t				offset;
+	atlas_tiles_header_t	hdr;
+	FILE*					fp;
+	uint32					t;
+	bool					ok;
+
+	for( t = 0; t < tile_count; ++t ) {
+		if( tiles->used[t] && NULL == tiles->images[t] ) {
+			fprintf(stderr, "ERROR: atlas_tiles_save: tile %u is not resident\n", t);
+			return false;
+		}
+	}
+
+	if( (fp = fopen(path, "wb")) == NULL ) {
+		fprintf(stderr, "ERROR: atlas_tiles_save: can't open %s\n", path);
+		return false;
+	}
+
+	hdr.magic		= ATLAS_TILES_MAGIC;
+	hdr.version		= ATLAS_TILES_VERSION;
+	hdr.tile_size	= tiles->tile_size;
+	hdr.border		= tiles->border;
+	hdr.columns		= tiles->columns;
+	hdr.rows		= tiles->rows;
+	hdr.format		= (uint32)tiles->format;
+	hdr.image_count	= tiles->image_count;
+	hdr.tile_bytes	= tile_bytes(tiles);
+	hdr.palette_size	= tiles->palette_size;
+
+	/* the used tiles follow the offset table back to back */
+	offsets	= (uint64_t*)malloc(sizeof(uint64_t) * tile_count);
+	assert( NULL != offsets );
+
+	offset	= sizeof(hdr) + sizeof(color4b_t) * tiles->palette_size + sizeof(atlas_tile_range_t) * tiles->image_count + sizeof(uint64_t) * tile_count;
+	for( t = 0; t < tile_count; ++t ) {
+		offsets[t]	= tiles->used[t] ? offset : 0;
+		if( tiles->used[t] ) offset += hdr.tile_bytes;
+	}
+
+	ok	= fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+		&& fwrite(tiles->palette, sizeof(color4b_t), tiles->palette_size, fp) == tiles->palette_size
+		&& fwrite(tiles->ranges, sizeof(atlas_tile_range_t), tiles->image_count, fp) == tiles->image_count
+		&& fwrite(offsets, sizeof(uint64_t), tile_count, fp) == tile_count;
+
+	for( t = 0; t < tile_count && ok; ++t ) {
+		if( tiles->used[t] ) {
+			ok	= fwrite(image_pixels(tiles->images[t]), 1, hdr.tile_bytes, fp) == hdr.tile_bytes;
+		}
+	}
+
+	free(offsets);
+
+	if( fclose(fp) != 0 ) ok = false;
+
+	if( !ok ) {
+		fprintf(stderr, "ERROR: atlas_tiles_save: failed to write %s\n", path);
+	}
+
+	return ok;
+}
+
+/* the tile size the header implies, 0 for formats tiles can't hold */
+static uint64_t
+header_tile_bytes(const atlas_tiles_header_t* hdr) {
+	uint64_t	side	= (uint64_t)hdr->tile_size + 2 * (uint64_t)hdr->border;
+	uint64_t	block	= image_format_block_size((PIXEL_FORMAT)hdr->format);
+
+	if( block ) return side % 4 ? 0 : (side / 4) * (side / 4) * block;
+	return side * side * image_format_pixel_size((PIXEL_FORMAT)hdr->format);
+}
+
+atlas_tiles_t*
+atlas_tiles_open(const char* path) {
+	atlas_tiles_header_t	hdr;
+	atlas_tiles_t*			tiles;
+	uint64_t				tables;
+	off_t					file_size;
+	uint32					tile_count;
+	uint32					t;
+	FILE*					fp;
+	bool					ok;
+
+	if( (fp = fopen(path, "rb")) == NULL ) {
+		fprintf(stderr, "ERROR: atlas_tiles_open: %s not found\n", path);
+		return NULL;
+	}
+
+	if( fread(&hdr, sizeof(hdr), 1, fp) != 1
+	 || hdr.magic != ATLAS_TILES_MAGIC
+	 || hdr.version != ATLAS_TILES_VERSION
+	 || hdr.palette_size > IMAGE_PALETTE_MAX
+	 || (hdr.palette_size != 0) != (hdr.format == PF_I8)
+	 || hdr.tile_size == 0
+	 || header_tile_bytes(&hdr) == 0
+	 || header_tile_bytes(&hdr) != hdr.tile_bytes
+	 || (uint64_t)hdr.columns * hdr.rows > 0xFFFFFFFFu ) {
+		fprintf(stderr, "ERROR: atlas_tiles_open: %s is not a compatible tile file\n", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	/* the page table must fit in the file before anything is allocated for it */
+	tile_count	= hdr.columns * hdr.rows;
+	tables		= sizeof(hdr) + sizeof(color4b_t) * (uint64_t)hdr.palette_size + sizeof(atlas_tile_range_t) * (uint64_t)hdr.image_count + sizeof(uint64_t) * (uint64_t)tile_count;
+	if( fseeko(fp, 0, SEEK_END) != 0 || (file_size = ftello(fp)) < 0 || (uint64_t)file_size < tables || fseeko(fp, sizeof(hdr), SEEK_SET) != 0 ) {
+		fprintf(stderr, "ERROR: atlas_tiles_open: %s is truncated\n", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	tiles	= (atlas_tiles_t*)malloc(sizeof(atlas_tiles_t));
+	assert( NULL != tiles );
+
+	memset(tiles, 0, sizeof(atlas_tiles_t));
+	tiles->tile_size	= hdr.tile_size;
+	tiles->border		= hdr.border;
+	tiles->columns		= hdr.columns;
+	tiles->rows			= hdr.rows;
+	tiles->format		= (PIXEL_FORMAT)hdr.format;
+	tiles->image_count	= hdr.image_count;
+	tiles->palette_size	= hdr.palette_size;
+	tiles->fp			= fp;
+
+	tiles->ranges	= (atlas_tile_range_t*)malloc(sizeof(atlas_tile_range_t) * (hdr.image_count ? hdr.image_count : 1));
+	tiles->offsets	= (uint64_t*)malloc(sizeof(uint64_t) * (tile_count ? tile_count : 1));
+	tiles->used		= (uint8*)calloc(tile_count ? tile_count : 1, sizeof(uint8));
+	tiles->images	= (image_t**)calloc(tile_count ? tile_count : 1, sizeof(image_t*));
+	assert( NULL != tiles->ranges && NULL != tiles->offsets && NULL != tiles->used && NULL != tiles->images );
+
+	ok	= fread(tiles->palette, sizeof(color4b_t), hdr.palette_size, fp) == hdr.palette_size
+		&& fread(tiles->ranges, sizeof(atlas_tile_range_t), hdr.image_count, fp) == hdr.image_count
+		&& fread(tiles->offsets, sizeof(uint64_t), tile_count, fp) == tile_count;
+
+	if( !ok ) {
+		fprintf(stderr, "ERROR: atlas_tiles_open: %s is truncated\n", path);
+		atlas_tiles_release(tiles);
+		return NULL;
+	}
+
+	/* every stored tile after the tables and whole, every range on the grid */
+	for( t = 0; t < tile_count && ok; ++t ) {
+		uint64_t	offset	= tiles->offsets[t];
+		ok	= offset == 0 || (offset >= tables && offset <= (uint64_t)file_size && (uint64_t)file_size - offset >= hdr.tile_bytes);
+	}
+
+	for( t = 0; t < hdr.image_count && ok; ++t ) {
+		const atlas_tile_range_t*	r	= &tiles->ranges[t];
+		ok	= (uint64_t)r->x + r->columns <= hdr.columns && (uint64_t)r->y + r->rows <= hdr.rows;
+	}
+
+	if( !ok ) {
+		fprintf(stderr, "ERROR: atlas_tiles_open: %s has tiles or ranges outside of it\n", path);
+		atlas_tiles_release(tiles);
+		return NULL;
+	}
+
+	for( t = 0; t < tile_count; ++t ) {
+		tiles->used[t]	= tiles->offsets[t] != 0;
+	}
+
+	return tiles;
+}
+
+bool
+atlas_tiles_load_tile(atlas_tiles_t* tiles, uint32 tile) {
+	uint32		side	= tiles->tile_size + 2 * tiles->border;
+	uint32		size	= tile_bytes(tiles);
+	image_t*	img;
+
+	if( tile >= tiles->columns * tiles->rows ) {
+		fprintf(stderr, "ERROR: atlas_tiles_load_tile: tile %u is out of range\n", tile);
+		return false;
+	}
+
+	if( tiles->images[tile] ) return true;
+
+	if( NULL == tiles->fp || tiles->offsets[tile] == 0 ) {
+		fprintf(stderr, "ERROR: atlas_tiles_load_tile: tile %u is not stored\n", tile);
+		return false;
+	}
+
+	img	= image_allocate(side, side, tiles->format);
+	if( NULL == img ) return false;
+
+	/* atlas_tiles_open kept the offsets inside the file, they fit an off_t */
+	if( fseeko(tiles->fp, (off_t)tiles->offsets[tile], SEEK_SET) != 0
+	 || fread(image_pixels(img), 1, size, tiles->fp) != size ) {
+		fprintf(stderr, "ERROR: atlas_tiles_load_tile: tile %u is truncated\n", tile);
+		image_release(img);
+		return false;
+	}
+
+	if( tiles->palette_size ) {
+		image_set_palette(img, tiles->palette, tiles->palette_size);
+	}
+
+	tiles->images[tile]	= img;
+	return true;
+}
+
+void
+atlas_tiles_evict_tile(atlas_tiles_t* tiles, uint32 tile) {
+	if( tile < tiles->columns * tiles->rows && tiles->images[tile] ) {
+		image_release(tiles->images[tile]);
+		tiles->images[tile]	= NULL;
+	}
+}
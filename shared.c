@@ -0,0 +1,284 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#define _POSIX_C_SOURCE 200112L
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * a published atlas is an immutable POSIX shared memory segment named
+ * '<name>.<generation>' and laid out as an atlas file (see serialize.c).
+ * the segment 'name' only holds the current generation: the publisher
+ * writes the next segment whole, then bumps the generation and unlinks
+ * the previous segment, whose pages stay until the last process attached
+ * to it lets go. the munmap and shm_unlink calls between the writes and
+ * the bump order them for the other processes. one publisher per name
+ */
+
+#define SHARED_MAGIC			0x48535441	/* "ATSH" */
+#define SHARED_NAME_MAX			256
+#define SHARED_ATTACH_TRIES		8			/* publishes racing an attach */
+
+static bool
+segment_name(char* out, const char* name, uint32 generation) {
+	int	n	= snprintf(out, SHARED_NAME_MAX, "%s.%u", name, generation);
+	return n > 0 && n < SHARED_NAME_MAX;
+}
+
+/* the control segment, created zeroed (nothing published) if 'writable' */
+static atlas_shared_control_t*
+map_control(const char* name, bool writable) {
+	atlas_shared_control_t*	control;
+	struct stat				st;
+	int						fd	= shm_open(name, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+
+	if( fd < 0 ) return NULL;
+
+	if( fstat(fd, &st) != 0
+	 || ((size_t)st.st_size < sizeof(atlas_shared_control_t) && (!writable || ftruncate(fd, sizeof(atlas_shared_control_t)) != 0)) ) {
+		close(fd);
+		return NULL;
+	}
+
+	control	= (atlas_shared_control_t*)mmap(NULL, sizeof(atlas_shared_control_t), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if( control == MAP_FAILED ) return NULL;
+
+	if( control->magic != SHARED_MAGIC && control->magic != 0 ) {
+		munmap(control, sizeof(atlas_shared_control_t));
+		return NULL;
+	}
+
+	return control;
+}
+
+uint32
+atlas_publish(const atlas_t* atlas, const char* name) {
+	atlas_shared_control_t*	control	= map_control(name, true);
+	atlas_file_header_t		hdr;
+	char					segment[SHARED_NAME_MAX];
+	uint32					generation;
+	uint32					previous;
+	uint8*					base;
+	uint8*					p;
+	size_t					size;
+	int						fd;
+
+	if( NULL == control ) {
+		fprintf(stderr, "ERROR: atlas_publish: can't open %s\n", name);
+		return 0;
+	}
+
+	previous	= control->generation;
+	generation	= previous + 1;
+	if( !atlas_file_header(atlas, &hdr) ) {
+		fprintf(stderr, "ERROR: atlas_publish: the baked image is too large to publish as %s\n", name);
+		munmap(control, sizeof(atlas_shared_control_t));
+		return 0;
+	}
+	size		= atlas_file_size(&hdr);
+
+	fd	= segment_name(segment, name, generation) ? shm_open(segment, O_RDWR | O_CREAT | O_EXCL, 0644) : -1;
+	if( fd < 0 ) {
+		fprintf(stderr, "ERROR: atlas_publish: can't create generation %u of %s\n", generation, name);
+		munmap(control, sizeof(atlas_shared_control_t));
+		return 0;
+	}
+
+	base	= ftruncate(fd, (off_t)size) == 0 ? (uint8*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : (uint8*)MAP_FAILED;
+	close(fd);
+
+	if( base == (uint8*)MAP_FAILED ) {
+		fprintf(stderr, "ERROR: atlas_publish: can't map %lu bytes for %s\n", (unsigned long)size, name);
+		shm_unlink(segment);
+		munmap(control, sizeof(atlas_shared_control_t));
+		return 0;
+	}
+
+	/* the file layout, the key padding is already zeroed */
+	TRACE_BEGIN("atlas_publish");
+	p	= base;
+	memcpy(p, &hdr, sizeof(hdr));
+	p	+= sizeof(hdr);
+	if( hdr.image_count ) memcpy(p, atlas->entries, sizeof(atlas_entry_t) * hdr.image_count);
+	p	+= sizeof(atlas_entry_t) * hdr.image_count;
+	if( hdr.key_count ) {
+		memcpy(p, atlas->buckets, sizeof(sint32) * hdr.key_count);
+		memcpy(p + sizeof(sint32) * hdr.key_count, atlas->slots, sizeof(uint32) * hdr.key_count);
+		memcpy(p + (sizeof(sint32) + sizeof(uint32)) * hdr.key_count, atlas->keys, hdr.keys_size);
+	}
+	p	+= (sizeof(sint32) + sizeof(uint32)) * hdr.key_count + ((hdr.keys_size + 3) & ~3u);
+	memcpy(p, image_pixels(atlas->baked_image), hdr.pixels_size);
+	p	+= hdr.pixels_size;
+	if( hdr.palette_size ) memcpy(p, image_palette(atlas->baked_image), sizeof(color4b_t) * hdr.palette_size);
+	munmap(base, size);
+	TRACE_END("atlas_publish");
+
+	control->magic		= SHARED_MAGIC;
+	control->generation	= generation;
+	munmap(control, sizeof(atlas_shared_control_t));
+
+	if( previous != 0 && segment_name(segment, name, previous) ) shm_unlink(segment);
+
+	return generation;
+}
+
+/* a read only atlas over a mapped segment, NULL if it is not one */
+static atlas_t*
+view(uint8* mapping, size_t size) {
+	const atlas_file_header_t*	hdr	= (const atlas_file_header_t*)mapping;
+	atlas_t*					atlas;
+	image_t*					baked;
+	uint8*						entries	= mapping + sizeof(atlas_file_header_t);
+	uint8*						buckets;
+	uint8*						slots;
+	uint8*						keys;
+	uint8*						pixels;
+
+	if( size < sizeof(atlas_file_header_t) || !atlas_file_header_valid(hdr) || atlas_file_size(hdr) > size ) return NULL;
+
+	buckets	= entries + sizeof(atlas_entry_t) * hdr->image_count;
+	slots	= buckets + sizeof(sint32) * hdr->key_count;
+	keys	= slots + sizeof(uint32) * hdr->key_count;
+	pixels	= keys + ((hdr->keys_size + 3) & ~3u);
+
+	/* the same checks as atlas_load, another process wrote the segment */
+	if( !atlas_file_tables_valid(hdr, (const atlas_entry_t*)entries, (const sint32*)buckets, (const uint32*)slots, (const char*)keys) ) return NULL;
+
+	baked	= image_wrap(hdr->width, hdr->height, (PIXEL_FORMAT)hdr->format, pixels);
+	if( NULL == baked ) return NULL;
+
+	if( hdr->palette_size ) {
+		image_set_palette(baked, (const color4b_t*)(pixels + hdr->pixels_size), hdr->palette_size);
+	}
+
+	atlas	= (atlas_t*)malloc(sizeof(atlas_t));
+	assert( NULL != atlas );
+
+	memset(atlas, 0, sizeof(atlas_t));
+	atlas->mapping			= mapping;
+	atlas->mapping_size		= size;
+	atlas->image_count		= hdr->image_count;
+	atlas->entry_capacity	= hdr->image_count;
+	atlas->alignment		= hdr->alignment ? hdr->alignment : 1;
+	atlas->key_count		= hdr->key_count;
+	atlas->keys_size		= hdr->keys_size;
+	atlas->entries			= (atlas_entry_t*)entries;
+	atlas->buckets			= (sint32*)buckets;
+	atlas->slots			= (uint32*)slots;
+	atlas->keys				= (char*)keys;
+	atlas->baked_image		= baked;
+
+	return atlas;
+}
+
+atlas_t*
+atlas_attach(const char* name) {
+	atlas_shared_control_t*	control	= map_control(name, false);
+	char					segment[SHARED_NAME_MAX];
+	uint32					tries;
+
+	if( NULL == control ) {
+		fprintf(stderr, "ERROR: atlas_attach: nothing published as %s\n", name);
+		return NULL;
+	}
+
+	for( tries = 0; tries < SHARED_ATTACH_TRIES; ++tries ) {
+		uint32		generation	= control->generation;
+		atlas_t*	atlas;
+		struct stat	st;
+		void*		mapping;
+		int			fd;
+
+		if( generation == 0 || !segment_name(segment, name, generation) ) break;
+
+		/* unlinked by a newer publish in between: read the generation again */
+		fd	= shm_open(segment, O_RDONLY, 0);
+		if( fd < 0 && errno == ENOENT ) continue;
+		if( fd < 0 ) break;
+
+		mapping	= fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+		if( mapping == MAP_FAILED ) break;
+
+		atlas	= view((uint8*)mapping, (size_t)st.st_size);
+		if( NULL == atlas ) {
+			munmap(mapping, (size_t)st.st_size);
+			fprintf(stderr, "ERROR: atlas_attach: %s is not a compatible atlas\n", segment);
+			munmap(control, sizeof(atlas_shared_control_t));
+			return NULL;
+		}
+
+		atlas->control		= control;
+		atlas->generation	= generation;
+		return atlas;
+	}
+
+	fprintf(stderr, "ERROR: atlas_attach: can't attach to %s\n", name);
+	munmap(control, sizeof(atlas_shared_control_t));
+	return NULL;
+}
+
+uint32
+atlas_generation(const atlas_t* atlas) {
+	return atlas->generation;
+}
+
+bool
+atlas_stale(const atlas_t* atlas) {
+	return atlas->control && atlas->control->generation != atlas->generation;
+}
+
+bool
+atlas_unpublish(const char* name) {
+	atlas_shared_control_t*	control	= map_control(name, false);
+	char					segment[SHARED_NAME_MAX];
+	bool					ok;
+
+	if( NULL == control ) {
+		fprintf(stderr, "ERROR: atlas_unpublish: nothing published as %s\n", name);
+		return false;
+	}
+
+	ok	= control->generation == 0 || (segment_name(segment, name, control->generation) && shm_unlink(segment) == 0);
+	munmap(control, sizeof(atlas_shared_control_t));
+
+	return shm_unlink(name) == 0 && ok;
+}
+
+void
+atlas_detach(atlas_t* atlas) {
+	munmap(atlas->mapping, atlas->mapping_size);
+	munmap((void*)atlas->control, sizeof(atlas_shared_control_t));
+
+	/* the rest of the release leaves them alone */
+	atlas->mapping	= NULL;
+	atlas->control	= NULL;
+	atlas->entries	= NULL;
+	atlas->buckets	= NULL;
+	atlas->slots	= NULL;
+	atlas->keys		= NULL;
+}
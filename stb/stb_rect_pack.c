@@ -67,11 +67,15 @@ enum
    STBRP__INIT_skyline = 1,
 };
 
+#define STBRP__MAX(a, b)  ((a) > (b) ? (a) : (b))
+#define STBRP__MIN(a, b)  ((a) < (b) ? (a) : (b))
+
 STBRP_DEF void stbrp_setup_heuristic(stbrp_context *context, int heuristic)
 {
    switch (context->init_mode) {
       case STBRP__INIT_skyline:
          STBRP_ASSERT(heuristic == STBRP_HEURISTIC_Skyline_BL_sortHeight || heuristic == STBRP_HEURISTIC_Skyline_BF_sortHeight);
+         STBRP_ASSERT(heuristic == STBRP_HEURISTIC_Skyline_BL_sortHeight || context->index == NULL);
          context->heuristic = heuristic;
          break;
       default:
@@ -79,6 +83,11 @@ STBRP_DEF void stbrp_setup_heuristic(stbrp_context *context, int heuristic)
    }
 }
 
+STBRP_DEF void stbrp_setup_allow_rotation(stbrp_context *context, int allow_rotation)
+{
+   context->allow_rotation = allow_rotation;
+}
+
 STBRP_DEF void stbrp_setup_allow_out_of_mem(stbrp_context *context, int allow_out_of_mem)
 {
    if (allow_out_of_mem)
@@ -111,7 +120,11 @@ STBRP_DEF void stbrp_init_target(stbrp_context *context, int width, int height,
    nodes[i].next = NULL;
    context->init_mode = STBRP__INIT_skyline;
    context->heuristic = STBRP_HEURISTIC_Skyline_default;
+   context->allow_rotation = 0;
+   context->index = NULL;
    context->free_head = &nodes[0];
+   context->nodes_in_use = 0;
+   context->nodes_peak = 0;
    context->active_head = &context->extra[0];
    context->width = width;
    context->height = height;
@@ -185,12 +198,322 @@ typedef struct
    stbrp_node **prev_link;
 } stbrp__findresult;
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// skyline index (stbrp_setup_index)
+//
+// The column heights live in a segment tree (range assign, range max/min)
+// and the node starts in a bitmap with a summary word per 32 words. A BL
+// search evaluates a candidate in O(log width), then skips every following
+// candidate up to the rightmost highest column of its span (their spans
+// contain that column too) and goes straight to the first run of columns
+// lower than the best so far that is wide enough: nothing in between can be
+// strictly lower. Node starts follow the same rules as the linked list, so
+// the placements are identical.
+
+typedef struct
+{
+   int leaves;             // power of two >= width
+   int *max, *min;         // column heights, node 1 covers [0, leaves)
+   int *tag;               // pending assignment to the children, -1 if none
+   unsigned int *starts;   // bit per column where a skyline node starts
+   unsigned int *summary;  // bit per non-empty 'starts' word
+   int count;              // skyline nodes
+} stbrp__index;
+
+static int stbrp__index_leaves(int width)
+{
+   int n = 1;
+   while (n < width)
+      n <<= 1;
+   return n;
+}
+
+STBRP_DEF int stbrp_index_size(int width)
+{
+   int words = (width + 31) / 32;
+   return (int) sizeof(stbrp__index) + (int) sizeof(int) * 6 * stbrp__index_leaves(width)
+        + (int) sizeof(unsigned int) * (words + (words + 31) / 32);
+}
+
+static int stbrp__ctz(unsigned int v)
+{
+#if defined(__GNUC__)
+   return __builtin_ctz(v);
+#else
+   int n = 0;
+   while (!(v & 1)) { v >>= 1; ++n; }
+   return n;
+#endif
+}
+
+static int stbrp__popcount(unsigned int v)
+{
+   v = v - ((v >> 1) & 0x55555555);
+   v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+   return (int) ((((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24);
+}
+
+STBRP_DEF void stbrp_setup_index(stbrp_context *context, void *memory)
+{
+   stbrp__index *ix = (stbrp__index *) memory;
+   int words = (context->width + 31) / 32;
+   int i;
+
+   STBRP_ASSERT(context->heuristic == STBRP_HEURISTIC_Skyline_BL_sortHeight);
+
+   ix->leaves  = stbrp__index_leaves(context->width);
+   ix->max     = (int *) (ix + 1);
+   ix->min     = ix->max + 2 * ix->leaves;
+   ix->tag     = ix->min + 2 * ix->leaves;
+   ix->starts  = (unsigned int *) (ix->tag + 2 * ix->leaves);
+   ix->summary = ix->starts + words;
+
+   for (i=0; i < 2 * ix->leaves; ++i) {
+      ix->max[i] = ix->min[i] = 0;
+      ix->tag[i] = -1;
+   }
+   for (i=0; i < words; ++i)
+      ix->starts[i] = 0;
+   for (i=0; i < (words + 31) / 32; ++i)
+      ix->summary[i] = 0;
+
+   // same as the initial list: one node at x = 0, y = 0
+   ix->starts[0] = ix->summary[0] = 1;
+   ix->count = 1;
+
+   context->index = ix;
+   context->align = 1;  // the index never runs out of nodes
+}
+
+static void stbrp__index_apply(stbrp__index *ix, int n, int v)
+{
+   ix->max[n] = ix->min[n] = ix->tag[n] = v;
+}
+
+static void stbrp__index_assign(stbrp__index *ix, int n, int l, int r, int ql, int qr, int v)
+{
+   int m;
+   if (qr <= l || r <= ql)
+      return;
+   if (ql <= l && r <= qr) {
+      stbrp__index_apply(ix, n, v);
+      return;
+   }
+   if (ix->tag[n] >= 0) {
+      stbrp__index_apply(ix, 2*n, ix->tag[n]);
+      stbrp__index_apply(ix, 2*n+1, ix->tag[n]);
+      ix->tag[n] = -1;
+   }
+   m = (l + r) / 2;
+   stbrp__index_assign(ix, 2*n, l, m, ql, qr, v);
+   stbrp__index_assign(ix, 2*n+1, m, r, ql, qr, v);
+   ix->max[n] = STBRP__MAX(ix->max[2*n], ix->max[2*n+1]);
+   ix->min[n] = STBRP__MIN(ix->min[2*n], ix->min[2*n+1]);
+}
+
+// a pending tag means the whole node has that height, no need to push it down
+static int stbrp__index_max(stbrp__index *ix, int n, int l, int r, int ql, int qr)
+{
+   int m, a, b;
+   if (qr <= l || r <= ql)
+      return -1;
+   if ((ql <= l && r <= qr) || ix->tag[n] >= 0)
+      return ix->max[n];
+   m = (l + r) / 2;
+   a = stbrp__index_max(ix, 2*n, l, m, ql, qr);
+   b = stbrp__index_max(ix, 2*n+1, m, r, ql, qr);
+   return STBRP__MAX(a, b);
+}
+
+// leftmost column of [ql, qr) at least 'v' high, -1 if none
+static int stbrp__index_first_ge(stbrp__index *ix, int n, int l, int r, int ql, int qr, int v)
+{
+   int m, res;
+   if (qr <= l || r <= ql || ix->max[n] < v)
+      return -1;
+   if (ix->tag[n] >= 0 || r - l == 1)
+      return STBRP__MAX(l, ql);
+   m = (l + r) / 2;
+   res = stbrp__index_first_ge(ix, 2*n, l, m, ql, qr, v);
+   return res >= 0 ? res : stbrp__index_first_ge(ix, 2*n+1, m, r, ql, qr, v);
+}
+
+// rightmost column of [ql, qr) at least 'v' high, -1 if none
+static int stbrp__index_last_ge(stbrp__index *ix, int n, int l, int r, int ql, int qr, int v)
+{
+   int m, res;
+   if (qr <= l || r <= ql || ix->max[n] < v)
+      return -1;
+   if (ix->tag[n] >= 0 || r - l == 1)
+      return STBRP__MIN(r, qr) - 1;
+   m = (l + r) / 2;
+   res = stbrp__index_last_ge(ix, 2*n+1, m, r, ql, qr, v);
+   return res >= 0 ? res : stbrp__index_last_ge(ix, 2*n, l, m, ql, qr, v);
+}
+
+// leftmost run of columns of [ql, qr) lower than 'v' and at least 'width'
+// wide, -1 if none; the run being measured is carried in 'start' and 'len'
+static int stbrp__index_find_run(stbrp__index *ix, int n, int l, int r, int ql, int qr, int v, int width, int *start, int *len)
+{
+   int m, res, lo, hi;
+   if (qr <= l || r <= ql)
+      return -1;
+   if (ix->min[n] >= v) {
+      *len = 0;
+      return -1;
+   }
+
+   lo = STBRP__MAX(l, ql);
+   hi = STBRP__MIN(r, qr);
+   if (*len == 0)
+      *start = lo;
+
+   // a span narrower than 'width' only matters through its ends: the run
+   // coming from the left goes on up to its first high column, and the one
+   // going on to the right starts after its last
+   if (r - l < width || ix->max[n] < v) {
+      int first = (ix->max[n] < v) ? -1 : stbrp__index_first_ge(ix, n, l, r, lo, hi, v);
+      if (first < 0) {
+         *len += hi - lo;
+         return (*len >= width) ? *start : -1;
+      }
+      *len += first - lo;
+      if (*len >= width)
+         return *start;
+      *start = stbrp__index_last_ge(ix, n, l, r, lo, hi, v) + 1;
+      *len = hi - *start;
+      return -1;
+   }
+
+   m = (l + r) / 2;
+   res = stbrp__index_find_run(ix, 2*n, l, m, ql, qr, v, width, start, len);
+   return res >= 0 ? res : stbrp__index_find_run(ix, 2*n+1, m, r, ql, qr, v, width, start, len);
+}
+
+// first node start at or after x, -1 if none
+static int stbrp__index_next_start(stbrp__index *ix, int width, int x)
+{
+   int words = (width + 31) / 32;
+   int w = x >> 5, s;
+   unsigned int bits;
+
+   if (x >= width)
+      return -1;
+   bits = ix->starts[w] & (~0u << (x & 31));
+   if (bits)
+      return (w << 5) + stbrp__ctz(bits);
+
+   ++w;
+   for (s = w >> 5; s < (words + 31) / 32; ++s) {
+      bits = ix->summary[s];
+      if (s == (w >> 5))
+         bits &= ~0u << (w & 31);
+      if (bits) {
+         w = (s << 5) + stbrp__ctz(bits);
+         return (w << 5) + stbrp__ctz(ix->starts[w]);
+      }
+   }
+   return -1;
+}
+
+static void stbrp__index_set_start(stbrp__index *ix, int x)
+{
+   if (!(ix->starts[x >> 5] & (1u << (x & 31)))) {
+      ix->starts[x >> 5] |= 1u << (x & 31);
+      ix->summary[x >> 10] |= 1u << ((x >> 5) & 31);
+      ++ix->count;
+   }
+}
+
+// remove the node starts in [x0, x1)
+static void stbrp__index_clear_starts(stbrp__index *ix, int x0, int x1)
+{
+   while (x0 < x1) {
+      int w = x0 >> 5;
+      int end = STBRP__MIN(x1, (w + 1) << 5);
+      unsigned int mask = (~0u << (x0 & 31)) & (~0u >> (31 - ((end - 1) & 31)));
+      ix->count -= stbrp__popcount(ix->starts[w] & mask);
+      ix->starts[w] &= ~mask;
+      if (!ix->starts[w])
+         ix->summary[w >> 5] &= ~(1u << (w & 31));
+      x0 = end;
+   }
+}
+
+// only positions lower than 'bound' are of interest, the search fails otherwise
+static stbrp__findresult stbrp__index_find_best_pos(stbrp_context *c, int width, int bound)
+{
+   stbrp__index *ix = (stbrp__index *) c->index;
+   int best_y = bound, best_x = -1, x = (width <= c->width) ? 0 : -1;
+   stbrp__findresult fr;
+
+   // usually a run at the lowest height is wide enough, that is the answer
+   if (x >= 0 && ix->min[1] < bound) {
+      int start = 0, len = 0;
+      int low = stbrp__index_find_run(ix, 1, 0, ix->leaves, 0, c->width, ix->min[1] + 1, width, &start, &len);
+      if (low >= 0) {
+         best_y = ix->min[1];
+         best_x = low;
+         x = -1;
+      }
+   }
+
+   while (x >= 0) {
+      int y = stbrp__index_max(ix, 1, 0, ix->leaves, x, x + width);
+      int last = stbrp__index_last_ge(ix, 1, 0, ix->leaves, x, x + width, y);
+      if (y < best_y) {
+         best_y = y;
+         best_x = x;
+      }
+      // the next candidate starts the first run of columns lower than the
+      // best that is wide enough, no other position can be lower; past
+      // 'last' a run starts on a node start (its left neighbour is higher)
+      x = stbrp__index_next_start(ix, c->width, last + 1);
+      if (x >= 0) {
+         int start = x, len = 0;
+         x = stbrp__index_find_run(ix, 1, 0, ix->leaves, x, c->width, best_y, width, &start, &len);
+      }
+   }
+
+   // prev_link is only tested against NULL on this path
+   fr.prev_link = (best_x < 0) ? NULL : &c->active_head;
+   fr.x = (best_x < 0) ? 0 : best_x;
+   fr.y = best_y;
+   return fr;
+}
+
+static stbrp__findresult stbrp__index_place_rectangle(stbrp_context *context, stbrp__findresult res, int width, int height)
+{
+   stbrp__index *ix = (stbrp__index *) context->index;
+
+   if (res.prev_link == NULL || res.y + height > context->height) {
+      res.prev_link = NULL;
+      return res;
+   }
+
+   // the new node replaces the ones it covers, the one it cuts starts at its right edge
+   stbrp__index_assign(ix, 1, 0, ix->leaves, res.x, res.x + width, res.y + height);
+   stbrp__index_clear_starts(ix, res.x + 1, res.x + width);
+   if (res.x + width < context->width)
+      stbrp__index_set_start(ix, res.x + width);
+
+   context->nodes_in_use = ix->count;
+   if (context->nodes_in_use > context->nodes_peak)
+      context->nodes_peak = context->nodes_in_use;
+   return res;
+}
+
+
 static stbrp__findresult stbrp__skyline_find_best_pos(stbrp_context *c, int width, int height)
 {
    int best_waste = (1<<30), best_x, best_y = (1 << 30);
    stbrp__findresult fr;
    stbrp_node **prev, *node, *tail, **best = NULL;
 
+   if (c->index)
+      return stbrp__index_find_best_pos(c, width, c->height - height + 1);
+
    // align to multiple of c->align
    width = (width + c->align - 1);
    width -= width % c->align;
@@ -280,12 +603,13 @@ static stbrp__findresult stbrp__skyline_find_best_pos(stbrp_context *c, int widt
    return fr;
 }
 
-static stbrp__findresult stbrp__skyline_pack_rectangle(stbrp_context *context, int width, int height)
+static stbrp__findresult stbrp__skyline_place_rectangle(stbrp_context *context, stbrp__findresult res, int width, int height)
 {
-   // find best position according to heuristic
-   stbrp__findresult res = stbrp__skyline_find_best_pos(context, width, height);
    stbrp_node *node, *cur;
 
+   if (context->index)
+      return stbrp__index_place_rectangle(context, res, width, height);
+
    // bail if:
    //    1. it failed
    //    2. the best node doesn't fit (we don't always check this)
@@ -301,6 +625,8 @@ static stbrp__findresult stbrp__skyline_pack_rectangle(stbrp_context *context, i
    node->y = (stbrp_coord) (res.y + height);
 
    context->free_head = node->next;
+   if (++context->nodes_in_use > context->nodes_peak)
+      context->nodes_peak = context->nodes_in_use;
 
    // insert the new node into the right starting point, and
    // let 'cur' point to the remaining nodes needing to be
@@ -323,6 +649,7 @@ static stbrp__findresult stbrp__skyline_pack_rectangle(stbrp_context *context, i
       // move the current node to the free list
       cur->next = context->free_head;
       context->free_head = cur;
+      --context->nodes_in_use;
       cur = next;
    }
 
@@ -362,6 +689,39 @@ static stbrp__findresult stbrp__skyline_pack_rectangle(stbrp_context *context, i
    return res;
 }
 
+static stbrp__findresult stbrp__skyline_pack_rectangle(stbrp_context *context, int width, int height)
+{
+   // find best position according to heuristic
+   stbrp__findresult res = stbrp__skyline_find_best_pos(context, width, height);
+   return stbrp__skyline_place_rectangle(context, res, width, height);
+}
+
+// same as above, but also tries the rectangle rotated and keeps the lowest top edge
+static stbrp__findresult stbrp__skyline_pack_rectangle_rotated(stbrp_context *context, int width, int height, int *rotated)
+{
+   stbrp__findresult res = stbrp__skyline_find_best_pos(context, width, height);
+   stbrp__findresult rot;
+   int fits, rot_fits;
+
+   *rotated = 0;
+   if (width == height || height > context->width)
+      return stbrp__skyline_place_rectangle(context, res, width, height);
+
+   fits = res.prev_link != NULL && res.y + height <= context->height;
+   // the rotated position only matters if it ends lower, the index can stop above that
+   if (context->index)
+      rot = stbrp__index_find_best_pos(context, height, fits ? STBRP__MIN(res.y + height - width, context->height - width + 1) : context->height - width + 1);
+   else
+      rot = stbrp__skyline_find_best_pos(context, height, width);
+   rot_fits = rot.prev_link != NULL && rot.y + width <= context->height;
+
+   if (rot_fits && (!fits || rot.y + width < res.y + height)) {
+      *rotated = 1;
+      return stbrp__skyline_place_rectangle(context, rot, height, width);
+   }
+   return stbrp__skyline_place_rectangle(context, res, width, height);
+}
+
 static int rect_height_compare(const void *a, const void *b)
 {
    stbrp_rect *p = (stbrp_rect *) a;
@@ -397,6 +757,69 @@ static int rect_original_order(const void *a, const void *b)
 #define STBRP__MAXVAL  0xffff
 #endif
 
+// place one rectangle, leaves x = y = STBRP__MAXVAL when it does not fit
+static int stbrp__pack_one(stbrp_context *context, stbrp_rect *rect)
+{
+   if (rect->w == 0 || rect->h == 0) {
+      rect->x = rect->y = 0;  // empty rect needs no space
+   } else if (context->allow_rotation) {
+      int rotated;
+      stbrp__findresult fr = stbrp__skyline_pack_rectangle_rotated(context, rect->w, rect->h, &rotated);
+      if (fr.prev_link) {
+         if (rotated) {
+            stbrp_coord t = rect->w;
+            rect->w = rect->h;
+            rect->h = t;
+            rect->was_rotated = 1;
+         }
+         rect->x = (stbrp_coord) fr.x;
+         rect->y = (stbrp_coord) fr.y;
+      } else {
+         rect->x = rect->y = STBRP__MAXVAL;
+         return 0;
+      }
+   } else {
+      stbrp__findresult fr = stbrp__skyline_pack_rectangle(context, rect->w, rect->h);
+      if (fr.prev_link) {
+         rect->x = (stbrp_coord) fr.x;
+         rect->y = (stbrp_coord) fr.y;
+      } else {
+         rect->x = rect->y = STBRP__MAXVAL;
+         return 0;
+      }
+   }
+   return 1;
+}
+
+STBRP_DEF int stbrp_pack_rects_ordered(stbrp_context *context, stbrp_rect *rects, const int *order, int num_rects)
+{
+   int i;
+
+   for (i=0; i < num_rects; ++i) {
+      if (rects[i].was_rotated) {
+         // undo the rotation of a previous call, so the same rects can be packed again
+         stbrp_coord t = rects[i].w;
+         rects[i].w = rects[i].h;
+         rects[i].h = t;
+      }
+      rects[i].was_packed = 0;
+      rects[i].was_rotated = 0;
+      #ifndef STBRP_LARGE_RECTS
+      STBRP_ASSERT(rects[i].w <= 0xffff && rects[i].h <= 0xffff);
+      #endif
+   }
+
+   // no sorting: the placements land directly in rects[order[i]]
+   for (i=0; i < num_rects; ++i) {
+      stbrp_rect *rect = &rects[order[i]];
+      if (!stbrp__pack_one(context, rect))
+         return 0;
+      rect->was_packed = 1;
+   }
+
+   return 1;
+}
+
 STBRP_DEF void stbrp_pack_rects(stbrp_context *context, stbrp_rect *rects, int num_rects)
 {
    int i;
@@ -404,6 +827,7 @@ STBRP_DEF void stbrp_pack_rects(stbrp_context *context, stbrp_rect *rects, int n
    // we use the 'was_packed' field internally to allow sorting/unsorting
    for (i=0; i < num_rects; ++i) {
       rects[i].was_packed = i;
+      rects[i].was_rotated = 0;
       #ifndef STBRP_LARGE_RECTS
       STBRP_ASSERT(rects[i].w <= 0xffff && rects[i].h <= 0xffff);
       #endif
@@ -412,19 +836,8 @@ STBRP_DEF void stbrp_pack_rects(stbrp_context *context, stbrp_rect *rects, int n
    // sort according to heuristic
    STBRP_SORT(rects, num_rects, sizeof(rects[0]), rect_height_compare);
 
-   for (i=0; i < num_rects; ++i) {
-      if (rects[i].w == 0 || rects[i].h == 0) {
-         rects[i].x = rects[i].y = 0;  // empty rect needs no space
-      } else {
-         stbrp__findresult fr = stbrp__skyline_pack_rectangle(context, rects[i].w, rects[i].h);
-         if (fr.prev_link) {
-            rects[i].x = (stbrp_coord) fr.x;
-            rects[i].y = (stbrp_coord) fr.y;
-         } else {
-            rects[i].x = rects[i].y = STBRP__MAXVAL;
-         }
-      }
-   }
+   for (i=0; i < num_rects; ++i)
+      stbrp__pack_one(context, &rects[i]);
 
    // unsort
    STBRP_SORT(rects, num_rects, sizeof(rects[0]), rect_original_order);
@@ -96,6 +96,15 @@ STBRP_DEF void stbrp_pack_rects (stbrp_context *context, stbrp_rect *rects, int
 // a single time with the full rectangle array, but the option is
 // available.
 
+STBRP_DEF int stbrp_pack_rects_ordered (stbrp_context *context, stbrp_rect *rects, const int *order, int num_rects);
+// Same as stbrp_pack_rects(), but the rectangles are placed in the order
+// given by the index array 'order' (rects[order[0]] first) instead of being
+// sorted, and the 'rects' array is never reordered: the caller sorts once
+// and can reuse the order (and the rects, rotated ones are turned back)
+// for several targets. Packing stops at the first
+// rectangle that does not fit; the function returns 1 if every rectangle
+// was packed, 0 otherwise ('was_packed' is 0 for the ones not reached).
+
 struct stbrp_rect
 {
    // reserved for your use:
@@ -107,6 +116,7 @@ struct stbrp_rect
    // output:
    stbrp_coord    x, y;
    int            was_packed;  // non-zero if valid packing
+   int            was_rotated; // non-zero if placed rotated by 90 degrees, w and h are then swapped
 
 }; // 16 bytes, nominally
 
@@ -143,6 +153,24 @@ STBRP_DEF void stbrp_setup_heuristic (stbrp_context *context, int heuristic);
 // heuristics will produce better/worse results for different data sets.
 // If you call init again, this will be reset to the default.
 
+STBRP_DEF void stbrp_setup_allow_rotation (stbrp_context *context, int allow_rotation);
+// Optionally allow rectangles to be placed rotated by 90 degrees when that
+// gives a lower top edge. Rotated rectangles come back with 'was_rotated'
+// set and their 'w' and 'h' swapped. If you call init again, this will be
+// reset to the default (false).
+
+STBRP_DEF int stbrp_index_size (int width);
+STBRP_DEF void stbrp_setup_index (stbrp_context *context, void *memory);
+// Optionally search the skyline through an index (a segment tree over the
+// column heights and a bitmap of the node starts) instead of walking the
+// node list for every candidate position. The placements are identical,
+// but a rectangle costs O(log width) per candidate visited, and most
+// candidates are skipped, which matters for tens of thousands of rects on
+// wide targets. 'memory' must hold stbrp_index_size(width) bytes and stay
+// alive while packing; the 'nodes' given to stbrp_init_target are not used
+// (one is enough). Only for the default BL heuristic. If you call init
+// again, this will be reset to the default (no index).
+
 enum
 {
    STBRP_HEURISTIC_Skyline_default=0,
@@ -169,7 +197,11 @@ struct stbrp_context
    int align;
    int init_mode;
    int heuristic;
+   int allow_rotation;
    int num_nodes;
+   int nodes_in_use;  // skyline nodes taken from 'nodes', for instrumentation
+   int nodes_peak;
+   void *index;       // see stbrp_setup_index, NULL to walk the node list
    stbrp_node *active_head;
    stbrp_node *free_head;
    stbrp_node extra[2]; // we allocate two extra nodes so optimal user-node-count is 'width' not 'width+2'
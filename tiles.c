@@ -0,0 +1,196 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static inline uint32
+clamp_index(sint32 v, uint32 count) {
+	if( v < 0 ) return 0;
+	return (uint32)v >= count ? count - 1 : (uint32)v;
+}
+
+/*
+ * copy a dst_units square of units (texels, or 4x4 blocks) starting at
+ * (x0, y0) in the source, units outside of it repeat the edge ones
+ */
+static void
+copy_clamped(uint8* dst, uint32 dst_units, const uint8* src, uint32 src_width, uint32 src_height, uint32 unit_bytes, sint32 x0, sint32 y0) {
+	uint32	left	= x0 < 0 ? (uint32)-x0 : 0;
+	uint32	mid_end	= x0 + (sint32)dst_units > (sint32)src_width ? (uint32)((sint32)src_width - x0) : dst_units;
+	uint32	y, x;
+
+	if( mid_end < left ) mid_end = left;
+
+	for( y = 0; y < dst_units; ++y ) {
+		const uint8*	row	= src + (size_t)clamp_index(y0 + (sint32)y, src_height) * src_width * unit_bytes;
+		uint8*			out	= dst + (size_t)y * dst_units * unit_bytes;
+
+		for( x = 0; x < left; ++x ) {
+			memcpy(out + x * unit_bytes, row, unit_bytes);
+		}
+		if( mid_end > left ) {
+			memcpy(out + left * unit_bytes, row + (size_t)(x0 + (sint32)left) * unit_bytes, (mid_end - left) * unit_bytes);
+		}
+		for( x = mid_end; x < dst_units; ++x ) {
+			memcpy(out + x * unit_bytes, row + (size_t)(src_width - 1) * unit_bytes, unit_bytes);
+		}
+	}
+}
+
+atlas_tiles_t*
+atlas_tiles_make(const atlas_t* atlas, uint32 tile_size, uint32 border) {
+	const image_t*	baked	= atlas->baked_image;
+	PIXEL_FORMAT	fmt		= image_format(baked);
+	uint32			width	= image_width(baked);
+	uint32			height	= image_height(baked);
+	uint32			unit	= image_format_block_size(fmt) ? 4 : 1;
+	uint32			unit_bytes	= image_format_block_size(fmt) ? image_format_block_size(fmt) : image_format_pixel_size(fmt);
+	uint32			tile_count;
+	atlas_tiles_t*	tiles;
+	uint32			i, tx, ty;
+
+	if( tile_size == 0 || tile_size % unit != 0 || border % unit != 0 ) {
+		fprintf(stderr, "ERROR: atlas_tiles_make: tile size %u and border %u must be multiples of %u\n", tile_size, border, unit);
+		return NULL;
+	}
+
+	TRACE_BEGIN("atlas_tiles_make");
+
+	tiles	= (atlas_tiles_t*)malloc(sizeof(atlas_tiles_t));
+	assert( NULL != tiles );
+
+	memset(tiles, 0, sizeof(atlas_tiles_t));
+	tiles->tile_size	= tile_size;
+	tiles->border		= border;
+	tiles->columns		= (width + tile_size - 1) / tile_size;
+	tiles->rows			= (height + tile_size - 1) / tile_size;
+	tiles->format		= fmt;
+	tiles->image_count	= atlas->image_count;
+
+	if( fmt == PF_I8 ) {
+		tiles->palette_size	= image_palette_size(baked);
+		memcpy(tiles->palette, image_palette(baked), sizeof(color4b_t) * tiles->palette_size);
+	}
+
+	tile_count		= tiles->columns * tiles->rows;
+	tiles->ranges	= (atlas_tile_range_t*)malloc(sizeof(atlas_tile_range_t) * (atlas->image_count ? atlas->image_count : 1));
+	tiles->used		= (uint8*)calloc(tile_count, sizeof(uint8));
+	tiles->images	= (image_t**)calloc(tile_count, sizeof(image_t*));
+	assert( NULL != tiles->ranges && NULL != tiles->used && NULL != tiles->images );
+
+	/* page table, the footprint of rotated images is transposed */
+	for( i = 0; i < atlas->image_count; ++i ) {
+		rect_t				r	= atlas_image_coordinates(atlas, i);
+		atlas_tile_range_t*	t	= &tiles->ranges[i];
+		uint32				x, y;
+
+		memset(t, 0, sizeof(atlas_tile_range_t));
+		if( r.width <= 0 || r.height <= 0 ) continue;
+
+		t->x		= (uint32)r.x / tile_size;
+		t->y		= (uint32)r.y / tile_size;
+		t->columns	= ((uint32)(r.x + r.width) - 1) / tile_size - t->x + 1;
+		t->rows		= ((uint32)(r.y + r.height) - 1) / tile_size - t->y + 1;
+
+		for( y = t->y; y < t->y + t->rows; ++y ) {
+			for( x = t->x; x < t->x + t->columns; ++x ) {
+				tiles->used[y * tiles->columns + x]	= 1;
+			}
+		}
+	}
+
+	/* cut the used tiles, in units of texels or blocks */
+	for( ty = 0; ty < tiles->rows; ++ty ) {
+		for( tx = 0; tx < tiles->columns; ++tx ) {
+			uint32		side	= tile_size + 2 * border;
+			image_t*	img;
+
+			if( !tiles->used[ty * tiles->columns + tx] ) continue;
+
+			img	= image_allocate(side, side, fmt);
+			assert( NULL != img );
+
+			copy_clamped((uint8*)image_pixels(img), side / unit, (const uint8*)image_pixels(baked), (width + unit - 1) / unit, (height + unit - 1) / unit, unit_bytes,
+						 ((sint32)(tx * tile_size) - (sint32)border) / (sint32)unit, ((sint32)(ty * tile_size) - (sint32)border) / (sint32)unit);
+
+			if( tiles->palette_size ) {
+				image_set_palette(img, tiles->palette, tiles->palette_size);
+			}
+
+			tiles->images[ty * tiles->columns + tx]	= img;
+		}
+	}
+
+	TRACE_END("atlas_tiles_make");
+
+	return tiles;
+}
+
+void
+atlas_tiles_release(atlas_tiles_t* tiles) {
+	uint32	t;
+
+	for( t = 0; t < tiles->columns * tiles->rows; ++t ) {
+		if( tiles->images[t] ) image_release(tiles->images[t]);
+	}
+
+	if( tiles->fp ) fclose(tiles->fp);
+	free(tiles->offsets);
+	free(tiles->images);
+	free(tiles->used);
+	free(tiles->ranges);
+	free(tiles);
+}
+
+uint32
+atlas_tiles_size(const atlas_tiles_t* tiles) {
+	return tiles->tile_size;
+}
+
+uint32
+atlas_tiles_border(const atlas_tiles_t* tiles) {
+	return tiles->border;
+}
+
+uint32
+atlas_tiles_columns(const atlas_tiles_t* tiles) {
+	return tiles->columns;
+}
+
+uint32
+atlas_tiles_rows(const atlas_tiles_t* tiles) {
+	return tiles->rows;
+}
+
+atlas_tile_range_t
+atlas_tiles_image_range(const atlas_tiles_t* tiles, uint32 img) {
+	return tiles->ranges[img];
+}
+
+bool
+atlas_tiles_used(const atlas_tiles_t* tiles, uint32 tile) {
+	return tiles->used[tile] != 0;
+}
+
+const image_t*
+atlas_tiles_image(const atlas_tiles_t* tiles, uint32 tile) {
+	return tiles->images[tile];
+}
@@ -0,0 +1,158 @@
+/*
+** Atlas library Copyright 2016(c) Wael El Oraiby. All Rights Reserved
+**
+** This library is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** Under Section 7 of GPL version 3, you are granted additional
+** permissions described in the GCC Runtime Library Exception, version
+** 3.1, as published by the Free Software Foundation.
+**
+** You should have received a copy of the GNU General Public License and
+** a copy of the GCC Runtime Library Exception along with this program;
+** see the files COPYING3 and COPYING.RUNTIME respectively.  If not, see
+** <http://www.gnu.org/licenses/>.
+**
+*/
+#include "atlas_private.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * the hooks are read under a lock, so that atlas_trace_set can be called
+ * while builds run on other threads: each event sees either the old or the
+ * new begin, end and user, never a mix. a callback already running when
+ * they change finishes with the old ones. the lock is only taken once
+ * 'trace_on' says there is a hook to call
+ */
+static pthread_mutex_t		hooks_lock	= PTHREAD_MUTEX_INITIALIZER;
+static atlas_trace_fun_t	begin_fun	= NULL;
+static atlas_trace_fun_t	end_fun		= NULL;
+static void*				hooks_user	= NULL;
+
+bool						trace_on	= false;
+
+void
+atlas_trace_set(atlas_trace_fun_t begin, atlas_trace_fun_t end, void* user) {
+	pthread_mutex_lock(&hooks_lock);
+	begin_fun	= begin;
+	end_fun		= end;
+	hooks_user	= user;
+#if defined(__GNUC__)
+	__atomic_store_n(&trace_on, begin || end, __ATOMIC_RELAXED);
+#else
+	trace_on	= begin || end;
+#endif
+	pthread_mutex_unlock(&hooks_lock);
+}
+
+void
+trace_event(const char* name, bool begin) {
+	atlas_trace_fun_t	fun;
+	void*				user;
+
+	pthread_mutex_lock(&hooks_lock);
+	fun		= begin ? begin_fun : end_fun;
+	user	= hooks_user;
+	pthread_mutex_unlock(&hooks_lock);
+
+	if( fun ) fun(user, name);
+}
+
+void
+atlas_trace_begin(const char* name) {
+	TRACE_BEGIN(name);
+}
+
+void
+atlas_trace_end(const char* name) {
+	TRACE_END(name);
+}
+
+/*
+ * Chrome trace event sink: one "B"/"E" duration event per callback, loadable
+ * in chrome://tracing or Perfetto
+ */
+typedef struct {
+	FILE*			fp;
+	pthread_mutex_t	lock;
+	double			origin;		/* ms */
+	bool			first;
+} chrome_sink_t;
+
+static chrome_sink_t	chrome	= { NULL, PTHREAD_MUTEX_INITIALIZER, 0.0, true };
+
+/* the name as a JSON string: quotes, backslashes and control characters escaped */
+static void
+chrome_name(FILE* fp, const char* name) {
+	fputc('"', fp);
+	for( ; *name; ++name ) {
+		unsigned char	c	= (unsigned char)*name;
+		if( c == '"' || c == '\\' ) fprintf(fp, "\\%c", c);
+		else if( c < 0x20 ) fprintf(fp, "\\u%04x", c);
+		else fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+static void
+chrome_event(const char* name, char phase) {
+	double	ts	= (timer_now_ms() - chrome.origin) * 1000.0;
+
+	pthread_mutex_lock(&chrome.lock);
+	if( chrome.fp ) {
+		fprintf(chrome.fp, "%s\n{\"name\":", chrome.first ? "" : ",");
+		chrome_name(chrome.fp, name);
+		fprintf(chrome.fp, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%lu}", phase, ts, (unsigned long)pthread_self());
+		chrome.first	= false;
+	}
+	pthread_mutex_unlock(&chrome.lock);
+}
+
+static void
+chrome_begin(void* user, const char* name) {
+	(void)user;
+	chrome_event(name, 'B');
+}
+
+static void
+chrome_end(void* user, const char* name) {
+	(void)user;
+	chrome_event(name, 'E');
+}
+
+bool
+atlas_trace_chrome_open(const char* path) {
+	FILE*	fp	= fopen(path, "w");
+	if( NULL == fp ) {
+		fprintf(stderr, "ERROR: atlas_trace_chrome_open: can't open %s\n", path);
+		return false;
+	}
+
+	atlas_trace_chrome_close();
+
+	pthread_mutex_lock(&chrome.lock);
+	chrome.fp		= fp;
+	chrome.origin	= timer_now_ms();
+	chrome.first	= true;
+	fprintf(fp, "{\"traceEvents\":[");
+	pthread_mutex_unlock(&chrome.lock);
+
+	atlas_trace_set(chrome_begin, chrome_end, NULL);
+	return true;
+}
+
+void
+atlas_trace_chrome_close(void) {
+	pthread_mutex_lock(&chrome.lock);
+	if( chrome.fp ) {
+		atlas_trace_set(NULL, NULL, NULL);
+		fprintf(chrome.fp, "\n]}\n");
+		fclose(chrome.fp);
+		chrome.fp	= NULL;
+	}
+	pthread_mutex_unlock(&chrome.lock);
+}